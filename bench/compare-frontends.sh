@@ -0,0 +1,20 @@
+#!/usr/bin/env sh
+# Mount the same source directory with the high-level and the low-level
+# frontend in turn, and run the metadata benchmark against each.
+#
+# Usage: bench/compare-frontends.sh <build dir> [n_files] [depth] [rounds]
+set -e
+
+BUILD=${1:?build directory}
+shift
+
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+
+for frontend in fangfs fangfs-ll; do
+    mkdir -p "$WORK/src-$frontend" "$WORK/mnt"
+    printf "bench\nbench\n" | "$BUILD/$frontend" "$WORK/src-$frontend" "$WORK/mnt"
+    echo "# $frontend"
+    "$BUILD/bench_metadata" "$WORK/mnt" "$@"
+    fusermount -u "$WORK/mnt"
+done
@@ -0,0 +1,89 @@
+#!/usr/bin/env sh
+# Compare compressed filesystems against an uncompressed one. For each codec,
+# create a fresh filesystem, write a corpus of compressible text and one of
+# random data through the mount, read both back, and report the write and
+# read throughput, the apparent and on-disk size of the ciphertext, and the
+# compression counters from /__FANGFS_STATS.
+#
+# Usage: SOURCE=/mnt/disk/dir bench/compression.sh <build dir> [data_mb] [codecs]
+set -e
+
+BUILD=${1:?build directory}
+DATA_MB=${2:-256}
+CODECS=${3:-"none lz4 zstd"}
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+mkdir -p "$SOURCE" "$WORK/mnt"
+
+wait_mounted() {
+    until mountpoint -q "$WORK/mnt" && stat "$WORK/mnt" >/dev/null 2>&1; do
+        sleep 0.01
+    done
+}
+
+# Log-like text, and the same amount of noise.
+awk -v bytes=$((DATA_MB * 1048576)) 'BEGIN {
+    srand(1)
+    while(total < bytes) {
+        line = sprintf("2024-01-%02d 12:%02d:%02d INFO request id=%d status=%d bytes=%d\n",
+                       NR % 28 + 1, int(rand() * 60), int(rand() * 60), NR++,
+                       (rand() < 0.1)? 500 : 200, int(rand() * 9000))
+        printf "%s", line
+        total += length(line)
+    }
+}' > "$WORK/text"
+head -c $((DATA_MB * 1048576)) /dev/urandom > "$WORK/random"
+
+mib_per_s() {
+    echo "scale=1; $DATA_MB / ($2 - $1)" | bc
+}
+
+timed_copy() {
+    start=$(date +%s.%N)
+    cat "$1" > "$2"
+    sync "$2"
+    end=$(date +%s.%N)
+    mib_per_s "$start" "$end"
+}
+
+printf "codec\tcorpus\twrite_mib_s\tread_mib_s\tapparent_mib\tdisk_mib\tcompressed_mib\tpacked_mib\tincompressible_mib\n"
+for codec in $CODECS; do
+    dir="$SOURCE/$codec"
+    mkdir "$dir"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o compress=$codec
+    wait_mounted
+
+    for corpus in text random; do
+        write=$(timed_copy "$WORK/$corpus" "$WORK/mnt/$corpus")
+        # The counters only cover this mount, so take them before remounting.
+        counters=$(awk -F '\t' '
+            $1 == "bytes_compressed" { compressed = $2 }
+            $1 == "bytes_packed" { packed = $2 }
+            $1 == "bytes_incompressible" { incompressible = $2 }
+            END {
+                printf "%.1f\t%.1f\t%.1f", compressed / 1048576, packed / 1048576,
+                       incompressible / 1048576
+            }
+        ' "$WORK/mnt/__FANGFS_STATS")
+
+        # Remount to drop the plaintext cache, so the read goes through the
+        # codec.
+        fusermount -u "$WORK/mnt"
+        printf "bench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt"
+        wait_mounted
+        start=$(date +%s.%N)
+        cat "$WORK/mnt/$corpus" >/dev/null
+        end=$(date +%s.%N)
+        read=$(mib_per_s "$start" "$end")
+
+        apparent=$(du -sm --apparent-size "$dir" | cut -f1)
+        disk=$(du -sm "$dir" | cut -f1)
+        printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$codec" "$corpus" "$write" "$read" \
+            "$apparent" "$disk" "$counters"
+        rm "$WORK/mnt/$corpus"
+    done
+
+    fusermount -u "$WORK/mnt"
+done
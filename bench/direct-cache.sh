@@ -0,0 +1,62 @@
+#!/usr/bin/env sh
+# Compare page cache usage with and without -o backing_direct. For each mode,
+# write a file, read it twice, and report the time of each pass, the FangFS
+# process's RSS, how much of the plaintext and of the ciphertext is resident
+# in the page cache (using fincore from util-linux), and the change in the
+# system-wide Cached figure. With backing_direct, the ciphertext column
+# should stay near zero, and the second pass should still be served from
+# the FUSE cache.
+#
+# Usage: SOURCE=/mnt/disk/dir bench/direct-cache.sh <build dir> [file_mb]
+set -e
+
+BUILD=${1:?build directory}
+SIZE_MB=${2:-512}
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+
+cached_kb() {
+    awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+
+resident_kb() {
+    if command -v fincore >/dev/null; then
+        fincore --bytes --noheadings --output RES "$@" 2>/dev/null |
+            awk '{ total += $1 } END { print int(total / 1024) }'
+    else
+        echo "-"
+    fi
+}
+
+timed_read() {
+    start=$(date +%s.%N)
+    cat "$WORK/mnt/data" >/dev/null
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+printf "mode\tfirst_s\tsecond_s\trss_kb\tplain_cached_kb\tcipher_cached_kb\tcached_delta_kb\n"
+for mode in buffered direct; do
+    opts=kernel_cache
+    if [ $mode = direct ]; then opts=$opts,backing_direct; fi
+
+    mkdir -p "$SOURCE/$mode" "$WORK/mnt"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$SOURCE/$mode" "$WORK/mnt" -o $opts
+    pid=$(pgrep -n -f "fangfs $SOURCE/$mode")
+
+    before=$(cached_kb)
+    dd if=/dev/urandom of="$WORK/mnt/data" bs=1M count="$SIZE_MB" 2>/dev/null
+    first=$(timed_read)
+    second=$(timed_read)
+
+    rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+    plain=$(resident_kb "$WORK/mnt/data")
+    cipher=$(resident_kb $(find "$SOURCE/$mode" -type f ! -name '.*' ! -name '__*'))
+    delta=$(($(cached_kb) - before))
+
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" $mode "$first" "$second" "$rss" "$plain" "$cipher" "$delta"
+    fusermount -u "$WORK/mnt"
+    rm -rf "$SOURCE/$mode"
+done
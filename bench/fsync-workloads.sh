@@ -0,0 +1,53 @@
+#!/usr/bin/env sh
+# Mount a fresh source directory with each sync mode in turn and run
+# fsync-heavy workloads against it: the fsync micro-benchmark, and, when the
+# tools are installed, a batch of SQLite transactions and a git commit loop.
+#
+# Usage: bench/fsync-workloads.sh <build dir> [threads] [ops_per_thread]
+set -e
+
+BUILD=${1:?build directory}
+shift
+
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+
+elapsed() {
+    start=$(date +%s.%N)
+    "$@" >/dev/null
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+for mode in direct journal; do
+    mkdir -p "$WORK/src-$mode" "$WORK/mnt"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$WORK/src-$mode" "$WORK/mnt" -o sync=$mode
+    echo "# sync=$mode"
+    "$BUILD/bench_fsync" "$WORK/mnt" "$@"
+
+    if command -v sqlite3 >/dev/null; then
+        sql=$(i=0; while [ $i -lt 200 ]; do
+            echo "INSERT INTO t VALUES($i, randomblob(512));"
+            i=$((i + 1))
+        done)
+        sqlite3 "$WORK/mnt/db" "CREATE TABLE t(a, b);"
+        echo "sqlite\t$(elapsed sqlite3 "$WORK/mnt/db" "$sql")"
+    fi
+
+    if command -v git >/dev/null; then
+        git init -q "$WORK/mnt/repo"
+        commits() {
+            i=0
+            while [ $i -lt 50 ]; do
+                echo $i > "$WORK/mnt/repo/file"
+                git -C "$WORK/mnt/repo" add file
+                git -C "$WORK/mnt/repo" -c user.name=bench -c user.email=bench@localhost \
+                    -c core.fsync=all commit -q -m "$i"
+                i=$((i + 1))
+            done
+        }
+        echo "git\t$(elapsed commits)"
+    fi
+
+    fusermount -u "$WORK/mnt"
+done
@@ -0,0 +1,86 @@
+// fsync latency benchmark. Each thread repeatedly overwrites a block of its
+// own file and calls fdatasync(), the way a database commits. Run it inside a
+// FangFS mount with -o sync=direct and -o sync=journal to compare how well
+// concurrent syncs are batched.
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what, const char* path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void worker(const char* dir, int id, int n_ops, size_t write_len,
+                   std::vector<double>* latencies) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/fsync-%d", dir, id);
+	const int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if(fd < 0) { die("create", path); }
+
+	std::vector<char> buf(write_len, static_cast<char>('a' + id % 26));
+	for(int i = 0; i < n_ops; i += 1) {
+		const double start = now();
+		const off_t offset = static_cast<off_t>(i % 16) * write_len;
+		if(pwrite(fd, buf.data(), write_len, offset) != static_cast<ssize_t>(write_len)) {
+			die("write", path);
+		}
+		if(fdatasync(fd) < 0) { die("fdatasync", path); }
+		latencies->push_back(now() - start);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	if(sorted.empty()) { return 0; }
+	const size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+	return sorted[i];
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [threads] [ops_per_thread] [write_len]\n", argv[0]);
+		return 1;
+	}
+
+	const char* dir = argv[1];
+	const int n_threads = (argc > 2)? atoi(argv[2]) : 8;
+	const int n_ops = (argc > 3)? atoi(argv[3]) : 200;
+	const size_t write_len = (argc > 4)? strtoul(argv[4], nullptr, 10) : 4096;
+
+	std::vector<std::vector<double>> latencies(n_threads);
+	std::vector<std::thread> threads;
+
+	const double start = now();
+	for(int i = 0; i < n_threads; i += 1) {
+		threads.push_back(std::thread(worker, dir, i, n_ops, write_len, &latencies[i]));
+	}
+	for(auto& thread: threads) { thread.join(); }
+	const double elapsed = now() - start;
+
+	std::vector<double> all;
+	for(const auto& l: latencies) { all.insert(all.end(), l.begin(), l.end()); }
+	std::sort(all.begin(), all.end());
+
+	printf("threads\tops\tseconds\tops_per_sec\tp50_ms\tp99_ms\tmax_ms\n");
+	printf("%d\t%zu\t%.6f\t%.1f\t%.3f\t%.3f\t%.3f\n",
+	       n_threads, all.size(), elapsed, all.size() / elapsed,
+	       percentile(all, 0.5) * 1000, percentile(all, 0.99) * 1000,
+	       all.empty()? 0 : all.back() * 1000);
+	return 0;
+}
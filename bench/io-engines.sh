@@ -0,0 +1,23 @@
+#!/usr/bin/env sh
+# Mount a source directory with each I/O engine in turn and run the
+# queue-depth benchmark against it. Point SOURCE at a directory on the device
+# under test, such as an NVMe drive; it defaults to a temporary directory.
+#
+# Usage: SOURCE=/mnt/nvme/dir bench/io-engines.sh <build dir> [file_mb] [max_threads]
+set -e
+
+BUILD=${1:?build directory}
+shift
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+
+for engine in posix uring; do
+    mkdir -p "$SOURCE/$engine" "$WORK/mnt"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$SOURCE/$engine" "$WORK/mnt" -o io=$engine,big_writes
+    echo "# io=$engine"
+    "$BUILD/bench_queue_depth" "$WORK/mnt" "$@"
+    fusermount -u "$WORK/mnt"
+    rm -rf "$SOURCE/$engine"
+done
@@ -0,0 +1,62 @@
+#!/usr/bin/env sh
+# Compare listing a large directory with and without an index. For each
+# setting, create a fresh filesystem holding one directory of many empty
+# files, list it once to build its index, remount with caches dropped, then
+# time a full listing, and a listing that stops after the first names as a
+# pager or a seeking client would.
+#
+# Usage: SOURCE=/mnt/disk/dir bench/large-dirs.sh <build dir> [files] [thresholds]
+set -e
+
+BUILD=${1:?build directory}
+FILES=${2:-100000}
+THRESHOLDS=${3:-"0 1000"}
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+mkdir -p "$SOURCE" "$WORK/mnt"
+
+wait_mounted() {
+    until mountpoint -q "$WORK/mnt" && stat "$WORK/mnt" >/dev/null 2>&1; do
+        sleep 0.01
+    done
+}
+
+seconds_since() {
+    echo "$(date +%s.%N) - $1" | bc
+}
+
+printf "dir_index\tcreate_s\tlist_s\tfirst_names_s\tindexes_built\n"
+for threshold in $THRESHOLDS; do
+    dir="$SOURCE/$threshold"
+    mkdir "$dir"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o dir_index=$threshold
+    wait_mounted
+
+    mkdir "$WORK/mnt/d"
+    start=$(date +%s.%N)
+    (cd "$WORK/mnt/d" && seq -f "file-%.0f" 1 "$FILES" | xargs touch)
+    create=$(seconds_since "$start")
+    ls -f "$WORK/mnt/d" >/dev/null
+    built=$(awk -F '\t' '$1 == "dir_indexes_built" { print $2 }' "$WORK/mnt/__FANGFS_STATS")
+    fusermount -u "$WORK/mnt"
+
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+    printf "bench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o dir_index=$threshold
+    wait_mounted
+    start=$(date +%s.%N)
+    ls -f "$WORK/mnt/d" >/dev/null
+    list=$(seconds_since "$start")
+    fusermount -u "$WORK/mnt"
+
+    printf "bench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o dir_index=$threshold
+    wait_mounted
+    start=$(date +%s.%N)
+    ls -f "$WORK/mnt/d" | head -n 20 >/dev/null
+    first=$(seconds_since "$start")
+    fusermount -u "$WORK/mnt"
+
+    printf "%s\t%s\t%s\t%s\t%s\n" "$threshold" "$create" "$list" "$first" "${built:-0}"
+done
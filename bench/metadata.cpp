@@ -0,0 +1,99 @@
+// Metadata throughput benchmark. Run it against a directory inside a mounted
+// FangFS (either frontend) to compare how many stat/open/create operations
+// per second each one sustains.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_path(const char* dir, int depth, int i, char* out, size_t out_len) {
+	// Nest files a few directories deep, so every path component has to be
+	// resolved.
+	int n = snprintf(out, out_len, "%s", dir);
+	for(int d = 0; d < depth; d += 1) {
+		n += snprintf(out + n, out_len - n, "/d%d", d);
+	}
+	snprintf(out + n, out_len - n, "/f%d", i);
+}
+
+static void report(const char* op, int n, double elapsed) {
+	printf("%s\t%d\t%.6f\t%.1f\n", op, n, elapsed, n / elapsed);
+}
+
+static void die(const char* what, const char* path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [n_files] [depth] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	const char* dir = argv[1];
+	const int n_files = (argc > 2)? atoi(argv[2]) : 1000;
+	const int depth = (argc > 3)? atoi(argv[3]) : 4;
+	const int rounds = (argc > 4)? atoi(argv[4]) : 5;
+
+	char path[4096];
+	{
+		int n = snprintf(path, sizeof(path), "%s", dir);
+		for(int d = 0; d < depth; d += 1) {
+			n += snprintf(path + n, sizeof(path) - n, "/d%d", d);
+			if(mkdir(path, 0700) < 0 && errno != EEXIST) { die("mkdir", path); }
+		}
+	}
+
+	printf("op\tcount\tseconds\tops_per_sec\n");
+
+	double start = now();
+	for(int i = 0; i < n_files; i += 1) {
+		file_path(dir, depth, i, path, sizeof(path));
+		int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0600);
+		if(fd < 0) { die("create", path); }
+		close(fd);
+	}
+	report("create", n_files, now() - start);
+
+	struct stat info;
+	start = now();
+	for(int r = 0; r < rounds; r += 1) {
+		for(int i = 0; i < n_files; i += 1) {
+			file_path(dir, depth, i, path, sizeof(path));
+			if(stat(path, &info) < 0) { die("stat", path); }
+		}
+	}
+	report("stat", n_files * rounds, now() - start);
+
+	start = now();
+	for(int r = 0; r < rounds; r += 1) {
+		for(int i = 0; i < n_files; i += 1) {
+			file_path(dir, depth, i, path, sizeof(path));
+			int fd = open(path, O_RDONLY);
+			if(fd < 0) { die("open", path); }
+			close(fd);
+		}
+	}
+	report("open", n_files * rounds, now() - start);
+
+	start = now();
+	for(int i = 0; i < n_files; i += 1) {
+		file_path(dir, depth, i, path, sizeof(path));
+		if(unlink(path) < 0) { die("unlink", path); }
+	}
+	report("unlink", n_files, now() - start);
+
+	return 0;
+}
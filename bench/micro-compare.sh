@@ -0,0 +1,23 @@
+#!/usr/bin/env sh
+# Compare two runs of bench_micro, and list every benchmark whose time per
+# operation grew by more than the threshold. Exits nonzero if any did.
+#
+# Usage: bench/micro-compare.sh <baseline.tsv> <candidate.tsv> [threshold_percent]
+set -e
+
+BASELINE=${1:?baseline results}
+CANDIDATE=${2:?candidate results}
+THRESHOLD=${3:-10}
+
+awk -F '\t' -v threshold="$THRESHOLD" '
+    FNR == 1 { next }
+    NR == FNR { base[$1 "/" $2] = $4; next }
+    ($1 "/" $2) in base {
+        key = $1 "/" $2
+        change = ($4 - base[key]) * 100 / base[key]
+        flag = (change > threshold)? "REGRESSION" : ""
+        printf "%-36s %12.1f %12.1f %+7.1f%% %s\n", key, base[key], $4, change, flag
+        if(change > threshold) { regressions += 1 }
+    }
+    END { exit (regressions > 0) }
+' "$BASELINE" "$CANDIDATE"
@@ -0,0 +1,319 @@
+// Micro-benchmarks of the core, run directly against a scratch directory
+// without going through FUSE. Results are tab-separated on stdout, one line
+// per benchmark, so that runs can be compared with bench/micro-compare.sh.
+//
+// Usage: bench_micro [dir] [min_seconds] [filter]
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../src/file.h"
+#include "../src/BufferEncryption.h"
+#include "../src/log.h"
+#include "../src/securepool.h"
+#include "../src/util.h"
+
+static double min_seconds = 0.2;
+static const char* filter = nullptr;
+
+// Where failures are reported, since stderr itself is silenced; see main().
+static FILE* errors = stderr;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what) {
+	fprintf(errors, "%s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/// Run f repeatedly for at least min_seconds, and report the time per call.
+/// bytes is the amount of data one call processes, or 0.
+template<typename F>
+static void bench(const char* name, const std::string& param, size_t bytes, F f) {
+	const std::string full_name = std::string(name) + "/" + param;
+	if(filter != nullptr && full_name.find(filter) == std::string::npos) {
+		return;
+	}
+
+	// Warm up, then grow the batch until one batch takes long enough to time.
+	f();
+	size_t n = 1;
+	double elapsed = 0;
+	while(1) {
+		const double start = now();
+		for(size_t i = 0; i < n; i += 1) { f(); }
+		elapsed = now() - start;
+		if(elapsed >= min_seconds) { break; }
+
+		n = (elapsed < min_seconds / 100)? n * 10 : n * 2;
+	}
+
+	const double ns_per_op = elapsed * 1e9 / n;
+	const double mb_per_sec = (bytes > 0)? (n * bytes / (1024.0 * 1024.0)) / elapsed : 0;
+	printf("%s\t%s\t%zu\t%.1f\t%.1f\n", name, param.c_str(), n, ns_per_op, mb_per_sec);
+	fflush(stdout);
+}
+
+static std::string size_param(size_t n) {
+	char buf[32];
+	if(n >= (1 << 20) && n % (1 << 20) == 0) {
+		snprintf(buf, sizeof(buf), "%zuM", n >> 20);
+	} else if(n >= 1024 && n % 1024 == 0) {
+		snprintf(buf, sizeof(buf), "%zuK", n >> 10);
+	} else {
+		snprintf(buf, sizeof(buf), "%zu", n);
+	}
+	return buf;
+}
+
+static void bench_paths(FangFS& fs) {
+	Buffer out;
+	bench("path_encrypt", "name", 0, [&]() { path_encrypt(fs, "/some/dir/filename.txt", out); });
+
+	Buffer encrypted;
+	path_encrypt(fs, "/some/dir/filename.txt", encrypted);
+	const std::string name(reinterpret_cast<char*>(encrypted.buf));
+	bench("path_decrypt", "name", 0, [&]() {
+		if(path_decrypt(fs, name.c_str(), out) != 0) { die("path_decrypt"); }
+	});
+
+	const size_t depths[] = {1, 4, 16};
+	for(size_t depth: depths) {
+		std::string path;
+		for(size_t i = 0; i < depth; i += 1) {
+			path += "/component" + std::to_string(i);
+		}
+		bench("path_resolve", "depth" + std::to_string(depth), 0,
+		      [&]() { path_resolve(fs, path.c_str(), out); });
+	}
+}
+
+/// The cost of logging on the lookup path. Debug messages, such as the one
+/// path_encrypt() logs for every name, are only there at all when built with
+/// -DFANGFS_LOG_LEVEL=debug; otherwise the on and off lookups should match.
+static void bench_logging(FangFS& fs) {
+	const char* name = "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghij";
+	log_set_level(LOG_LEVEL_INFO);
+	bench("log", "filtered", 0, [&]() { log_debug("Encrypted: %s", name); });
+	bench("log", "sync", 0, [&]() { log_write(LOG_LEVEL_INFO, "Encrypted: %s", name); });
+
+	// Messages that don't fit in the ring are dropped, which is cheaper than
+	// queueing them, so a long run flatters the async path somewhat.
+	log_start();
+	bench("log", "async", 0, [&]() { log_write(LOG_LEVEL_INFO, "Encrypted: %s", name); });
+
+	Buffer out;
+	const char* path = "/component0/component1/component2/component3";
+	log_set_level(LOG_LEVEL_ERROR);
+	bench("lookup", "log_off", 0, [&]() { path_resolve(fs, path, out); });
+	log_set_level(LOG_LEVEL_DEBUG);
+	bench("lookup", "log_on", 0, [&]() { path_resolve(fs, path, out); });
+
+	log_stop();
+	log_set_level(LOG_LEVEL_INFO);
+}
+
+/// Allocating and freeing a buffer for plaintext: plainly, wiped on the way
+/// out, from libsodium's guarded allocator, and from the secure pool.
+static void bench_buffers(void) {
+	const size_t sizes[] = {256, 4096, 65536};
+	for(size_t size: sizes) {
+		bench("buffer", "malloc/" + size_param(size), 0, [&]() {
+			uint8_t* mem = reinterpret_cast<uint8_t*>(malloc(size));
+			if(mem == nullptr) { die("malloc"); }
+			mem[0] = 1;
+			free(mem);
+		});
+		bench("buffer", "malloc_zeroed/" + size_param(size), 0, [&]() {
+			uint8_t* mem = reinterpret_cast<uint8_t*>(malloc(size));
+			if(mem == nullptr) { die("malloc"); }
+			mem[0] = 1;
+			sodium_memzero(mem, size);
+			free(mem);
+		});
+		bench("buffer", "sodium_malloc/" + size_param(size), 0, [&]() {
+			uint8_t* mem = reinterpret_cast<uint8_t*>(sodium_malloc(size));
+			if(mem == nullptr) { die("sodium_malloc"); }
+			mem[0] = 1;
+			sodium_free(mem);
+		});
+		bench("buffer", "secure/" + size_param(size), 0, [&]() {
+			Buffer buf;
+			buf_make_secure(buf);
+			buf_grow(buf, size);
+			buf.buf[0] = 1;
+		});
+	}
+}
+
+static void bench_base32(void) {
+	const size_t sizes[] = {16, 64, 256};
+	for(size_t size: sizes) {
+		Buffer input;
+		buf_grow(input, size);
+		randombytes_buf(input.buf, size);
+		input.len = size;
+
+		Buffer encoded;
+		bench("base32_enc", size_param(size), size, [&]() { base32_enc(input, encoded); });
+
+		Buffer decoded;
+		base32_enc(input, encoded);
+		const char* text = reinterpret_cast<char*>(encoded.buf);
+		bench("base32_dec", size_param(size), size, [&]() {
+			if(base32_dec(text, decoded) < 0) { die("base32_dec"); }
+		});
+	}
+}
+
+static void bench_crypto(const FangFS& fs) {
+	const size_t sizes[] = {64, 4096, 65536};
+	uint8_t nonce[crypto_secretbox_NONCEBYTES];
+	randombytes_buf(nonce, sizeof(nonce));
+
+	for(size_t size: sizes) {
+		std::vector<uint8_t> plaintext(size, 'p');
+		std::vector<uint8_t> ciphertext(size + crypto_secretbox_MACBYTES);
+		bench("buf_encrypt", size_param(size), size, [&]() {
+			buf_encrypt(plaintext.data(), size, nonce, fs.master_key, ciphertext.data());
+		});
+
+		bench("buf_decrypt", size_param(size), size, [&]() {
+			if(buf_decrypt(ciphertext.data(), ciphertext.size(), nonce, fs.master_key,
+			               plaintext.data()) != 0) {
+				die("buf_decrypt");
+			}
+		});
+	}
+}
+
+static FangFile* open_scratch(FangFS& fs, const char* dir, const char* name) {
+	const std::string path = std::string(dir) + "/" + name;
+	const int fd = open(path.c_str(), O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0600);
+	if(fd < 0) { die(path.c_str()); }
+
+	FangFile* file = fang_file_open(fs, fd, path.c_str());
+	if(file == nullptr) { die("fang_file_open"); }
+	return file;
+}
+
+static void bench_blocks(FangFS& fs, const char* dir) {
+	FangFile* file = open_scratch(fs, dir, "bench-blocks");
+	const size_t payload = fang_block_payload(fs);
+	std::vector<uint8_t> data(payload, 'b');
+
+	// Lay down a few blocks, so the one under test is not the cached tail.
+	for(uint64_t i = 0; i < 4; i += 1) {
+		if(fang_file_block_write(*file, i, data.data(), payload) < 0) { die("block_write"); }
+	}
+
+	bench("block_write", size_param(payload), payload, [&]() {
+		if(fang_file_block_write(*file, 1, data.data(), payload) < 0) { die("block_write"); }
+	});
+
+	Buffer out;
+	bench("block_read", size_param(payload), payload, [&]() {
+		if(fang_file_block_read(*file, 1, out) < 0) { die("block_read"); }
+	});
+
+	fang_file_close(file);
+	unlink((std::string(dir) + "/bench-blocks").c_str());
+}
+
+static void bench_file(FangFS& fs, const char* dir) {
+	const size_t file_len = 16 << 20;
+	FangFile* file = open_scratch(fs, dir, "bench-file");
+
+	std::vector<uint8_t> data(1 << 20, 'f');
+	for(size_t offset = 0; offset < file_len; offset += data.size()) {
+		if(fang_file_write(*file, offset, data.size(), data.data()) < 0) { die("write"); }
+	}
+
+	// Aligned requests land on block boundaries; unaligned ones straddle a
+	// boundary at both ends, and so pay for read-modify-write on writes.
+	const size_t block_size = fs.metafile.block_size;
+	const size_t payload = fang_block_payload(fs);
+	const size_t sizes[] = {512, 4096, 65536, 1 << 20};
+	for(size_t size: sizes) {
+		const off_t offsets[] = {static_cast<off_t>(payload * 8),
+		                         static_cast<off_t>(payload * 8 + block_size / 2)};
+		const char* offset_names[] = {"aligned", "unaligned"};
+		for(size_t i = 0; i < 2; i += 1) {
+			const std::string param = size_param(size) + "/" + offset_names[i];
+			const off_t offset = offsets[i];
+			bench("fang_file_read", param, size, [&]() {
+				if(fang_file_read(*file, offset, size, data.data()) < 0) { die("read"); }
+			});
+			bench("fang_file_write", param, size, [&]() {
+				if(fang_file_write(*file, offset, size, data.data()) < 0) { die("write"); }
+			});
+		}
+	}
+
+	// Appending grows the file and replaces the cached tail block each time.
+	const off_t append_start = file_len;
+	off_t append_at = append_start;
+	bench("fang_file_write", "4K/append", 4096, [&]() {
+		if(fang_file_write(*file, append_at, 4096, data.data()) < 0) { die("append"); }
+		append_at += 4096;
+	});
+
+	fang_file_close(file);
+	unlink((std::string(dir) + "/bench-file").c_str());
+}
+
+int main(int argc, char** argv) {
+	const char* parent = (argc > 1)? argv[1] : "/tmp";
+	if(argc > 2) { min_seconds = atof(argv[2]); }
+	if(argc > 3) { filter = argv[3]; }
+
+	if(sodium_init() < 0) {
+		fprintf(stderr, "Failed to initialize libsodium\n");
+		return 1;
+	}
+
+	std::string dir_template = std::string(parent) + "/fangfs-bench-XXXXXX";
+	std::vector<char> dir(dir_template.begin(), dir_template.end());
+	dir.push_back('\0');
+	if(mkdtemp(dir.data()) == nullptr) { die("mkdtemp"); }
+
+	// Log messages, including the ones the logging benchmarks write, go to
+	// stderr; keep them out of the terminal.
+	errors = fdopen(dup(STDERR_FILENO), "w");
+	if(errors == nullptr || freopen("/dev/null", "w", stderr) == nullptr) {
+		errors = stderr;
+	}
+
+	// As a mount would, so that plaintext buffers come from the pool.
+	if(secure_pool_init(static_cast<size_t>(SECURE_POOL_DEFAULT_MIB) << 20) < 0) {
+		die("secure_pool_init");
+	}
+
+	FangFS fs;
+	memset(&fs.metafile, 0, sizeof(fs.metafile));
+	fs.metafile.block_size = 4096;
+	randombytes_buf(fs.master_key, sizeof(fs.master_key));
+	randombytes_buf(fs.metafile.filename_nonce, sizeof(fs.metafile.filename_nonce));
+	fs.source = dir.data();
+
+	printf("benchmark\tparam\titerations\tns_per_op\tmb_per_sec\n");
+	bench_paths(fs);
+	bench_logging(fs);
+	bench_base32();
+	bench_buffers();
+	bench_crypto(fs);
+	bench_blocks(fs, dir.data());
+	bench_file(fs, dir.data());
+
+	rmdir(dir.data());
+	return 0;
+}
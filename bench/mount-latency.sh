@@ -0,0 +1,38 @@
+#!/usr/bin/env sh
+# Time how long it takes from starting fangfs until the mount answers
+# requests, with and without the kernel keyring key cache. The first mount
+# with the cache still pays for the KDF; the rest should not.
+#
+# Usage: bench/mount-latency.sh <build dir> [rounds]
+set -e
+
+BUILD=${1:?build directory}
+ROUNDS=${2:-5}
+
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+mkdir -p "$WORK/src" "$WORK/mnt"
+
+# Create the filesystem once.
+printf "bench\nbench\n" | "$BUILD/fangfs" "$WORK/src" "$WORK/mnt"
+fusermount -u "$WORK/mnt"
+
+now() {
+    date +%s.%N
+}
+
+printf "cache\tround\tseconds\n"
+for cache in 0 300; do
+    i=0
+    while [ $i -lt "$ROUNDS" ]; do
+        start=$(now)
+        printf "bench\n" | "$BUILD/fangfs" "$WORK/src" "$WORK/mnt" -o keycache=$cache
+        until mountpoint -q "$WORK/mnt" && stat "$WORK/mnt" >/dev/null 2>&1; do
+            sleep 0.001
+        done
+        end=$(now)
+        printf "%s\t%s\t%s\n" $cache $i "$(echo "$end - $start" | bc)"
+        fusermount -u "$WORK/mnt"
+        i=$((i + 1))
+    done
+done
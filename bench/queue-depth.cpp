@@ -0,0 +1,89 @@
+// Read/write throughput at a range of request sizes and thread counts. With
+// -o io=uring, every whole block of a request is one entry in a single batch,
+// so the request size sets the queue depth each FUSE thread drives against
+// the source device. Run it inside a mount on an NVMe-backed source with each
+// engine to compare them.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what, const char* path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+/// Each thread reads or writes its own slice of the file, one request at a time.
+static void worker(const char* path, bool write, off_t start, off_t end, size_t request_len) {
+	const int fd = open(path, O_RDWR);
+	if(fd < 0) { die("open", path); }
+
+	std::vector<char> buf(request_len, 'x');
+	for(off_t offset = start; offset < end; offset += request_len) {
+		const ssize_t n = write? pwrite(fd, buf.data(), request_len, offset)
+		                       : pread(fd, buf.data(), request_len, offset);
+		if(n < 0) { die(write? "write" : "read", path); }
+	}
+
+	close(fd);
+}
+
+static double run(const char* path, bool write, off_t file_len, int n_threads,
+                  size_t request_len) {
+	const off_t slice = file_len / n_threads / request_len * request_len;
+	std::vector<std::thread> threads;
+
+	const double start = now();
+	for(int i = 0; i < n_threads; i += 1) {
+		threads.push_back(std::thread(worker, path, write, i * slice, (i + 1) * slice,
+		                              request_len));
+	}
+	for(auto& thread: threads) { thread.join(); }
+	return now() - start;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [file_mb] [max_threads]\n", argv[0]);
+		return 1;
+	}
+
+	const char* dir = argv[1];
+	const off_t file_len = static_cast<off_t>((argc > 2)? atoi(argv[2]) : 256) << 20;
+	const int max_threads = (argc > 3)? atoi(argv[3]) : 8;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/queue-depth", dir);
+	const int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if(fd < 0) { die("create", path); }
+	close(fd);
+
+	// Lay the file down once, so the read passes have something to read.
+	run(path, true, file_len, 1, 1 << 20);
+
+	const size_t request_lens[] = {4 << 10, 16 << 10, 64 << 10, 128 << 10};
+	printf("op\tthreads\trequest_kb\tseconds\tmb_per_sec\n");
+	for(int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+		for(const size_t request_len: request_lens) {
+			for(int write = 0; write < 2; write += 1) {
+				const double elapsed = run(path, write, file_len, n_threads, request_len);
+				printf("%s\t%d\t%zu\t%.6f\t%.1f\n", write? "write" : "read", n_threads,
+				       request_len >> 10, elapsed, (file_len >> 20) / elapsed);
+			}
+		}
+	}
+
+	unlink(path);
+	return 0;
+}
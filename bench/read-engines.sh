@@ -0,0 +1,21 @@
+#!/usr/bin/env sh
+# Mount a source directory with the read() and mmap read engines in turn and
+# run the read pattern benchmark against each. direct_io keeps the FUSE page
+# cache out of the way, so that every read reaches the engine.
+#
+# Usage: bench/read-engines.sh <build dir> [file_mb] [random_reads]
+set -e
+
+BUILD=${1:?build directory}
+shift
+
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+
+for engine in posix mmap; do
+    mkdir -p "$WORK/src-$engine" "$WORK/mnt"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$WORK/src-$engine" "$WORK/mnt" -o io=$engine,direct_io
+    echo "# io=$engine"
+    "$BUILD/bench_read_patterns" "$WORK/mnt" "$@"
+    fusermount -u "$WORK/mnt"
+done
@@ -0,0 +1,74 @@
+// Read throughput for random 4 KiB reads and sequential 1 MiB reads of one
+// large file. Run it inside mounts using -o io=posix and -o io=mmap to compare
+// the read engines.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what, const char* path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void report(const char* op, size_t n, size_t request_len, double elapsed) {
+	printf("%s\t%zu\t%zu\t%.6f\t%.1f\t%.1f\n", op, n, request_len, elapsed, n / elapsed,
+	       (n * request_len / (1024.0 * 1024.0)) / elapsed);
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [file_mb] [random_reads]\n", argv[0]);
+		return 1;
+	}
+
+	const char* dir = argv[1];
+	const off_t file_len = static_cast<off_t>((argc > 2)? atoi(argv[2]) : 256) << 20;
+	const size_t n_random = (argc > 3)? atoi(argv[3]) : 20000;
+	const size_t small = 4 << 10;
+	const size_t large = 1 << 20;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/read-patterns", dir);
+	const int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if(fd < 0) { die("create", path); }
+
+	std::vector<char> buf(large, 'r');
+	for(off_t offset = 0; offset < file_len; offset += large) {
+		if(pwrite(fd, buf.data(), large, offset) != static_cast<ssize_t>(large)) {
+			die("write", path);
+		}
+	}
+
+	printf("op\tcount\trequest_len\tseconds\tops_per_sec\tmb_per_sec\n");
+
+	double start = now();
+	size_t n = 0;
+	for(off_t offset = 0; offset < file_len; offset += large, n += 1) {
+		if(pread(fd, buf.data(), large, offset) < 0) { die("read", path); }
+	}
+	report("sequential", n, large, now() - start);
+
+	srand(1);
+	const off_t n_slots = file_len / small;
+	start = now();
+	for(size_t i = 0; i < n_random; i += 1) {
+		const off_t offset = (rand() % n_slots) * small;
+		if(pread(fd, buf.data(), small, offset) < 0) { die("read", path); }
+	}
+	report("random", n_random, small, now() - start);
+
+	close(fd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env sh
+# Measure what a background key rotation costs foreground operations. Fill a
+# filesystem, then run the same small-file workload against a quiet mount and
+# against mounts rotating at each rate, and report the latency percentiles
+# from /__FANGFS_STATS for the operations it uses, along with how long
+# operations waited on the rotation engine and how far it got.
+#
+# Usage: SOURCE=/mnt/disk/dir bench/rotate-latency.sh <build dir> [data_mb] [seconds] [rates]
+set -e
+
+BUILD=${1:?build directory}
+DATA_MB=${2:-512}
+SECONDS_PER_RUN=${3:-20}
+RATES=${4:-"4 16 64 0"}
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+mkdir -p "$SOURCE" "$WORK/mnt"
+
+wait_mounted() {
+    until mountpoint -q "$WORK/mnt" && stat "$WORK/mnt" >/dev/null 2>&1; do
+        sleep 0.01
+    done
+}
+
+# Bulk data for the engine to chew through, and small files for the workload.
+printf "bench\nbench\n" | "$BUILD/fangfs" "$SOURCE" "$WORK/mnt"
+wait_mounted
+mkdir "$WORK/mnt/bulk" "$WORK/mnt/small"
+i=0
+while [ $i -lt "$DATA_MB" ]; do
+    dd if=/dev/urandom of="$WORK/mnt/bulk/$i" bs=1M count=1 2>/dev/null
+    i=$((i + 1))
+done
+i=0
+while [ $i -lt 200 ]; do
+    head -c 8192 /dev/urandom > "$WORK/mnt/small/$i"
+    i=$((i + 1))
+done
+fusermount -u "$WORK/mnt"
+
+workload() {
+    end=$(($(date +%s) + SECONDS_PER_RUN))
+    while [ "$(date +%s)" -lt "$end" ]; do
+        for f in "$WORK"/mnt/small/*; do
+            cat "$f" >/dev/null
+        done
+        ls -l "$WORK/mnt/small" >/dev/null
+    done
+}
+
+report() {
+    awk -v run="$1" -F '\t' '
+        $1 ~ /^(getattr|open|read|readdir|rotate_wait)$/ {
+            printf "%s\t%s\t%s\t%s\t%s\t%s\n", run, $1, $2, $4, $6, $8
+        }
+        $1 == "bytes_rotated" { printf "%s\trotated_mib\t%.1f\n", run, $2 / 1048576 }
+    ' "$WORK/mnt/__FANGFS_STATS"
+}
+
+printf "run\ttimer\tcount\tp50_us\tp99_us\tmax_us\n"
+printf "bench\n" | "$BUILD/fangfs" "$SOURCE" "$WORK/mnt"
+wait_mounted
+workload
+report quiet
+fusermount -u "$WORK/mnt"
+
+for rate in $RATES; do
+    # Each run starts a fresh rotation, or carries on with the last one if
+    # it didn't finish.
+    printf "bench\n" | "$BUILD/fangfs" "$SOURCE" "$WORK/mnt" \
+        -o rotate_key,rotate_rate=$rate,rotate_duty=100
+    wait_mounted
+    workload
+    report "rate=$rate"
+    fusermount -u "$WORK/mnt"
+done
@@ -0,0 +1,77 @@
+#!/usr/bin/env sh
+# Compare a tree of small files with and without packing. For each threshold,
+# create a fresh filesystem, write the files through the mount, wait for the
+# engine to pack them, then time a cold listing and read of the whole tree,
+# and report the apparent and on-disk size of the ciphertext and the packing
+# counter from /__FANGFS_STATS.
+#
+# Usage: SOURCE=/mnt/disk/dir bench/small-files.sh <build dir> [files] [max_bytes] [thresholds]
+set -e
+
+BUILD=${1:?build directory}
+FILES=${2:-20000}
+MAX_BYTES=${3:-4096}
+THRESHOLDS=${4:-"0 4096 65536"}
+
+WORK=$(mktemp -d)
+SOURCE=${SOURCE:-$WORK/src}
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; rm -rf "$WORK"' EXIT
+mkdir -p "$SOURCE" "$WORK/mnt" "$WORK/corpus"
+
+wait_mounted() {
+    until mountpoint -q "$WORK/mnt" && stat "$WORK/mnt" >/dev/null 2>&1; do
+        sleep 0.01
+    done
+}
+
+seconds_since() {
+    echo "$(date +%s.%N) - $1" | bc
+}
+
+# Files of random length up to MAX_BYTES, a hundred to a directory.
+awk -v files="$FILES" -v max="$MAX_BYTES" -v dir="$WORK/corpus" 'BEGIN {
+    srand(1)
+    for(i = 0; i < files; i += 1) {
+        if(i % 100 == 0) { system("mkdir -p " dir "/" int(i / 100)) }
+        printf "%d/%d %d\n", int(i / 100), i, int(rand() * max) + 1
+    }
+}' | while read -r path len; do
+    head -c "$len" /dev/urandom > "$WORK/corpus/$path"
+done
+
+printf "pack\twrite_s\tlist_s\tread_s\tapparent_mib\tdisk_mib\tfiles_packed\n"
+for threshold in $THRESHOLDS; do
+    dir="$SOURCE/$threshold"
+    mkdir "$dir"
+    printf "bench\nbench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o pack=$threshold
+    wait_mounted
+
+    start=$(date +%s.%N)
+    cp -r "$WORK/corpus/." "$WORK/mnt/"
+    sync
+    write=$(seconds_since "$start")
+
+    # Give the engine time to pack everything that was closed, and take the
+    # counters before remounting.
+    sleep 10
+    packed=$(awk -F '\t' '$1 == "files_packed" { print $2 }' "$WORK/mnt/__FANGFS_STATS")
+    fusermount -u "$WORK/mnt"
+
+    # Remount with caches dropped, so the reads reach the source.
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+    printf "bench\n" | "$BUILD/fangfs" "$dir" "$WORK/mnt" -o pack=$threshold
+    wait_mounted
+    start=$(date +%s.%N)
+    ls -lR "$WORK/mnt" >/dev/null
+    list=$(seconds_since "$start")
+    start=$(date +%s.%N)
+    find "$WORK/mnt" -type f -exec cat {} + >/dev/null
+    read=$(seconds_since "$start")
+    fusermount -u "$WORK/mnt"
+
+    apparent=$(du -sm --apparent-size "$dir" | cut -f1)
+    disk=$(du -sm "$dir" | cut -f1)
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$threshold" "$write" "$list" "$read" \
+        "$apparent" "$disk" "${packed:-0}"
+done
@@ -1,9 +1,13 @@
 #include "Buffer.h"
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <sodium.h>
+#include "securepool.h"
 #include "error.h"
 
-Buffer::Buffer(Buffer&& other): buf(other.buf), buf_len(other.buf_len), len(other.len) {
+Buffer::Buffer(Buffer&& other): buf(other.buf), buf_len(other.buf_len), len(other.len),
+        secure(other.secure) {
     other.buf = nullptr;
     other.buf_len = 0;
     other.len = 0;
@@ -35,6 +39,20 @@ void buf_grow(Buffer& buf, size_t size) {
         size = 16;
     }
 
+    // Secure memory is never reallocated in place, so the old copy is wiped.
+    if(buf.secure) {
+        if(size <= buf.buf_len) { return; }
+        size_t new_len = 0;
+        uint8_t* newbuf = secure_alloc(size, new_len);
+        if(buf.buf != nullptr) {
+            memcpy(newbuf, buf.buf, buf.buf_len);
+            secure_free(buf.buf, buf.buf_len);
+        }
+        buf.buf_len = new_len;
+        buf.buf = newbuf;
+        return;
+    }
+
     // Otherwise, use the provided size.
     uint8_t* newbuf = (uint8_t*)realloc(buf.buf, size);
     if(newbuf == nullptr) { throw AllocationError(); }
@@ -42,6 +60,38 @@ void buf_grow(Buffer& buf, size_t size) {
     buf.buf = newbuf;
 }
 
+void buf_grow_aligned(Buffer& buf, size_t size, size_t alignment) {
+    const bool aligned = (reinterpret_cast<uintptr_t>(buf.buf) % alignment) == 0;
+    if(buf.buf != nullptr && aligned && size <= buf.buf_len) { return; }
+
+    size = std::max(size, buf.buf_len);
+    size = (size + alignment - 1) / alignment * alignment;
+
+    void* newbuf = nullptr;
+    if(posix_memalign(&newbuf, alignment, size) != 0) { throw AllocationError(); }
+    if(buf.buf != nullptr) {
+        memcpy(newbuf, buf.buf, buf.buf_len);
+        free(buf.buf);
+    }
+
+    buf.buf_len = size;
+    buf.buf = reinterpret_cast<uint8_t*>(newbuf);
+}
+
+void buf_make_secure(Buffer& buf) {
+    if(buf.secure) { return; }
+    buf.secure = true;
+    if(buf.buf == nullptr) { return; }
+
+    size_t new_len = 0;
+    uint8_t* newbuf = secure_alloc(buf.buf_len, new_len);
+    memcpy(newbuf, buf.buf, buf.buf_len);
+    sodium_memzero(buf.buf, buf.buf_len);
+    free(buf.buf);
+    buf.buf_len = new_len;
+    buf.buf = newbuf;
+}
+
 void buf_load_string(Buffer& buf, const char* str) {
     const size_t len = strlen(str) + 1;
 
@@ -53,7 +103,7 @@ void buf_load_string(Buffer& buf, const char* str) {
 void buf_copy(const Buffer& src, Buffer& dest) {
     buf_grow(dest, src.buf_len);
     dest.len = src.len;
-    memcpy(dest.buf, src.buf, dest.buf_len);
+    memcpy(dest.buf, src.buf, src.buf_len);
 }
 
 char* buf_copy_string(Buffer& buf) {
@@ -67,7 +117,11 @@ char* buf_copy_string(Buffer& buf) {
 }
 
 void buf_free(Buffer& buf) {
-    free(buf.buf);
+    if(buf.secure) {
+        secure_free(buf.buf, buf.buf_len);
+    } else {
+        free(buf.buf);
+    }
     buf.buf_len = 0;
     buf.len = 0;
     buf.buf = nullptr;
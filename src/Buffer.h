@@ -5,7 +5,7 @@
 
 /// A growable buffer type.
 struct Buffer {
-    Buffer(): buf(nullptr), buf_len(0), len(0) {}
+    Buffer(): buf(nullptr), buf_len(0), len(0), secure(false) {}
     Buffer(Buffer&& other);
     uint8_t operator[](size_t i) const;
     uint8_t& operator[](size_t i);
@@ -19,11 +19,23 @@ struct Buffer {
 
     /// Usecase-defined logical content length.
     size_t len;
+
+    /// Whether buf comes from the secure pool; see buf_make_secure().
+    bool secure;
 };
 
 /// Grow a buffer to the given size, or double its size if minsize=0.
 void buf_grow(Buffer& buf, size_t minsize);
 
+/// Grow a buffer to at least minsize bytes, placing it at an address that is
+/// a multiple of alignment. Contents are preserved. A buffer grown this way
+/// must keep being grown this way to stay aligned, and can't be secure.
+void buf_grow_aligned(Buffer& buf, size_t minsize, size_t alignment);
+
+/// Keep the buffer's contents in secure memory from now on: locked into RAM
+/// and zeroed when freed or grown out of. For plaintext and key material.
+void buf_make_secure(Buffer& buf);
+
 /// Helper to copy a C-string into a buffer. The "len" property excludes the
 /// terminating nul byte.
 void buf_load_string(Buffer& buf, const char* str);
@@ -4,20 +4,36 @@ void buf_encrypt(const Buffer& inbuf,
                  const uint8_t nonce[crypto_secretbox_NONCEBYTES],
                  const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf) {
 	buf_grow(outbuf, inbuf.len + crypto_secretbox_MACBYTES);
-	crypto_secretbox_easy(outbuf.buf, inbuf.buf, inbuf.len,
-	                      nonce, key);
+	buf_encrypt(inbuf.buf, inbuf.len, nonce, key, outbuf.buf);
 	outbuf.len = inbuf.len + crypto_secretbox_MACBYTES;
 }
 
+void buf_encrypt(const uint8_t* inbuf, size_t inlen,
+                 const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                 const uint8_t key[crypto_secretbox_KEYBYTES], uint8_t* outbuf) {
+	crypto_secretbox_easy(outbuf, inbuf, inlen, nonce, key);
+}
+
 int buf_decrypt(const Buffer& inbuf,
                 const uint8_t nonce[crypto_secretbox_NONCEBYTES],
                 const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf) {
-    const size_t outlen = inbuf.len - crypto_secretbox_MACBYTES;
+	return buf_decrypt(inbuf.buf, inbuf.len, nonce, key, outbuf);
+}
 
-    buf_grow(outbuf, outlen);
+int buf_decrypt(const uint8_t* inbuf, size_t inlen,
+                const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf) {
+	if(inlen < crypto_secretbox_MACBYTES) {
+		outbuf.len = 0;
+		return -1;
+	}
+
+	const size_t outlen = inlen - crypto_secretbox_MACBYTES;
+
+	buf_grow(outbuf, outlen);
 	int result = crypto_secretbox_open_easy(outbuf.buf,
-	                                        inbuf.buf,
-	                                        inbuf.len,
+	                                        inbuf,
+	                                        inlen,
 	                                        nonce,
 	                                        key);
 	if(result != 0) {
@@ -32,3 +48,13 @@ int buf_decrypt(const Buffer& inbuf,
 
 	return result;
 }
+
+int buf_decrypt(const uint8_t* inbuf, size_t inlen,
+                const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                const uint8_t key[crypto_secretbox_KEYBYTES], uint8_t* outbuf) {
+	if(inlen < crypto_secretbox_MACBYTES) {
+		return -1;
+	}
+
+	return crypto_secretbox_open_easy(outbuf, inbuf, inlen, nonce, key);
+}
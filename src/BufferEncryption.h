@@ -8,7 +8,24 @@ void buf_encrypt(const Buffer& inbuf,
                  const uint8_t nonce[crypto_secretbox_NONCEBYTES],
                  const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf);
 
+/// Encrypt inlen bytes into outbuf, which must have room for
+/// inlen + crypto_secretbox_MACBYTES bytes.
+void buf_encrypt(const uint8_t* inbuf, size_t inlen,
+                 const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                 const uint8_t key[crypto_secretbox_KEYBYTES], uint8_t* outbuf);
+
 /// Returns 0 on success
 int buf_decrypt(const Buffer& inbuf,
                 const uint8_t nonce[crypto_secretbox_NONCEBYTES],
                 const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf);
+
+/// Decrypt inlen bytes of raw ciphertext. Returns 0 on success
+int buf_decrypt(const uint8_t* inbuf, size_t inlen,
+                const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                const uint8_t key[crypto_secretbox_KEYBYTES], Buffer& outbuf);
+
+/// Decrypt inlen bytes of raw ciphertext into outbuf, which must have room for
+/// inlen - crypto_secretbox_MACBYTES bytes. Returns 0 on success
+int buf_decrypt(const uint8_t* inbuf, size_t inlen,
+                const uint8_t nonce[crypto_secretbox_NONCEBYTES],
+                const uint8_t key[crypto_secretbox_KEYBYTES], uint8_t* outbuf);
@@ -0,0 +1,554 @@
+#include "check.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "BufferEncryption.h"
+#include "file.h"
+#include "pack.h"
+#include "util.h"
+#include "error.h"
+
+#define CHECKPOINT_HEADER "fangfs-fsck checkpoint 1"
+
+/// Files are split into ranges of about this much ciphertext, so that one
+/// huge file is checked by every thread at once.
+#define CHECK_RANGE_BYTES (64 * 1024 * 1024)
+
+/// How much ciphertext a thread reads at a time.
+#define CHECK_CHUNK_BYTES (1024 * 1024)
+
+/// A problem a checkpoint recorded against a file it lists as checked.
+struct StoredProblem {
+	CheckProblemKind kind;
+	uint64_t detail;
+};
+
+/// A regular file being checked, shared by the tasks covering its ranges.
+struct CheckFile {
+	std::string cipher_path;
+	std::string plain_path;
+	bool plain_known;
+	std::atomic<uint64_t> ranges_left;
+	std::atomic<bool> unreadable;
+};
+
+/// Either a directory to list, or a range of blocks of a file to verify.
+struct CheckTask {
+	bool is_dir;
+	std::string cipher_path;
+	std::string plain_path;
+	std::shared_ptr<CheckFile> file;
+	uint64_t first_block;
+	uint64_t n_blocks;
+};
+
+struct CheckState {
+	CheckState(FangFS& fang, const CheckOptions& opts):
+		fs(fang), options(opts), source_fd(-1), busy(0), done(false),
+		checkpoint(nullptr) {}
+
+	FangFS& fs;
+	const CheckOptions& options;
+	int source_fd;
+
+	std::mutex lock;
+	std::condition_variable cond;
+
+	/// Wakes the calling thread once done is set.
+	std::condition_variable finished;
+	std::vector<CheckTask> tasks;
+	unsigned busy;
+	bool done;
+
+	std::atomic<uint64_t> dirs;
+	std::atomic<uint64_t> files;
+	std::atomic<uint64_t> files_skipped;
+	std::atomic<uint64_t> blocks;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> problems;
+
+	/// Serializes problem reports and checkpoint writes.
+	std::mutex report_lock;
+	FILE* checkpoint;
+
+	/// Files the checkpoint lists as already checked, and what was wrong
+	/// with them. Read-only once the check starts.
+	std::unordered_map<std::string, std::vector<StoredProblem>> checked;
+};
+
+const char* check_problem_name(CheckProblemKind kind) {
+	switch(kind) {
+	case CHECK_CORRUPT_NAME: return "corrupt_name";
+	case CHECK_MISPLACED: return "misplaced";
+	case CHECK_BAD_LENGTH: return "bad_length";
+	case CHECK_CORRUPT_BLOCK: return "corrupt_block";
+	case CHECK_CORRUPT_RECORD: return "corrupt_record";
+	case CHECK_UNREADABLE: return "unreadable";
+	}
+	return "unknown";
+}
+
+/// Problems with files go into the checkpoint ahead of the line marking
+/// the file as checked; problems with names are found again on every run.
+static char checkpoint_tag(CheckProblemKind kind) {
+	switch(kind) {
+	case CHECK_BAD_LENGTH: return 'L';
+	case CHECK_CORRUPT_BLOCK: return 'B';
+	case CHECK_UNREADABLE: return 'U';
+	default: return '\0';
+	}
+}
+
+static void report(CheckState& state, CheckProblemKind kind, const std::string& cipher_path,
+                   const char* plain_path, uint64_t detail, bool record) {
+	std::lock_guard<std::mutex> guard(state.report_lock);
+	state.problems.fetch_add(1);
+
+	const char tag = checkpoint_tag(kind);
+	if(record && state.checkpoint != nullptr && tag != '\0') {
+		fprintf(state.checkpoint, "%c\t%llu\t%s\n", tag,
+		        static_cast<unsigned long long>(detail), cipher_path.c_str());
+	}
+
+	if(state.options.on_problem) {
+		CheckProblem problem;
+		problem.kind = kind;
+		problem.cipher_path = cipher_path.c_str();
+		problem.plain_path = plain_path;
+		problem.detail = detail;
+		state.options.on_problem(problem);
+	}
+}
+
+static void push_task(CheckState& state, CheckTask& task) {
+	std::lock_guard<std::mutex> guard(state.lock);
+	state.tasks.push_back(std::move(task));
+	state.cond.notify_one();
+}
+
+static void file_finished(CheckState& state, CheckFile& file) {
+	if(file.ranges_left.fetch_sub(1) != 1) { return; }
+
+	state.files.fetch_add(1);
+	std::lock_guard<std::mutex> guard(state.report_lock);
+	if(state.checkpoint != nullptr) {
+		fprintf(state.checkpoint, "F\t0\t%s\n", file.cipher_path.c_str());
+	}
+}
+
+/// Queue up the ranges of a regular file found while listing a directory.
+static void add_file(CheckState& state, const std::string& cipher_path,
+                     const char* plain_path, off_t physical_size) {
+	auto checked = state.checked.find(cipher_path);
+	if(checked != state.checked.end()) {
+		state.files_skipped.fetch_add(1);
+		for(const StoredProblem& problem: checked->second) {
+			report(state, problem.kind, cipher_path, plain_path, problem.detail, false);
+		}
+		return;
+	}
+
+	std::shared_ptr<CheckFile> file = std::make_shared<CheckFile>();
+	file->cipher_path = cipher_path;
+	file->plain_known = (plain_path != nullptr);
+	if(file->plain_known) { file->plain_path = plain_path; }
+	file->unreadable.store(false);
+
+	// A trailing fragment too short to be a block is reported, and the
+	// whole blocks before it are still checked.
+	const uint64_t block_size = state.fs.metafile.block_size;
+	uint64_t n_blocks = (physical_size + block_size - 1) / block_size;
+	if(fang_file_size_at(state.fs, state.source_fd, cipher_path.c_str(), physical_size) < 0) {
+		report(state, CHECK_BAD_LENGTH, cipher_path, plain_path, 0, true);
+		n_blocks = physical_size / block_size;
+	}
+
+	const uint64_t range_blocks = std::max<uint64_t>(CHECK_RANGE_BYTES / block_size, 1);
+	const uint64_t n_ranges = std::max<uint64_t>((n_blocks + range_blocks - 1) / range_blocks, 1);
+	file->ranges_left.store(n_ranges);
+
+	for(uint64_t i = 0; i < n_ranges; i += 1) {
+		CheckTask task;
+		task.is_dir = false;
+		task.file = file;
+		task.first_block = i * range_blocks;
+		task.n_blocks = std::min(range_blocks, n_blocks - std::min(n_blocks, task.first_block));
+		push_task(state, task);
+	}
+}
+
+/// Verify the record of a packed file found while listing a directory. Packed
+/// files are small, so they are checked on the spot, and never checkpointed.
+/// segments holds the segments opened so far.
+static void check_packed(CheckState& state, int dir_fd, const char* name,
+                         const std::string& cipher_path, const char* plain_path,
+                         std::map<uint32_t, int>& segments) {
+	// Some other symlink, which the filesystem never shows.
+	PackLocator locator;
+	if(pack_read_link(dir_fd, name, locator) < 0) { return; }
+
+	auto it = segments.find(locator.segment);
+	if(it == segments.end()) {
+		it = segments.insert(std::make_pair(locator.segment,
+		                                    pack_open_segment(state.source_fd,
+		                                                      locator.segment))).first;
+	}
+
+	Buffer contents;
+	const ssize_t status = (it->second < 0)? STATUS_CHECK_ERRNO :
+	                       pack_read_record(state.fs, it->second, locator, cipher_path.c_str(),
+	                                        state.fs.master_key, contents);
+	sodium_memzero(contents.buf, contents.buf_len);
+	if(status == STATUS_TAMPERING || (status < 0 && (errno == ESTALE || errno == ENOENT))) {
+		report(state, CHECK_CORRUPT_RECORD, cipher_path, plain_path, 0, false);
+	} else if(status < 0) {
+		report(state, CHECK_UNREADABLE, cipher_path, plain_path, errno, false);
+	} else {
+		state.bytes.fetch_add(locator.size, std::memory_order_relaxed);
+	}
+	state.files.fetch_add(1);
+}
+
+static void check_dir(CheckState& state, const CheckTask& task) {
+	const char* plain_dir = task.plain_path.c_str();
+	const char* open_path = task.cipher_path.empty()? "." : task.cipher_path.c_str();
+	const int fd = openat(state.source_fd, open_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	DIR* dir = (fd < 0)? nullptr : fdopendir(fd);
+	if(dir == nullptr) {
+		report(state, CHECK_UNREADABLE, task.cipher_path, plain_dir, errno, false);
+		if(fd >= 0) { close(fd); }
+		return;
+	}
+
+	Buffer decrypted;
+	Buffer child_plain;
+	std::map<uint32_t, int> segments;
+	while(1) {
+		errno = 0;
+		struct dirent* entry = readdir(dir);
+		if(entry == nullptr) {
+			if(errno != 0) {
+				report(state, CHECK_UNREADABLE, task.cipher_path, plain_dir, errno, false);
+			}
+			break;
+		}
+
+		// Special names, as readdir skips them.
+		const char* name = entry->d_name;
+		if(name[0] == '_' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+
+		const std::string child_cipher = task.cipher_path.empty()?
+		                                 std::string(name) : task.cipher_path + "/" + name;
+
+		const char* plain_name = nullptr;
+		const int status = name_decrypt(state.fs, plain_dir, name, decrypted, &plain_name);
+		const char* plain_path = nullptr;
+		if(status == STATUS_TAMPERING) {
+			report(state, CHECK_CORRUPT_NAME, child_cipher, nullptr, 0, false);
+		} else if(status < 0) {
+			report(state, CHECK_MISPLACED, child_cipher, nullptr, 0, false);
+		} else {
+			path_join(plain_dir, plain_name, child_plain);
+			plain_path = reinterpret_cast<char*>(child_plain.buf);
+		}
+
+		struct stat info;
+		if(fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+			report(state, CHECK_UNREADABLE, child_cipher, plain_path, errno, false);
+			continue;
+		}
+
+		if(S_ISDIR(info.st_mode)) {
+			// Without the plaintext path, the children's names can't be checked.
+			if(plain_path == nullptr) { continue; }
+
+			CheckTask child;
+			child.is_dir = true;
+			child.cipher_path = child_cipher;
+			child.plain_path = plain_path;
+			child.first_block = child.n_blocks = 0;
+			push_task(state, child);
+		} else if(S_ISREG(info.st_mode)) {
+			add_file(state, child_cipher, plain_path, info.st_size);
+		} else if(S_ISLNK(info.st_mode)) {
+			check_packed(state, dirfd(dir), name, child_cipher, plain_path, segments);
+		}
+	}
+
+	for(const auto& segment: segments) {
+		if(segment.second >= 0) { close(segment.second); }
+	}
+	closedir(dir);
+	state.dirs.fetch_add(1);
+}
+
+static void check_range(CheckState& state, const CheckTask& task, Buffer& ciphertext,
+                        Buffer& plaintext, Buffer& packed) {
+	CheckFile& file = *task.file;
+	const char* plain_path = file.plain_known? file.plain_path.c_str() : nullptr;
+	if(task.n_blocks == 0 || file.unreadable.load()) {
+		file_finished(state, file);
+		return;
+	}
+
+	const int fd = openat(state.source_fd, file.cipher_path.c_str(), O_RDONLY|O_CLOEXEC);
+	if(fd < 0) {
+		if(!file.unreadable.exchange(true)) {
+			report(state, CHECK_UNREADABLE, file.cipher_path, plain_path, errno, true);
+		}
+		file_finished(state, file);
+		return;
+	}
+
+	const size_t block_size = state.fs.metafile.block_size;
+	const size_t chunk_blocks = std::max<size_t>(CHECK_CHUNK_BYTES / block_size, 1);
+	const off_t range_start = task.first_block * block_size;
+	posix_fadvise(fd, range_start, task.n_blocks * block_size, POSIX_FADV_SEQUENTIAL);
+
+	buf_grow(ciphertext, chunk_blocks * block_size);
+	buf_grow(plaintext, block_size);
+	for(uint64_t done = 0; done < task.n_blocks;) {
+		const size_t n = std::min<uint64_t>(chunk_blocks, task.n_blocks - done);
+		const off_t offset = range_start + done * block_size;
+		ssize_t got;
+		do {
+			got = pread(fd, ciphertext.buf, n * block_size, offset);
+		} while(got < 0 && errno == EINTR);
+
+		if(got < 0) {
+			if(!file.unreadable.exchange(true)) {
+				report(state, CHECK_UNREADABLE, file.cipher_path, plain_path, errno, true);
+			}
+			break;
+		}
+
+		// A short read means the file shrank under us; check what's there.
+		for(size_t i = 0; i * block_size < static_cast<size_t>(got); i += 1) {
+			const uint8_t* block = ciphertext.buf + i * block_size;
+			const size_t len = std::min<size_t>(block_size, got - i * block_size);
+			const uint64_t block_n = task.first_block + done + i;
+			if(fang_block_open(state.fs, state.fs.master_key, block, len, plaintext.buf,
+			                   packed) < 0) {
+				report(state, CHECK_CORRUPT_BLOCK, file.cipher_path, plain_path, block_n, true);
+			}
+			state.blocks.fetch_add(1, std::memory_order_relaxed);
+		}
+		state.bytes.fetch_add(got, std::memory_order_relaxed);
+
+		if(static_cast<size_t>(got) < n * block_size) { break; }
+		done += n;
+	}
+
+	close(fd);
+	file_finished(state, file);
+}
+
+static void worker(CheckState& state) {
+	Buffer ciphertext;
+	Buffer plaintext;
+	Buffer packed;
+
+	std::unique_lock<std::mutex> guard(state.lock);
+	while(1) {
+		while(state.tasks.empty() && !state.done) {
+			state.cond.wait(guard);
+		}
+		if(state.done) { break; }
+
+		CheckTask task = std::move(state.tasks.back());
+		state.tasks.pop_back();
+		state.busy += 1;
+		guard.unlock();
+
+		if(task.is_dir) {
+			check_dir(state, task);
+		} else {
+			check_range(state, task, ciphertext, plaintext, packed);
+		}
+
+		guard.lock();
+		state.busy -= 1;
+		if(state.tasks.empty() && state.busy == 0) {
+			state.done = true;
+			state.cond.notify_all();
+			state.finished.notify_all();
+		}
+	}
+
+	sodium_memzero(plaintext.buf, plaintext.buf_len);
+	sodium_memzero(packed.buf, packed.buf_len);
+}
+
+/// Read the files a previous run checked, then reopen the checkpoint to add
+/// to it. Returns 0 or STATUS_CHECK_ERRNO.
+static int open_checkpoint(CheckState& state, const char* path) {
+	FILE* f = fopen(path, "r");
+	if(f == nullptr && errno != ENOENT) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	bool fresh = (f == nullptr);
+	if(f != nullptr) {
+		std::unordered_map<std::string, std::vector<StoredProblem>> problems;
+		char line[4096];
+		bool header = true;
+		while(fgets(line, sizeof(line), f) != nullptr) {
+			line[strcspn(line, "\n")] = '\0';
+			if(header) {
+				if(strcmp(line, CHECKPOINT_HEADER) != 0) {
+					fclose(f);
+					errno = EINVAL;
+					return STATUS_CHECK_ERRNO;
+				}
+				header = false;
+				continue;
+			}
+
+			// tag, detail, path; a torn last line is simply ignored.
+			char* detail_end = nullptr;
+			if(line[0] == '\0' || line[1] != '\t') { continue; }
+			const unsigned long long detail = strtoull(line + 2, &detail_end, 10);
+			if(*detail_end != '\t') { continue; }
+			const std::string cipher_path(detail_end + 1);
+
+			StoredProblem problem;
+			problem.detail = detail;
+			switch(line[0]) {
+			case 'F':
+				state.checked[cipher_path] = problems[cipher_path];
+				problems.erase(cipher_path);
+				continue;
+			case 'L': problem.kind = CHECK_BAD_LENGTH; break;
+			case 'B': problem.kind = CHECK_CORRUPT_BLOCK; break;
+			case 'U': problem.kind = CHECK_UNREADABLE; break;
+			default: continue;
+			}
+			problems[cipher_path].push_back(problem);
+		}
+		fresh = header;
+		fclose(f);
+	}
+
+	state.checkpoint = fopen(path, "a");
+	if(state.checkpoint == nullptr) {
+		return STATUS_CHECK_ERRNO;
+	}
+	if(fresh) {
+		fprintf(state.checkpoint, "%s\n", CHECKPOINT_HEADER);
+	}
+	return 0;
+}
+
+static void snapshot(const CheckState& state, CheckStats& stats) {
+	stats.dirs = state.dirs.load();
+	stats.files = state.files.load();
+	stats.files_skipped = state.files_skipped.load();
+	stats.blocks = state.blocks.load();
+	stats.bytes = state.bytes.load();
+	stats.problems = state.problems.load();
+}
+
+int check_run(FangFS& fs, const CheckOptions& options, CheckStats& stats) {
+	CheckState state(fs, options);
+	state.dirs.store(0);
+	state.files.store(0);
+	state.files_skipped.store(0);
+	state.blocks.store(0);
+	state.bytes.store(0);
+	state.problems.store(0);
+
+	state.source_fd = open(fs.source, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(state.source_fd < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	if(options.checkpoint_path != nullptr &&
+	   open_checkpoint(state, options.checkpoint_path) < 0) {
+		const int new_errno = errno;
+		close(state.source_fd);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	CheckTask root;
+	root.is_dir = true;
+	root.plain_path = "/";
+	root.first_block = root.n_blocks = 0;
+	state.tasks.push_back(root);
+
+	unsigned n_threads = options.threads;
+	if(n_threads == 0) {
+		n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 0; i < n_threads; i += 1) {
+		threads.push_back(std::thread(worker, std::ref(state)));
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(state.lock);
+		const bool report_progress = options.on_progress && options.progress_seconds > 0;
+		const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(options.progress_seconds));
+		auto next_progress = std::chrono::steady_clock::now() + interval;
+		while(!state.done) {
+			if(!report_progress) {
+				state.finished.wait(guard);
+				continue;
+			}
+
+			if(state.finished.wait_until(guard, next_progress) != std::cv_status::timeout) {
+				continue;
+			}
+			next_progress += interval;
+
+			// Keep the checkpoint current, so an interrupted check loses
+			// little work.
+			{
+				std::lock_guard<std::mutex> report_guard(state.report_lock);
+				if(state.checkpoint != nullptr) { fflush(state.checkpoint); }
+			}
+
+			CheckStats progress;
+			snapshot(state, progress);
+			guard.unlock();
+			options.on_progress(progress);
+			guard.lock();
+		}
+	}
+
+	for(std::thread& thread: threads) {
+		thread.join();
+	}
+
+	snapshot(state, stats);
+	close(state.source_fd);
+
+	// The walk is complete, so a rerun would start over anyway.
+	if(state.checkpoint != nullptr) {
+		fclose(state.checkpoint);
+		unlink(options.checkpoint_path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include "fangfs.h"
+
+/// What an offline check can find wrong with a source tree.
+enum CheckProblemKind {
+	/// A name that fails authentication.
+	CHECK_CORRUPT_NAME,
+
+	/// A name that authenticates, but was encrypted for another directory:
+	/// the entry was moved around outside the filesystem. Misplaced
+	/// directories are not descended into, since their children's names
+	/// can't be checked without knowing where they belong.
+	CHECK_MISPLACED,
+
+	/// A ciphertext file whose length no sequence of blocks could have.
+	CHECK_BAD_LENGTH,
+
+	/// A block that fails authentication.
+	CHECK_CORRUPT_BLOCK,
+
+	/// A packed file whose record is missing, or fails authentication, or
+	/// belongs to another entry.
+	CHECK_CORRUPT_RECORD,
+
+	/// A file or directory that couldn't be read at all.
+	CHECK_UNREADABLE
+};
+
+struct CheckProblem {
+	CheckProblemKind kind;
+
+	/// The ciphertext path, relative to the source.
+	const char* cipher_path;
+
+	/// The plaintext path, or nullptr if it isn't known.
+	const char* plain_path;
+
+	/// The block number, for CHECK_CORRUPT_BLOCK, or the errno value, for
+	/// CHECK_UNREADABLE.
+	uint64_t detail;
+};
+
+/// Running totals of a check. Files skipped are those a checkpoint recorded
+/// as already checked.
+struct CheckStats {
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t files_skipped;
+	uint64_t blocks;
+	uint64_t bytes;
+	uint64_t problems;
+};
+
+struct CheckOptions {
+	CheckOptions(): threads(0), checkpoint_path(nullptr), progress_seconds(0) {}
+
+	/// Worker threads; 0 picks one per CPU.
+	unsigned threads;
+
+	/// If not nullptr, every file checked is recorded here, along with the
+	/// problems found in it, and a rerun skips the files it lists. The file
+	/// is removed once the check finishes.
+	const char* checkpoint_path;
+
+	/// Called with each problem found, one at a time.
+	std::function<void(const CheckProblem&)> on_problem;
+
+	/// Called every progress_seconds from the calling thread, if set.
+	std::function<void(const CheckStats&)> on_progress;
+	double progress_seconds;
+};
+
+/// The name of kind, for reports.
+const char* check_problem_name(CheckProblemKind kind);
+
+/// Verify every name and block in the unlocked filesystem fs, spreading the
+/// work across threads. Returns 0 once the whole tree has been walked,
+/// whatever problems were found, or STATUS_CHECK_ERRNO if the check couldn't
+/// run at all.
+int check_run(FangFS& fs, const CheckOptions& options, CheckStats& stats);
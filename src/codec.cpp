@@ -0,0 +1,111 @@
+#include "codec.h"
+
+#include <limits.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+
+static size_t lz4_compress(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+	if(len > INT_MAX || out_len > INT_MAX) { return 0; }
+
+	const int n = LZ4_compress_default(reinterpret_cast<const char*>(in),
+	                                   reinterpret_cast<char*>(out),
+	                                   static_cast<int>(len), static_cast<int>(out_len));
+	return (n > 0)? n : 0;
+}
+
+static ssize_t lz4_decompress(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+	if(len > INT_MAX || out_len > INT_MAX) { return -1; }
+
+	const int n = LZ4_decompress_safe(reinterpret_cast<const char*>(in),
+	                                  reinterpret_cast<char*>(out),
+	                                  static_cast<int>(len), static_cast<int>(out_len));
+	return (n >= 0)? n : -1;
+}
+
+static const Codec lz4_codec = {CODEC_LZ4, "lz4", lz4_compress, lz4_decompress};
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+/// Blocks are compressed on the write path, so favour speed over ratio.
+#define ZSTD_BLOCK_LEVEL 1
+
+/// Contexts are expensive to set up, so every thread keeps its own.
+struct ZstdContexts {
+	ZstdContexts(): cctx(nullptr), dctx(nullptr) {}
+	~ZstdContexts() {
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+	}
+
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+};
+
+static thread_local ZstdContexts zstd_contexts;
+
+static size_t zstd_compress(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+	ZstdContexts& contexts = zstd_contexts;
+	if(contexts.cctx == nullptr) {
+		contexts.cctx = ZSTD_createCCtx();
+		if(contexts.cctx == nullptr) { return 0; }
+	}
+
+	const size_t n = ZSTD_compressCCtx(contexts.cctx, out, out_len, in, len, ZSTD_BLOCK_LEVEL);
+	return ZSTD_isError(n)? 0 : n;
+}
+
+static ssize_t zstd_decompress(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+	ZstdContexts& contexts = zstd_contexts;
+	if(contexts.dctx == nullptr) {
+		contexts.dctx = ZSTD_createDCtx();
+		if(contexts.dctx == nullptr) { return -1; }
+	}
+
+	const size_t n = ZSTD_decompressDCtx(contexts.dctx, out, out_len, in, len);
+	return ZSTD_isError(n)? -1 : static_cast<ssize_t>(n);
+}
+
+static const Codec zstd_codec = {CODEC_ZSTD, "zstd", zstd_compress, zstd_decompress};
+#endif
+
+const Codec* codec_find(uint8_t id) {
+	switch(id) {
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return &lz4_codec;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return &zstd_codec;
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+const Codec* codec_by_name(const char* name) {
+	for(uint8_t id = CODEC_NONE + 1; codec_name(id) != nullptr; id += 1) {
+		if(strcmp(name, codec_name(id)) == 0) {
+			return codec_find(id);
+		}
+	}
+
+	return nullptr;
+}
+
+const char* codec_name(uint8_t id) {
+	switch(id) {
+	case CODEC_NONE:
+		return "none";
+	case CODEC_LZ4:
+		return "lz4";
+	case CODEC_ZSTD:
+		return "zstd";
+	default:
+		return nullptr;
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Compression codecs, by the ID that the metafile records. These are on
+/// disk, so never renumber them.
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+
+/// A block compressor. Both functions are safe to call from any thread.
+struct Codec {
+	uint8_t id;
+	const char* name;
+
+	/// Compress len bytes of in into out, which has room for out_len bytes.
+	/// Returns the compressed length, or 0 if it would not fit.
+	size_t (*compress)(const uint8_t* in, size_t len, uint8_t* out, size_t out_len);
+
+	/// Decompress len bytes of in into out, which has room for out_len
+	/// bytes. Returns the decompressed length, or -1 if in is malformed or
+	/// would not fit.
+	ssize_t (*decompress)(const uint8_t* in, size_t len, uint8_t* out, size_t out_len);
+};
+
+/// The codec with the given ID, or nullptr if it is unknown or this build
+/// lacks it.
+const Codec* codec_find(uint8_t id);
+
+/// The codec called name, or nullptr if it is unknown or this build lacks it.
+const Codec* codec_by_name(const char* name);
+
+/// The name of the codec with the given ID, even if this build lacks it, or
+/// nullptr if the ID is unknown.
+const char* codec_name(uint8_t id);
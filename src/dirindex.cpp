@@ -0,0 +1,834 @@
+// Directory indexes. Listing a directory normally means decrypting every
+// name in it, in whatever order the source filesystem keeps them. With -o
+// dir_index, a directory found to hold many names gets an index: its names,
+// sorted, sealed a chunk at a time into a hidden file in its backing
+// directory, and mapped for reading. Listings then walk the index in order,
+// and start from an offset by decrypting only the chunk it falls in. Names
+// added and removed afterwards are appended to the index as change records,
+// and folded back in once there are many of them.
+//
+// An index in use is only kept up to date by this mount. It is marked clean,
+// along with the time its directory was last changed, when the mount ends;
+// an index that is not clean, or whose directory has changed since, is built
+// again by the next listing.
+#include "dirindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "BufferEncryption.h"
+#include "log.h"
+#include "memory.h"
+#include "stats.h"
+#include "util.h"
+#include "error.h"
+
+/// An index file starts with the magic, flags, the number of chunks and of
+/// names, and the modification time of its directory when it was marked
+/// clean, followed by the offset of every chunk and of the end of the last
+/// one, as little-endian uint64s. Change records follow the chunks.
+#define DIRINDEX_MAGIC "FANGIDX1"
+#define DIRINDEX_MAGIC_LEN 8
+#define DIRINDEX_HEADER_LEN 40
+#define DIRINDEX_FLAGS_OFFSET 8
+#define DIRINDEX_CLEAN 1
+
+/// A chunk is a nonce and, sealed, the hash of the directory's path, the
+/// chunk's number, the number of chunks and of names, and its names, each a
+/// type and a length byte followed by the name.
+#define DIRINDEX_CHUNK_HEADER_LEN (16 + 4 + 4 + 8)
+
+/// A change record is the length of the rest of it as a little-endian
+/// uint32, a nonce, and, sealed, the hash of the directory's path, the
+/// record's number, and the type and length byte and the name.
+#define DIRINDEX_RECORD_HEADER_LEN 4
+#define DIRINDEX_RECORD_PLAIN_LEN (16 + 8 + 2)
+
+#define DIRINDEX_SEAL_OVERHEAD (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES)
+
+/// What each change held in memory is charged at: a map node and its name.
+#define DIRINDEX_CHANGE_COST 128
+
+DirIndexBase::~DirIndexBase() {
+	if(map != nullptr) { munmap(map, map_len); }
+}
+
+DirIndex::~DirIndex() {
+	memory_release(MEM_DIR_INDEXES, charged);
+	if(fd >= 0) { close(fd); }
+	if(dir_fd >= 0) { close(dir_fd); }
+}
+
+DirIndexStore::DirIndexStore() {
+	pthread_rwlock_init(&names, nullptr);
+	root_mtime.tv_sec = root_mtime.tv_nsec = 0;
+}
+
+DirIndexStore::~DirIndexStore() {
+	pthread_rwlock_destroy(&names);
+}
+
+FangDir::~FangDir() {
+	if(dir != nullptr) { closedir(dir); }
+}
+
+/// Zero all of name's memory, including whatever is past its end.
+static void wipe_name(std::string& name) {
+	name.resize(name.capacity());
+	if(!name.empty()) { sodium_memzero(&name[0], name.size()); }
+	name.clear();
+}
+
+void IndexNames::wipe(iterator first) {
+	for(; first != end(); ++first) { wipe_name(first->first); }
+}
+
+static inline void store_u32(uint8_t* out, uint32_t x) {
+	x = u32_to_le(x);
+	memcpy(out, &x, sizeof(x));
+}
+
+static inline void store_u64(uint8_t* out, uint64_t x) {
+	x = u64_to_le(x);
+	memcpy(out, &x, sizeof(x));
+}
+
+static inline uint32_t load_u32(const uint8_t* in) {
+	return u32_from_le(u32_from_bytes(in));
+}
+
+static inline uint64_t load_u64(const uint8_t* in) {
+	uint64_t x;
+	memcpy(&x, in, sizeof(x));
+	return u64_from_le(x);
+}
+
+/// Read len bytes at offset. Returns 0, 1 if the file ends first, or -1.
+static int pread_full(int fd, uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pread(fd, buf + total, len - total, offset + total);
+		if(n == 0) {
+			return 1;
+		} else if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pwrite(fd, buf + total, len - total, offset + total);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+/// The plaintext path of the directory holding path.
+static std::string parent_path(const char* path) {
+	const char* name = path_get_basename(path);
+	const size_t len = name - path;
+	return (len <= 1)? std::string("/") : std::string(path, len - 1);
+}
+
+static void hash_path(const char* path, uint8_t out[16]) {
+	crypto_generichash(out, 16, reinterpret_cast<const uint8_t*>(path), strlen(path),
+	                   nullptr, 0);
+}
+
+/// The offset of chunk n, or of the end of the chunks if n is base.chunks.
+static inline uint64_t chunk_offset(const DirIndexBase& base, uint64_t n) {
+	return load_u64(base.map + DIRINDEX_HEADER_LEN + n * 8);
+}
+
+/// Seal plain_len bytes of plain under key into out, nonce first. out needs
+/// room for plain_len + DIRINDEX_SEAL_OVERHEAD bytes.
+static void seal(const uint8_t* key, const uint8_t* plain, size_t plain_len, uint8_t* out) {
+	randombytes_buf(out, crypto_secretbox_NONCEBYTES);
+	const uint64_t start = stats_clock();
+	buf_encrypt(plain, plain_len, out, key, out + crypto_secretbox_NONCEBYTES);
+	stats_time(STAT_ENCRYPT, start);
+}
+
+/// Open len bytes sealed by seal() into plain. Returns 0 or STATUS_TAMPERING.
+static int unseal(const uint8_t* key, const uint8_t* sealed, size_t len, Buffer& plain) {
+	if(len < DIRINDEX_SEAL_OVERHEAD) { return STATUS_TAMPERING; }
+	const uint64_t start = stats_clock();
+	if(buf_decrypt(sealed + crypto_secretbox_NONCEBYTES, len - crypto_secretbox_NONCEBYTES,
+	               sealed, key, plain) != 0) {
+		return STATUS_TAMPERING;
+	}
+	stats_time(STAT_DECRYPT, start);
+	return 0;
+}
+
+/// Decrypt chunk n of dir.base into dir.chunk, and find its names. Returns 0
+/// or STATUS_TAMPERING.
+static int load_chunk(FangFS& fs, FangDir& dir, uint64_t n) {
+	const DirIndexBase& base = *dir.base;
+	const uint64_t start = chunk_offset(base, n);
+	const uint64_t end = chunk_offset(base, n + 1);
+	dir.chunk_n = -1;
+	dir.chunk_names.clear();
+	if(unseal(fs.master_key, base.map + start, end - start, dir.chunk) < 0 ||
+	   dir.chunk.len < DIRINDEX_CHUNK_HEADER_LEN) {
+		return STATUS_TAMPERING;
+	}
+
+	// The chunk has to be this one, of this index, of this directory.
+	const uint8_t* plain = dir.chunk.buf;
+	if(sodium_memcmp(plain, base.path_hash, 16) != 0 || load_u32(plain + 16) != n ||
+	   load_u32(plain + 20) != base.chunks || load_u64(plain + 24) != base.entries) {
+		return STATUS_TAMPERING;
+	}
+
+	const uint64_t expected = std::min<uint64_t>(DIRINDEX_CHUNK_ENTRIES,
+	                                             base.entries - n * DIRINDEX_CHUNK_ENTRIES);
+	size_t offset = DIRINDEX_CHUNK_HEADER_LEN;
+	while(offset < dir.chunk.len) {
+		if(offset + 2 > dir.chunk.len || plain[offset + 1] == 0 ||
+		   offset + 2 + plain[offset + 1] > dir.chunk.len) {
+			return STATUS_TAMPERING;
+		}
+		dir.chunk_names.push_back(offset);
+		offset += 2 + plain[offset + 1];
+	}
+	if(dir.chunk_names.size() != expected) { return STATUS_TAMPERING; }
+
+	dir.chunk_n = n;
+	return 0;
+}
+
+/// Start walking dir's index from the beginning.
+static void rewind_index(FangDir& dir) {
+	dir.next_offset = 0;
+	dir.base_pos = 0;
+	if(dir.delta) { dir.delta_pos = dir.delta->begin(); }
+}
+
+/// Step to the next name of dir's index, with changes applied. Returns 1
+/// with the name and its type, 0 at the end, or STATUS_TAMPERING.
+static int next_entry(FangFS& fs, FangDir& dir, std::string& name, uint8_t& type) {
+	while(1) {
+		const uint8_t* base_entry = nullptr;
+		if(dir.base && dir.base_pos < dir.base->entries) {
+			const uint64_t n = dir.base_pos / DIRINDEX_CHUNK_ENTRIES;
+			if(dir.chunk_n != static_cast<int64_t>(n) && load_chunk(fs, dir, n) < 0) {
+				return STATUS_TAMPERING;
+			}
+			base_entry = dir.chunk.buf + dir.chunk_names[dir.base_pos % DIRINDEX_CHUNK_ENTRIES];
+		}
+		const bool have_change = dir.delta && dir.delta_pos != dir.delta->end();
+		if(base_entry == nullptr && !have_change) { return 0; }
+
+		int order = 1;
+		if(base_entry == nullptr) {
+			order = 1;
+		} else if(!have_change) {
+			order = -1;
+		} else {
+			order = -dir.delta_pos->first.compare(0, std::string::npos,
+			                                      reinterpret_cast<const char*>(base_entry + 2),
+			                                      base_entry[1]);
+		}
+
+		if(order < 0) {
+			name.assign(reinterpret_cast<const char*>(base_entry + 2), base_entry[1]);
+			type = base_entry[0];
+			dir.base_pos += 1;
+			return 1;
+		}
+
+		// A change overrides the name it is about.
+		const DirIndexDelta::value_type& change = *dir.delta_pos;
+		++dir.delta_pos;
+		if(order == 0) { dir.base_pos += 1; }
+		if(change.second == DIRINDEX_REMOVED) { continue; }
+
+		name = change.first;
+		type = change.second;
+		return 1;
+	}
+}
+
+/// Bring the charge for index's base and delta up to date. Call under
+/// index.lock, or before the index is in use.
+static void account(DirIndex& index) {
+	size_t len = sizeof(DirIndex);
+	if(index.base) { len += index.base->map_len; }
+	if(index.delta) { len += index.delta->size() * DIRINDEX_CHANGE_COST; }
+	memory_adjust(MEM_DIR_INDEXES, index.charged, len);
+	index.charged = len;
+}
+
+/// Write names, sorted, out as a new index for index, replacing any old one,
+/// and start using it. Call under index.lock. Returns 0 or -1.
+static int write_index(FangFS& fs, DirIndex& index, const IndexNames& names) {
+	const uint64_t entries = names.size();
+	const uint32_t chunks = (entries + DIRINDEX_CHUNK_ENTRIES - 1) / DIRINDEX_CHUNK_ENTRIES;
+
+	// Lay the chunks out first, so that the table can go before them.
+	std::vector<uint64_t> table(chunks + 1);
+	table[0] = DIRINDEX_HEADER_LEN + (chunks + 1) * 8;
+	for(uint32_t n = 0; n < chunks; n += 1) {
+		size_t plain_len = DIRINDEX_CHUNK_HEADER_LEN;
+		const size_t last = std::min<uint64_t>(entries, (n + 1) * DIRINDEX_CHUNK_ENTRIES);
+		for(size_t i = n * DIRINDEX_CHUNK_ENTRIES; i < last; i += 1) {
+			plain_len += 2 + names[i].first.size();
+		}
+		table[n + 1] = table[n] + plain_len + DIRINDEX_SEAL_OVERHEAD;
+	}
+
+	const int fd = openat(index.dir_fd, DIRINDEX_TEMP_NAME,
+	                      O_RDWR|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if(fd < 0) { return -1; }
+
+	// Not clean: only dirindex_free() vouches for an index.
+	Buffer head;
+	buf_grow(head, table[0]);
+	memset(head.buf, 0, DIRINDEX_HEADER_LEN);
+	memcpy(head.buf, DIRINDEX_MAGIC, DIRINDEX_MAGIC_LEN);
+	store_u32(head.buf + 12, chunks);
+	store_u64(head.buf + 16, entries);
+	for(uint32_t n = 0; n <= chunks; n += 1) {
+		store_u64(head.buf + DIRINDEX_HEADER_LEN + n * 8, table[n]);
+	}
+	int status = pwrite_full(fd, head.buf, table[0], 0);
+
+	uint8_t path_hash[16];
+	hash_path(index.path.c_str(), path_hash);
+	Buffer plain;
+	Buffer sealed;
+	for(uint32_t n = 0; status == 0 && n < chunks; n += 1) {
+		const size_t sealed_len = table[n + 1] - table[n];
+		const size_t plain_len = sealed_len - DIRINDEX_SEAL_OVERHEAD;
+		buf_grow(plain, plain_len);
+		buf_grow(sealed, sealed_len);
+		memcpy(plain.buf, path_hash, 16);
+		store_u32(plain.buf + 16, n);
+		store_u32(plain.buf + 20, chunks);
+		store_u64(plain.buf + 24, entries);
+
+		size_t offset = DIRINDEX_CHUNK_HEADER_LEN;
+		const size_t last = std::min<uint64_t>(entries, (n + 1) * DIRINDEX_CHUNK_ENTRIES);
+		for(size_t i = n * DIRINDEX_CHUNK_ENTRIES; i < last; i += 1) {
+			const std::string& name = names[i].first;
+			plain.buf[offset] = names[i].second;
+			plain.buf[offset + 1] = name.size();
+			memcpy(plain.buf + offset + 2, name.data(), name.size());
+			offset += 2 + name.size();
+		}
+
+		seal(fs.master_key, plain.buf, plain_len, sealed.buf);
+		status = pwrite_full(fd, sealed.buf, sealed_len, table[n]);
+	}
+	sodium_memzero(plain.buf, plain.buf_len);
+
+	DirIndexBase* base = nullptr;
+	if(status == 0) {
+		base = new DirIndexBase;
+		base->map_len = table[chunks];
+		base->chunks = chunks;
+		base->entries = entries;
+		memcpy(base->path_hash, path_hash, 16);
+		void* map = mmap(nullptr, base->map_len, PROT_READ, MAP_SHARED, fd, 0);
+		if(map == MAP_FAILED) {
+			status = -1;
+		} else {
+			base->map = reinterpret_cast<uint8_t*>(map);
+		}
+	}
+	if(status == 0 && renameat(index.dir_fd, DIRINDEX_TEMP_NAME, index.dir_fd,
+	                           DIRINDEX_NAME) < 0) {
+		status = -1;
+	}
+	if(status < 0) {
+		const int new_errno = errno;
+		delete base;
+		close(fd);
+		unlinkat(index.dir_fd, DIRINDEX_TEMP_NAME, 0);
+		errno = new_errno;
+		return -1;
+	}
+
+	// Listings still going keep the old mapping.
+	if(index.fd >= 0) { close(index.fd); }
+	index.fd = fd;
+	index.base.reset(base);
+	index.delta = std::make_shared<DirIndexDelta>();
+	index.next_seq = 0;
+	index.log_end = table[chunks];
+	index.stale = false;
+	index.ready = true;
+	account(index);
+	return 0;
+}
+
+/// Append a change record for name to index's file. Returns 0 or -1.
+static int append_change(FangFS& fs, DirIndex& index, const char* name, uint8_t type) {
+	const size_t name_len = strlen(name);
+	const size_t plain_len = DIRINDEX_RECORD_PLAIN_LEN + name_len;
+	uint8_t plain[DIRINDEX_RECORD_PLAIN_LEN + 255];
+	uint8_t record[DIRINDEX_RECORD_HEADER_LEN + DIRINDEX_SEAL_OVERHEAD +
+	               DIRINDEX_RECORD_PLAIN_LEN + 255];
+	if(name_len == 0 || name_len > 255) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(plain, index.base->path_hash, 16);
+	store_u64(plain + 16, index.next_seq);
+	plain[24] = type;
+	plain[25] = name_len;
+	memcpy(plain + DIRINDEX_RECORD_PLAIN_LEN, name, name_len);
+
+	const size_t record_len = DIRINDEX_RECORD_HEADER_LEN + DIRINDEX_SEAL_OVERHEAD + plain_len;
+	store_u32(record, record_len - DIRINDEX_RECORD_HEADER_LEN);
+	seal(fs.master_key, plain, plain_len, record + DIRINDEX_RECORD_HEADER_LEN);
+	sodium_memzero(plain, sizeof(plain));
+
+	// Not synced: an index is only trusted after a clean unmount, which
+	// syncs it first.
+	if(pwrite_full(index.fd, record, record_len, index.log_end) < 0) { return -1; }
+	index.next_seq += 1;
+	index.log_end += record_len;
+	return 0;
+}
+
+/// Load the index file of index's directory, if it is clean and its
+/// directory hasn't changed since, and start using it. mtime is when the
+/// directory was last changed. Returns 0 or -1.
+static int load_index(FangFS& fs, DirIndex& index, const struct timespec& mtime) {
+	const int fd = openat(index.dir_fd, DIRINDEX_NAME, O_RDWR|O_NOFOLLOW|O_CLOEXEC);
+	if(fd < 0) { return -1; }
+
+	uint8_t head[DIRINDEX_HEADER_LEN];
+	struct stat info;
+	if(fstat(fd, &info) < 0 || pread_full(fd, head, sizeof(head), 0) != 0 ||
+	   memcmp(head, DIRINDEX_MAGIC, DIRINDEX_MAGIC_LEN) != 0 ||
+	   !(load_u32(head + DIRINDEX_FLAGS_OFFSET) & DIRINDEX_CLEAN) ||
+	   load_u64(head + 24) != static_cast<uint64_t>(mtime.tv_sec) ||
+	   load_u64(head + 32) != static_cast<uint64_t>(mtime.tv_nsec)) {
+		log_debug("The index of %s is out of date", index.path.c_str());
+		close(fd);
+		return -1;
+	}
+
+	std::shared_ptr<DirIndexBase> base = std::make_shared<DirIndexBase>();
+	base->chunks = load_u32(head + 12);
+	base->entries = load_u64(head + 16);
+	hash_path(index.path.c_str(), base->path_hash);
+	const uint64_t table_len = (static_cast<uint64_t>(base->chunks) + 1) * 8;
+	const uint64_t file_len = info.st_size;
+	bool ok = base->entries <= static_cast<uint64_t>(base->chunks) * DIRINDEX_CHUNK_ENTRIES &&
+	          base->entries > (static_cast<uint64_t>(base->chunks) - 1) * DIRINDEX_CHUNK_ENTRIES &&
+	          DIRINDEX_HEADER_LEN + table_len <= file_len;
+	if(base->chunks == 0) { ok = (base->entries == 0 && DIRINDEX_HEADER_LEN + 8 <= file_len); }
+
+	std::vector<uint8_t> table;
+	if(ok) {
+		table.resize(table_len);
+		ok = pread_full(fd, table.data(), table_len, DIRINDEX_HEADER_LEN) == 0;
+	}
+	for(uint32_t n = 0; ok && n <= base->chunks; n += 1) {
+		const uint64_t offset = load_u64(table.data() + n * 8);
+		const uint64_t previous = (n == 0)? DIRINDEX_HEADER_LEN + table_len :
+		                          load_u64(table.data() + (n - 1) * 8) +
+		                          DIRINDEX_SEAL_OVERHEAD + DIRINDEX_CHUNK_HEADER_LEN;
+		ok = (n == 0)? offset == previous : offset >= previous && offset <= file_len;
+	}
+	if(ok) {
+		base->map_len = load_u64(table.data() + base->chunks * 8);
+		void* map = mmap(nullptr, base->map_len, PROT_READ, MAP_SHARED, fd, 0);
+		ok = (map != MAP_FAILED);
+		if(ok) { base->map = reinterpret_cast<uint8_t*>(map); }
+	}
+
+	// An index sealed under a key since rotated away opens no chunk.
+	if(ok && base->chunks > 0) {
+		FangDir walk;
+		walk.base = base;
+		ok = load_chunk(fs, walk, 0) == 0;
+	}
+
+	// Replay the changes made since the index was last written out.
+	std::shared_ptr<DirIndexDelta> delta = std::make_shared<DirIndexDelta>();
+	uint64_t offset = base->map_len;
+	uint64_t seq = 0;
+	Buffer record;
+	Buffer plain;
+	while(ok && offset < file_len) {
+		uint8_t len_bytes[DIRINDEX_RECORD_HEADER_LEN];
+		ok = pread_full(fd, len_bytes, sizeof(len_bytes), offset) == 0;
+		const uint64_t body_len = ok? load_u32(len_bytes) : 0;
+		ok = ok && body_len >= DIRINDEX_SEAL_OVERHEAD + DIRINDEX_RECORD_PLAIN_LEN + 1 &&
+		     offset + DIRINDEX_RECORD_HEADER_LEN + body_len <= file_len;
+		if(ok) {
+			buf_grow(record, body_len);
+			ok = pread_full(fd, record.buf, body_len, offset + DIRINDEX_RECORD_HEADER_LEN) == 0 &&
+			     unseal(fs.master_key, record.buf, body_len, plain) == 0 &&
+			     plain.len >= DIRINDEX_RECORD_PLAIN_LEN + 1 &&
+			     sodium_memcmp(plain.buf, base->path_hash, 16) == 0 &&
+			     load_u64(plain.buf + 16) == seq &&
+			     plain.buf[25] == plain.len - DIRINDEX_RECORD_PLAIN_LEN;
+		}
+		if(ok) {
+			(*delta)[std::string(reinterpret_cast<char*>(plain.buf) + DIRINDEX_RECORD_PLAIN_LEN,
+			                     plain.buf[25])] = plain.buf[24];
+			offset += DIRINDEX_RECORD_HEADER_LEN + body_len;
+			seq += 1;
+		}
+	}
+	sodium_memzero(plain.buf, plain.buf_len);
+
+	// From here on, only this mount knows whether the index is up to date.
+	uint8_t flags[4];
+	store_u32(flags, 0);
+	if(ok) {
+		ok = pwrite_full(fd, flags, sizeof(flags), DIRINDEX_FLAGS_OFFSET) == 0 &&
+		     fdatasync(fd) == 0;
+	}
+	if(!ok) {
+		log_warn("Rebuilding the damaged index of %s", index.path.c_str());
+		close(fd);
+		return -1;
+	}
+
+	index.fd = fd;
+	index.base = base;
+	index.delta = delta;
+	index.next_seq = seq;
+	index.log_end = file_len;
+	index.ready = true;
+	account(index);
+	return 0;
+}
+
+/// Write index back out with its changes folded in. Call under index.lock.
+static int compact_index(FangFS& fs, DirIndex& index) {
+	FangDir walk;
+	walk.base = index.base;
+	walk.delta = index.delta;
+	rewind_index(walk);
+
+	IndexNames names;
+	names.reserve(index.base->entries + index.delta->size());
+	std::string name;
+	uint8_t type;
+	int status;
+	while((status = next_entry(fs, walk, name, type)) == 1) {
+		names.push_back(std::make_pair(name, type));
+	}
+	wipe_name(name);
+	if(status < 0) { return status; }
+
+	return (write_index(fs, index, names) == 0)? 0 : STATUS_CHECK_ERRNO;
+}
+
+/// Stop using index, which was found to be damaged, if it is still the one
+/// in use for its directory, and remove its file so that it is rebuilt.
+static void drop_index(FangFS& fs, const std::shared_ptr<DirIndex>& index) {
+	DirIndexStore& store = *fs.dir_indexes;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		auto it = store.dirs.find(index->path);
+		if(it == store.dirs.end() || it->second != index) { return; }
+		store.dirs.erase(it);
+	}
+	unlinkat(index->dir_fd, DIRINDEX_NAME, 0);
+}
+
+/// Find the index in use for the plaintext directory path, if any.
+static std::shared_ptr<DirIndex> find_index(DirIndexStore& store, const std::string& path) {
+	std::lock_guard<std::mutex> guard(store.lock);
+	auto it = store.dirs.find(path);
+	return (it == store.dirs.end())? std::shared_ptr<DirIndex>() : it->second;
+}
+
+DirIndexUpdate::DirIndexUpdate(FangFS& fang, const char* path):
+	fs(fang), store(nullptr), name(nullptr) {
+	if(fs.dir_indexes == nullptr || path == nullptr || strcmp(path, "/") == 0) { return; }
+
+	store = fs.dir_indexes;
+	pthread_rwlock_rdlock(&store->names);
+	name = path_get_basename(path);
+	index = find_index(*store, parent_path(path));
+	if(index) { index->lock.lock(); }
+}
+
+DirIndexUpdate::~DirIndexUpdate() {
+	if(index) { index->lock.unlock(); }
+	if(store != nullptr) { pthread_rwlock_unlock(&store->names); }
+}
+
+void dirindex_init(FangFS& fs) {
+	if(fs.dir_index == 0) { return; }
+
+	fs.dir_indexes = new DirIndexStore;
+	memory_register_shrinker(MEM_DIR_INDEXES, dirindex_shrink, &fs);
+
+	// Taking the metafile lock changes the root, so note when it last
+	// changed before that.
+	struct stat info;
+	if(stat(fs.source, &info) == 0) { fs.dir_indexes->root_mtime = info.st_mtim; }
+}
+
+void dirindex_free(FangFS& fs) {
+	DirIndexStore* store = fs.dir_indexes;
+	if(store == nullptr) { return; }
+	memory_unregister_shrinker(MEM_DIR_INDEXES);
+
+	// Nothing changes names any more. An index that is synced, and notes
+	// when its directory last changed, can be trusted next time.
+	for(const auto& entry: store->dirs) {
+		DirIndex& index = *entry.second;
+		std::lock_guard<std::mutex> guard(index.lock);
+		if(!index.ready || index.stale) { continue; }
+
+		uint8_t head[DIRINDEX_HEADER_LEN - DIRINDEX_FLAGS_OFFSET];
+		struct stat info;
+		if(fdatasync(index.fd) < 0 || fstat(index.dir_fd, &info) < 0) {
+			log_warn("Cannot save the index of %s: %s", index.path.c_str(), strerror(errno));
+			continue;
+		}
+		store_u32(head, DIRINDEX_CLEAN);
+		store_u32(head + 4, index.base->chunks);
+		store_u64(head + 8, index.base->entries);
+		store_u64(head + 16, info.st_mtim.tv_sec);
+		store_u64(head + 24, info.st_mtim.tv_nsec);
+		if(pwrite_full(index.fd, head, sizeof(head), DIRINDEX_FLAGS_OFFSET) < 0 ||
+		   fdatasync(index.fd) < 0) {
+			log_warn("Cannot save the index of %s: %s", index.path.c_str(), strerror(errno));
+		}
+	}
+
+	delete store;
+	fs.dir_indexes = nullptr;
+}
+
+size_t dirindex_shrink(void* arg, size_t goal) {
+	DirIndexStore& store = *reinterpret_cast<FangFS*>(arg)->dir_indexes;
+
+	// Listings and changes only get at an index through the store, and hold
+	// on to its base for as long as they use it.
+	std::vector<std::shared_ptr<DirIndex> > idle;
+	size_t freed = 0;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		auto it = store.dirs.begin();
+		while(it != store.dirs.end() && freed < goal) {
+			const std::shared_ptr<DirIndex>& index = it->second;
+			if(index.use_count() > 1 || !index->ready || index->base.use_count() > 1) {
+				++it;
+				continue;
+			}
+
+			freed += index->charged;
+			idle.push_back(index);
+			it = store.dirs.erase(it);
+		}
+	}
+
+	return freed;
+}
+
+void dirindex_update(DirIndexUpdate& update, uint8_t type) {
+	if(!update.index) { return; }
+
+	// Listings hold on to the changes as they were when they started.
+	DirIndex& index = *update.index;
+	if(!index.delta) {
+		index.delta = std::make_shared<DirIndexDelta>();
+	} else if(index.delta.use_count() > 1) {
+		index.delta = std::make_shared<DirIndexDelta>(*index.delta);
+	}
+	(*index.delta)[update.name] = type;
+	account(index);
+
+	if(index.ready && !index.stale && append_change(update.fs, index, update.name, type) < 0) {
+		log_warn("Cannot update the index of %s: %s", index.path.c_str(), strerror(errno));
+		index.stale = true;
+	}
+}
+
+void dirindex_open(FangFS& fs, const char* path, const char* real_path, FangDir& dir) {
+	DirIndexStore& store = *fs.dir_indexes;
+	std::shared_ptr<DirIndex> index = find_index(store, path);
+	if(!index) {
+		// A directory only gets a new index while the budget has room.
+		if(!memory_reserve(MEM_DIR_INDEXES, sizeof(DirIndex))) { return; }
+		std::shared_ptr<DirIndex> fresh = std::make_shared<DirIndex>();
+		fresh->charged = sizeof(DirIndex);
+
+		const int dir_fd = open(real_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if(dir_fd < 0) { return; }
+		fresh->path = path;
+		fresh->dir_fd = dir_fd;
+
+		// No change can be made between looking at the directory and putting
+		// its index in place, or it would be missed.
+		pthread_rwlock_wrlock(&store.names);
+		index = find_index(store, path);
+		if(!index) {
+			struct stat info;
+			if(strcmp(path, "/") == 0) {
+				info.st_mtim = store.root_mtime;
+			} else if(fstat(dir_fd, &info) < 0) {
+				info.st_mtim.tv_sec = info.st_mtim.tv_nsec = 0;
+			}
+
+			if(load_index(fs, *fresh, info.st_mtim) < 0) {
+				fresh->delta = std::make_shared<DirIndexDelta>();
+				dir.building = fresh;
+			}
+			std::lock_guard<std::mutex> guard(store.lock);
+			store.dirs[path] = fresh;
+			index = fresh;
+		}
+		pthread_rwlock_unlock(&store.names);
+		if(dir.building) { return; }
+	}
+
+	// Another listing may be building it, in which case this one just lists
+	// the backing directory.
+	std::lock_guard<std::mutex> guard(index->lock);
+	if(!index->ready) { return; }
+
+	const uint64_t changes = index->delta->size();
+	if(changes > DIRINDEX_MIN_CHANGES &&
+	   changes > index->base->entries / DIRINDEX_CHANGES_SHARE) {
+		const int status = compact_index(fs, *index);
+		if(status == STATUS_TAMPERING) {
+			log_warn("Tampering detected on the index of %s", path);
+			stats_count(STAT_TAMPERING, 1);
+			drop_index(fs, index);
+			return;
+		} else if(status < 0) {
+			log_warn("Cannot rewrite the index of %s: %s", path, strerror(errno));
+		}
+	}
+
+	dir.base = index->base;
+	dir.delta = index->delta;
+	rewind_index(dir);
+}
+
+int dirindex_list(FangFS& fs, FangDir& dir, const char* path, void* buf,
+                  fuse_fill_dir_t filler, off_t offset) {
+	int status = 0;
+	std::string name;
+	uint8_t type = DT_UNKNOWN;
+
+	// Anywhere but where the last listing left off means walking there.
+	if(offset != dir.next_offset) {
+		rewind_index(dir);
+		while(status >= 0 && dir.next_offset < offset) {
+			if(dir.next_offset >= 2 && (status = next_entry(fs, dir, name, type)) == 0) {
+				return 0;
+			}
+			dir.next_offset += 1;
+		}
+	}
+
+	struct stat info;
+	memset(&info, 0, sizeof(info));
+	while(status >= 0) {
+		const uint64_t base_pos = dir.base_pos;
+		const DirIndexDelta::const_iterator delta_pos = dir.delta_pos;
+		if(dir.next_offset < 2) {
+			name = (dir.next_offset == 0)? "." : "..";
+			type = DT_DIR;
+		} else if((status = next_entry(fs, dir, name, type)) <= 0) {
+			break;
+		}
+
+		// The buffer is full; this entry goes first next time.
+		info.st_mode = DTTOIF(type);
+		if(filler(buf, name.c_str(), &info, dir.next_offset + 1) != 0) {
+			dir.base_pos = base_pos;
+			dir.delta_pos = delta_pos;
+			return 0;
+		}
+		dir.next_offset += 1;
+	}
+
+	if(status == STATUS_TAMPERING) {
+		log_warn("Tampering detected on the index of %s", path);
+		stats_count(STAT_TAMPERING, 1);
+		std::shared_ptr<DirIndex> index = find_index(*fs.dir_indexes, path);
+		if(index && index->base == dir.base) { drop_index(fs, index); }
+		return -EIO;
+	}
+	return 0;
+}
+
+void dirindex_built(FangFS& fs, FangDir& dir, bool complete) {
+	std::shared_ptr<DirIndex> index;
+	index.swap(dir.building);
+	if(!index) { return; }
+
+	IndexNames names;
+	names.swap(dir.names);
+	std::sort(names.begin(), names.end());
+	auto last = std::unique(names.begin(), names.end(),
+	                        [](const IndexNames::value_type& a, const IndexNames::value_type& b) {
+	                            return a.first == b.first;
+	                        });
+	names.wipe(last);
+	names.erase(last, names.end());
+
+	std::lock_guard<std::mutex> guard(index->lock);
+	if(complete) {
+		// Fold in the changes made while the directory was being listed.
+		FangDir walk;
+		walk.delta = index->delta;
+		rewind_index(walk);
+		IndexNames merged;
+		merged.reserve(names.size() + index->delta->size());
+		auto listed = names.begin();
+		while(listed != names.end() || walk.delta_pos != walk.delta->end()) {
+			if(walk.delta_pos == walk.delta->end() ||
+			   (listed != names.end() && listed->first < walk.delta_pos->first)) {
+				merged.push_back(*listed);
+				++listed;
+				continue;
+			}
+			if(listed != names.end() && listed->first == walk.delta_pos->first) { ++listed; }
+			if(walk.delta_pos->second != DIRINDEX_REMOVED) {
+				merged.push_back(*walk.delta_pos);
+			}
+			++walk.delta_pos;
+		}
+		names.swap(merged);
+	}
+
+	if(complete && names.size() >= fs.dir_index) {
+		if(write_index(fs, *index, names) == 0) {
+			stats_count(STAT_DIR_INDEXES_BUILT, 1);
+			return;
+		}
+		log_warn("Cannot index %s: %s", index->path.c_str(), strerror(errno));
+	} else if(complete) {
+		// Too small to bother with, so nothing should trust an old index.
+		unlinkat(index->dir_fd, DIRINDEX_NAME, 0);
+	}
+
+	std::lock_guard<std::mutex> store_guard(fs.dir_indexes->lock);
+	auto it = fs.dir_indexes->dirs.find(index->path);
+	if(it != fs.dir_indexes->dirs.end() && it->second == index) {
+		fs.dir_indexes->dirs.erase(it);
+	}
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "fangfs.h"
+#include "Buffer.h"
+#include "securepool.h"
+
+/// The index of a directory, kept in its backing directory.
+#define DIRINDEX_NAME "__FANGFS_INDEX"
+
+/// Hidden name that an index is rewritten under before it replaces the old
+/// one.
+#define DIRINDEX_TEMP_NAME "__FANGFS_INDEX_NEW"
+
+/// Names are sealed this many to a chunk, so that listing from an offset
+/// only decrypts the chunk it falls in.
+#define DIRINDEX_CHUNK_ENTRIES 256
+
+/// An index is rewritten once its change records outnumber both of these:
+/// a fixed count, and a share of its names.
+#define DIRINDEX_MIN_CHANGES 1024
+#define DIRINDEX_CHANGES_SHARE 8
+
+/// The type recorded for a name that was removed.
+#define DIRINDEX_REMOVED 0xff
+
+/// Names added and removed since an index was last written out, each mapped
+/// to its type, a DT_* value, or DIRINDEX_REMOVED.
+typedef std::map<std::string, uint8_t> DirIndexDelta;
+
+/// An index file as last written out, mapped read-only.
+struct DirIndexBase {
+	DirIndexBase(): map(nullptr), map_len(0), chunks(0), entries(0) {}
+	~DirIndexBase();
+
+	uint8_t* map;
+	size_t map_len;
+	uint32_t chunks;
+	uint64_t entries;
+
+	/// The hash of the plaintext path of the directory, which every chunk
+	/// and change record carries.
+	uint8_t path_hash[16];
+
+private:
+	DirIndexBase(const DirIndexBase&);
+	DirIndexBase& operator=(const DirIndexBase&);
+};
+
+/// A directory whose index is in use by the mount, or being built.
+struct DirIndex {
+	DirIndex(): ready(false), stale(false), dir_fd(-1), fd(-1), next_seq(0), log_end(0),
+	            charged(0) {}
+	~DirIndex();
+
+	/// The plaintext path of the directory.
+	std::string path;
+
+	/// Held by every change to the directory's names, from before the change
+	/// is made until it is recorded, and while the index is rewritten.
+	std::mutex lock;
+
+	/// Whether the index has been built. Until then, changes only go into
+	/// delta, to be applied to what the listing building it finds.
+	bool ready;
+
+	/// Set if a change couldn't be written to the index file, which then
+	/// can't be trusted by the next mount.
+	bool stale;
+
+	/// The backing directory, and its index file.
+	int dir_fd;
+	int fd;
+
+	std::shared_ptr<const DirIndexBase> base;
+	std::shared_ptr<DirIndexDelta> delta;
+
+	/// The number of the next change record, and where it goes.
+	uint64_t next_seq;
+	uint64_t log_end;
+
+	/// The bytes charged to MEM_DIR_INDEXES for base and delta.
+	size_t charged;
+
+private:
+	DirIndex(const DirIndex&);
+	DirIndex& operator=(const DirIndex&);
+};
+
+/// The directory indexes of a mounted filesystem.
+struct DirIndexStore {
+	DirIndexStore();
+	~DirIndexStore();
+
+	/// Operations that add or remove names hold this for reading from before
+	/// they look for an index until they have recorded their change, and
+	/// listings take it for writing to start an index, so that no change
+	/// slips past one.
+	pthread_rwlock_t names;
+
+	/// Guards dirs.
+	std::mutex lock;
+	std::map<std::string, std::shared_ptr<DirIndex> > dirs;
+
+	/// When the root of the source last changed before the mount.
+	struct timespec root_mtime;
+
+private:
+	DirIndexStore(const DirIndexStore&);
+	DirIndexStore& operator=(const DirIndexStore&);
+};
+
+/// Plaintext names, each with its type. The vector's own memory, which holds
+/// short names in place, is secure, and every name is wiped before it goes.
+struct IndexNames: std::vector<std::pair<std::string, uint8_t>,
+                               SecureAllocator<std::pair<std::string, uint8_t> > > {
+	IndexNames() {}
+	~IndexNames() { wipe(begin()); }
+
+	/// Wipe the names from first on, ahead of erasing them.
+	void wipe(iterator first);
+};
+
+/// An open directory. A pointer to one of these lives in fi->fh from opendir
+/// until releasedir.
+struct FangDir {
+	FangDir(): dir(nullptr), next_offset(0), base_pos(0), chunk_n(-1) {
+		buf_make_secure(chunk);
+	}
+	~FangDir();
+
+	/// The backing directory stream.
+	DIR* dir;
+
+	/// When listed from an index, the index as it was when the directory was
+	/// opened. Offsets count the entries in order, "." and ".." first.
+	std::shared_ptr<const DirIndexBase> base;
+	std::shared_ptr<const DirIndexDelta> delta;
+
+	/// Where the previous listing left off: the offset of the next entry,
+	/// and the positions in base and delta that it comes from.
+	off_t next_offset;
+	uint64_t base_pos;
+	DirIndexDelta::const_iterator delta_pos;
+
+	/// The decrypted chunk chunk_n, with where each of its names starts.
+	int64_t chunk_n;
+	Buffer chunk;
+	std::vector<uint32_t> chunk_names;
+
+	/// When this listing is building the index: the index, and every name
+	/// listed with its type.
+	std::shared_ptr<DirIndex> building;
+	IndexNames names;
+
+private:
+	FangDir(const FangDir&);
+	FangDir& operator=(const FangDir&);
+};
+
+/// Held by operations that add or remove the name at path, a plaintext path,
+/// for as long as they live. If the directory holding it has an index in
+/// use, the index is locked.
+struct DirIndexUpdate {
+	/// Passing nullptr for path makes this a no-op, for operations that
+	/// might not change any name.
+	DirIndexUpdate(FangFS& fang, const char* path);
+	~DirIndexUpdate();
+
+	FangFS& fs;
+	DirIndexStore* store;
+	std::shared_ptr<DirIndex> index;
+	const char* name;
+
+private:
+	DirIndexUpdate(const DirIndexUpdate&);
+	DirIndexUpdate& operator=(const DirIndexUpdate&);
+};
+
+/// Set up fs.dir_indexes if -o dir_index asks for indexes.
+void dirindex_init(FangFS& fs);
+
+/// Write out every index in use, mark it as up to date with its directory,
+/// and free them.
+void dirindex_free(FangFS& fs);
+
+/// A MemoryShrinker for MEM_DIR_INDEXES, with the FangFS as arg: stops
+/// using indexes that no listing or change is using. Their files aren't
+/// marked up to date, so the next listing of their directories builds them
+/// again.
+size_t dirindex_shrink(void* arg, size_t goal);
+
+/// Record that update's name now has the given type, or DIRINDEX_REMOVED.
+void dirindex_update(DirIndexUpdate& update, uint8_t type);
+
+/// Attach the index of the plaintext directory path, backed by real_path,
+/// to dir, loading it if it is on disk and up to date, or compacting it if
+/// it has gathered many changes. Otherwise, unless another listing is
+/// already at it, have dir build it. Call under a RotateReadLock.
+void dirindex_open(FangFS& fs, const char* path, const char* real_path, FangDir& dir);
+
+/// List dir from its index, starting at offset, into filler. Returns 0 or
+/// -errno; an index found to be damaged is dropped, to be rebuilt.
+int dirindex_list(FangFS& fs, FangDir& dir, const char* path, void* buf,
+                  fuse_fill_dir_t filler, off_t offset);
+
+/// The listing building dir's index is over: write the index out if the
+/// listing was complete and found at least fs.dir_index names, and give up
+/// on it otherwise.
+void dirindex_built(FangFS& fs, FangDir& dir, bool complete);
@@ -1,56 +1,142 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
-#include <sched.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include "exlockfile.h"
 #include "error.h"
 
-bool exlock_try_obtain(const char* path) {
-	// Reset errno so people can get an error code if they like.
-	errno = 0;
+/// Bounds on how long to sleep between attempts while waiting for a lock.
+#define EXLOCK_BACKOFF_MIN_MS 1
+#define EXLOCK_BACKOFF_MAX_MS 100
 
-	int fd = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
-	if(fd < 0) {
+static void sleep_ms(int ms) {
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/// Whether fd still refers to the file at path. The previous holder unlinks
+/// the file on release, and a lock on the orphaned inode excludes nobody.
+static bool still_linked(int fd, const char* path) {
+	struct stat fd_info;
+	struct stat path_info;
+	if(fstat(fd, &fd_info) < 0 || stat(path, &path_info) < 0) {
 		return false;
-	} else {
-		// Write in our PID, just to be a good system citizen
-		char buf[12];
-		pid_t pid = getpid();
-		snprintf(buf, sizeof(buf), "%d", pid);
-		ssize_t pid_len = strlen(buf);
-
-		// It's tough beans if we can't write. This shouldn't ever happen, and
-		// if it does, our best shot is to just ignore it.
-		if(write(fd, buf, pid_len) < pid_len) {}
+	}
+
+	return fd_info.st_dev == path_info.st_dev && fd_info.st_ino == path_info.st_ino;
+}
+
+/// Open path and lock it, blocking if block is set. Returns the descriptor or
+/// -1.
+static int lock_file(const char* path, bool block) {
+	while(1) {
+		int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+		if(fd < 0) {
+			return -1;
+		}
+
+		int status;
+		do {
+			status = flock(fd, LOCK_EX | (block? 0 : LOCK_NB));
+		} while(status < 0 && errno == EINTR);
+
+		if(status < 0) {
+			const int new_errno = errno;
+			close(fd);
+			errno = new_errno;
+			return -1;
+		}
+
+		if(still_linked(fd, path)) {
+			exlock_set_owner(fd);
+			return fd;
+		}
+
 		close(fd);
-		return true;
 	}
 }
 
-int exlock_obtain(const char* path) {
+int exlock_try_obtain(const char* path) {
+	return lock_file(path, false);
+}
+
+int exlock_obtain(const char* path, int timeout_ms) {
+	if(timeout_ms < 0) {
+		const int fd = lock_file(path, true);
+		return (fd < 0)? STATUS_CHECK_ERRNO : fd;
+	}
+
+	const long long deadline = now_ms() + timeout_ms;
+	int backoff = EXLOCK_BACKOFF_MIN_MS;
 	while(1) {
-		bool have_lock = exlock_try_obtain(path);
-		if(have_lock) {
-			return 0;
-		} else {
-			if(errno != EEXIST) {
-				return STATUS_CHECK_ERRNO;
-			}
+		const int fd = lock_file(path, false);
+		if(fd >= 0) {
+			return fd;
+		} else if(errno != EWOULDBLOCK) {
+			return STATUS_CHECK_ERRNO;
 		}
 
-		// Avoid starving out other threads while we try to get this lock.
-		// XXX Should we sleep here instead?
-		sched_yield();
+		const long long remaining = deadline - now_ms();
+		if(remaining <= 0) {
+			errno = ETIMEDOUT;
+			return STATUS_CHECK_ERRNO;
+		}
+
+		sleep_ms(static_cast<int>(std::min<long long>(backoff, remaining)));
+		backoff = std::min(backoff * 2, EXLOCK_BACKOFF_MAX_MS);
+	}
+}
+
+void exlock_set_owner(int fd) {
+	char buf[16];
+	const int pid_len = snprintf(buf, sizeof(buf), "%d\n", static_cast<int>(getpid()));
+
+	// It's tough beans if we can't write. The PID is only informational.
+	if(ftruncate(fd, 0) < 0 || pwrite(fd, buf, pid_len, 0) < pid_len) {}
+}
+
+pid_t exlock_owner(const char* path) {
+	const int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0) {
+		return -1;
+	}
+
+	char buf[16];
+	const ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if(n <= 0) {
+		return -1;
 	}
+
+	buf[n] = '\0';
+	const long pid = strtol(buf, nullptr, 10);
+	return (pid > 0)? static_cast<pid_t>(pid) : -1;
 }
 
-int exlock_release(const char* path) {
+int exlock_release(const char* path, int fd) {
+	// Unlink while still holding the lock, so that nobody can lock the file
+	// in between and then have it vanish.
+	int status = 0;
 	if(unlink(path) < 0) {
-		return STATUS_CHECK_ERRNO;
+		status = STATUS_CHECK_ERRNO;
 	}
 
-	return 0;
+	const int new_errno = errno;
+	close(fd);
+	errno = new_errno;
+	return status;
 }
@@ -1,14 +1,27 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/types.h>
 
-/// Try to obtain an exclusive lock via the filesystem immediately, or else
-/// return. Errors are returned via errno.
-bool exlock_try_obtain(const char* path);
+/// Exclusive locks held with flock() on a lock file. The kernel drops the
+/// lock along with its holder, so a crashed process can never leave one
+/// behind. The holder's PID is written into the file for diagnostics.
 
-/// Obtain an exclusive lock via the filesystem, and blocks until it can be
-/// obtained. Returns 0 if successful.
-int exlock_obtain(const char* path);
+/// Try to obtain the lock at path immediately. Returns the descriptor holding
+/// the lock, or -1 with errno set (EWOULDBLOCK if someone else holds it).
+int exlock_try_obtain(const char* path);
 
-/// Release an exclusive lock via the filesystem. Returns 0 if successful.
-int exlock_release(const char* path);
+/// Obtain the lock at path, waiting up to timeout_ms milliseconds for it, or
+/// indefinitely if timeout_ms is negative. Returns the descriptor holding the
+/// lock, or STATUS_CHECK_ERRNO (ETIMEDOUT if the wait ran out).
+int exlock_obtain(const char* path, int timeout_ms);
+
+/// Record the calling process as the holder of the lock on fd, such as after
+/// forking into the background.
+void exlock_set_owner(int fd);
+
+/// Return the PID recorded as holding the lock at path, or -1 if unknown.
+pid_t exlock_owner(const char* path);
+
+/// Release the lock at path held by fd. Returns 0 if successful.
+int exlock_release(const char* path, int fd);
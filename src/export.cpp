@@ -0,0 +1,138 @@
+// Decrypt a filesystem, or part of it, without mounting it: into a plaintext
+// directory tree, or as a tar stream on stdout for backups. Blocks are
+// decrypted on every core while a single writer keeps the output in order.
+#include "fangfs.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include "exporter.h"
+#include "journal.h"
+#include "log.h"
+#include "options.h"
+#include "util.h"
+#include "error.h"
+
+static FangFS fangfs;
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-d dir] [-q] <source> <to|-> [-o options]\n"
+	                "  -j  Decryption threads; defaults to one per CPU\n"
+	                "  -d  Export only this directory of the filesystem\n"
+	                "  -q  Don't report progress\n"
+	                "If the destination is -, a tar stream is written to stdout.\n"
+	                "Otherwise it's a directory, created if missing. The passphrase\n"
+	                "for source is read from stdin.\n", name);
+}
+
+static void print_error(const char* path, int error) {
+	log_error("%s: %s", path, strerror(error));
+}
+
+static void print_progress(const ExportStats& stats) {
+	fprintf(stderr, "%llu dirs, %llu files, %.1f MiB exported, %llu errors\n",
+	        static_cast<unsigned long long>(stats.dirs),
+	        static_cast<unsigned long long>(stats.files),
+	        stats.bytes / (1024.0 * 1024.0),
+	        static_cast<unsigned long long>(stats.errors));
+}
+
+int main(int argc, char** argv) {
+	ExportOptions options;
+	const char* from = "/";
+	bool quiet = false;
+	int c;
+	while((c = getopt(argc, argv, "+j:d:qh")) != -1) {
+		switch(c) {
+		case 'j':
+			options.threads = atoi(optarg);
+			break;
+		case 'd':
+			from = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(argc - optind < 2 || from[0] != '/') {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char* source_dir = argv[optind];
+	const char* to = argv[optind + 1];
+	if(strcmp(to, "-") == 0) {
+		if(isatty(STDOUT_FILENO)) {
+			log_error("Refusing to write a tar stream to a terminal");
+			return 1;
+		}
+		options.tar_fd = STDOUT_FILENO;
+	}
+
+	// Whatever is left are "-o" options, as for a mount.
+	argv[optind + 1] = argv[0];
+	struct fuse_args args = FUSE_ARGS_INIT(argc - optind - 1, argv + optind + 1);
+	if(fangfs_parse_options(fangfs, &args) < 0) {
+		return 1;
+	}
+	if(args.argc > 1) {
+		log_error("Unknown argument: %s", args.argv[1]);
+		return 1;
+	}
+	fuse_opt_free_args(&args);
+
+	options.on_error = print_error;
+	if(!quiet) {
+		options.on_progress = print_progress;
+		options.progress_seconds = 5;
+	}
+
+	ExportStats stats;
+	try {
+		int status = fangfs_fsopen(fangfs, source_dir);
+		if(status < 0) {
+			if(status == STATUS_CHECK_ERRNO) {
+				log_error("Initialization error: %d. %s", status, strerror(errno));
+			} else {
+				log_error("Initialization error: %d.", status);
+			}
+			return 1;
+		}
+
+		// The export reads the source as it is, without replaying the intent
+		// log, which only a mount may do.
+		Buffer journal_path;
+		path_join(source_dir, JOURNAL_NAME, journal_path);
+		struct stat info;
+		if(stat(reinterpret_cast<char*>(journal_path.buf), &info) == 0 && info.st_size > 0) {
+			log_warn("The intent log has not been replayed; mount and unmount "
+			         "first, or expect stale or unreadable blocks");
+		}
+
+		status = export_run(fangfs, from, to, options, stats);
+		if(status < 0) {
+			log_error("Cannot export %s: %s", from, strerror(errno));
+			fangfs_fsclose(fangfs);
+			return 1;
+		}
+	} catch (std::runtime_error& e) {
+		log_error("Panic: %s", e.what());
+		fangfs_fsclose(fangfs);
+		return 1;
+	}
+
+	fangfs_fsclose(fangfs);
+
+	if(!quiet) { print_progress(stats); }
+	return (stats.errors > 0)? 1 : 0;
+}
@@ -0,0 +1,772 @@
+#include "exporter.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BufferEncryption.h"
+#include "file.h"
+#include "pack.h"
+#include "util.h"
+#include "workqueue.h"
+#include "error.h"
+
+/// Ciphertext read and decrypted at a time, rounded down to whole blocks.
+#define EXPORT_CHUNK_BYTES (1024 * 1024)
+
+/// Items in flight per decryption thread. This, times the chunk size and the
+/// thread count, bounds memory whatever the size of the tree.
+#define EXPORT_ITEMS_PER_THREAD 2
+
+#define TAR_BLOCK 512
+
+enum ExportItemKind {
+	/// Create a directory.
+	EXPORT_DIR,
+
+	/// Start a file.
+	EXPORT_FILE,
+
+	/// A chunk of the current file's contents.
+	EXPORT_DATA,
+
+	/// Finish the current file.
+	EXPORT_END
+};
+
+/// One step of the output stream. Items are numbered in the order the walk
+/// produces them, and the writer puts them back into that order after they
+/// come out of the decryption threads.
+struct ExportItem {
+	ExportItem(): kind(EXPORT_DIR), seq(0), mode(0), uid(0), gid(0), size(0),
+	              cipher_len(0), plain_len(0), failed(false) {}
+
+	ExportItemKind kind;
+	uint64_t seq;
+
+	/// For EXPORT_DIR and EXPORT_FILE: the path relative to the output, the
+	/// plaintext path in the filesystem, and attributes.
+	std::string path;
+	std::string plain_path;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime;
+
+	/// For EXPORT_FILE, the plaintext length.
+	uint64_t size;
+
+	/// For EXPORT_DATA, the chunk before and after decryption. If any block
+	/// fails authentication, failed is set and its plaintext is zeroed.
+	/// For EXPORT_END, failed means the file couldn't be read to the end.
+	size_t cipher_len;
+	size_t plain_len;
+	bool failed;
+	Buffer ciphertext;
+	Buffer plaintext;
+};
+
+struct ExportDir {
+	std::string plain_path;
+	std::string cipher_path;
+	std::string path;
+};
+
+struct ExportState {
+	ExportState(FangFS& fang, const ExportOptions& opts, const char* dest):
+		fs(fang), options(opts), to(dest), next_seq(0), output_error(0), done(false) {}
+
+	FangFS& fs;
+	const ExportOptions& options;
+	const char* to;
+	size_t chunk_blocks;
+
+	/// The walk's next item number.
+	uint64_t next_seq;
+
+	/// The walk's scratch space for decrypting packed files.
+	Buffer record;
+
+	/// walk -> decryptors -> writer, and back to the walk. Items that need
+	/// no decryption go straight to the writer.
+	WorkQueue<ExportItem*> free_items;
+	WorkQueue<ExportItem*> to_decrypt;
+	WorkQueue<ExportItem*> to_write;
+	std::atomic<unsigned> decryptors_left;
+
+	/// Set once the output can't be written, to stop the walk early.
+	std::atomic<bool> aborted;
+	int output_error;
+
+	std::atomic<uint64_t> n_dirs;
+	std::atomic<uint64_t> n_files;
+	std::atomic<uint64_t> n_bytes;
+	std::atomic<uint64_t> n_errors;
+	std::mutex error_lock;
+
+	/// Set by the writer once everything has been written.
+	std::mutex done_lock;
+	std::condition_variable done_cond;
+	bool done;
+};
+
+static void report(ExportState& state, const std::string& path, int error) {
+	state.n_errors.fetch_add(1);
+	std::lock_guard<std::mutex> guard(state.error_lock);
+	if(state.options.on_error) {
+		state.options.on_error(path.c_str(), error);
+	}
+}
+
+static std::string join(const std::string& a, const char* b) {
+	Buffer joined;
+	path_join(a.c_str(), b, joined);
+	return reinterpret_cast<char*>(joined.buf);
+}
+
+static ExportItem* take_item(ExportState& state, ExportItemKind kind) {
+	ExportItem* item = nullptr;
+	workqueue_pop(state.free_items, item);
+	item->kind = kind;
+	item->seq = state.next_seq++;
+	item->failed = false;
+	item->cipher_len = item->plain_len = 0;
+	return item;
+}
+
+static void set_attributes(ExportItem& item, const struct stat& info) {
+	item.mode = info.st_mode & 07777;
+	item.uid = info.st_uid;
+	item.gid = info.st_gid;
+	item.mtime = info.st_mtim;
+}
+
+/// Fill buf from fd, stopping early only at the end of the file. Returns the
+/// number of bytes read, or -1.
+static ssize_t read_fill(int fd, uint8_t* buf, size_t len) {
+	size_t got = 0;
+	while(got < len) {
+		const ssize_t n = read(fd, buf + got, len - got);
+		if(n < 0 && errno == EINTR) { continue; }
+		if(n < 0) { return -1; }
+		if(n == 0) { break; }
+		got += n;
+	}
+	return got;
+}
+
+static void export_file(ExportState& state, const std::string& plain_path,
+                        const std::string& cipher_path, const std::string& path,
+                        const struct stat& info) {
+	const int fd = open(cipher_path.c_str(), O_RDONLY|O_CLOEXEC);
+	if(fd < 0) {
+		report(state, plain_path, errno);
+		return;
+	}
+
+	const off_t size = fang_file_size_fd(state.fs, fd, info.st_size);
+	if(size < 0) {
+		report(state, plain_path, (errno == EIO)? EBADMSG : errno);
+		close(fd);
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ExportItem* item = take_item(state, EXPORT_FILE);
+	item->path = path;
+	item->plain_path = plain_path;
+	item->size = size;
+	set_attributes(*item, info);
+	workqueue_push(state.to_write, item);
+
+	const size_t chunk_len = state.chunk_blocks * state.fs.metafile.block_size;
+	bool failed = false;
+	for(off_t offset = 0;;) {
+		item = take_item(state, EXPORT_DATA);
+		buf_grow(item->ciphertext, chunk_len);
+		const ssize_t n = read_fill(fd, item->ciphertext.buf, chunk_len);
+		if(n <= 0) {
+			if(n < 0) {
+				report(state, plain_path, errno);
+				failed = true;
+			}
+
+			// An empty item keeps the numbering gapless.
+			workqueue_push(state.to_write, item);
+			break;
+		}
+
+		// Have the next chunk on its way while this one is decrypted.
+		offset += n;
+		posix_fadvise(fd, offset, chunk_len, POSIX_FADV_WILLNEED);
+
+		item->cipher_len = n;
+		workqueue_push(state.to_decrypt, item);
+		if(static_cast<size_t>(n) < chunk_len) { break; }
+	}
+	close(fd);
+
+	item = take_item(state, EXPORT_END);
+	item->failed = failed;
+	workqueue_push(state.to_write, item);
+}
+
+/// Export a packed file. Its record is small, so it is read and decrypted on
+/// the spot, and its contents go straight to the writer. segments holds the
+/// segments opened so far.
+static void export_packed(ExportState& state, const ExportDir& entry, const struct stat& info,
+                          std::map<uint32_t, int>& segments) {
+	// Some other symlink, which the filesystem never shows.
+	PackLocator locator;
+	if(pack_read_link(AT_FDCWD, entry.cipher_path.c_str(), locator) < 0) { return; }
+
+	auto it = segments.find(locator.segment);
+	if(it == segments.end()) {
+		const int source_fd = open(state.fs.source, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		const int fd = (source_fd < 0)? -1 : pack_open_segment(source_fd, locator.segment);
+		if(source_fd >= 0) { close(source_fd); }
+		it = segments.insert(std::make_pair(locator.segment, fd)).first;
+	}
+
+	const ssize_t n = (it->second < 0)? STATUS_CHECK_ERRNO :
+	                  pack_read_record(state.fs, it->second, locator,
+	                                   pack_relative_path(state.fs, entry.cipher_path.c_str()),
+	                                   state.fs.master_key, state.record);
+	if(n < 0) {
+		report(state, entry.plain_path,
+		       (n == STATUS_TAMPERING || errno == ESTALE || errno == ENOENT)? EBADMSG : errno);
+		return;
+	}
+
+	ExportItem* item = take_item(state, EXPORT_FILE);
+	item->path = entry.path;
+	item->plain_path = entry.plain_path;
+	item->size = n;
+	set_attributes(*item, info);
+	item->mode = locator.mode & 07777;
+	workqueue_push(state.to_write, item);
+
+	item = take_item(state, EXPORT_DATA);
+	buf_grow(item->plaintext, std::max<size_t>(n, 1));
+	memcpy(item->plaintext.buf, state.record.buf, n);
+	item->plain_len = n;
+	workqueue_push(state.to_write, item);
+	sodium_memzero(state.record.buf, n);
+
+	workqueue_push(state.to_write, take_item(state, EXPORT_END));
+}
+
+static void export_dir(ExportState& state, const ExportDir& task,
+                       std::vector<ExportDir>& stack) {
+	DIR* dir = opendir(task.cipher_path.c_str());
+	if(dir == nullptr) {
+		report(state, task.plain_path, errno);
+		return;
+	}
+
+	std::vector<ExportDir> children;
+	std::map<uint32_t, int> segments;
+	Buffer decrypted;
+	while(!state.aborted.load()) {
+		errno = 0;
+		struct dirent* entry = readdir(dir);
+		if(entry == nullptr) {
+			if(errno != 0) { report(state, task.plain_path, errno); }
+			break;
+		}
+
+		// Special names, as readdir skips them.
+		const char* name = entry->d_name;
+		if(name[0] == '_' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+
+		const char* plain_name = nullptr;
+		if(name_decrypt(state.fs, task.plain_path.c_str(), name, decrypted, &plain_name) < 0) {
+			report(state, join(task.plain_path, name), EBADMSG);
+			continue;
+		}
+
+		ExportDir child;
+		child.plain_path = join(task.plain_path, plain_name);
+		child.cipher_path = join(task.cipher_path, name);
+		child.path = task.path.empty()? std::string(plain_name) : task.path + "/" + plain_name;
+
+		struct stat info;
+		if(fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+			report(state, child.plain_path, errno);
+		} else if(S_ISDIR(info.st_mode)) {
+			children.push_back(std::move(child));
+		} else if(S_ISREG(info.st_mode)) {
+			export_file(state, child.plain_path, child.cipher_path, child.path, info);
+		} else if(S_ISLNK(info.st_mode)) {
+			export_packed(state, child, info, segments);
+		}
+	}
+	closedir(dir);
+	for(const auto& segment: segments) {
+		if(segment.second >= 0) { close(segment.second); }
+	}
+
+	// Depth first, in the order the directory listed them.
+	std::reverse(children.begin(), children.end());
+	for(ExportDir& child: children) {
+		stack.push_back(std::move(child));
+	}
+}
+
+static void walker(ExportState& state, ExportDir root) {
+	std::vector<ExportDir> stack;
+	stack.push_back(root);
+	while(!stack.empty() && !state.aborted.load()) {
+		ExportDir task = std::move(stack.back());
+		stack.pop_back();
+
+		// The root itself is the output, not an entry in it.
+		if(!task.path.empty()) {
+			struct stat info;
+			if(stat(task.cipher_path.c_str(), &info) < 0) {
+				report(state, task.plain_path, errno);
+				continue;
+			}
+
+			ExportItem* item = take_item(state, EXPORT_DIR);
+			item->path = task.path;
+			item->plain_path = task.plain_path;
+			set_attributes(*item, info);
+			workqueue_push(state.to_write, item);
+		}
+
+		export_dir(state, task, stack);
+	}
+
+	workqueue_close(state.to_decrypt);
+}
+
+static void decrypt_item(const FangFS& fs, ExportItem& item, Buffer& packed) {
+	const size_t block_size = fs.metafile.block_size;
+	const size_t payload = fang_block_payload(fs);
+	buf_grow(item.plaintext, (item.cipher_len + block_size - 1) / block_size * payload);
+
+	size_t plain_len = 0;
+	for(size_t offset = 0; offset < item.cipher_len; offset += block_size) {
+		const size_t len = std::min(block_size, item.cipher_len - offset);
+		const uint8_t* block = item.ciphertext.buf + offset;
+		uint8_t* out = item.plaintext.buf + plain_len;
+		const ssize_t n = fang_block_open(fs, fs.master_key, block, len, out, packed);
+		if(n == STATUS_ERROR) {
+			item.failed = true;
+			break;
+		} else if(n < 0) {
+			// Keep the rest of the file where it belongs. A compressed
+			// block's length can't be trusted, but only the final block
+			// can be short.
+			item.failed = true;
+			const size_t lost = (fs.metafile.compression != CODEC_NONE)?
+			                    payload : len - BLOCK_OVERHEAD;
+			memset(out, 0, lost);
+			plain_len += lost;
+		} else {
+			plain_len += n;
+		}
+	}
+	item.plain_len = plain_len;
+}
+
+static void decryptor(ExportState& state) {
+	ExportItem* item = nullptr;
+	Buffer packed;
+	while(workqueue_pop(state.to_decrypt, item)) {
+		decrypt_item(state.fs, *item, packed);
+		workqueue_push(state.to_write, item);
+	}
+	sodium_memzero(packed.buf, packed.buf_len);
+
+	if(state.decryptors_left.fetch_sub(1) == 1) {
+		workqueue_close(state.to_write);
+	}
+}
+
+static int write_all(int fd, const uint8_t* buf, size_t len) {
+	while(len > 0) {
+		const ssize_t n = write(fd, buf, len);
+		if(n < 0 && errno == EINTR) { continue; }
+		if(n < 0) { return -1; }
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/// Store value in a numeric tar header field as octal, or, if it doesn't fit,
+/// in the base-256 form GNU tar introduced.
+static void tar_number(char* field, size_t len, uint64_t value) {
+	if(len < 12 || value < (1ULL << (3 * (len - 1)))) {
+		snprintf(field, len, "%0*llo", static_cast<int>(len - 1),
+		         static_cast<unsigned long long>(value));
+		return;
+	}
+
+	memset(field, 0, len);
+	field[0] = static_cast<char>(0x80);
+	for(size_t i = len - 1; i > 0 && value > 0; i -= 1) {
+		field[i] = static_cast<char>(value & 0xff);
+		value >>= 8;
+	}
+}
+
+static void tar_checksum(uint8_t* header) {
+	memset(header + 148, ' ', 8);
+	unsigned sum = 0;
+	for(size_t i = 0; i < TAR_BLOCK; i += 1) { sum += header[i]; }
+	snprintf(reinterpret_cast<char*>(header) + 148, 8, "%06o", sum);
+}
+
+/// Put name into a ustar header's name and prefix fields. Returns false if it
+/// can't be split to fit.
+static bool tar_set_name(uint8_t* header, const std::string& name) {
+	if(name.size() <= 100) {
+		memcpy(header, name.data(), name.size());
+		return true;
+	}
+
+	for(size_t slash = std::min<size_t>(name.size() - 1, 155); slash > 0; slash -= 1) {
+		if(name[slash] != '/') { continue; }
+		if(name.size() - slash - 1 > 100) { return false; }
+
+		memcpy(header + 345, name.data(), slash);
+		memcpy(header, name.data() + slash + 1, name.size() - slash - 1);
+		return true;
+	}
+
+	return false;
+}
+
+/// Write the header for a directory or file of size bytes, preceded by a GNU
+/// long name record if the name is too long for ustar. Returns 0 or -1.
+static int tar_header(int fd, const ExportItem& item, char type, uint64_t size) {
+	const std::string name = (type == '5')? item.path + "/" : item.path;
+	uint8_t header[TAR_BLOCK];
+
+	memset(header, 0, sizeof(header));
+	if(!tar_set_name(header, name)) {
+		memset(header, 0, sizeof(header));
+		strcpy(reinterpret_cast<char*>(header), "././@LongLink");
+		tar_number(reinterpret_cast<char*>(header) + 100, 8, 0);
+		tar_number(reinterpret_cast<char*>(header) + 108, 8, 0);
+		tar_number(reinterpret_cast<char*>(header) + 116, 8, 0);
+		tar_number(reinterpret_cast<char*>(header) + 124, 12, name.size() + 1);
+		tar_number(reinterpret_cast<char*>(header) + 136, 12, 0);
+		header[156] = 'L';
+		memcpy(header + 257, "ustar", 6);
+		memcpy(header + 263, "00", 2);
+		tar_checksum(header);
+
+		std::vector<uint8_t> long_name((name.size() + TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK, 0);
+		memcpy(long_name.data(), name.data(), name.size());
+		if(write_all(fd, header, sizeof(header)) < 0 ||
+		   write_all(fd, long_name.data(), long_name.size()) < 0) {
+			return -1;
+		}
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, name.data(), 100);
+	}
+
+	tar_number(reinterpret_cast<char*>(header) + 100, 8, item.mode);
+	tar_number(reinterpret_cast<char*>(header) + 108, 8, item.uid);
+	tar_number(reinterpret_cast<char*>(header) + 116, 8, item.gid);
+	tar_number(reinterpret_cast<char*>(header) + 124, 12, size);
+	tar_number(reinterpret_cast<char*>(header) + 136, 12, item.mtime.tv_sec);
+	header[156] = type;
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	tar_checksum(header);
+	return write_all(fd, header, sizeof(header));
+}
+
+/// What the writer knows about the file it's in the middle of.
+struct ExportCurrent {
+	ExportCurrent(): fd(-1), remaining(0), failed(false) {}
+
+	std::string path;
+	std::string plain_path;
+	int fd;
+	struct timespec times[2];
+	uint64_t size;
+	uint64_t remaining;
+	bool failed;
+};
+
+static void output_failed(ExportState& state) {
+	if(state.output_error == 0) {
+		state.output_error = errno;
+		state.aborted.store(true);
+	}
+}
+
+static void write_tar_item(ExportState& state, ExportItem& item, ExportCurrent& current) {
+	const int fd = state.options.tar_fd;
+	static const uint8_t zeros[TAR_BLOCK] = {0};
+
+	switch(item.kind) {
+	case EXPORT_DIR:
+		if(tar_header(fd, item, '5', 0) < 0) { output_failed(state); }
+		state.n_dirs.fetch_add(1);
+		break;
+	case EXPORT_FILE:
+		current.plain_path = item.plain_path;
+		current.size = current.remaining = item.size;
+		current.failed = false;
+		if(tar_header(fd, item, '0', item.size) < 0) { output_failed(state); }
+		break;
+	case EXPORT_DATA: {
+		// The header promised a length, so blocks that fail authentication
+		// come out as zeros, and the stream never says more than promised.
+		if(item.failed && !current.failed) {
+			report(state, current.plain_path, EBADMSG);
+			current.failed = true;
+		}
+		const size_t n = std::min<uint64_t>(item.plain_len, current.remaining);
+		if(write_all(fd, item.plaintext.buf, n) < 0) { output_failed(state); }
+		current.remaining -= n;
+		state.n_bytes.fetch_add(n, std::memory_order_relaxed);
+		break;
+	}
+	case EXPORT_END:
+		current.failed = current.failed || item.failed;
+		while(current.remaining > 0) {
+			const size_t n = std::min<uint64_t>(current.remaining, sizeof(zeros));
+			if(write_all(fd, zeros, n) < 0) {
+				output_failed(state);
+				break;
+			}
+			current.remaining -= n;
+		}
+		if(current.size % TAR_BLOCK != 0 &&
+		   write_all(fd, zeros, TAR_BLOCK - current.size % TAR_BLOCK) < 0) {
+			output_failed(state);
+		}
+		if(!current.failed) { state.n_files.fetch_add(1); }
+		break;
+	}
+}
+
+static void write_tree_item(ExportState& state, ExportItem& item, ExportCurrent& current) {
+	switch(item.kind) {
+	case EXPORT_DIR: {
+		// Owner write permission is kept so that the children can be
+		// created.
+		const std::string path = join(state.to, item.path.c_str());
+		if(mkdir(path.c_str(), item.mode | S_IRWXU) < 0) {
+			const int error = errno;
+			struct stat existing;
+			if(error != EEXIST || stat(path.c_str(), &existing) < 0 ||
+			   !S_ISDIR(existing.st_mode)) {
+				report(state, item.plain_path, error);
+				break;
+			}
+		}
+		state.n_dirs.fetch_add(1);
+		break;
+	}
+	case EXPORT_FILE:
+		current.path = join(state.to, item.path.c_str());
+		current.plain_path = item.plain_path;
+		current.times[0] = item.mtime;
+		current.times[1] = item.mtime;
+		current.failed = false;
+		current.fd = open(current.path.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, item.mode);
+		if(current.fd < 0) {
+			report(state, current.plain_path, errno);
+			current.failed = true;
+		}
+		break;
+	case EXPORT_DATA:
+		if(current.failed) { break; }
+		if(item.failed) {
+			report(state, current.plain_path, EBADMSG);
+			current.failed = true;
+		} else if(write_all(current.fd, item.plaintext.buf, item.plain_len) < 0) {
+			report(state, current.plain_path, errno);
+			current.failed = true;
+		} else {
+			state.n_bytes.fetch_add(item.plain_len, std::memory_order_relaxed);
+		}
+		break;
+	case EXPORT_END:
+		if(current.fd < 0) { break; }
+
+		// A file that can't be exported whole isn't exported at all.
+		current.failed = current.failed || item.failed;
+		if(!current.failed && futimens(current.fd, current.times) < 0) {
+			report(state, current.plain_path, errno);
+			current.failed = true;
+		}
+		if(close(current.fd) < 0 && !current.failed) {
+			report(state, current.plain_path, errno);
+			current.failed = true;
+		}
+		current.fd = -1;
+
+		if(current.failed) {
+			unlink(current.path.c_str());
+		} else {
+			state.n_files.fetch_add(1);
+		}
+		break;
+	}
+}
+
+static void writer(ExportState& state) {
+	const bool tar = (state.options.tar_fd >= 0);
+	ExportCurrent current;
+	std::map<uint64_t, ExportItem*> waiting;
+	uint64_t next_seq = 0;
+
+	ExportItem* item = nullptr;
+	while(workqueue_pop(state.to_write, item)) {
+		waiting[item->seq] = item;
+		for(auto next = waiting.begin(); next != waiting.end() && next->first == next_seq;
+		    next = waiting.begin()) {
+			ExportItem* ready = next->second;
+			waiting.erase(next);
+			next_seq += 1;
+
+			if(state.output_error == 0) {
+				if(tar) {
+					write_tar_item(state, *ready, current);
+				} else {
+					write_tree_item(state, *ready, current);
+				}
+			}
+
+			sodium_memzero(ready->plaintext.buf, ready->plain_len);
+			workqueue_push(state.free_items, ready);
+		}
+	}
+
+	// The end-of-archive marker.
+	if(tar && state.output_error == 0) {
+		static const uint8_t zeros[2 * TAR_BLOCK] = {0};
+		if(write_all(state.options.tar_fd, zeros, sizeof(zeros)) < 0) {
+			output_failed(state);
+		}
+	}
+	if(current.fd >= 0) {
+		close(current.fd);
+		unlink(current.path.c_str());
+	}
+
+	std::lock_guard<std::mutex> guard(state.done_lock);
+	state.done = true;
+	state.done_cond.notify_all();
+}
+
+static void snapshot(const ExportState& state, ExportStats& stats) {
+	stats.dirs = state.n_dirs.load();
+	stats.files = state.n_files.load();
+	stats.bytes = state.n_bytes.load();
+	stats.errors = state.n_errors.load();
+}
+
+int export_run(FangFS& fs, const char* from, const char* to, const ExportOptions& options,
+               ExportStats& stats) {
+	Buffer cipher_root;
+	path_resolve(fs, from, cipher_root);
+
+	struct stat info;
+	if(stat(reinterpret_cast<char*>(cipher_root.buf), &info) < 0) { return STATUS_CHECK_ERRNO; }
+	if(!S_ISDIR(info.st_mode)) {
+		errno = ENOTDIR;
+		return STATUS_CHECK_ERRNO;
+	}
+	if(options.tar_fd < 0 && mkdir(to, 0700) < 0 && errno != EEXIST) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	ExportState state(fs, options, to);
+	state.aborted.store(false);
+	state.n_dirs.store(0);
+	state.n_files.store(0);
+	state.n_bytes.store(0);
+	state.n_errors.store(0);
+	state.chunk_blocks = std::max<size_t>(EXPORT_CHUNK_BYTES / fs.metafile.block_size, 1);
+
+	unsigned n_threads = options.threads;
+	if(n_threads == 0) {
+		n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	state.decryptors_left.store(n_threads);
+
+	// Every item the walk produces takes one of these, so the walk can only
+	// get so far ahead of the writer.
+	std::vector<ExportItem*> items;
+	for(unsigned i = 0; i < n_threads * EXPORT_ITEMS_PER_THREAD + 2; i += 1) {
+		items.push_back(new ExportItem);
+		workqueue_push(state.free_items, items.back());
+	}
+
+	ExportDir root;
+	root.plain_path = from;
+	root.cipher_path = reinterpret_cast<char*>(cipher_root.buf);
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 0; i < n_threads; i += 1) {
+		threads.push_back(std::thread(decryptor, std::ref(state)));
+	}
+	threads.push_back(std::thread(walker, std::ref(state), root));
+	threads.push_back(std::thread(writer, std::ref(state)));
+
+	{
+		std::unique_lock<std::mutex> guard(state.done_lock);
+		const bool report_progress = options.on_progress && options.progress_seconds > 0;
+		const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(options.progress_seconds));
+		auto next_progress = std::chrono::steady_clock::now() + interval;
+		while(!state.done) {
+			if(!report_progress) {
+				state.done_cond.wait(guard);
+				continue;
+			}
+
+			if(state.done_cond.wait_until(guard, next_progress) != std::cv_status::timeout) {
+				continue;
+			}
+			next_progress += interval;
+
+			ExportStats progress;
+			snapshot(state, progress);
+			guard.unlock();
+			options.on_progress(progress);
+			guard.lock();
+		}
+	}
+
+	for(std::thread& thread: threads) {
+		thread.join();
+	}
+
+	for(ExportItem* item: items) {
+		delete item;
+	}
+
+	snapshot(state, stats);
+	if(state.output_error != 0) {
+		errno = state.output_error;
+		return STATUS_CHECK_ERRNO;
+	}
+	return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include "fangfs.h"
+
+/// Running totals of an export.
+struct ExportStats {
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+struct ExportOptions {
+	ExportOptions(): threads(0), tar_fd(-1), progress_seconds(0) {}
+
+	/// Decryption threads; 0 picks one per CPU.
+	unsigned threads;
+
+	/// If not -1, write the tree as a tar stream to this descriptor instead
+	/// of into a directory.
+	int tar_fd;
+
+	/// Called with the plaintext path and errno of every entry that couldn't
+	/// be exported, EBADMSG for anything that fails authentication. Calls are
+	/// serialized.
+	std::function<void(const char* path, int error)> on_error;
+
+	/// Called every progress_seconds from the calling thread, if set.
+	std::function<void(const ExportStats&)> on_progress;
+	double progress_seconds;
+};
+
+/// Decrypt the plaintext directory from of the unlocked filesystem fs, and
+/// everything under it, into the directory to, which is created if missing,
+/// or as a tar stream if options.tar_fd is set. Files and directories keep
+/// their permissions, and files their times. Output is written in a single
+/// ordered stream however many threads decrypt, and memory use doesn't grow
+/// with the size of the files. Returns 0 once the whole tree has been
+/// walked, whatever failed along the way, or STATUS_CHECK_ERRNO if the
+/// export couldn't start or its output couldn't be written.
+int export_run(FangFS& fs, const char* from, const char* to, const ExportOptions& options,
+               ExportStats& stats);
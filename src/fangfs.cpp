@@ -1,6 +1,7 @@
 #include "fangfs.h"
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,13 +9,34 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <algorithm>
 #include "util.h"
 #include "BufferEncryption.h"
+#include "codec.h"
+#include "dirindex.h"
 #include "file.h"
+#include "journal.h"
+#include "log.h"
+#include "pack.h"
+#include "probes.h"
+#include "rotate.h"
+#include "securepool.h"
+#include "stats.h"
 #include "error.h"
 #include "compat/compat.h"
 
+/// Recover the per-open handle stashed in fi->fh by fangfs_open.
+static inline FangFile* get_file(struct fuse_file_info* fi) {
+	return reinterpret_cast<FangFile*>(static_cast<uintptr_t>(fi->fh));
+}
+
+/// Recover the open directory stashed in fi->fh by fangfs_opendir.
+static inline FangDir* get_dir(struct fuse_file_info* fi) {
+	return reinterpret_cast<FangDir*>(static_cast<uintptr_t>(fi->fh));
+}
+
 // Returns 0 on success, 1 if the directory is populated, and -1 on error.
 static int initialize_empty_filesystem(FangFS& self) {
 	// Make sure the source is a directory, and check if it's empty.
@@ -44,16 +66,83 @@ static int initialize_empty_filesystem(FangFS& self) {
 		if(n_entries > 4) { return 1; }
 	}
 
+	// Compression changes the block layout, so it's chosen once and for all.
+	if(self.compression != CODEC_NONE) {
+		self.metafile.compression = self.compression;
+		self.metafile.block_size = std::max<uint32_t>(self.metafile.block_size,
+		                                              COMPRESS_BLOCK_SIZE);
+		log_info("Compressing blocks of %u bytes with %s", self.metafile.block_size,
+		         codec_name(self.compression));
+	}
+
 	// Create our master key
 	randombytes_buf(self.master_key, sizeof(self.master_key));
 
+	// Protect it with a passphrase
+	Buffer passphrase;
+	Buffer confirmation;
+	buf_make_secure(passphrase);
+	buf_make_secure(confirmation);
+	int status = read_passphrase("New passphrase: ", passphrase);
+	if(status == 0) {
+		status = read_passphrase("Repeat passphrase: ", confirmation);
+	}
+	if(status == 0 && (passphrase.len != confirmation.len ||
+	                   sodium_memcmp(passphrase.buf, confirmation.buf, passphrase.len) != 0)) {
+		log_error("Passphrases do not match");
+		status = STATUS_KEY_REJECTED;
+	}
+	if(status == 0) {
+		const size_t mem_ceiling = (self.kdf_mem_ceiling > 0)?
+		                           self.kdf_mem_ceiling : kdf_default_mem_ceiling();
+		KdfParams params;
+		status = metafile_new_key_auto(self.metafile, self.kdf_target_seconds, mem_ceiling,
+		                               self.key_name, reinterpret_cast<char*>(passphrase.buf),
+		                               passphrase.len, self.master_key, &params);
+		if(status == 0) {
+			log_info("Key derivation: opslimit %u, memlimit %u MiB, %.2fs to unlock",
+			         params.opslimit, params.memlimit >> 20, params.seconds);
+		}
+	}
+	if(status != 0) { return status; }
+
 	// Create our metafile
-	metafile_write(self.metafile);
+	return metafile_write(self.metafile);
+}
 
-	return 0;
+/// Recover the master key of an existing filesystem from the user's
+/// passphrase. If next_key is not nullptr, also begin rotating to it, which
+/// takes the passphrase even if the key is cached.
+static int unlock_filesystem(FangFS& self, const uint8_t* next_key) {
+	// A recent mount may have left the key behind for us.
+	if(next_key == nullptr && self.key_cache_timeout > 0 &&
+	   metafile_unlock_cached(self.metafile, self.key_name, self.master_key) == 0) {
+		return 0;
+	}
+
+	Buffer passphrase;
+	buf_make_secure(passphrase);
+	int status = read_passphrase("Passphrase: ", passphrase);
+	if(status == 0 && next_key != nullptr) {
+		status = metafile_rotate(self.metafile, self.key_name,
+		                         reinterpret_cast<char*>(passphrase.buf), passphrase.len,
+		                         self.key_cache_timeout, self.rotate_drop_others,
+		                         next_key, self.master_key);
+	} else if(status == 0) {
+		status = metafile_unlock(self.metafile, self.key_name,
+		                         reinterpret_cast<char*>(passphrase.buf), passphrase.len,
+		                         self.key_cache_timeout, self.master_key);
+	}
+
+	if(status == STATUS_KEY_REJECTED) {
+		log_error("Incorrect passphrase");
+	}
+	return status;
 }
 
 int fangfs_mknod(FangFS& self, const char* path, mode_t m, dev_t d) {
+	RotateReadLock names(self);
+	DirIndexUpdate listing(self, path);
 	Buffer real_path;
 	path_resolve(self, path, real_path);
 
@@ -64,51 +153,104 @@ int fangfs_mknod(FangFS& self, const char* path, mode_t m, dev_t d) {
 		}
 	}
 
+	dirindex_update(listing, IFTODT((m & S_IFMT)? m : S_IFREG));
 	return 0;
 }
 
 int fangfs_truncate(FangFS& self, const char* path, off_t end) {
+	RotateReadLock names(self);
+	PackReadLock packed(self);
 	Buffer real_path;
-	path_resolve(self, path, real_path);
-
-	int fd = open(reinterpret_cast<char*>(real_path.buf), O_RDWR, 0);
-	if(fd < 0) { return errno; }
-
-	struct fuse_file_info fi;
-	fi.fh = fd;
-	fangfs_ftruncate(self, path, end, &fi);
+	const uint8_t* key = nullptr;
+	path_resolve(self, path, real_path, &key);
+
+	const char* real_path_str = reinterpret_cast<char*>(real_path.buf);
+	int fd = open(real_path_str, (packed.store != nullptr)? O_RDWR|O_NOFOLLOW : O_RDWR, 0);
+	if(fd < 0 && errno == ELOOP && packed.store != nullptr) {
+		// Packed files are only ever changed as standalone files.
+		const int status = pack_unpack(self, real_path_str, key, end > 0);
+		if(status < 0) { return status; }
+		fd = open(real_path_str, O_RDWR|O_NOFOLLOW, 0);
+	}
+	if(fd < 0) { return -errno; }
 
-	if(close(fd) < 0) { return errno; }
-	return 0;
+	FangFile* file = fang_file_open(self, fd, real_path_str);
+	if(file == nullptr) {
+		const int new_errno = errno;
+		close(fd);
+		return -new_errno;
+	}
+	file->key = key;
+
+	if(names.rotation != nullptr) { rotate_pin(self, real_path_str); }
+	if(packed.store != nullptr) { pack_pin(self, real_path_str); }
+	const int status = fang_file_truncate(*file, end);
+	if(names.rotation != nullptr) { rotate_unpin(self, real_path_str); }
+	if(packed.store != nullptr) { pack_release(self, *file); }
+	const int close_status = fang_file_close(file);
+	return (status < 0)? status : close_status;
 }
 
 int fangfs_ftruncate(FangFS& self, const char* path, off_t end, struct fuse_file_info* fi) {
-	if(fi->fh == 0) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
 		return -EINVAL;
 	}
 
-	fprintf(stderr, "Truncating %s to %lu\n", path, end);
-	if(end == 0) {
-		// This is common, so let's fast-path this
-		return ftruncate(fi->fh, 0);
-	}
-
-	errno = ENOSYS;
-	return -errno;
+	log_debug("Truncating %s to %lld", path, static_cast<long long>(end));
+	return fang_file_truncate(*file, end);
 }
 
 int fangfs_unlink(FangFS& self, const char* path) {
+	RotateReadLock names(self);
+	PackReadLock packed(self);
+	DirIndexUpdate listing(self, path);
 	Buffer real_path;
-	path_resolve(self, path, real_path);
+	const uint8_t* key = nullptr;
+	path_resolve(self, path, real_path, &key);
 
-	if(unlink(reinterpret_cast<char*>(real_path.buf)) != 0) {
-		return -errno;
+	const int status = pack_unlink(self, reinterpret_cast<char*>(real_path.buf));
+	if(status < 0) {
+		return status;
+	}
+	dirindex_update(listing, DIRINDEX_REMOVED);
+
+	// A crash just as the rotation engine swapped this file to the master
+	// key can leave the old copy behind, which must not resurface now.
+	if(names.rotation != nullptr && key == self.master_key) {
+		const char* real_path_str = reinterpret_cast<char*>(real_path.buf);
+		real_path.buf[path_get_basename(real_path_str) - real_path_str] = '\0';
+
+		Buffer old_name;
+		Buffer old_path;
+		path_encrypt(self, path, old_name, names.rotation->old_key);
+		path_join(real_path_str, reinterpret_cast<char*>(old_name.buf), old_path);
+		pack_unlink(self, reinterpret_cast<char*>(old_path.buf));
 	}
 
 	return 0;
 }
 
-int fangfs_fsinit(FangFS& self, const char* source) {
+/// Make sure that this build can read the blocks of an existing filesystem.
+static int check_compression(FangFS& self) {
+	const uint8_t id = self.metafile.compression;
+	if(self.compression != CODEC_NONE && self.compression != id) {
+		log_info("Compression is chosen when a filesystem is created; keeping %s",
+		         codec_name(id)? codec_name(id) : "the existing codec");
+	}
+
+	if(id != CODEC_NONE && codec_find(id) == nullptr) {
+		log_error("This filesystem is compressed with %s, which this build lacks",
+		          codec_name(id)? codec_name(id) : "an unknown codec");
+		errno = ENOTSUP;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	return 0;
+}
+
+/// Setup shared by fangfs_fsinit() and fangfs_fsopen().
+static int prepare_filesystem(FangFS& self, const char* source) {
 	self.source = source;
 
 	// Prevent swapping out the master key
@@ -117,85 +259,403 @@ int fangfs_fsinit(FangFS& self, const char* source) {
 		if(error) { return STATUS_ERROR; }
 	}
 
+	// Likewise the passphrase, names and blocks, which live in buffers from
+	// a locked pool.
+	if(self.secure_pool > 0 && secure_pool_init(self.secure_pool) < 0) {
+		log_warn("Cannot set up the secure buffer pool: %s", strerror(errno));
+	}
+
+	// Everything the mount holds on to is charged against one budget.
+	memory_set_budget((self.memory_limit > 0)? self.memory_limit :
+	                  static_cast<size_t>(get_memory_size() * self.memory_share));
+
+	if(self.key_name == nullptr) {
+		self.key_name = getenv("USER");
+		if(self.key_name == nullptr) { self.key_name = "default"; }
+	}
+
+	return 0;
+}
+
+int fangfs_fsinit(FangFS& self, const char* source) {
+	int status = prepare_filesystem(self, source);
+	if(status < 0) { return status; }
+	memory_register_shrinker(MEM_FILE_BUFFERS, fang_file_shrink, nullptr);
+	dirindex_init(self);
+
+	// The key to rotate to, if a new rotation is asked for.
+	uint8_t next_key[crypto_secretbox_KEYBYTES];
+	bool begin_rotation = false;
+
 	// If we already have a metafile, parse it.  Otherwise, initialize it.
-	int status = metafile_init(self.metafile, source);
+	status = metafile_init(self.metafile, source);
 	if(status == 0) {
+		if(self.rotate_key) {
+			log_info("Not rotating the key of a new filesystem");
+		}
+
 		int initstatus = initialize_empty_filesystem(self);
-		int new_errno = 0;
-		if(initstatus > 0) { new_errno = ENOTEMPTY; }
-		if(initstatus != 0) {
+		if(initstatus > 0) {
+			fangfs_fsclose(self);
+			errno = ENOTEMPTY;
+			return STATUS_CHECK_ERRNO;
+		} else if(initstatus != 0) {
+			const int new_errno = errno;
 			fangfs_fsclose(self);
 			errno = new_errno;
+			return initstatus;
+		}
+	} else if(status < 0) {
+		return status;
+	} else {
+		status = check_compression(self);
+		if(status != 0) {
+			const int new_errno = errno;
+			fangfs_fsclose(self);
+			errno = new_errno;
+			return status;
+		}
+
+		if(self.rotate_key && self.metafile.rotating) {
+			log_info("A key rotation is already under way; resuming it");
+		} else if(self.rotate_key && self.metafile.n_keys > 1 && !self.rotate_drop_others) {
+			// Rotating would lock everyone else out; don't ask for a
+			// passphrase only to refuse.
+			log_error("%zu other key fields would be dropped by a key rotation; "
+			          "mount with -o rotate_key=drop_others to do so",
+			          self.metafile.n_keys - 1);
+			fangfs_fsclose(self);
+			errno = EEXIST;
 			return STATUS_CHECK_ERRNO;
+		} else if(self.rotate_key) {
+			if(sodium_mlock(next_key, sizeof(next_key)) != 0) {
+				fangfs_fsclose(self);
+				return STATUS_ERROR;
+			}
+			randombytes_buf(next_key, sizeof(next_key));
+			begin_rotation = true;
+		}
+
+		status = unlock_filesystem(self, begin_rotation? next_key : nullptr);
+		if(status != 0) {
+			const int new_errno = errno;
+			if(begin_rotation) { sodium_munlock(next_key, sizeof(next_key)); }
+			fangfs_fsclose(self);
+			errno = new_errno;
+			return status;
+		}
+	}
+
+	// Repair any blocks torn by a crash before anything can read them.
+	status = journal_recover(self);
+
+	// The intent log is under the key it was written with, so only switch
+	// keys once it is replayed.
+	if(begin_rotation) {
+		if(status == 0) { status = rotate_begin(self, next_key); }
+		sodium_munlock(next_key, sizeof(next_key));
+	} else if(status == 0 && self.metafile.rotating) {
+		status = rotate_resume(self);
+	}
+	if(status == 0) {
+		status = pack_open(self);
+	}
+	if(status < 0) {
+		const int new_errno = errno;
+		fangfs_fsclose(self);
+		errno = new_errno;
+		return status;
+	}
+
+	if(self.sync_mode == FANGFS_SYNC_JOURNAL) {
+		self.journal = new Journal;
+		status = journal_open(*self.journal, self);
+		if(status < 0) {
+			delete self.journal;
+			self.journal = nullptr;
+			fangfs_fsclose(self);
+			return status;
 		}
+	}
+
+	return 0;
+}
+
+int fangfs_fsopen(FangFS& self, const char* source) {
+	// metafile_init() would create a metafile that isn't there.
+	Buffer metapath;
+	path_join(source, METAFILE_NAME, metapath);
+	struct stat info;
+	if(stat(reinterpret_cast<char*>(metapath.buf), &info) < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+	if(info.st_size == 0) {
+		errno = ENOENT;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	int status = prepare_filesystem(self, source);
+	if(status < 0) { return status; }
+
+	status = metafile_init(self.metafile, source);
+	if(status == 0) {
+		// Emptied between the stat() and taking the lock.
+		fangfs_fsclose(self);
+		errno = ENOENT;
+		return STATUS_CHECK_ERRNO;
 	} else if(status < 0) {
 		return status;
 	}
 
+	status = check_compression(self);
+	if(status != 0) {
+		const int new_errno = errno;
+		fangfs_fsclose(self);
+		errno = new_errno;
+		return status;
+	}
+
+	// Offline tools know only one key, so a rotation has to be finished by
+	// a mount first.
+	if(self.metafile.rotating) {
+		log_error("A key rotation is under way; mount the filesystem until it finishes");
+		fangfs_fsclose(self);
+		errno = EBUSY;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	status = unlock_filesystem(self, nullptr);
+	if(status != 0) {
+		const int new_errno = errno;
+		fangfs_fsclose(self);
+		errno = new_errno;
+		return status;
+	}
+
 	return 0;
 }
 
 void fangfs_fsclose(FangFS& self) {
+	// The packing engine looks at the rotation, so it goes first.
+	pack_free(self);
+	rotate_free(self);
+
+	if(self.journal != nullptr) {
+		journal_close(*self.journal);
+		delete self.journal;
+		self.journal = nullptr;
+	}
+
 	metafile_free(self.metafile);
 
+	// Taking the metafile lock changed the root, so indexes are only marked
+	// up to date once it is gone.
+	dirindex_free(self);
+	memory_unregister_shrinker(MEM_FILE_BUFFERS);
+
 	// Zeros the key and allows its page to be swapped again.
 	sodium_munlock(self.master_key, sizeof(self.master_key));
 }
 
+void fangfs_relock(FangFS& self) {
+	if(sodium_mlock(self.master_key, sizeof(self.master_key)) != 0) {
+		log_warn("Cannot lock the master key into memory: %s", strerror(errno));
+	}
+	secure_pool_relock();
+}
+
 int fangfs_getattr(FangFS& self, const char* path, struct stat* stbuf) {
+	RotateReadLock names(self);
 	Buffer real_path;
 	path_resolve(self, path, real_path);
 
-	if(stat(reinterpret_cast<char*>(real_path.buf), stbuf) < 0) {
-		return -errno;
+	const char* real_path_str = reinterpret_cast<char*>(real_path.buf);
+	if(self.pack == nullptr) {
+		if(stat(real_path_str, stbuf) < 0) {
+			return -errno;
+		}
+	} else {
+		// A packed file's entry describes it.
+		PackLocator locator;
+		if(lstat(real_path_str, stbuf) < 0) {
+			return -errno;
+		} else if(S_ISLNK(stbuf->st_mode) &&
+		          pack_read_link(AT_FDCWD, real_path_str, locator) == 0) {
+			pack_stat(locator, stbuf);
+			return 0;
+		}
+	}
+
+	// Report the plaintext length rather than the ciphertext length
+	if(S_ISREG(stbuf->st_mode)) {
+		const off_t size = fang_file_size_at(self, AT_FDCWD,
+		                                     reinterpret_cast<char*>(real_path.buf),
+		                                     stbuf->st_size);
+		if(size < 0) { return -EIO; }
+		stbuf->st_size = size;
 	}
 
 	return 0;
 }
 
-int fangfs_open(FangFS& self, const char* path, struct fuse_file_info* fi) {
+/// Open the backing file for path and hang a new FangFile off of fi.
+static int open_file(FangFS& self, const char* path, int flags, mode_t mode,
+                     struct fuse_file_info* fi) {
+	RotateReadLock names(self);
+	PackReadLock packed(self);
+	DirIndexUpdate listing(self, (flags & O_CREAT)? path : nullptr);
 	Buffer real_path;
-	path_resolve(self, path, real_path);
+	const uint8_t* key = nullptr;
+	path_resolve(self, path, real_path, &key);
+
+	const char* real_path_str = reinterpret_cast<char*>(real_path.buf);
+	int backing_flags = fang_file_backing_flags(self, flags);
+	if(packed.store != nullptr) { backing_flags |= O_NOFOLLOW; }
+
+	bool created = false;
+	int fd = fang_file_open_backing(AT_FDCWD, real_path_str, backing_flags, mode, &created);
+	FangFile* file = nullptr;
+	if(fd < 0 && errno == ELOOP && packed.store != nullptr) {
+		// A packed file is read straight out of its record, and turned back
+		// into a standalone file to be written.
+		if((flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC)) {
+			Buffer contents;
+			buf_make_secure(contents);
+			const int status = pack_load(self, real_path_str, key, contents);
+			if(status < 0) { return status; }
+			file = fang_file_open_resident(self, contents, real_path_str);
+		} else {
+			const int status = pack_unpack(self, real_path_str, key, !(flags & O_TRUNC));
+			if(status < 0) { return status; }
+			fd = fang_file_open_backing(AT_FDCWD, real_path_str, backing_flags, mode,
+			                            &created);
+		}
+	}
+	if(created) { dirindex_update(listing, DT_REG); }
 
-	// Writing to a block always requires reading it in
-	int flags = fi->flags;
-	if(flags & O_WRONLY) {
-		flags = O_RDWR;
+	if(file == nullptr) {
+		if(fd < 0) {
+			return -errno;
+		}
+
+		file = fang_file_open(self, fd, real_path_str);
+		if(file == nullptr) {
+			const int new_errno = errno;
+			close(fd);
+			return -new_errno;
+		}
 	}
+	file->key = key;
 
-	int fd = open(reinterpret_cast<char*>(real_path.buf), flags);
-	int new_errno = errno;
+	// Keep the rotation and packing engines away from the file until it is
+	// released.
+	if(names.rotation != nullptr) { rotate_pin(self, real_path_str); }
+	if(packed.store != nullptr) { pack_pin(self, real_path_str); }
 
-	if(fd < 0) {
-		return new_errno;
+	if(created || (flags & O_TRUNC)) {
+		file->modified = true;
+		const int status = fang_file_note_created(*file);
+		if(status < 0) {
+			fang_file_close(file);
+			return status;
+		}
 	}
 
-	printf("Open OK\n");
-	fi->fh = fd;
+	log_debug("Open OK");
+	fi->fh = reinterpret_cast<uintptr_t>(file);
 	return 0;
 }
 
+int fangfs_open(FangFS& self, const char* path, struct fuse_file_info* fi) {
+	return open_file(self, path, fi->flags, 0, fi);
+}
+
+int fangfs_create(FangFS& self, const char* path, mode_t mode, struct fuse_file_info* fi) {
+	return open_file(self, path, fi->flags | O_CREAT, mode, fi);
+}
+
 int fangfs_read(FangFS& self, char* buf, size_t size, off_t offset, \
                 struct fuse_file_info* fi) {
-	if(fi->fh == 0) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
 		return -EINVAL;
 	}
 
-	FangFile file(self, fi->fh);
-	return fang_file_read(file, offset, size, reinterpret_cast<uint8_t*>(buf));
+	return fang_file_read(*file, offset, size, reinterpret_cast<uint8_t*>(buf));
 }
 
 int fangfs_write(FangFS& self, const char* buf, size_t size, off_t offset, \
                  struct fuse_file_info* fi) {
-	if(fi->fh == 0) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
 		return -EINVAL;
 	}
 
-	FangFile file(self, fi->fh);
-	return fang_file_write(file, offset, size, reinterpret_cast<const uint8_t*>(buf));
+	return fang_file_write(*file, offset, size, reinterpret_cast<const uint8_t*>(buf));
+}
+
+int fangfs_read_buf(FangFS& self, struct fuse_bufvec** bufp, size_t size,
+                    off_t offset, struct fuse_file_info* fi) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
+		return -EINVAL;
+	}
+
+	// libfuse takes ownership of both allocations and frees them once the
+	// reply is sent, so blocks are decrypted directly into the reply memory.
+	struct fuse_bufvec* bufv = reinterpret_cast<struct fuse_bufvec*>(malloc(sizeof(*bufv)));
+	uint8_t* mem = reinterpret_cast<uint8_t*>(malloc(size > 0 ? size : 1));
+	if(bufv == nullptr || mem == nullptr) {
+		free(bufv);
+		free(mem);
+		return -ENOMEM;
+	}
+
+	const int n = fang_file_read(*file, offset, size, mem);
+	if(n < 0) {
+		free(bufv);
+		free(mem);
+		return n;
+	}
+
+	memset(bufv, 0, sizeof(*bufv));
+	bufv->count = 1;
+	bufv->buf[0].size = n;
+	bufv->buf[0].mem = mem;
+	bufv->buf[0].fd = -1;
+
+	*bufp = bufv;
+	return 0;
+}
+
+int fangfs_write_buf(FangFS& self, struct fuse_bufvec* buf, off_t offset,
+                     struct fuse_file_info* fi) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
+		return -EINVAL;
+	}
+
+	return fang_file_write_buf(*file, offset, buf);
+}
+
+int fangfs_fsync(FangFS& self, int datasync, struct fuse_file_info* fi) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
+		return -EINVAL;
+	}
+
+	return fang_file_sync(*file, datasync);
+}
+
+int fangfs_flush(FangFS& self, struct fuse_file_info* fi) {
+	// Blocks are written through on every request, so nothing is buffered
+	// here that close() would need to push out.
+	return 0;
 }
 
 int fangfs_mkdir(FangFS& self, const char* path, mode_t mode) {
+	RotateReadLock names(self);
+	DirIndexUpdate listing(self, path);
 	Buffer realpath;
 	path_resolve(self, path, realpath);
 
@@ -203,39 +663,73 @@ int fangfs_mkdir(FangFS& self, const char* path, mode_t mode) {
 		return -errno;
 	}
 
+	dirindex_update(listing, DT_DIR);
 	return 0;
 }
 
 int fangfs_opendir(FangFS& self, const char* path, struct fuse_file_info* fi) {
+	RotateReadLock names(self);
 	Buffer real_path;
 	path_resolve(self, path, real_path);
 
-	DIR* dir = opendir(reinterpret_cast<char*>(real_path.buf));
-	int new_errno = errno;
-
-	if(dir == nullptr) {
-		return new_errno;
+	FangDir* dir = new FangDir;
+	dir->dir = opendir(reinterpret_cast<char*>(real_path.buf));
+	if(dir->dir == nullptr) {
+		const int new_errno = errno;
+		delete dir;
+		return -new_errno;
 	}
 
-	fi->fh = dirfd(dir);
+	if(self.dir_indexes != nullptr) {
+		dirindex_open(self, path, reinterpret_cast<char*>(real_path.buf), *dir);
+	}
+	fi->fh = reinterpret_cast<uintptr_t>(dir);
 	return 0;
 }
 
+/// The type of the backing entry, as listed. Packed files are symlinks in
+/// the source but regular files to the user.
+static uint8_t entry_type(DIR* dir, const struct dirent& entry) {
+	uint8_t type = entry.d_type;
+	if(type == DT_UNKNOWN) {
+		struct stat info;
+		if(fstatat(dirfd(dir), entry.d_name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+			type = IFTODT(info.st_mode);
+		}
+	}
+	return (type == DT_LNK)? static_cast<uint8_t>(DT_REG) : type;
+}
+
 int fangfs_readdir(FangFS& self, const char* path, void* buf,
                         fuse_fill_dir_t filler, off_t offset,
                         struct fuse_file_info* fi) {
-	DIR* dir = fdopendir(fi->fh);
-	if(dir == nullptr) {
-		return -errno;
+	FANGFS_PROBE2(readdir_entry, path, offset);
+	FangDir* handle = get_dir(fi);
+	if(handle == nullptr) {
+		FANGFS_PROBE2(readdir_return, path, -EBADF);
+		return -EBADF;
+	}
+
+	// An indexed directory is listed in order, from any offset.
+	if(handle->base) {
+		const int status = dirindex_list(self, *handle, path, buf, filler, offset);
+		FANGFS_PROBE2(readdir_return, path, status);
+		return status;
 	}
 
+	RotateReadLock names(self);
+	DIR* dir = handle->dir;
+	if(offset == 0) { rewinddir(dir); }
+
 	Buffer decrypted;
-	Buffer fullpath;
+	buf_make_secure(decrypted);
 
 	struct dirent entry;
 	struct dirent* result;
 	while(readdir_r(dir, &entry, &result) == 0) {
 		if(result == nullptr) {
+			dirindex_built(self, *handle, true);
+			FANGFS_PROBE2(readdir_return, path, 0);
 			return 0;
 		}
 
@@ -248,66 +742,126 @@ int fangfs_readdir(FangFS& self, const char* path, void* buf,
 		}
 
 		// Decrypt the filename
-		int status = path_decrypt(self, entry.d_name, decrypted);
-		if(status < 0) {
-			fprintf(stderr, "Tampering detected on file %s\n", entry.d_name);
+		const char* filename = nullptr;
+		const uint8_t* key = nullptr;
+		int status = name_decrypt(self, path, entry.d_name, decrypted, &filename, &key);
+		if(status == STATUS_TAMPERING) {
+			log_warn("Tampering detected on file %s", entry.d_name);
+			continue;
+		} else if(status < 0) {
 			continue;
 		}
 
-		// Strip out the hash
-		const char* filename = reinterpret_cast<char*>(decrypted.buf) +
-		                       crypto_generichash_BYTES;
-
-		// Verify the hash, preventing files from being moved around by someone
-		// outside the encrypted filesystem.
-		{
+		// An entry under the previous key may have been left behind next to
+		// its rotated copy by a crash, and only the copy counts.
+		if(key != self.master_key) {
+			Buffer fullpath;
+			Buffer current_name;
 			path_join(path, filename, fullpath);
-			uint8_t path_hash[crypto_generichash_BYTES];
-			crypto_generichash(path_hash, sizeof(path_hash),
-			                   reinterpret_cast<const uint8_t*>(fullpath.buf),
-			                   fullpath.len, nullptr, 0);
-			if(sodium_memcmp(path_hash, decrypted.buf, sizeof(path_hash)) != 0) {
+			path_encrypt(self, reinterpret_cast<char*>(fullpath.buf), current_name);
+			if(faccessat(dirfd(dir), reinterpret_cast<char*>(current_name.buf), F_OK,
+			             AT_SYMLINK_NOFOLLOW) == 0) {
 				continue;
 			}
 		}
 
 		filler(buf, filename, nullptr, 0);
+		if(handle->building) {
+			handle->names.push_back(std::make_pair(std::string(filename),
+			                                       entry_type(dir, entry)));
+		}
 	}
 
 	// Something went haywire
 	int new_errno = errno;
+	dirindex_built(self, *handle, false);
 
+	FANGFS_PROBE2(readdir_return, path, -new_errno);
 	return -new_errno;
 }
 
-int fangfs_close(FangFS& self, struct fuse_file_info* fi) {
-	close(fi->fh);
+int fangfs_releasedir(FangFS& self, const char* path, struct fuse_file_info* fi) {
+	FangDir* handle = get_dir(fi);
+	if(handle == nullptr) {
+		return -EBADF;
+	}
+
+	fi->fh = 0;
+	dirindex_built(self, *handle, false);
+	delete handle;
 	return 0;
 }
 
-void path_resolve(FangFS& self, const char* path, Buffer& outbuf) {
+int fangfs_close(FangFS& self, struct fuse_file_info* fi) {
+	FangFile* file = get_file(fi);
+	if(file == nullptr) {
+		return -EINVAL;
+	}
+
+	fi->fh = 0;
+	if(self.rotation != nullptr && file->real_path != nullptr) {
+		rotate_unpin(self, file->real_path);
+	}
+	if(self.pack != nullptr) {
+		pack_release(self, *file);
+	}
+	return fang_file_close(file);
+}
+
+void path_resolve(FangFS& self, const char* path, Buffer& outbuf, const uint8_t** key) {
+	StatScope timer(STAT_PATH_RESOLVE);
+	FANGFS_PROBE1(path_resolve_entry, path);
+	if(key != nullptr) { *key = self.master_key; }
 	if(strcmp(path, "/") == 0) {
 		buf_load_string(outbuf, self.source);
+		FANGFS_PROBE2(path_resolve_return, path, outbuf.buf);
 		return;
 	}
 
 	Buffer path_buf;
+	buf_make_secure(path_buf);
 	buf_load_string(path_buf, path);
 
 	Buffer encrypted_path;
 	Buffer tmpbuf;
 
+	// Once a component is missing under both keys, nothing below it exists.
+	const Rotation* rotation = (self.rotation != nullptr && !self.rotation->done)?
+	                           self.rotation : nullptr;
+	bool missing = false;
+
 	buf_load_string(outbuf, self.source);
 	path_building_for_each(path_buf, [&](const Buffer& cur) {
-		path_encrypt(self, reinterpret_cast<char*>(cur.buf), encrypted_path);
+		const char* cur_str = reinterpret_cast<char*>(cur.buf);
+		path_encrypt(self, cur_str, encrypted_path);
 		buf_copy(outbuf, tmpbuf);
 		path_join(reinterpret_cast<char*>(tmpbuf.buf),
 		          reinterpret_cast<char*>(encrypted_path.buf),
 		          outbuf);
+		if(key != nullptr) { *key = self.master_key; }
+
+		struct stat info;
+		if(rotation == nullptr || missing ||
+		   lstat(reinterpret_cast<char*>(outbuf.buf), &info) == 0 || errno != ENOENT) {
+			return;
+		}
+
+		Buffer old_path;
+		path_encrypt(self, cur_str, encrypted_path, rotation->old_key);
+		path_join(reinterpret_cast<char*>(tmpbuf.buf),
+		          reinterpret_cast<char*>(encrypted_path.buf),
+		          old_path);
+		if(lstat(reinterpret_cast<char*>(old_path.buf), &info) == 0) {
+			buf_copy(old_path, outbuf);
+			if(key != nullptr) { *key = rotation->old_key; }
+		} else {
+			missing = true;
+		}
 	});
+	FANGFS_PROBE2(path_resolve_return, path, outbuf.buf);
 }
 
-void path_encrypt(FangFS& self, const char* orig, Buffer& outbuf) {
+void path_encrypt(FangFS& self, const char* orig, Buffer& outbuf, const uint8_t* key) {
 	const size_t orig_len = strlen(orig);
 
 	// Four steps to this
@@ -321,29 +875,79 @@ void path_encrypt(FangFS& self, const char* orig, Buffer& outbuf) {
 
 	// 3) Encrypt the concatenation of the hash with the filename
 	Buffer inbuf;
+	buf_make_secure(inbuf);
 	buf_grow(inbuf, sizeof(path_hash) + strlen(basename) + 1);
 	memcpy(inbuf.buf, path_hash, sizeof(path_hash));
 	strcpy(reinterpret_cast<char*>(inbuf.buf) + sizeof(path_hash), basename);
 	inbuf.len = inbuf.buf_len;
 
 	Buffer ciphertext;
-	buf_encrypt(inbuf, self.metafile.filename_nonce, self.master_key, ciphertext);
+	buf_encrypt(inbuf, self.metafile.filename_nonce,
+	            (key != nullptr)? key : self.master_key, ciphertext);
 
 	// 4) Encode
 	base32_enc(ciphertext, outbuf);
-	fprintf(stderr, "Encrypted: %s\n", outbuf.buf);
+	log_debug("Encrypted: %s", outbuf.buf);
 }
 
-int path_decrypt(FangFS& self, const char* orig, Buffer& outbuf) {
+int path_decrypt(FangFS& self, const char* orig, Buffer& outbuf, const uint8_t* key) {
+	FANGFS_PROBE1(path_decrypt_entry, orig);
 	Buffer ciphertext;
 
 	base32_dec(orig, ciphertext);
 
-	int result = buf_decrypt(ciphertext, self.metafile.filename_nonce, self.master_key, outbuf);
+	int result = buf_decrypt(ciphertext, self.metafile.filename_nonce,
+	                         (key != nullptr)? key : self.master_key, outbuf);
 
 	if(result != 0) {
+		FANGFS_PROBE2(name_mac_failure, orig, STATUS_TAMPERING);
+		FANGFS_PROBE2(path_decrypt_return, orig, STATUS_TAMPERING);
 		return STATUS_TAMPERING;
 	}
 
+	FANGFS_PROBE2(path_decrypt_return, orig, 0);
+	return 0;
+}
+
+int name_decrypt(FangFS& self, const char* dirpath, const char* name,
+                 Buffer& outbuf, const char** filename, const uint8_t** key) {
+	StatScope timer(STAT_READDIR_DECRYPT);
+	if(key != nullptr) { *key = self.master_key; }
+	int status = path_decrypt(self, name, outbuf);
+	if(status == STATUS_TAMPERING && self.rotation != nullptr && !self.rotation->done) {
+		status = path_decrypt(self, name, outbuf, self.rotation->old_key);
+		if(status == 0 && key != nullptr) { *key = self.rotation->old_key; }
+	}
+	if(status < 0) {
+		if(status == STATUS_TAMPERING) { stats_count(STAT_TAMPERING, 1); }
+		return status;
+	}
+
+	if(outbuf.len < crypto_generichash_BYTES) {
+		stats_count(STAT_TAMPERING, 1);
+		FANGFS_PROBE2(name_mac_failure, name, STATUS_TAMPERING);
+		return STATUS_TAMPERING;
+	}
+
+	// Strip out the hash
+	const char* plain_name = reinterpret_cast<char*>(outbuf.buf) +
+	                         crypto_generichash_BYTES;
+
+	// Verify the hash, preventing files from being moved around by someone
+	// outside the encrypted filesystem.
+	Buffer fullpath;
+	buf_make_secure(fullpath);
+	path_join(dirpath, plain_name, fullpath);
+	uint8_t path_hash[crypto_generichash_BYTES];
+	crypto_generichash(path_hash, sizeof(path_hash),
+	                   reinterpret_cast<const uint8_t*>(fullpath.buf),
+	                   fullpath.len, nullptr, 0);
+	if(sodium_memcmp(path_hash, outbuf.buf, sizeof(path_hash)) != 0) {
+		stats_count(STAT_TAMPERING, 1);
+		FANGFS_PROBE2(name_mac_failure, name, STATUS_ERROR);
+		return STATUS_ERROR;
+	}
+
+	*filename = plain_name;
 	return 0;
 }
@@ -7,36 +7,190 @@
 #include <sys/stat.h>
 #include <fuse.h>
 #include <sodium.h>
+#include "memory.h"
 #include "metafile.h"
 
+/// How fsync requests are honoured.
+enum FangSyncMode {
+	/// fsync the backing file on every call.
+	FANGFS_SYNC_DIRECT,
+
+	/// Log every block to the intent log first, and group-commit fsyncs
+	/// against the log.
+	FANGFS_SYNC_JOURNAL
+};
+
+/// How block reads and writes reach the backing files.
+enum FangIoEngine {
+	/// One pread/pwrite per block.
+	FANGFS_IO_POSIX,
+
+	/// Submit every block of a request to io_uring as one batch, falling
+	/// back to FANGFS_IO_POSIX where io_uring is unavailable.
+	FANGFS_IO_URING,
+
+	/// Decrypt reads straight out of a shared mapping of the backing file.
+	/// Writes still use pwrite.
+	FANGFS_IO_MMAP
+};
+
+/// Defaults for how hard key rotation may work in the background: MiB per
+/// second, and the share of time it may be busy.
+#define ROTATE_DEFAULT_RATE_MIB 16
+#define ROTATE_DEFAULT_DUTY 0.25
+
+/// The default size of the pool that plaintext and key buffers come from, in
+/// MiB.
+#define SECURE_POOL_DEFAULT_MIB 4
+
+struct DirIndexStore;
+struct Journal;
+struct PackStore;
+struct Rotation;
+
 struct FangFS {
+	FangFS(): metafile(), source(nullptr), sync_mode(FANGFS_SYNC_DIRECT), io_engine(FANGFS_IO_POSIX),
+	          backing_direct(false), key_name(nullptr), key_cache_timeout(0),
+	          kdf_target_seconds(KDF_DEFAULT_TARGET_SECONDS), kdf_mem_ceiling(0),
+	          trace_path(nullptr), trace_records(0), journal(nullptr), rotate_key(false),
+	          rotate_drop_others(false),
+	          rotate_rate(static_cast<uint64_t>(ROTATE_DEFAULT_RATE_MIB) << 20), rotate_duty(ROTATE_DEFAULT_DUTY),
+	          rotation(nullptr), compression(0), pack_threshold(0), pack(nullptr),
+	          dir_index(0), dir_indexes(nullptr),
+	          secure_pool(static_cast<size_t>(SECURE_POOL_DEFAULT_MIB) << 20),
+	          memory_limit(0), memory_share(MEMORY_DEFAULT_SHARE) {}
+
 	Metafile metafile;
 	uint8_t master_key[crypto_secretbox_KEYBYTES];
 	char const* source;
+
+	FangSyncMode sync_mode;
+	FangIoEngine io_engine;
+
+	/// Open backing files with O_DIRECT, so that only the plaintext is
+	/// cached, in the kernel's FUSE page cache.
+	bool backing_direct;
+
+	/// The name of the key to unlock with. Defaults to $USER.
+	const char* key_name;
+
+	/// If nonzero, keep the unlocked child key in the kernel keyring for
+	/// this many seconds, so that remounting skips the KDF.
+	unsigned key_cache_timeout;
+
+	/// How long unlocking a newly created key should take, and the most
+	/// memory it may use; 0 picks kdf_default_mem_ceiling().
+	double kdf_target_seconds;
+	size_t kdf_mem_ceiling;
+
+	/// Where to record a trace of every operation, or nullptr, and how many
+	/// of the latest operations it keeps; 0 picks TRACE_DEFAULT_RECORDS.
+	const char* trace_path;
+	uint32_t trace_records;
+
+	/// The intent log, if sync_mode is FANGFS_SYNC_JOURNAL.
+	Journal* journal;
+
+	/// Start rotating to a new master key on mount, dropping other users'
+	/// key fields only if rotate_drop_others is set, and how hard the
+	/// background re-encryption may work: at most rotate_rate bytes per
+	/// second, 0 for no limit, and busy at most rotate_duty of the time.
+	bool rotate_key;
+	bool rotate_drop_others;
+	uint64_t rotate_rate;
+	double rotate_duty;
+
+	/// The key rotation under way, or nullptr.
+	Rotation* rotation;
+
+	/// The codec to compress the blocks of a newly created filesystem with.
+	/// An existing filesystem keeps the one in its metafile.
+	uint8_t compression;
+
+	/// Pack files written and closed at most this many bytes long into
+	/// shared segment files; 0 leaves every file standalone.
+	uint32_t pack_threshold;
+
+	/// The segments of packed files, if the filesystem has any or
+	/// pack_threshold is set, or nullptr.
+	PackStore* pack;
+
+	/// Index directories found to hold at least this many names when listed;
+	/// 0 never indexes any.
+	uint32_t dir_index;
+
+	/// The directory indexes in use, if dir_index is set, or nullptr.
+	DirIndexStore* dir_indexes;
+
+	/// Bytes of memory to lock for plaintext and key buffers; 0 leaves them
+	/// on the heap, where they are still zeroed when freed.
+	size_t secure_pool;
+
+	/// The budget for the memory that the mount holds on to, in bytes, or
+	/// if that is 0, as a share of RAM; if both are 0, there is none.
+	size_t memory_limit;
+	double memory_share;
 };
 
 int fangfs_fsinit(FangFS& self, const char* source);
+
+/// Unlock an existing filesystem for an offline tool. Unlike fangfs_fsinit(),
+/// never creates a new filesystem, and leaves the intent log alone. Fails with
+/// STATUS_CHECK_ERRNO and ENOENT if source holds no filesystem.
+int fangfs_fsopen(FangFS& self, const char* source);
 void fangfs_fsclose(FangFS& self);
 
+/// Lock the master key and the secure buffer pool into memory again, in a
+/// child that fork() didn't pass the locks on to.
+void fangfs_relock(FangFS& self);
+
 int fangfs_mknod(FangFS& self, const char* path, mode_t m, dev_t d);
 int fangfs_truncate(FangFS& self, const char* path, off_t end);
 int fangfs_ftruncate(FangFS& self, const char* path, off_t end, struct fuse_file_info* fi);
 int fangfs_unlink(FangFS& self, const char* path);
 int fangfs_open(FangFS& self, const char* path, struct fuse_file_info* fi);
+int fangfs_create(FangFS& self, const char* path, mode_t mode, struct fuse_file_info* fi);
 int fangfs_close(FangFS& self, struct fuse_file_info* fi);
 int fangfs_getattr(FangFS& self, const char* path, struct stat* stbuf);
 int fangfs_read(FangFS& self, char* buf, size_t size, off_t offset, \
                 struct fuse_file_info* fi);
 int fangfs_write(FangFS& self, const char* buf, size_t size, off_t offset, \
                  struct fuse_file_info* fi);
+int fangfs_read_buf(FangFS& self, struct fuse_bufvec** bufp, size_t size,
+                    off_t offset, struct fuse_file_info* fi);
+int fangfs_write_buf(FangFS& self, struct fuse_bufvec* buf, off_t offset,
+                     struct fuse_file_info* fi);
+int fangfs_fsync(FangFS& self, int datasync, struct fuse_file_info* fi);
+int fangfs_flush(FangFS& self, struct fuse_file_info* fi);
 int fangfs_mkdir(FangFS& self, const char* path, mode_t mode);
 int fangfs_opendir(FangFS& self, const char* path, struct fuse_file_info* fi);
 int fangfs_readdir(FangFS& self, const char* path, void* buf,
                         fuse_fill_dir_t filler, off_t offset,
                         struct fuse_file_info* fi);
+int fangfs_releasedir(FangFS& self, const char* path, struct fuse_file_info* fi);
 
 
 // Filename utilities
-void path_resolve(FangFS& self, const char* path, Buffer& outbuf);
-void path_encrypt(FangFS& self, const char* orig, Buffer& outbuf);
-int path_decrypt(FangFS& self, const char* orig, Buffer& outbuf);
+
+/// Map a plaintext path to its backing path. While a key rotation is under
+/// way, each component is looked for under the master key, then under the
+/// previous key, and one found under neither is named under the master key,
+/// ready to be created. If key is not nullptr, it receives the key that the
+/// final component is under.
+void path_resolve(FangFS& self, const char* path, Buffer& outbuf,
+                  const uint8_t** key=nullptr);
+
+/// Encrypt the final component of the plaintext path orig under key, by
+/// default the master key.
+void path_encrypt(FangFS& self, const char* orig, Buffer& outbuf,
+                  const uint8_t* key=nullptr);
+int path_decrypt(FangFS& self, const char* orig, Buffer& outbuf,
+                 const uint8_t* key=nullptr);
+
+/// Decrypt a ciphertext directory entry name found in the plaintext
+/// directory dirpath, and check that it really belongs there. On success,
+/// *filename points at the plaintext name inside outbuf. While a key
+/// rotation is under way, names under the previous key are accepted too;
+/// if key is not nullptr, it receives the key that the name was under.
+int name_decrypt(FangFS& self, const char* dirpath, const char* name,
+                 Buffer& outbuf, const char** filename, const uint8_t** key=nullptr);
@@ -1,176 +1,1452 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <tuple>
 #include "Buffer.h"
 #include "BufferEncryption.h"
 #include "file.h"
+#include "ioring.h"
+#include "journal.h"
+#include "log.h"
+#include "memory.h"
+#include "probes.h"
+#include "securepool.h"
+#include "stats.h"
+#include "error.h"
 
-/// Return the number of the block containing the given byte offset.
-static inline uint64_t get_block_number(const FangFile& self, off_t offset) {
-	return (offset / self.fs.metafile.block_size) *
-	       self.fs.metafile.block_size;
+/// Every open handle, for fang_file_shrink().
+static std::mutex open_files_lock;
+static std::set<FangFile*> open_files;
+
+/// The state shared by the handles on each open backing file, by filesystem,
+/// device, and inode number.
+typedef std::tuple<const FangFS*, dev_t, ino_t> FileStateKey;
+static std::mutex file_states_lock;
+static std::map<FileStateKey, FangFileState*> file_states;
+
+/// The bytes of buf that are charged to the memory accountant: any outside
+/// the secure pool, which is accounted for as a whole.
+static size_t heap_len(const Buffer& buf) {
+	return (buf.buf == nullptr || secure_pool_owns(buf.buf))? 0 : buf.buf_len;
 }
 
-/// Translate the logical decrypted file offset into an underlying offset,
-/// taking into account the block headers MACs.
-static inline off_t translate_offset(const FangFile& self, off_t offset) {
-	const uint64_t block_n = get_block_number(self, offset);
-	return (block_n * (BLOCK_OVERHEAD)) + offset;
+/// Bring the charge for the handle's buffers, and the tail it shares, up to
+/// date. Call under self.state->lock.
+static void account(FangFile& self) {
+	const size_t len = heap_len(self.ciphertext) + heap_len(self.plaintext) +
+	                   heap_len(self.packed);
+	memory_adjust(MEM_FILE_BUFFERS, self.charged, len);
+	self.charged = len;
+
+	FangFileState& state = *self.state;
+	memory_adjust(MEM_FILE_BUFFERS, state.charged, heap_len(state.tail));
+	state.charged = heap_len(state.tail);
 }
 
-static ssize_t block_read(FangFile& self, uint64_t block_n, Buffer& outbuf) {
-	if(outbuf.len > (self.fs.metafile.block_size - BLOCK_OVERHEAD)) {
-		errno = EINVAL;
+/// Join the state of the backing file described by info, setting it up if
+/// no other handle of fs has it open.
+static FangFileState* state_acquire(const FangFS& fs, const struct stat& info) {
+	std::lock_guard<std::mutex> guard(file_states_lock);
+	FangFileState*& state = file_states[FileStateKey(&fs, info.st_dev, info.st_ino)];
+	if(state == nullptr) {
+		state = new FangFileState;
+		state->dev = info.st_dev;
+		state->ino = info.st_ino;
+	}
+	state->refs += 1;
+	return state;
+}
+
+/// Leave a handle's state, freeing it along with the last handle.
+static void state_release(const FangFS& fs, FangFileState* state) {
+	std::lock_guard<std::mutex> guard(file_states_lock);
+	state->refs -= 1;
+	if(state->refs > 0) { return; }
+
+	const auto found = file_states.find(FileStateKey(&fs, state->dev, state->ino));
+	if(found != file_states.end() && found->second == state) {
+		file_states.erase(found);
+	}
+	memory_release(MEM_FILE_BUFFERS, state->charged);
+	delete state;
+}
+
+/// Accounts for a request's use of a handle's buffers when it is over. Lives
+/// inside the request's hold on the file's lock.
+struct FileAccounting {
+	explicit FileAccounting(FangFile& f): file(f) {}
+	~FileAccounting() { account(file); }
+
+	FangFile& file;
+
+private:
+	FileAccounting(const FileAccounting&);
+	FileAccounting& operator=(const FileAccounting&);
+};
+
+FangFile::FangFile(FangFS& fang, int file, FangFileState* shared, const char* path):
+		fs(fang), key(fang.master_key), fd(file), ino(shared->ino), direct(false),
+		real_path(nullptr), journal_path(nullptr), journal_lsn(0), state(shared),
+		last_read_end(0), sequential_reads(0), map(nullptr), map_len(0),
+		map_advice(MADV_NORMAL), resident(false), modified(false), charged(0) {
+	// Everything these hold is plaintext.
+	buf_make_secure(contents);
+	buf_make_secure(plaintext);
+	buf_make_secure(packed);
+
+	if(path != nullptr) {
+		real_path = strdup(path);
+		if(real_path == nullptr) { throw AllocationError(); }
+
+		// Backing paths are built by joining onto the source.
+		const size_t source_len = (fs.source != nullptr)? strlen(fs.source) : 0;
+		if(source_len > 0 && strncmp(real_path, fs.source, source_len) == 0) {
+			journal_path = real_path + source_len;
+			while(*journal_path == '/') { journal_path += 1; }
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(open_files_lock);
+	open_files.insert(this);
+}
+
+FangFile::~FangFile() {
+	// Out of reach of fang_file_shrink() before anything is torn down.
+	{
+		std::lock_guard<std::mutex> guard(open_files_lock);
+		open_files.erase(this);
+	}
+	memory_release(MEM_FILE_BUFFERS, charged);
+	if(resident) { memory_release(MEM_RESIDENT_FILES, heap_len(contents)); }
+	state_release(fs, state);
+
+	if(map != nullptr) { munmap(map, map_len); }
+	if(fd >= 0) { close(fd); }
+	free(real_path);
+}
+
+off_t fang_file_plaintext_size(const FangFS& fs, off_t physical_size) {
+	const off_t block_size = fs.metafile.block_size;
+	const off_t remainder = physical_size % block_size;
+
+	// Every block carries its own nonce and MAC, so a trailing fragment
+	// shorter than that can't have come from us.
+	if(remainder > 0 && remainder < static_cast<off_t>(BLOCK_OVERHEAD)) {
+		return -1;
+	}
+
+	off_t size = (physical_size / block_size) * fang_block_payload(fs);
+	if(remainder > 0) {
+		size += remainder - BLOCK_OVERHEAD;
+	}
+
+	return size;
+}
+
+/// Whether fs compresses its blocks, which lays them out as
+/// fang_block_seal() describes.
+static inline bool is_compressed(const FangFS& fs) {
+	return fs.metafile.compression != CODEC_NONE;
+}
+
+size_t fang_block_seal(const FangFS& fs, const uint8_t* key, const uint8_t* plaintext,
+                       size_t len, uint8_t* out, Buffer& scratch) {
+	if(!is_compressed(fs)) {
+		randombytes_buf(out, BLOCK_HEADER_LEN);
+		const uint64_t start = stats_clock();
+		buf_encrypt(plaintext, len, out, key, out + BLOCK_HEADER_LEN);
+		stats_time(STAT_ENCRYPT, start);
+		return len + BLOCK_OVERHEAD;
+	}
+
+	// The sealed body is the kind byte, then the plaintext compressed, or
+	// as it is if compressing it doesn't save enough.
+	buf_grow(scratch, len + 1);
+	const Codec* codec = codec_find(fs.metafile.compression);
+	size_t body_len = 0;
+	if(codec != nullptr && len > 0) {
+		const size_t limit = len - std::max<size_t>(len / COMPRESS_MIN_SAVING, 1);
+		const uint64_t start = stats_clock();
+		body_len = codec->compress(plaintext, len, scratch.buf + 1, limit);
+		stats_time(STAT_COMPRESS, start);
+	}
+
+	if(body_len > 0) {
+		scratch.buf[0] = BLOCK_KIND_COMPRESSED;
+		stats_count(STAT_BYTES_COMPRESSED, len);
+		stats_count(STAT_BYTES_PACKED, body_len);
+	} else {
+		scratch.buf[0] = BLOCK_KIND_RAW;
+		memcpy(scratch.buf + 1, plaintext, len);
+		body_len = len;
+		stats_count(STAT_BYTES_INCOMPRESSIBLE, len);
+	}
+
+	const size_t sealed_len = BLOCK_OVERHEAD + 1 + body_len;
+	const uint32_t header[2] = {u32_to_le(sealed_len), u32_to_le(len)};
+	memcpy(out, header, sizeof(header));
+
+	uint8_t* sealed = out + BLOCK_SLOT_HEADER_LEN;
+	randombytes_buf(sealed, BLOCK_HEADER_LEN);
+	const uint64_t start = stats_clock();
+	buf_encrypt(scratch.buf, 1 + body_len, sealed, key, sealed + BLOCK_HEADER_LEN);
+	stats_time(STAT_ENCRYPT, start);
+	return BLOCK_SLOT_HEADER_LEN + sealed_len;
+}
+
+ssize_t fang_block_open(const FangFS& fs, const uint8_t* key, const uint8_t* block,
+                        size_t len, uint8_t* out, Buffer& scratch) {
+	// Empty virtual files have empty physical files
+	if(len == 0) {
+		return 0;
+	}
+
+	if(!is_compressed(fs)) {
+		if(len < BLOCK_OVERHEAD) {
+			return STATUS_ERROR;
+		}
+
+		// The nonce leads the block; decrypt the remainder.
+		const uint64_t start = stats_clock();
+		const int status = buf_decrypt(block + BLOCK_HEADER_LEN, len - BLOCK_HEADER_LEN,
+		                               block, key, out);
+		stats_time(STAT_DECRYPT, start);
+		return (status == 0)? static_cast<ssize_t>(len - BLOCK_OVERHEAD) : STATUS_TAMPERING;
+	}
+
+	if(len < BLOCK_SLOT_HEADER_LEN) {
+		return STATUS_ERROR;
+	}
+
+	const size_t sealed_len = u32_from_le(u32_from_bytes(block));
+	const size_t plain_len = u32_from_le(u32_from_bytes(block + 4));
+	const size_t payload = fang_block_payload(fs);
+	if(sealed_len < BLOCK_OVERHEAD + 1 || sealed_len > len - BLOCK_SLOT_HEADER_LEN ||
+	   plain_len > payload) {
+		return STATUS_ERROR;
+	}
+
+	const uint8_t* sealed = block + BLOCK_SLOT_HEADER_LEN;
+	const size_t body_len = sealed_len - BLOCK_OVERHEAD;
+	buf_grow(scratch, body_len);
+	uint64_t start = stats_clock();
+	const int status = buf_decrypt(sealed + BLOCK_HEADER_LEN, sealed_len - BLOCK_HEADER_LEN,
+	                               sealed, key, scratch.buf);
+	stats_time(STAT_DECRYPT, start);
+	if(status != 0) {
+		return STATUS_TAMPERING;
+	}
+
+	// The lengths in the header aren't sealed, so they have to agree with
+	// what is.
+	const uint8_t* body = scratch.buf + 1;
+	if(scratch.buf[0] == BLOCK_KIND_RAW) {
+		if(body_len - 1 != plain_len) {
+			return STATUS_TAMPERING;
+		}
+
+		memcpy(out, body, plain_len);
+		return plain_len;
+	} else if(scratch.buf[0] != BLOCK_KIND_COMPRESSED) {
+		return STATUS_ERROR;
+	}
+
+	const Codec* codec = codec_find(fs.metafile.compression);
+	if(codec == nullptr) {
+		return STATUS_ERROR;
+	}
+
+	start = stats_clock();
+	const ssize_t n = codec->decompress(body, body_len - 1, out, payload);
+	stats_time(STAT_DECOMPRESS, start);
+	if(n < 0) {
+		return STATUS_ERROR;
+	} else if(static_cast<size_t>(n) != plain_len) {
+		return STATUS_TAMPERING;
+	}
+
+	return n;
+}
+
+off_t fang_file_size_fd(const FangFS& fs, int fd, off_t physical_size) {
+	if(!is_compressed(fs) || physical_size == 0) {
+		const off_t size = fang_file_plaintext_size(fs, physical_size);
+		if(size < 0) { errno = EIO; }
+		return size;
+	}
+
+	// Every block but the final one is full, and the final one's header
+	// says how much it holds.
+	const off_t block_size = fs.metafile.block_size;
+	for(int attempt = 0;; attempt += 1) {
+		const off_t last = (physical_size - 1) / block_size * block_size;
+		uint8_t header[BLOCK_SLOT_HEADER_LEN];
+		ssize_t n;
+		do {
+			n = pread(fd, header, sizeof(header), last);
+		} while(n < 0 && errno == EINTR);
+		if(n < 0) {
+			return -1;
+		}
+
+		const off_t sealed_len = u32_from_le(u32_from_bytes(header));
+		const size_t plain_len = u32_from_le(u32_from_bytes(header + 4));
+		if(n == static_cast<ssize_t>(sizeof(header)) &&
+		   sealed_len >= static_cast<off_t>(BLOCK_OVERHEAD + 1) &&
+		   last + static_cast<off_t>(BLOCK_SLOT_HEADER_LEN) + sealed_len <= physical_size &&
+		   plain_len <= fang_block_payload(fs)) {
+			return (last / block_size) * fang_block_payload(fs) + plain_len;
+		}
+
+		// The file may have grown or shrunk since physical_size was taken.
+		struct stat info;
+		if(attempt >= 2 || fstat(fd, &info) < 0 || info.st_size == physical_size) {
+			errno = EIO;
+			return -1;
+		}
+		physical_size = info.st_size;
+		if(physical_size == 0) {
+			return 0;
+		}
+	}
+}
+
+off_t fang_file_size_at(const FangFS& fs, int dirfd, const char* name, off_t physical_size) {
+	if(!is_compressed(fs) || physical_size == 0) {
+		return fang_file_size_fd(fs, -1, physical_size);
+	}
+
+	// Non-blocking, in case something other than a file has taken its place.
+	const int fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+	if(fd < 0) {
+		return -1;
+	}
+
+	const off_t size = fang_file_size_fd(fs, fd, physical_size);
+	const int new_errno = errno;
+	close(fd);
+	errno = new_errno;
+	return size;
+}
+
+/// Return the number of the block containing the given plaintext offset.
+static inline uint64_t get_block_number(const FangFile& self, off_t offset) {
+	return offset / fang_block_payload(self.fs);
+}
+
+/// Make sure the logical file size is known. It is only read from the
+/// backing file when no handle knows it, as after an error part way through
+/// a change.
+static int refresh_size(FangFile& self) {
+	if(self.state->size >= 0) {
+		return 0;
+	}
+
+	self.state->tail_block_n = -1;
+	struct stat info;
+	if(fstat(self.fd, &info) < 0) {
 		return -1;
 	}
 
-	const off_t offset = block_n * self.fs.metafile.block_size;
-	const off_t seek_status = fang_file_seek(self, offset, SEEK_SET);
-	if(seek_status == (off_t)-1) {
+	const off_t size = fang_file_size_fd(self.fs, self.fd, info.st_size);
+	if(size < 0) {
 		return -1;
 	}
 
-	const size_t goal_n = self.fs.metafile.block_size + BLOCK_OVERHEAD;
-	Buffer ciphertext;
-	buf_grow(ciphertext, goal_n);
+	self.state->size = size;
+	return 0;
+}
+
+/// Remember the plaintext of block_n if it is the final block of the file.
+static void cache_tail(FangFile& self, uint64_t block_n, const uint8_t* data, size_t len) {
+	if(self.state->size <= 0 || block_n != get_block_number(self, self.state->size - 1)) {
+		return;
+	}
+
+	buf_grow(self.state->tail, fang_block_payload(self.fs));
+	memcpy(self.state->tail.buf, data, len);
+	self.state->tail.len = len;
+	self.state->tail_block_n = block_n;
+}
 
+/// pread() until len bytes have arrived or the file ends. Returns the number
+/// of bytes read, or -1.
+static ssize_t read_full(const FangFile& self, uint8_t* buf, size_t len, off_t offset) {
+	StatScope timer(STAT_BACKING_READ);
 	size_t total_read = 0;
-	uint8_t* cur = ciphertext.buf;
-	while(total_read < goal_n) {
-		const ssize_t n = read(self.fd, cur, goal_n);
+	while(total_read < len) {
+		const ssize_t n = pread(self.fd, buf + total_read, len - total_read,
+		                        offset + total_read);
 		if(n == 0) {
 			break;
 		} else if(n < 0) {
-			fprintf(stderr, "Error03: fd %d\n", self.fd);
+			if(errno == EINTR) { continue; }
 			return -1;
 		}
 
 		total_read += n;
-		cur += n;
+
+		// O_DIRECT reads only come up short at the end of the file, and
+		// couldn't continue from an unaligned offset anyway.
+		if(self.direct) { break; }
 	}
-	ciphertext.len = total_read;
 
-	// Make sure there's enough here to work with
-	if(ciphertext.len < BLOCK_OVERHEAD) {
-		// Empty virtual files have empty physical files
-		if(ciphertext.len == 0) { return 0; }
-		errno = EIO;
+	stats_count(STAT_BACKING_BYTES_READ, total_read);
+	return total_read;
+}
+
+/// pwrite() all len bytes. Returns 0 or -1.
+static int write_full(int fd, const uint8_t* buf, size_t len, off_t offset) {
+	StatScope timer(STAT_BACKING_WRITE);
+	size_t total_written = 0;
+	while(total_written < len) {
+		const ssize_t n = pwrite(fd, buf + total_written, len - total_written,
+		                         offset + total_written);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+
+		total_written += n;
+	}
+
+	stats_count(STAT_BACKING_BYTES_WRITTEN, len);
+	return 0;
+}
+
+int fang_block_write_slots(const FangFS& fs, int fd, const uint8_t* buf, size_t len,
+                           off_t offset) {
+	if(!is_compressed(fs)) {
+		return write_full(fd, buf, len, offset);
+	}
+
+	const size_t block_size = fs.metafile.block_size;
+	for(size_t slot = 0; slot < len; slot += block_size) {
+		const size_t n = std::min(block_size, len - slot);
+		size_t block_len = n;
+		if(n >= BLOCK_SLOT_HEADER_LEN) {
+			block_len = std::min<size_t>(n, BLOCK_SLOT_HEADER_LEN +
+			                                u32_from_le(u32_from_bytes(buf + slot)));
+		}
+
+		if(write_full(fd, buf + slot, block_len, offset + slot) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/// Write a whole block's ciphertext at offset. Under O_DIRECT, a block that
+/// isn't a multiple of the alignment (only ever the short final block) is
+/// written through the page cache instead.
+static int block_write_full(const FangFile& self, const uint8_t* buf, size_t len, off_t offset) {
+	if(!self.direct || len % DIRECT_IO_ALIGN == 0) {
+		return write_full(self.fd, buf, len, offset);
+	}
+
+#ifdef O_DIRECT
+	const int flags = fcntl(self.fd, F_GETFL);
+	if(flags < 0 || fcntl(self.fd, F_SETFL, flags & ~O_DIRECT) < 0) {
 		return -1;
 	}
 
-	// Extract the nonce
-	uint8_t nonce[crypto_secretbox_NONCEBYTES];
-	memcpy(nonce, ciphertext.buf, sizeof(nonce));
+	int status = write_full(self.fd, buf, len, offset);
 
-	// Slide the remainder back over the nonce so it begins the buffer
-	memmove(ciphertext.buf, ciphertext.buf+sizeof(nonce), ciphertext.len-sizeof(nonce));
-	ciphertext.len -= sizeof(nonce);
+	const int new_errno = errno;
+	if(fcntl(self.fd, F_SETFL, flags) < 0 && status == 0) {
+		return -1;
+	}
+	errno = new_errno;
+	return status;
+#else
+	// Handles are never direct without O_DIRECT.
+	return write_full(self.fd, buf, len, offset);
+#endif
+}
 
-	// Decrypt
-	const int status = buf_decrypt(ciphertext, nonce, self.fs.master_key, outbuf);
-	if(status != 0) {
-		// Tampering detected
+/// Make room for len bytes of ciphertext scratch space, aligned for O_DIRECT
+/// if the handle needs it.
+static void grow_ciphertext(FangFile& self, size_t len) {
+	if(self.direct) {
+		buf_grow_aligned(self.ciphertext, len, DIRECT_IO_ALIGN);
+	} else {
+		buf_grow(self.ciphertext, len);
+	}
+}
+
+/// Decrypt the len bytes of ciphertext read from block_n into out, which must
+/// have room for a full block of plaintext.
+static ssize_t block_decrypt(FangFile& self, uint64_t block_n, const uint8_t* ciphertext,
+                             size_t len, uint8_t* out) {
+	const ssize_t n = fang_block_open(self.fs, self.key, ciphertext, len, out, self.packed);
+	if(n == STATUS_TAMPERING) {
+		stats_count(STAT_TAMPERING, 1);
+		FANGFS_PROBE2(block_mac_failure, self.ino, block_n);
+		log_warn("Tampering detected in block %llu",
+		         static_cast<unsigned long long>(block_n));
+	}
+	if(n < 0) {
 		errno = EIO;
-		fprintf(stderr, "Error05\n");
 		return -1;
 	}
 
-	return outbuf.len;
+	stats_count(STAT_BYTES_DECRYPTED, n);
+	return n;
 }
 
-static ssize_t block_write(FangFile& self, uint64_t block_n, const Buffer& inbuf) {
-	if(inbuf.len > (self.fs.metafile.block_size - BLOCK_OVERHEAD)) {
-		errno = EINVAL;
+/// Once the mapping has to grow, grow it at least this much.
+#define MAP_MIN_GROWTH (8 * 1024 * 1024)
+
+/// How many bytes past a sequential read to ask the kernel to read ahead.
+#define MAP_READAHEAD (4 * 1024 * 1024)
+
+/// The jump buffer of the mapped read running on this thread, if any.
+static thread_local sigjmp_buf* map_fault_jump = nullptr;
+static struct sigaction prev_sigbus;
+
+/// Someone shrank a backing file under a mapped read. Abandon the read rather
+/// than dying.
+static void handle_sigbus(int sig, siginfo_t* info, void* context) {
+	if(map_fault_jump != nullptr) {
+		siglongjmp(*map_fault_jump, 1);
+	}
+
+	// Not one of ours: hand it to whatever was there before. Only when that
+	// is the default, which kills the process anyway, is the disposition
+	// changed, so that mapped reads on other threads stay covered.
+	if(prev_sigbus.sa_flags & SA_SIGINFO) {
+		if(prev_sigbus.sa_sigaction != nullptr) {
+			prev_sigbus.sa_sigaction(sig, info, context);
+			return;
+		}
+	} else if(prev_sigbus.sa_handler != SIG_DFL && prev_sigbus.sa_handler != SIG_IGN) {
+		prev_sigbus.sa_handler(sig);
+		return;
+	}
+
+	// A fault can't be ignored, so SIG_IGN gets the default too.
+	signal(SIGBUS, SIG_DFL);
+	raise(SIGBUS);
+}
+
+static void install_sigbus_handler(void) {
+	static std::once_flag once;
+	std::call_once(once, []() {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = handle_sigbus;
+		action.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGBUS, &action, &prev_sigbus);
+	});
+}
+
+/// The length of the backing file holding size bytes of plaintext.
+static off_t physical_size(const FangFS& fs, off_t size) {
+	const off_t payload = fang_block_payload(fs);
+	const off_t remainder = size % payload;
+	return (size / payload) * fs.metafile.block_size + ((remainder > 0)? remainder + BLOCK_OVERHEAD : 0);
+}
+
+static void unmap_file(FangFile& self) {
+	if(self.map == nullptr) { return; }
+	munmap(self.map, self.map_len);
+	self.map = nullptr;
+	self.map_len = 0;
+	self.map_advice = MADV_NORMAL;
+}
+
+/// Make sure the mapping covers the first end bytes of the backing file.
+/// Returns false if the handle can't be mapped.
+static bool map_file(FangFile& self, size_t end) {
+	if(self.map != nullptr && end <= self.map_len) {
+		return true;
+	}
+
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t len = std::max(end, self.map_len + MAP_MIN_GROWTH);
+	len = (len + page - 1) / page * page;
+
+	unmap_file(self);
+	void* map = mmap(nullptr, len, PROT_READ, MAP_SHARED, self.fd, 0);
+	if(map == MAP_FAILED) {
+		return false;
+	}
+
+	install_sigbus_handler();
+	self.map = reinterpret_cast<uint8_t*>(map);
+	self.map_len = len;
+	return true;
+}
+
+/// Tell the kernel how this handle is being read, based on the pattern of
+/// recent requests.
+static void map_advise(FangFile& self, off_t offset, size_t len) {
+	if(self.map == nullptr) { return; }
+
+	const int advice = (self.sequential_reads >= 2)? MADV_SEQUENTIAL :
+	                   (self.sequential_reads == 0)? MADV_RANDOM : MADV_NORMAL;
+	if(advice != self.map_advice) {
+		madvise(self.map, self.map_len, advice);
+		self.map_advice = advice;
+	}
+
+	// Pull in the ciphertext the next few reads will want.
+	if(advice == MADV_SEQUENTIAL) {
+		const size_t page = sysconf(_SC_PAGESIZE);
+		const off_t end = physical_size(self.fs, self.state->size);
+		const off_t start = physical_size(self.fs, offset + len) / page * page;
+		const off_t ahead = std::min<off_t>(start + MAP_READAHEAD, end);
+		if(start < ahead) {
+			madvise(self.map + start, ahead - start, MADV_WILLNEED);
+		}
+	}
+}
+
+/// Decrypt block_n straight out of the mapping. Returns -2 if the block
+/// should be read with pread() instead.
+static ssize_t block_read_mapped(FangFile& self, uint64_t block_n, uint8_t* out) {
+	// Compressed blocks don't fill their slots, so the length of the
+	// plaintext says nothing about where the ciphertext ends.
+	if(self.state->size < 0 || self.direct || is_compressed(self.fs)) { return -2; }
+
+	const size_t block_size = self.fs.metafile.block_size;
+	const off_t end = physical_size(self.fs, self.state->size);
+	const off_t offset = block_n * block_size;
+	if(offset >= end) {
+		return 0;
+	}
+
+	const size_t len = std::min<off_t>(block_size, end - offset);
+	if(!map_file(self, offset + len)) {
+		return -2;
+	}
+
+	sigjmp_buf jump;
+	if(sigsetjmp(jump, 1) != 0) {
+		// The file shrank under us; see what's left of it the slow way.
+		map_fault_jump = nullptr;
+		unmap_file(self);
+		self.state->size = -1;
+		self.state->tail_block_n = -1;
+		return -2;
+	}
+
+	map_fault_jump = &jump;
+	stats_count(STAT_BACKING_BYTES_READ, len);
+	const ssize_t n = block_decrypt(self, block_n, self.map + offset, len, out);
+	map_fault_jump = nullptr;
+	return n;
+}
+
+/// Read and decrypt a block straight into out, which must have room for a
+/// full block of plaintext. Bypasses the tail cache.
+static ssize_t block_read_into(FangFile& self, uint64_t block_n, uint8_t* out) {
+	FANGFS_PROBE2(block_read_entry, self.ino, block_n);
+
+	ssize_t n = -2;
+	if(self.fs.io_engine == FANGFS_IO_MMAP) {
+		n = block_read_mapped(self, block_n, out);
+	}
+
+	if(n == -2) {
+		const size_t block_size = self.fs.metafile.block_size;
+		grow_ciphertext(self, block_size);
+
+		const ssize_t read_n = read_full(self, self.ciphertext.buf, block_size,
+		                                 block_n * block_size);
+		n = (read_n < 0)? -1 : block_decrypt(self, block_n, self.ciphertext.buf, read_n, out);
+	}
+
+	FANGFS_PROBE3(block_read_return, self.ino, block_n, n);
+	return n;
+}
+
+/// The ring to batch this handle's block I/O through, or nullptr to use
+/// plain pread/pwrite.
+static IoRing* get_ring(const FangFile& self) {
+	// Batches assume that every block but the last fills its slot.
+	if(self.fs.io_engine != FANGFS_IO_URING || is_compressed(self.fs)) {
+		return nullptr;
+	}
+
+	return io_ring_thread();
+}
+
+/// Run one operation per block against self.fd through ring. Block i of the
+/// batch lives at data + i * block_size and is len bytes long (or a whole
+/// block, for reads). A read that comes up short is finished with pread(),
+/// since it either hit the end of the file or was interrupted; a write that
+/// comes up short or fails is retried with pwrite(). done is called with the
+/// number of bytes transferred for each block as its completion arrives, or
+/// with -1 and errno set. Returns 0, or -1 with errno set if any block
+/// failed.
+template <typename F>
+static int ring_blocks(FangFile& self, IoRing& ring, bool write, uint64_t first_block_n,
+                       size_t count, uint8_t* data, size_t last_len, F done) {
+	const size_t block_size = self.fs.metafile.block_size;
+	int first_errno = 0;
+	size_t next = 0;
+	size_t in_flight = 0;
+
+	while(next < count || in_flight > 0) {
+		while(next < count) {
+			const size_t len = (write && next == count - 1)? last_len : block_size;
+			if(!io_ring_prep(ring, write, self.fd, data + next * block_size, len,
+			                 (first_block_n + next) * block_size, next)) {
+				break;
+			}
+
+			next += 1;
+			in_flight += 1;
+		}
+
+		const uint64_t start = stats_clock();
+		const int status = io_ring_submit(ring, true);
+		stats_time(write? STAT_BACKING_WRITE : STAT_BACKING_READ, start);
+		if(status < 0 && in_flight == 0) {
+			errno = -status;
+			return -1;
+		}
+
+		uint64_t i;
+		int32_t res;
+		while(io_ring_reap(ring, &i, &res)) {
+			in_flight -= 1;
+
+			uint8_t* block = data + i * block_size;
+			const off_t offset = (first_block_n + i) * block_size;
+			const size_t len = (write && i == count - 1)? last_len : block_size;
+			ssize_t n = res;
+			if(n > 0) {
+				stats_count(write? STAT_BACKING_BYTES_WRITTEN : STAT_BACKING_BYTES_READ, n);
+			}
+
+			if(write) {
+				if(n < 0 || static_cast<size_t>(n) < len) {
+					// O_DIRECT can't resume at an unaligned offset, so
+					// rewrite the whole block.
+					const size_t written = (n < 0 || self.direct)? 0 : n;
+					n = (block_write_full(self, block + written, len - written,
+					                      offset + written) < 0)? -1 : len;
+				}
+			} else if(n < 0 || (static_cast<size_t>(n) < len && !self.direct)) {
+				const size_t have = (n < 0)? 0 : n;
+				n = read_full(self, block + have, len - have, offset + have);
+				if(n >= 0) { n += have; }
+			}
+
+			if(done(i, n) < 0 && first_errno == 0) {
+				first_errno = (errno != 0)? errno : EIO;
+			}
+		}
+	}
+
+	if(first_errno != 0) {
+		errno = first_errno;
 		return -1;
 	}
 
-	const off_t offset = block_n * self.fs.metafile.block_size;
+	return 0;
+}
+
+/// Read and decrypt count whole blocks starting at first_block_n into out
+/// with a single batch of submissions, decrypting each block as it arrives.
+/// Returns the number of plaintext bytes produced, which stops short at the
+/// first partial block.
+static ssize_t block_read_batch(FangFile& self, IoRing& ring, uint64_t first_block_n,
+                                size_t count, uint8_t* out) {
+	FANGFS_PROBE3(block_read_batch_entry, self.ino, first_block_n, count);
+	const size_t block_size = self.fs.metafile.block_size;
+	const size_t payload = fang_block_payload(self.fs);
+	grow_ciphertext(self, count * block_size);
+
+	size_t total = count * payload;
+	const int status = ring_blocks(self, ring, false, first_block_n, count,
+	                               self.ciphertext.buf, block_size,
+	                               [&](uint64_t i, ssize_t n) -> int {
+		if(n < 0) { return -1; }
+
+		const ssize_t plain_n = block_decrypt(self, first_block_n + i,
+		                                      self.ciphertext.buf + i * block_size, n,
+		                                      out + i * payload);
+		if(plain_n < 0) { return -1; }
+		if(static_cast<size_t>(plain_n) < payload) {
+			total = std::min(total, i * payload + plain_n);
+		}
+		return 0;
+	});
+
+	const ssize_t result = (status < 0)? -1 : total;
+	FANGFS_PROBE3(block_read_batch_return, self.ino, first_block_n, result);
+	return result;
+}
+
+static ssize_t block_read(FangFile& self, uint64_t block_n, Buffer& outbuf) {
+	if(static_cast<int64_t>(block_n) == self.state->tail_block_n) {
+		buf_grow(outbuf, self.state->tail.len);
+		memcpy(outbuf.buf, self.state->tail.buf, self.state->tail.len);
+		outbuf.len = self.state->tail.len;
+		return outbuf.len;
+	}
+
+	buf_grow(outbuf, fang_block_payload(self.fs));
+	const ssize_t n = block_read_into(self, block_n, outbuf.buf);
+	outbuf.len = (n < 0)? 0 : n;
+	return n;
+}
 
-	const off_t seek_status = fang_file_seek(self, offset, SEEK_SET);
-	if(seek_status == (off_t)-1) {
+static ssize_t block_write(FangFile& self, uint64_t block_n, const uint8_t* inbuf, size_t len) {
+	if(len > fang_block_payload(self.fs)) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	const size_t goal_n = self.fs.metafile.block_size;
-	Buffer ciphertext;
-	buf_grow(ciphertext, goal_n);
+	FANGFS_PROBE3(block_write_entry, self.ino, block_n, len);
+
+	const size_t block_size = self.fs.metafile.block_size;
+	const off_t offset = block_n * block_size;
+	grow_ciphertext(self, len + BLOCK_PACKED_OVERHEAD);
+
+	const size_t goal_n = fang_block_seal(self.fs, self.key, inbuf, len,
+	                                      self.ciphertext.buf, self.packed);
+	stats_count(STAT_BYTES_ENCRYPTED, len);
+	self.ciphertext.len = goal_n;
+
+	// With an intent log, the block has to be logged before it may
+	// overwrite the old copy in place.
+	Journal* journal = (self.journal_path != nullptr)? self.fs.journal : nullptr;
+	uint64_t lsn = 0;
+	if(journal != nullptr) {
+		const int status = journal_log_block(*journal, self.journal_path, block_n,
+		                                     self.ciphertext.buf, goal_n, &lsn);
+		if(status < 0) {
+			FANGFS_PROBE3(block_write_return, self.ino, block_n, -1);
+			errno = -status;
+			return -1;
+		}
+	}
+
+	const ssize_t result = (block_write_full(self, self.ciphertext.buf, goal_n, offset) < 0)? -1 : goal_n;
+
+	// A compressed block replacing a longer one would leave the old tail
+	// taking up space in the slot. Failing to free it is harmless.
+	const bool replaced = self.state->size < 0 ||
+	                      static_cast<off_t>(block_n * fang_block_payload(self.fs)) < self.state->size;
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if(result >= 0 && is_compressed(self.fs) && replaced && goal_n < block_size) {
+		fallocate(self.fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		          offset + goal_n, block_size - goal_n);
+	}
+#endif
+
+	if(journal != nullptr) {
+		const int new_errno = errno;
+		journal_write_done(*journal);
+		self.journal_lsn = lsn;
+		errno = new_errno;
+	}
 
-	uint8_t nonce[crypto_secretbox_NONCEBYTES];
-	randombytes_buf(nonce, sizeof(nonce));
+	FANGFS_PROBE3(block_write_return, self.ino, block_n, result);
+	return result;
+}
 
-	buf_encrypt(inbuf, nonce, self.fs.master_key, ciphertext);
+/// Encrypt count whole blocks of plaintext from inbuf and write them starting
+/// at first_block_n with a single batch of submissions. Returns 0 or -1.
+static int block_write_batch(FangFile& self, IoRing& ring, uint64_t first_block_n,
+                             size_t count, const uint8_t* inbuf) {
+	FANGFS_PROBE3(block_write_batch_entry, self.ino, first_block_n, count);
+	const size_t block_size = self.fs.metafile.block_size;
+	const size_t payload = fang_block_payload(self.fs);
+	grow_ciphertext(self, count * block_size);
 
-	memmove(ciphertext.buf+BLOCK_HEADER_LEN, ciphertext.buf, ciphertext.len);
-	ciphertext.len += BLOCK_HEADER_LEN;
-	memcpy(ciphertext.buf, nonce, sizeof(nonce));
+	for(size_t i = 0; i < count; i += 1) {
+		uint8_t* block = self.ciphertext.buf + i * block_size;
+		randombytes_buf(block, BLOCK_HEADER_LEN);
+		const uint64_t start = stats_clock();
+		buf_encrypt(inbuf + i * payload, payload, block, self.key,
+		            block + BLOCK_HEADER_LEN);
+		stats_time(STAT_ENCRYPT, start);
+	}
+	stats_count(STAT_BYTES_ENCRYPTED, count * payload);
 
-	size_t total_written = 0;
-	uint8_t* cur = ciphertext.buf;
-	while(total_written < ciphertext.len) {
-		const ssize_t n = write(self.fd, cur, ciphertext.len);
-		if(n < 0) {
+	// Every block has to be logged before any of them may land in place.
+	Journal* journal = (self.journal_path != nullptr)? self.fs.journal : nullptr;
+	uint64_t lsn = 0;
+	if(journal != nullptr) {
+		const int status = journal_log_blocks(*journal, self.journal_path, first_block_n,
+		                                      self.ciphertext.buf, block_size, count, &lsn);
+		if(status < 0) {
+			errno = -status;
+			FANGFS_PROBE3(block_write_batch_return, self.ino, first_block_n, -1);
 			return -1;
 		}
+	}
 
-		total_written += n;
-		cur += n;
+	const int status = ring_blocks(self, ring, true, first_block_n, count, self.ciphertext.buf,
+	                               block_size, [](uint64_t i, ssize_t n) -> int {
+		return (n < 0)? -1 : 0;
+	});
+
+	if(journal != nullptr) {
+		const int new_errno = errno;
+		journal_write_done(*journal);
+		self.journal_lsn = std::max(self.journal_lsn, lsn);
+		errno = new_errno;
 	}
 
-	return total_written;
+	FANGFS_PROBE3(block_write_batch_return, self.ino, first_block_n, status);
+	return status;
 }
 
-int fang_file_read(FangFile& self, off_t offset, size_t len, uint8_t* outbuf) {
-	const uint64_t start_block_n = get_block_number(self, offset);
-	const uint64_t end_block_n = get_block_number(self, offset+len);
+/// Truncate the backing file, logging it first if need be.
+static int backing_truncate(FangFile& self, off_t physical_size) {
+	Journal* journal = (self.journal_path != nullptr)? self.fs.journal : nullptr;
+	uint64_t lsn = 0;
+	if(journal != nullptr) {
+		const int status = journal_log_truncate(*journal, self.journal_path,
+		                                        physical_size, &lsn);
+		if(status < 0) {
+			errno = -status;
+			return -1;
+		}
+	}
 
-	Buffer tmpbuf;
-	size_t outi = 0;
+	const int status = ftruncate(self.fd, physical_size);
+
+	if(journal != nullptr) {
+		const int new_errno = errno;
+		journal_write_done(*journal);
+		self.journal_lsn = lsn;
+		errno = new_errno;
+	}
+
+	return status;
+}
+
+/// Write len bytes at offset, or zeros if buf is nullptr. The caller must hold
+/// the file's lock, and self.state->size must be valid.
+static int write_range(FangFile& self, off_t offset, size_t len, const uint8_t* buf) {
+	const size_t payload = fang_block_payload(self.fs);
+	const off_t old_size = self.state->size;
+	const off_t write_end = offset + len;
+	const off_t new_size = std::max(old_size, write_end);
+
+	// Writing past the end of the file leaves a hole that has to read back as
+	// zeros, so start filling from the old end.
+	const uint64_t start_block_n = get_block_number(self, std::min(offset, old_size));
+	const uint64_t end_block_n = get_block_number(self, write_end - 1);
+
+	buf_grow(self.plaintext, payload);
 	for(uint64_t i = start_block_n; i <= end_block_n; i += 1) {
-		const ssize_t n = block_read(self, i, tmpbuf);
+		const off_t block_start = i * payload;
+		const size_t old_len = std::min<off_t>(std::max<off_t>(old_size - block_start, 0), payload);
+		const size_t new_len = std::min<off_t>(std::max<off_t>(old_len, write_end - block_start), payload);
+
+		// The region of this block covered by the caller's data.
+		const size_t copy_start = std::min<off_t>(std::max<off_t>(offset - block_start, 0), payload);
+		const size_t copy_end = std::min<off_t>(write_end - block_start, payload);
+
+		// A block entirely covered by the caller's data is encrypted straight
+		// out of their buffer.
+		if(buf != nullptr && copy_start == 0 && copy_end == payload) {
+			const uint8_t* src = buf + (block_start - offset);
+
+			// With io_uring, the whole run of such blocks goes out at once.
+			const size_t run = std::min<uint64_t>((write_end - block_start) / payload,
+			                                      end_block_n - i + 1);
+			IoRing* ring = (run > 1)? get_ring(self) : nullptr;
+			if(ring != nullptr) {
+				if(block_write_batch(self, *ring, i, run, src) < 0) {
+					self.state->size = -1;
+					self.state->tail_block_n = -1;
+					return -errno;
+				}
+
+				const uint64_t last = i + run - 1;
+				self.state->size = std::max<off_t>(self.state->size, (last + 1) * payload);
+				cache_tail(self, last, src + (run - 1) * payload, payload);
+				i = last;
+				continue;
+			}
+
+			if(block_write(self, i, src, payload) < 0) {
+				self.state->size = -1;
+				self.state->tail_block_n = -1;
+				return -errno;
+			}
+
+			self.state->size = std::max<off_t>(self.state->size, block_start + payload);
+			cache_tail(self, i, src, payload);
+			continue;
+		}
+
+		// Only read the block in if some of its old contents survive.
+		size_t kept = 0;
+		if(old_len > 0 && (copy_start > 0 || copy_end < old_len)) {
+			stats_count(STAT_RMW_CYCLES, 1);
+			const ssize_t n = block_read(self, i, self.plaintext);
+			if(n < 0) {
+				return -errno;
+			}
+			kept = std::min(static_cast<size_t>(n), new_len);
+		}
+
+		memset(self.plaintext.buf + kept, 0, new_len - kept);
+		if(copy_start < copy_end) {
+			uint8_t* dest = self.plaintext.buf + copy_start;
+			if(buf == nullptr) {
+				memset(dest, 0, copy_end - copy_start);
+			} else {
+				memcpy(dest, buf + (block_start + copy_start - offset), copy_end - copy_start);
+			}
+		}
+
+		if(block_write(self, i, self.plaintext.buf, new_len) < 0) {
+			// We don't know how much of the block made it out.
+			self.state->size = -1;
+			self.state->tail_block_n = -1;
+			return -errno;
+		}
+
+		self.state->size = std::max<off_t>(self.state->size, block_start + new_len);
+		cache_tail(self, i, self.plaintext.buf, new_len);
+	}
+
+	self.state->size = new_size;
+	return 0;
+}
+
+int fang_file_backing_flags(const FangFS& fs, int flags) {
+	// Writing to a block always requires reading it in
+	if((flags & O_ACCMODE) == O_WRONLY) {
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	}
+
+	// Whole blocks can only bypass the page cache if they are aligned, and
+	// compressed blocks never are. Options refuse backing_direct where
+	// there is no O_DIRECT.
+#ifdef O_DIRECT
+	if(fs.backing_direct && fs.metafile.block_size % DIRECT_IO_ALIGN == 0 &&
+	   !is_compressed(fs)) {
+		flags |= O_DIRECT;
+	}
+#endif
+
+	// Block offsets are computed here, so the kernel must not move writes
+	// to the end of the backing file behind our back.
+	return flags & ~O_APPEND;
+}
+
+/// openat(), dropping O_DIRECT if the filesystem doesn't support it.
+static int open_backing(int dirfd, const char* name, int flags, mode_t mode) {
+	const int fd = openat(dirfd, name, flags, mode);
+#ifdef O_DIRECT
+	if(fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+		return openat(dirfd, name, flags & ~O_DIRECT, mode);
+	}
+#endif
+
+	return fd;
+}
+
+int fang_file_open_backing(int dirfd, const char* name, int flags, mode_t mode,
+                           bool* created) {
+	*created = false;
+	if(!(flags & O_CREAT)) {
+		return open_backing(dirfd, name, flags, 0);
+	}
+
+	if(flags & O_EXCL) {
+		const int fd = open_backing(dirfd, name, flags, mode);
+		*created = (fd >= 0);
+		return fd;
+	}
+
+	// Find out whether the file is new, racing against anyone else creating
+	// or removing it.
+	while(1) {
+		int fd = open_backing(dirfd, name, flags | O_EXCL, mode);
+		if(fd >= 0) {
+			*created = true;
+			return fd;
+		} else if(errno != EEXIST) {
+			return -1;
+		}
+
+		fd = open_backing(dirfd, name, flags & ~O_CREAT, 0);
+		if(fd >= 0 || errno != ENOENT) {
+			return fd;
+		}
+	}
+}
+
+FangFile* fang_file_open(FangFS& fs, int fd, const char* real_path) {
+	struct stat info;
+	if(fstat(fd, &info) < 0) {
+		return nullptr;
+	}
+
+	FangFile* self = new FangFile(fs, fd, state_acquire(fs, info), real_path);
+
+#ifdef O_DIRECT
+	const int flags = fcntl(fd, F_GETFL);
+	self->direct = (flags >= 0 && (flags & O_DIRECT));
+#endif
+
+	int status;
+	{
+		std::lock_guard<std::mutex> guard(self->state->lock);
+		status = refresh_size(*self);
+	}
+	if(status < 0) {
+		const int new_errno = errno;
+		self->fd = -1;
+		delete self;
+		errno = new_errno;
+		return nullptr;
+	}
+
+	return self;
+}
+
+FangFile* fang_file_open_resident(FangFS& fs, Buffer& contents, const char* real_path) {
+	// Nothing else can change a packed file while it is read, so its state
+	// is its own.
+	FangFileState* state = new FangFileState;
+	state->refs = 1;
+	FangFile* self = new FangFile(fs, -1, state, real_path);
+	self->resident = true;
+	std::swap(self->contents.buf, contents.buf);
+	std::swap(self->contents.buf_len, contents.buf_len);
+	std::swap(self->contents.len, contents.len);
+	std::swap(self->contents.secure, contents.secure);
+	self->state->size = self->contents.len;
+	memory_charge(MEM_RESIDENT_FILES, heap_len(self->contents));
+	return self;
+}
+
+size_t fang_file_shrink(void* arg, size_t goal) {
+	size_t freed = 0;
+	std::lock_guard<std::mutex> guard(open_files_lock);
+	for(FangFile* file: open_files) {
+		if(freed >= goal) { break; }
+
+		// Handles in use will have their buffers put straight back.
+		std::unique_lock<std::mutex> busy(file->state->lock, std::try_to_lock);
+		if(!busy.owns_lock()) { continue; }
+
+		const size_t before = file->charged + file->state->charged;
+		file->state->tail_block_n = -1;
+		buf_free(file->state->tail);
+		buf_free(file->ciphertext);
+		buf_free(file->plaintext);
+		buf_free(file->packed);
+		account(*file);
+		freed += before - file->charged - file->state->charged;
+	}
+
+	return freed;
+}
+
+int fang_file_close(FangFile* self) {
+	int status = 0;
+	if(self->fd >= 0 && close(self->fd) < 0) {
+		status = -errno;
+	}
+
+	self->fd = -1;
+	delete self;
+	return status;
+}
+
+/// Read up to len bytes at offset. The caller must hold the file's lock.
+static int read_range(FangFile& self, off_t offset, size_t len, uint8_t* outbuf) {
+	if(refresh_size(self) < 0) {
+		return -errno;
+	}
+
+	if(offset == self.last_read_end) {
+		self.sequential_reads += 1;
+	} else {
+		self.sequential_reads = 0;
+	}
+
+	if(offset >= self.state->size) {
+		self.last_read_end = offset;
+		return 0;
+	}
+	len = std::min<off_t>(len, self.state->size - offset);
+	self.last_read_end = offset + len;
+
+	if(self.fs.io_engine == FANGFS_IO_MMAP) {
+		map_advise(self, offset, len);
+	}
+
+	const size_t payload = fang_block_payload(self.fs);
+	size_t outi = 0;
+	while(outi < len) {
+		const off_t cur = offset + outi;
+		const uint64_t block_n = get_block_number(self, cur);
+		const size_t block_offset = cur % payload;
+
+		// With io_uring, a run of whole blocks is read in one batch.
+		const size_t run = (block_offset == 0)? (len - outi) / payload : 0;
+		IoRing* ring = (run > 1)? get_ring(self) : nullptr;
+		if(ring != nullptr) {
+			const ssize_t n = block_read_batch(self, *ring, block_n, run, outbuf + outi);
+			if(n < 0) {
+				return -errno;
+			}
+
+			if(n > 0) {
+				const uint64_t last = block_n + (n - 1) / payload;
+				cache_tail(self, last, outbuf + outi + (last - block_n) * payload,
+				           n - (last - block_n) * payload);
+			}
+			outi += n;
+			if(static_cast<size_t>(n) < run * payload) {
+				break;
+			}
+			continue;
+		}
+
+		// Whole blocks are decrypted straight into the caller's buffer.
+		if(block_offset == 0 && len - outi >= payload &&
+		   static_cast<int64_t>(block_n) != self.state->tail_block_n) {
+			const ssize_t n = block_read_into(self, block_n, outbuf + outi);
+			if(n < 0) {
+				return -errno;
+			}
+
+			cache_tail(self, block_n, outbuf + outi, n);
+			outi += n;
+			if(static_cast<size_t>(n) < payload) {
+				break;
+			}
+			continue;
+		}
+
+		const ssize_t n = block_read(self, block_n, self.plaintext);
 		if(n < 0) {
 			return -errno;
 		}
 
-		memcpy(outbuf+outi, tmpbuf.buf, n);
-		outi += n;
+		// The file is shorter than its size claims; stop here.
+		if(static_cast<size_t>(n) <= block_offset) {
+			break;
+		}
+
+		cache_tail(self, block_n, self.plaintext.buf, n);
+
+		const size_t n_copy = std::min(len - outi, n - block_offset);
+		memcpy(outbuf+outi, self.plaintext.buf + block_offset, n_copy);
+		outi += n_copy;
 	}
 
 	return static_cast<int>(outi);
 }
 
+int fang_file_read(FangFile& self, off_t offset, size_t len, uint8_t* outbuf) {
+	FANGFS_PROBE3(file_read_entry, self.ino, offset, len);
+	std::lock_guard<std::mutex> guard(self.state->lock);
+	FileAccounting charge(self);
+
+	int status = 0;
+	if(self.resident) {
+		const size_t n = (offset < self.state->size)? std::min<size_t>(len, self.state->size - offset) : 0;
+		if(n > 0) { memcpy(outbuf, self.contents.buf + offset, n); }
+		status = static_cast<int>(n);
+	} else {
+		status = read_range(self, offset, len, outbuf);
+	}
+	FANGFS_PROBE3(file_read_return, self.ino, offset, status);
+	return status;
+}
+
 int fang_file_write(FangFile& self, off_t offset, size_t len, const uint8_t* buf) {
-	const uint64_t start_block_n = get_block_number(self, offset);
-	const uint64_t end_block_n = get_block_number(self, offset+len);
+	FANGFS_PROBE3(file_write_entry, self.ino, offset, len);
+	std::lock_guard<std::mutex> guard(self.state->lock);
+	FileAccounting charge(self);
 
-	Buffer newblock;
-	buf_grow(newblock, self.fs.metafile.block_size);
+	int status = 0;
+	if(self.resident) {
+		status = -EBADF;
+	} else if(len > 0 && refresh_size(self) < 0) {
+		status = -errno;
+	} else if(len > 0) {
+		status = write_range(self, offset, len, buf);
+	}
 
-	size_t srci = 0;
-	for(uint64_t i = start_block_n; i <= end_block_n; i += 1) {
-		const ssize_t n_read = block_read(self, i, newblock);
-		if(n_read < 0) {
+	if(status == 0) {
+		self.modified = true;
+		status = static_cast<int>(len);
+	}
+
+	FANGFS_PROBE3(file_write_return, self.ino, offset, status);
+	return status;
+}
+
+int fang_file_write_buf(FangFile& self, off_t offset, struct fuse_bufvec* bufv) {
+	const size_t size = fuse_buf_size(bufv);
+
+	// The common case is a single in-memory buffer, which is encrypted
+	// straight out of the FUSE request.
+	if(bufv->count - bufv->idx == 1 && !(bufv->buf[bufv->idx].flags & FUSE_BUF_IS_FD)) {
+		const uint8_t* mem = reinterpret_cast<const uint8_t*>(bufv->buf[bufv->idx].mem);
+		return fang_file_write(self, offset, size, mem + bufv->off);
+	}
+
+	// Spliced or scattered data has to be gathered into memory once, since
+	// it can't be encrypted where it sits.
+	Buffer gathered;
+	buf_make_secure(gathered);
+	buf_grow(gathered, size);
+
+	struct fuse_bufvec dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.count = 1;
+	dest.buf[0].size = size;
+	dest.buf[0].mem = gathered.buf;
+	dest.buf[0].fd = -1;
+
+	const ssize_t n = fuse_buf_copy(&dest, bufv, static_cast<fuse_buf_copy_flags>(0));
+	if(n < 0) {
+		return n;
+	}
+
+	return fang_file_write(self, offset, n, gathered.buf);
+}
+
+ssize_t fang_file_block_read(FangFile& self, uint64_t block_n, Buffer& outbuf) {
+	std::lock_guard<std::mutex> guard(self.state->lock);
+	FileAccounting charge(self);
+	if(self.resident) {
+		errno = EBADF;
+		return -1;
+	}
+	return block_read(self, block_n, outbuf);
+}
+
+ssize_t fang_file_block_write(FangFile& self, uint64_t block_n, const uint8_t* buf,
+                              size_t len) {
+	std::lock_guard<std::mutex> guard(self.state->lock);
+	FileAccounting charge(self);
+	if(self.resident) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// The block may change the length of the file or replace the tail.
+	self.modified = true;
+	self.state->size = -1;
+	self.state->tail_block_n = -1;
+	return block_write(self, block_n, buf, len);
+}
+
+int fang_file_note_created(FangFile& self) {
+	std::lock_guard<std::mutex> guard(self.state->lock);
+
+	// The file changed outside of any handle, so what they know is stale.
+	self.state->size = -1;
+	self.state->tail_block_n = -1;
+
+	if(self.fs.journal == nullptr || self.journal_path == nullptr) {
+		return 0;
+	}
+
+	uint64_t lsn = 0;
+	const int status = journal_log_truncate(*self.fs.journal, self.journal_path, 0, &lsn);
+	if(status < 0) {
+		return status;
+	}
+
+	journal_write_done(*self.fs.journal);
+	self.journal_lsn = lsn;
+	return 0;
+}
+
+int fang_file_sync(FangFile& self, int datasync) {
+	// Packed files are only ever read through a handle.
+	if(self.resident) {
+		return 0;
+	}
+
+	if(self.fs.journal != nullptr && self.journal_path != nullptr) {
+		uint64_t lsn;
+		{
+			std::lock_guard<std::mutex> guard(self.state->lock);
+			lsn = self.journal_lsn;
+		}
+
+		return journal_sync(*self.fs.journal, lsn);
+	}
+
+	const int status = datasync? fdatasync(self.fd) : fsync(self.fd);
+	if(status < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+int fang_file_truncate(FangFile& self, off_t end) {
+	std::lock_guard<std::mutex> guard(self.state->lock);
+	FileAccounting charge(self);
+	if(self.resident) {
+		return -EBADF;
+	}
+	self.modified = true;
+
+	if(refresh_size(self) < 0) {
+		return -errno;
+	}
+
+	if(end == self.state->size) {
+		return 0;
+	} else if(end > self.state->size) {
+		return write_range(self, self.state->size, end - self.state->size, nullptr);
+	}
+
+	// Shrinking. If the new end falls inside a block, that block has to be
+	// re-encrypted at its new length.
+	const uint64_t block_n = get_block_number(self, end);
+	const size_t block_offset = end % fang_block_payload(self.fs);
+	if(block_offset > 0) {
+		if(block_read(self, block_n, self.plaintext) < 0) {
 			return -errno;
 		}
+	}
 
-		const size_t delta = (offset / self.fs.metafile.block_size) *
-		                     self.fs.metafile.block_size;
-		const size_t outi = offset - delta;
-		const size_t n = std::min(len, (self.fs.metafile.block_size - delta));
+	self.state->size = -1;
+	self.state->tail_block_n = -1;
 
-		memcpy(newblock.buf+outi, buf+srci, n);
-		newblock.len = n;
-		srci += n;
+	if(backing_truncate(self, block_n * self.fs.metafile.block_size) < 0) {
+		return -errno;
+	}
 
-		const int status = block_write(self, i, newblock);
-		if(status < 0) {
+	if(block_offset > 0) {
+		if(block_write(self, block_n, self.plaintext.buf, block_offset) < 0) {
 			return -errno;
 		}
 	}
 
-	return srci;
-}
+	self.state->size = end;
+	if(block_offset > 0) {
+		cache_tail(self, block_n, self.plaintext.buf, block_offset);
+	}
 
-off_t fang_file_seek(FangFile& self, off_t offset, int whence) {
-	return lseek(self.fd, translate_offset(self, offset), whence);
+	return 0;
 }
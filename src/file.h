@@ -1,17 +1,241 @@
 #pragma once
 
+#include <sys/types.h>
+#include <mutex>
 #include <sodium.h>
 #include "fangfs.h"
+#include "codec.h"
+#include "Buffer.h"
 
 #define BLOCK_HEADER_LEN (crypto_secretbox_NONCEBYTES)
 #define BLOCK_OVERHEAD (BLOCK_HEADER_LEN + crypto_secretbox_MACBYTES)
 
+/// On compressed filesystems, every block starts with the length of the
+/// sealed data that follows and the length of its plaintext, as
+/// little-endian uint32s, and the sealed data with one of the BLOCK_KIND_*
+/// bytes. Blocks still start on block_size boundaries, so the rest of each
+/// block's slot is left as a hole.
+#define BLOCK_SLOT_HEADER_LEN 8
+#define BLOCK_PACKED_OVERHEAD (BLOCK_SLOT_HEADER_LEN + BLOCK_OVERHEAD + 1)
+#define BLOCK_KIND_RAW 0
+#define BLOCK_KIND_COMPRESSED 1
+
+/// The smallest block size that compressed filesystems are created with.
+/// Space is only given back a whole filesystem block at a time, so a block
+/// has to span several of them for compression to save anything.
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+
+/// A block is only stored compressed if that saves at least 1/this of it;
+/// otherwise the work of decompressing it isn't worth it.
+#define COMPRESS_MIN_SAVING 8
+
+/// Memory, offset, and length alignment used for O_DIRECT backing I/O.
+#define DIRECT_IO_ALIGN 4096
+
+/// The logical size and decrypted tail block of one backing file, shared by
+/// every handle open on it, so that what one handle writes or truncates the
+/// others see at once, without going back to the backing file. While
+/// mounted, every change to a backing file is made through a handle, so
+/// these stay right; changes made behind the filesystem's back are not
+/// noticed.
+struct FangFileState {
+	FangFileState(): dev(0), ino(0), refs(0), size(-1), tail_block_n(-1), charged(0) {
+		buf_make_secure(tail);
+	}
+
+	/// The backing file, which identifies the state among those of its
+	/// filesystem. Both are 0 for a packed file's private state.
+	dev_t dev;
+	ino_t ino;
+
+	/// The handles sharing this state.
+	size_t refs;
+
+	/// Serializes requests against the file, through any of its handles,
+	/// along with those handles' own caches.
+	std::mutex lock;
+
+	/// Cached logical (plaintext) file size, or -1 if it must be re-read.
+	off_t size;
+
+	/// Decrypted copy of the final block of the file, valid if
+	/// tail_block_n >= 0.
+	int64_t tail_block_n;
+	Buffer tail;
+
+	/// The bytes of tail charged to MEM_FILE_BUFFERS.
+	size_t charged;
+
+private:
+	FangFileState(const FangFileState&);
+	FangFileState& operator=(const FangFileState&);
+};
+
+/// Per-open state for a file. A pointer to one of these lives in fi->fh from
+/// open/create until release, so that scratch buffers and access history
+/// survive between requests.
 struct FangFile {
-	FangFile(FangFS& fang, int file): fs(fang), fd(file) {}
+	FangFile(FangFS& fang, int file, FangFileState* shared, const char* path=nullptr);
+	~FangFile();
+
 	FangFS& fs;
+
+	/// The key the blocks are under: the master key, unless a key rotation
+	/// hasn't reached the file yet.
+	const uint8_t* key;
+
+	/// The backing ciphertext file descriptor. Owned by this handle.
 	int fd;
+
+	/// The backing file's inode number, which identifies it in probes.
+	ino_t ino;
+
+	/// Whether fd was opened with O_DIRECT. Block I/O then goes through
+	/// aligned scratch buffers, and the one unaligned write, a short final
+	/// block, briefly switches O_DIRECT off.
+	bool direct;
+
+	/// The resolved ciphertext path, or nullptr if unknown.
+	char* real_path;
+
+	/// real_path relative to the source, as recorded in the intent log.
+	const char* journal_path;
+
+	/// Intent log position covering every block this handle has written.
+	uint64_t journal_lsn;
+
+	/// The size and tail shared with every other handle on the file. Its
+	/// lock is held for every request.
+	FangFileState* state;
+
+	/// Access-pattern history: where the previous read ended, and how many
+	/// consecutive reads have picked up exactly where the last one left off.
+	off_t last_read_end;
+	uint32_t sequential_reads;
+
+	/// Read-only mapping of the backing file, for FANGFS_IO_MMAP. It is
+	/// grown as the file grows, and may extend past the end of the file.
+	uint8_t* map;
+	size_t map_len;
+
+	/// The madvise() pattern last applied to map.
+	int map_advice;
+
+	/// For a packed file opened read-only, its whole contents, which the
+	/// handle reads from in place of a backing descriptor; fd is then -1.
+	bool resident;
+	Buffer contents;
+
+	/// Whether anything has been written or truncated through this handle.
+	bool modified;
+
+	/// Scratch buffers reused across requests. packed holds a block's
+	/// compressed plaintext on its way into or out of ciphertext.
+	Buffer ciphertext;
+	Buffer plaintext;
+	Buffer packed;
+
+	/// The bytes of the scratch buffers charged to MEM_FILE_BUFFERS, as of
+	/// the end of the last request.
+	size_t charged;
+
+private:
+	FangFile(const FangFile&);
+	FangFile& operator=(const FangFile&);
 };
 
+/// The number of plaintext bytes stored in each block.
+static inline size_t fang_block_payload(const FangFS& fs) {
+	const size_t overhead = (fs.metafile.compression != CODEC_NONE)?
+	                        BLOCK_PACKED_OVERHEAD : BLOCK_OVERHEAD;
+	return fs.metafile.block_size - overhead;
+}
+
+/// Seal len bytes of plaintext, at most one block's payload, into out as a
+/// block under key, compressing it first if the filesystem is compressed.
+/// out needs room for a whole block, and scratch is used along the way.
+/// Returns the length of the block.
+size_t fang_block_seal(const FangFS& fs, const uint8_t* key, const uint8_t* plaintext,
+                       size_t len, uint8_t* out, Buffer& scratch);
+
+/// Open the block at the start of the len bytes read from its slot, which
+/// may run on past the end of the block, into out, which needs room for a
+/// whole block's payload. Returns the plaintext length, STATUS_ERROR if the
+/// block is malformed, or STATUS_TAMPERING if it fails authentication.
+ssize_t fang_block_open(const FangFS& fs, const uint8_t* key, const uint8_t* block,
+                        size_t len, uint8_t* out, Buffer& scratch);
+
+/// Write len bytes of consecutive slots, each holding a block laid out by
+/// fang_block_seal(), from buf to fd at offset. On compressed filesystems,
+/// only the blocks themselves are written, so that the rest of each slot
+/// stays a hole. Returns 0 or -1.
+int fang_block_write_slots(const FangFS& fs, int fd, const uint8_t* buf, size_t len,
+                           off_t offset);
+
+/// Compute the plaintext length of a backing file from its ciphertext
+/// length, on a filesystem without compression. Returns -1 if the length is
+/// impossible for a well-formed file.
+off_t fang_file_plaintext_size(const FangFS& fs, off_t physical_size);
+
+/// The plaintext length of the backing file open as fd, physical_size bytes
+/// long. Compressed filesystems have to read the header of its final block
+/// to know. Returns -1 with errno set, to EIO if the length is impossible.
+off_t fang_file_size_fd(const FangFS& fs, int fd, off_t physical_size);
+
+/// As fang_file_size_fd(), for the backing file name relative to dirfd,
+/// which is only opened if need be.
+off_t fang_file_size_at(const FangFS& fs, int dirfd, const char* name, off_t physical_size);
+
+/// Adjust open(2) flags requested for a plaintext file into the flags its
+/// backing file must be opened with.
+int fang_file_backing_flags(const FangFS& fs, int flags);
+
+/// Open the backing file name relative to dirfd. When flags include O_CREAT,
+/// *created reports whether this call is the one that created it. If the
+/// source filesystem refuses O_DIRECT, the file is opened without it.
+int fang_file_open_backing(int dirfd, const char* name, int flags, mode_t mode,
+                           bool* created);
+
+/// Open a new handle around an already-open backing descriptor. On failure,
+/// the descriptor is left open and nullptr is returned with errno set.
+FangFile* fang_file_open(FangFS& fs, int fd, const char* real_path);
+
+/// Open a new handle on the packed file at real_path, whose contents are
+/// taken from contents. It can be read, but not written.
+FangFile* fang_file_open_resident(FangFS& fs, Buffer& contents, const char* real_path);
+
+/// A MemoryShrinker for MEM_FILE_BUFFERS: frees the tail and scratch buffers
+/// of open handles that no request is using, until goal bytes are given
+/// back. They are set up again by the next request.
+size_t fang_file_shrink(void* arg, size_t goal);
+
+/// Close the backing descriptor and free the handle.
+int fang_file_close(FangFile* self);
+
 int fang_file_read(FangFile& self, off_t offset, size_t len, uint8_t* outbuf);
 int fang_file_write(FangFile& self, off_t offset, size_t len, const uint8_t* buf);
-off_t fang_file_seek(FangFile& self, off_t offset, int whence);
+int fang_file_truncate(FangFile& self, off_t end);
+
+/// Record that the backing file was just created or truncated to nothing
+/// outside of the handle, so that stale intent log records for an earlier file
+/// at the same path are not replayed into it, and so that the handles on it
+/// read its size again.
+int fang_file_note_created(FangFile& self);
+
+/// Read and decrypt the single block block_n into outbuf, returning its
+/// plaintext length or -1. Normal callers want fang_file_read(); this is the
+/// unit that it is built from, exposed for benchmarks.
+ssize_t fang_file_block_read(FangFile& self, uint64_t block_n, Buffer& outbuf);
+
+/// Encrypt len bytes, at most one block's payload, and write them as block
+/// block_n. The caller is responsible for only writing a short block at the
+/// end of the file. Returns the number of ciphertext bytes written, or -1.
+ssize_t fang_file_block_write(FangFile& self, uint64_t block_n, const uint8_t* buf,
+                              size_t len);
+
+/// Make everything written through this handle durable.
+int fang_file_sync(FangFile& self, int datasync);
+
+/// Write the contents of a FUSE buffer vector at offset, without staging
+/// in-memory buffers through an extra copy.
+int fang_file_write_buf(FangFile& self, off_t offset, struct fuse_bufvec* bufv);
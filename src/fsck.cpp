@@ -0,0 +1,138 @@
+// Check an unmounted filesystem for tampering and corruption: every name is
+// decrypted and checked against the directory it's in, and every block's MAC
+// is verified. Problems are printed to stdout, one per line, tab-separated.
+#include "fangfs.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include "check.h"
+#include "journal.h"
+#include "log.h"
+#include "options.h"
+#include "util.h"
+#include "error.h"
+
+/// Exit statuses, as for fsck(8).
+#define FSCK_CLEAN 0
+#define FSCK_PROBLEMS 4
+#define FSCK_FAILED 8
+
+static FangFS fangfs;
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-c checkpoint] [-q] <source> [-o options]\n"
+	                "  -j  Worker threads; defaults to one per CPU\n"
+	                "  -c  Record progress in checkpoint, and skip what an earlier,\n"
+	                "      interrupted run with the same checkpoint already checked\n"
+	                "  -q  Don't report progress\n"
+	                "The passphrase for source is read from stdin. The filesystem must\n"
+	                "not be mounted.\n", name);
+}
+
+static void print_problem(const CheckProblem& problem) {
+	printf("%s\t%s\t%s\t%llu\n", check_problem_name(problem.kind), problem.cipher_path,
+	       (problem.plain_path != nullptr)? problem.plain_path : "-",
+	       static_cast<unsigned long long>(problem.detail));
+}
+
+static void print_progress(const CheckStats& stats) {
+	fprintf(stderr, "%llu dirs, %llu files (%llu skipped), %.1f MiB checked, %llu problems\n",
+	        static_cast<unsigned long long>(stats.dirs),
+	        static_cast<unsigned long long>(stats.files),
+	        static_cast<unsigned long long>(stats.files_skipped),
+	        stats.bytes / (1024.0 * 1024.0),
+	        static_cast<unsigned long long>(stats.problems));
+}
+
+int main(int argc, char** argv) {
+	CheckOptions options;
+	bool quiet = false;
+	int c;
+	while((c = getopt(argc, argv, "+j:c:qh")) != -1) {
+		switch(c) {
+		case 'j':
+			options.threads = atoi(optarg);
+			break;
+		case 'c':
+			options.checkpoint_path = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+			return FSCK_FAILED;
+		}
+	}
+
+	if(argc - optind < 1) {
+		usage(argv[0]);
+		return FSCK_FAILED;
+	}
+
+	const char* source_dir = argv[optind];
+
+	// Whatever is left are "-o" options, as for a mount.
+	argv[optind] = argv[0];
+	struct fuse_args args = FUSE_ARGS_INIT(argc - optind, argv + optind);
+	if(fangfs_parse_options(fangfs, &args) < 0) {
+		return FSCK_FAILED;
+	}
+	if(args.argc > 1) {
+		log_error("Unknown argument: %s", args.argv[1]);
+		return FSCK_FAILED;
+	}
+	fuse_opt_free_args(&args);
+
+	options.on_problem = print_problem;
+	if(!quiet) {
+		options.on_progress = print_progress;
+		options.progress_seconds = 5;
+	}
+
+	CheckStats stats;
+	try {
+		int status = fangfs_fsopen(fangfs, source_dir);
+		if(status < 0) {
+			if(status == STATUS_CHECK_ERRNO) {
+				log_error("Initialization error: %d. %s", status, strerror(errno));
+			} else {
+				log_error("Initialization error: %d.", status);
+			}
+			return FSCK_FAILED;
+		}
+
+		// Writes the intent log hasn't replayed yet can leave blocks that
+		// don't authenticate until the next mount recovers them.
+		Buffer journal_path;
+		path_join(source_dir, JOURNAL_NAME, journal_path);
+		struct stat info;
+		if(stat(reinterpret_cast<char*>(journal_path.buf), &info) == 0 && info.st_size > 0) {
+			log_warn("The intent log has not been replayed; mount and unmount "
+			         "first, or expect spurious corrupt blocks");
+		}
+
+		status = check_run(fangfs, options, stats);
+		if(status < 0) {
+			log_error("Check failed: %s", strerror(errno));
+			fangfs_fsclose(fangfs);
+			return FSCK_FAILED;
+		}
+	} catch (std::runtime_error& e) {
+		log_error("Panic: %s", e.what());
+		fangfs_fsclose(fangfs);
+		return FSCK_FAILED;
+	}
+
+	fangfs_fsclose(fangfs);
+	fflush(stdout);
+
+	if(!quiet) { print_progress(stats); }
+	return (stats.problems > 0)? FSCK_PROBLEMS : FSCK_CLEAN;
+}
@@ -0,0 +1,481 @@
+#include "importer.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BufferEncryption.h"
+#include "file.h"
+#include "log.h"
+#include "util.h"
+#include "workqueue.h"
+#include "error.h"
+
+/// Plaintext read and encrypted at a time, rounded down to whole blocks.
+#define IMPORT_CHUNK_BYTES (1024 * 1024)
+
+/// Chunks in flight per encryption thread. This, times the chunk size and
+/// the thread count, bounds memory whatever the size of the tree.
+#define IMPORT_CHUNKS_PER_THREAD 2
+
+/// Files found by the walk that may wait for the reader.
+#define IMPORT_FILE_BACKLOG 4096
+
+/// A directory to list, and where its entries go.
+struct ImportDir {
+	std::string from;
+	std::string plain_path;
+	std::string cipher_path;
+};
+
+/// A regular file found by the walk.
+struct ImportJob {
+	std::string from;
+	std::string cipher_path;
+	mode_t mode;
+	struct timespec times[2];
+};
+
+/// A file being written, shared by its chunks in flight. Whoever drops the
+/// last reference finishes it.
+struct ImportFile {
+	std::string from;
+	std::string cipher_path;
+	int fd;
+	struct timespec times[2];
+	std::atomic<unsigned> refs;
+	std::atomic<bool> failed;
+};
+
+struct ImportChunk {
+	ImportChunk(): file(nullptr), first_block(0), len(0), cipher_len(0) {}
+
+	ImportFile* file;
+	uint64_t first_block;
+
+	/// Plaintext bytes in plaintext, and ciphertext bytes in ciphertext.
+	size_t len;
+	size_t cipher_len;
+	Buffer plaintext;
+	Buffer ciphertext;
+};
+
+struct ImportState {
+	ImportState(FangFS& fang, const ImportOptions& opts):
+		fs(fang), options(opts), busy(0), walk_done(false),
+		files(IMPORT_FILE_BACKLOG), done(false) {}
+
+	FangFS& fs;
+	const ImportOptions& options;
+	size_t chunk_bytes;
+
+	/// Directories waiting to be listed, and how many walkers are busy.
+	std::mutex walk_lock;
+	std::condition_variable walk_cond;
+	std::vector<ImportDir> dirs;
+	unsigned busy;
+	bool walk_done;
+
+	/// walk -> reader -> encryptors -> writer, and back to the reader.
+	WorkQueue<ImportJob> files;
+	WorkQueue<ImportChunk*> free_chunks;
+	WorkQueue<ImportChunk*> to_encrypt;
+	WorkQueue<ImportChunk*> to_write;
+	std::atomic<unsigned> encryptors_left;
+
+	std::atomic<uint64_t> n_dirs;
+	std::atomic<uint64_t> n_files;
+	std::atomic<uint64_t> n_skipped;
+	std::atomic<uint64_t> n_bytes;
+	std::atomic<uint64_t> n_errors;
+	std::mutex error_lock;
+
+	/// Set by the writer once everything has been written.
+	std::mutex done_lock;
+	std::condition_variable done_cond;
+	bool done;
+};
+
+static void report(ImportState& state, const std::string& path, int error) {
+	state.n_errors.fetch_add(1);
+	std::lock_guard<std::mutex> guard(state.error_lock);
+	if(state.options.on_error) {
+		state.options.on_error(path.c_str(), error);
+	}
+}
+
+static std::string join(const std::string& a, const char* b) {
+	Buffer joined;
+	path_join(a.c_str(), b, joined);
+	return reinterpret_cast<char*>(joined.buf);
+}
+
+static void import_dir(ImportState& state, const ImportDir& task) {
+	DIR* dir = opendir(task.from.c_str());
+	if(dir == nullptr) {
+		report(state, task.from, errno);
+		return;
+	}
+
+	// Gather the whole directory first, and encrypt its names together.
+	std::vector<std::string> names;
+	while(1) {
+		errno = 0;
+		struct dirent* entry = readdir(dir);
+		if(entry == nullptr) {
+			if(errno != 0) { report(state, task.from, errno); }
+			break;
+		}
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		names.push_back(entry->d_name);
+	}
+
+	Buffer encrypted;
+	for(const std::string& name: names) {
+		const std::string from = join(task.from, name.c_str());
+		struct stat info;
+		if(fstatat(dirfd(dir), name.c_str(), &info, AT_SYMLINK_NOFOLLOW) < 0) {
+			report(state, from, errno);
+			continue;
+		}
+
+		if(!S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode)) {
+			log_warn("Skipping %s: not a regular file or directory", from.c_str());
+			state.n_skipped.fetch_add(1);
+			continue;
+		}
+
+		const std::string plain_path = join(task.plain_path, name.c_str());
+		path_encrypt(state.fs, plain_path.c_str(), encrypted);
+		const std::string cipher_path = join(task.cipher_path,
+		                                     reinterpret_cast<char*>(encrypted.buf));
+
+		if(S_ISREG(info.st_mode)) {
+			ImportJob job;
+			job.from = from;
+			job.cipher_path = cipher_path;
+			job.mode = info.st_mode & 07777;
+			job.times[0] = info.st_atim;
+			job.times[1] = info.st_mtim;
+			workqueue_push(state.files, std::move(job));
+			continue;
+		}
+
+		// Owner write permission is kept so that the children can be
+		// created; the mount would refuse them otherwise.
+		if(mkdir(cipher_path.c_str(), (info.st_mode & 07777) | S_IRWXU) < 0) {
+			const int error = errno;
+			struct stat existing;
+			if(error != EEXIST || stat(cipher_path.c_str(), &existing) < 0 ||
+			   !S_ISDIR(existing.st_mode)) {
+				report(state, from, error);
+				continue;
+			}
+		}
+
+		ImportDir child;
+		child.from = from;
+		child.plain_path = plain_path;
+		child.cipher_path = cipher_path;
+		std::lock_guard<std::mutex> guard(state.walk_lock);
+		state.dirs.push_back(std::move(child));
+		state.walk_cond.notify_one();
+	}
+
+	closedir(dir);
+	state.n_dirs.fetch_add(1);
+}
+
+static void walker(ImportState& state) {
+	std::unique_lock<std::mutex> guard(state.walk_lock);
+	while(1) {
+		while(state.dirs.empty() && !state.walk_done) {
+			state.walk_cond.wait(guard);
+		}
+		if(state.walk_done) { break; }
+
+		ImportDir task = std::move(state.dirs.back());
+		state.dirs.pop_back();
+		state.busy += 1;
+		guard.unlock();
+
+		import_dir(state, task);
+
+		guard.lock();
+		state.busy -= 1;
+		if(state.dirs.empty() && state.busy == 0) {
+			state.walk_done = true;
+			state.walk_cond.notify_all();
+			workqueue_close(state.files);
+		}
+	}
+}
+
+/// Drop a reference to file, and if it was the last, set its times and
+/// close it, or remove it if anything went wrong.
+static void release(ImportState& state, ImportFile* file) {
+	if(file->refs.fetch_sub(1) != 1) { return; }
+
+	if(!file->failed.load() && futimens(file->fd, file->times) < 0) {
+		report(state, file->from, errno);
+		file->failed.store(true);
+	}
+	if(close(file->fd) < 0 && !file->failed.exchange(true)) {
+		report(state, file->from, errno);
+	}
+
+	if(file->failed.load()) {
+		unlink(file->cipher_path.c_str());
+	} else {
+		state.n_files.fetch_add(1);
+	}
+	delete file;
+}
+
+/// Fill buf from fd, stopping early only at the end of the file. Returns the
+/// number of bytes read, or -1.
+static ssize_t read_fill(int fd, uint8_t* buf, size_t len) {
+	size_t got = 0;
+	while(got < len) {
+		const ssize_t n = read(fd, buf + got, len - got);
+		if(n < 0 && errno == EINTR) { continue; }
+		if(n < 0) { return -1; }
+		if(n == 0) { break; }
+		got += n;
+	}
+	return got;
+}
+
+static void import_file(ImportState& state, const ImportJob& job) {
+	const int in_fd = open(job.from.c_str(), O_RDONLY|O_CLOEXEC);
+	if(in_fd < 0) {
+		report(state, job.from, errno);
+		return;
+	}
+
+	const int out_fd = open(job.cipher_path.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, job.mode);
+	if(out_fd < 0) {
+		report(state, job.from, errno);
+		close(in_fd);
+		return;
+	}
+	posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ImportFile* file = new ImportFile;
+	file->from = job.from;
+	file->cipher_path = job.cipher_path;
+	file->fd = out_fd;
+	file->times[0] = job.times[0];
+	file->times[1] = job.times[1];
+	file->refs.store(1);
+	file->failed.store(false);
+
+	const size_t payload = fang_block_payload(state.fs);
+	uint64_t block_n = 0;
+	while(1) {
+		ImportChunk* chunk = nullptr;
+		workqueue_pop(state.free_chunks, chunk);
+
+		const ssize_t n = read_fill(in_fd, chunk->plaintext.buf, state.chunk_bytes);
+		if(n <= 0) {
+			if(n < 0) {
+				report(state, job.from, errno);
+				file->failed.store(true);
+			}
+			workqueue_push(state.free_chunks, chunk);
+			break;
+		}
+
+		chunk->file = file;
+		chunk->first_block = block_n;
+		chunk->len = n;
+		file->refs.fetch_add(1);
+		workqueue_push(state.to_encrypt, chunk);
+
+		block_n += (n + payload - 1) / payload;
+		if(static_cast<size_t>(n) < state.chunk_bytes) { break; }
+	}
+
+	close(in_fd);
+	release(state, file);
+}
+
+static void reader(ImportState& state) {
+	ImportJob job;
+	while(workqueue_pop(state.files, job)) {
+		import_file(state, job);
+	}
+	workqueue_close(state.to_encrypt);
+}
+
+/// Lay out chunk's plaintext as consecutive blocks, exactly as
+/// fang_file_write() would: each sealed by fang_block_seal() at the start of
+/// its slot.
+static void encrypt_chunk(const FangFS& fs, ImportChunk& chunk, Buffer& packed) {
+	const size_t block_size = fs.metafile.block_size;
+	const size_t payload = fang_block_payload(fs);
+
+	size_t cipher_len = 0;
+	for(size_t offset = 0; offset < chunk.len; offset += payload) {
+		const size_t n = std::min(payload, chunk.len - offset);
+		const size_t slot = (offset / payload) * block_size;
+		cipher_len = slot + fang_block_seal(fs, fs.master_key, chunk.plaintext.buf + offset, n,
+		                                    chunk.ciphertext.buf + slot, packed);
+	}
+	chunk.cipher_len = cipher_len;
+}
+
+static void encryptor(ImportState& state) {
+	ImportChunk* chunk = nullptr;
+	Buffer packed;
+	while(workqueue_pop(state.to_encrypt, chunk)) {
+		if(!chunk->file->failed.load()) {
+			encrypt_chunk(state.fs, *chunk, packed);
+		}
+		workqueue_push(state.to_write, chunk);
+	}
+	sodium_memzero(packed.buf, packed.buf_len);
+
+	if(state.encryptors_left.fetch_sub(1) == 1) {
+		workqueue_close(state.to_write);
+	}
+}
+
+static void writer(ImportState& state) {
+	ImportChunk* chunk = nullptr;
+	while(workqueue_pop(state.to_write, chunk)) {
+		ImportFile* file = chunk->file;
+		if(!file->failed.load()) {
+			const off_t offset = chunk->first_block * state.fs.metafile.block_size;
+			if(fang_block_write_slots(state.fs, file->fd, chunk->ciphertext.buf,
+			                          chunk->cipher_len, offset) < 0 &&
+			   !file->failed.exchange(true)) {
+				report(state, file->from, errno);
+			}
+			state.n_bytes.fetch_add(chunk->len, std::memory_order_relaxed);
+		}
+
+		chunk->file = nullptr;
+		workqueue_push(state.free_chunks, chunk);
+		release(state, file);
+	}
+
+	std::lock_guard<std::mutex> guard(state.done_lock);
+	state.done = true;
+	state.done_cond.notify_all();
+}
+
+static void snapshot(const ImportState& state, ImportStats& stats) {
+	stats.dirs = state.n_dirs.load();
+	stats.files = state.n_files.load();
+	stats.skipped = state.n_skipped.load();
+	stats.bytes = state.n_bytes.load();
+	stats.errors = state.n_errors.load();
+}
+
+int import_run(FangFS& fs, const char* from, const char* to, const ImportOptions& options,
+               ImportStats& stats) {
+	Buffer cipher_root;
+	path_resolve(fs, to, cipher_root);
+
+	struct stat info;
+	if(stat(from, &info) < 0) { return STATUS_CHECK_ERRNO; }
+	if(!S_ISDIR(info.st_mode)) {
+		errno = ENOTDIR;
+		return STATUS_CHECK_ERRNO;
+	}
+	if(stat(reinterpret_cast<char*>(cipher_root.buf), &info) < 0) { return STATUS_CHECK_ERRNO; }
+	if(!S_ISDIR(info.st_mode)) {
+		errno = ENOTDIR;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	ImportState state(fs, options);
+	state.n_dirs.store(0);
+	state.n_files.store(0);
+	state.n_skipped.store(0);
+	state.n_bytes.store(0);
+	state.n_errors.store(0);
+
+	const size_t payload = fang_block_payload(fs);
+	const size_t chunk_blocks = std::max<size_t>(IMPORT_CHUNK_BYTES / payload, 1);
+	state.chunk_bytes = chunk_blocks * payload;
+
+	unsigned n_threads = options.threads;
+	if(n_threads == 0) {
+		n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	state.encryptors_left.store(n_threads);
+
+	std::vector<ImportChunk*> chunks;
+	for(unsigned i = 0; i < n_threads * IMPORT_CHUNKS_PER_THREAD; i += 1) {
+		ImportChunk* chunk = new ImportChunk;
+		buf_grow(chunk->plaintext, state.chunk_bytes);
+		buf_grow(chunk->ciphertext, chunk_blocks * fs.metafile.block_size);
+		chunks.push_back(chunk);
+		workqueue_push(state.free_chunks, chunk);
+	}
+
+	ImportDir root;
+	root.from = from;
+	root.plain_path = to;
+	root.cipher_path = reinterpret_cast<char*>(cipher_root.buf);
+	state.dirs.push_back(root);
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 0; i < n_threads; i += 1) {
+		threads.push_back(std::thread(walker, std::ref(state)));
+		threads.push_back(std::thread(encryptor, std::ref(state)));
+	}
+	threads.push_back(std::thread(reader, std::ref(state)));
+	threads.push_back(std::thread(writer, std::ref(state)));
+
+	{
+		std::unique_lock<std::mutex> guard(state.done_lock);
+		const bool report_progress = options.on_progress && options.progress_seconds > 0;
+		const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(options.progress_seconds));
+		auto next_progress = std::chrono::steady_clock::now() + interval;
+		while(!state.done) {
+			if(!report_progress) {
+				state.done_cond.wait(guard);
+				continue;
+			}
+
+			if(state.done_cond.wait_until(guard, next_progress) != std::cv_status::timeout) {
+				continue;
+			}
+			next_progress += interval;
+
+			ImportStats progress;
+			snapshot(state, progress);
+			guard.unlock();
+			options.on_progress(progress);
+			guard.lock();
+		}
+	}
+
+	for(std::thread& thread: threads) {
+		thread.join();
+	}
+
+	for(ImportChunk* chunk: chunks) {
+		sodium_memzero(chunk->plaintext.buf, chunk->plaintext.buf_len);
+		delete chunk;
+	}
+
+	snapshot(state, stats);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include "fangfs.h"
+
+/// Running totals of an import. Skipped entries are those the filesystem
+/// can't hold, such as symlinks and devices.
+struct ImportStats {
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t skipped;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+struct ImportOptions {
+	ImportOptions(): threads(0), progress_seconds(0) {}
+
+	/// Threads for each of the directory walk and block encryption; 0 picks
+	/// one per CPU.
+	unsigned threads;
+
+	/// Called with the plaintext path, on the importing side, and errno of
+	/// every entry that couldn't be imported. Calls are serialized.
+	std::function<void(const char* path, int error)> on_error;
+
+	/// Called every progress_seconds from the calling thread, if set.
+	std::function<void(const ImportStats&)> on_progress;
+	double progress_seconds;
+};
+
+/// Copy the plaintext tree at from into the unlocked filesystem fs, under
+/// the existing plaintext directory to, writing ciphertext straight into the
+/// source. Files and directories keep their permissions, and files their
+/// times; anything else in the tree is skipped. Entries that already exist
+/// are errors, except for directories, which are merged. Returns 0 once the
+/// whole tree has been walked, whatever failed along the way, or
+/// STATUS_CHECK_ERRNO if the import couldn't start.
+int import_run(FangFS& fs, const char* from, const char* to, const ImportOptions& options,
+               ImportStats& stats);
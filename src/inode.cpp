@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "inode.h"
+#include "util.h"
+#include "error.h"
+
+static FangInode* inode_new(fuse_ino_t ino) {
+	FangInode* inode = new FangInode;
+	memset(inode, 0, sizeof(*inode));
+	inode->ino = ino;
+	inode->fd = -1;
+	return inode;
+}
+
+static void inode_delete(FangInode* inode) {
+	if(inode->fd >= 0) { close(inode->fd); }
+	free(inode->path);
+	free(inode->name);
+	delete inode;
+}
+
+int inode_table_init(InodeTable& self, const char* source) {
+	self.next_ino = FUSE_ROOT_ID + 1;
+
+	FangInode* root = inode_new(FUSE_ROOT_ID);
+	root->fd = open(source, O_RDONLY|O_DIRECTORY);
+	if(root->fd < 0) {
+		const int new_errno = errno;
+		inode_delete(root);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	struct stat info;
+	if(fstat(root->fd, &info) < 0) {
+		const int new_errno = errno;
+		inode_delete(root);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	root->path = strdup("/");
+	if(root->path == nullptr) { throw AllocationError(); }
+	root->backing_dev = info.st_dev;
+	root->backing_ino = info.st_ino;
+
+	// The kernel never forgets the root
+	root->nlookup = 1;
+
+	self.root = root;
+	self.inodes[root->ino] = root;
+	self.backing[std::make_pair(info.st_dev, info.st_ino)] = root;
+	return 0;
+}
+
+void inode_table_free(InodeTable& self) {
+	std::lock_guard<std::mutex> guard(self.lock);
+
+	for(auto& entry: self.inodes) {
+		inode_delete(entry.second);
+	}
+
+	self.inodes.clear();
+	self.backing.clear();
+	self.root = nullptr;
+}
+
+FangInode* inode_get(InodeTable& self, fuse_ino_t ino) {
+	std::lock_guard<std::mutex> guard(self.lock);
+
+	auto it = self.inodes.find(ino);
+	if(it == self.inodes.end()) {
+		return nullptr;
+	}
+
+	return it->second;
+}
+
+FangInode* inode_ref_child(InodeTable& self, FangInode& parent,
+                           const char* plain_name, const char* cipher_name,
+                           const struct stat& info) {
+	std::lock_guard<std::mutex> guard(self.lock);
+
+	const std::pair<dev_t, ino_t> key(info.st_dev, info.st_ino);
+	auto it = self.backing.find(key);
+	if(it != self.backing.end()) {
+		it->second->nlookup += 1;
+		return it->second;
+	}
+
+	FangInode* inode = inode_new(self.next_ino);
+	inode->backing_dev = info.st_dev;
+	inode->backing_ino = info.st_ino;
+
+	if(S_ISDIR(info.st_mode)) {
+		inode->fd = openat(parent.fd, cipher_name, O_RDONLY|O_DIRECTORY);
+		if(inode->fd < 0) {
+			const int new_errno = errno;
+			inode_delete(inode);
+			errno = new_errno;
+			return nullptr;
+		}
+	}
+
+	Buffer path_buf;
+	path_join(parent.path, plain_name, path_buf);
+	inode->path = buf_copy_string(path_buf);
+	inode->name = strdup(cipher_name);
+	if(inode->name == nullptr) { throw AllocationError(); }
+
+	inode->parent = &parent;
+	inode->nlookup = 1;
+	parent.n_children += 1;
+
+	self.next_ino += 1;
+	self.inodes[inode->ino] = inode;
+	self.backing[key] = inode;
+	return inode;
+}
+
+void inode_backing_path(const FangInode& inode, const char* source, Buffer& outbuf) {
+	if(inode.parent == nullptr) {
+		buf_load_string(outbuf, source);
+		return;
+	}
+
+	Buffer parent_path;
+	inode_backing_path(*inode.parent, source, parent_path);
+	path_join(reinterpret_cast<char*>(parent_path.buf), inode.name, outbuf);
+}
+
+/// Remove an inode that nothing refers to anymore, releasing its hold on its
+/// parent in turn. The caller must hold the table lock.
+static void inode_release(InodeTable& self, FangInode* inode) {
+	while(inode != nullptr && inode != self.root &&
+	      inode->nlookup == 0 && inode->n_children == 0) {
+		FangInode* parent = inode->parent;
+
+		auto it = self.backing.find(std::make_pair(inode->backing_dev, inode->backing_ino));
+		if(it != self.backing.end() && it->second == inode) {
+			self.backing.erase(it);
+		}
+		self.inodes.erase(inode->ino);
+		inode_delete(inode);
+
+		parent->n_children -= 1;
+		inode = parent;
+	}
+}
+
+void inode_forget(InodeTable& self, fuse_ino_t ino, uint64_t nlookup) {
+	std::lock_guard<std::mutex> guard(self.lock);
+
+	auto it = self.inodes.find(ino);
+	if(it == self.inodes.end()) {
+		return;
+	}
+
+	FangInode* inode = it->second;
+	inode->nlookup -= std::min(inode->nlookup, nlookup);
+	inode_release(self, inode);
+}
+
+void inode_unlink_backing(InodeTable& self, dev_t dev, ino_t ino) {
+	std::lock_guard<std::mutex> guard(self.lock);
+	self.backing.erase(std::make_pair(dev, ino));
+}
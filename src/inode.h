@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include "fangfs.h"
+#include <fuse_lowlevel.h>
+
+/// An inode known to the kernel through the low-level FUSE frontend. Each
+/// one remembers where its ciphertext lives, so that requests carrying an
+/// inode number never need to re-encrypt a whole path.
+struct FangInode {
+	fuse_ino_t ino;
+
+	/// The containing directory, or nullptr for the root.
+	FangInode* parent;
+
+	/// Plaintext path from the mount root. Needed to encrypt the names of
+	/// children, since every name is bound to its full path.
+	char* path;
+
+	/// Ciphertext name within parent, or nullptr for the root.
+	char* name;
+
+	/// For directories, a descriptor onto the ciphertext directory that
+	/// children are resolved against with the *at() calls. -1 otherwise.
+	int fd;
+
+	/// Identity of the backing file, used to hand out stable numbers.
+	dev_t backing_dev;
+	ino_t backing_ino;
+
+	/// Kernel lookup count; the inode is dropped when this and n_children
+	/// both reach zero.
+	uint64_t nlookup;
+	uint64_t n_children;
+};
+
+struct InodeTable {
+	std::mutex lock;
+	fuse_ino_t next_ino;
+	FangInode* root;
+	std::unordered_map<fuse_ino_t, FangInode*> inodes;
+	std::map<std::pair<dev_t, ino_t>, FangInode*> backing;
+};
+
+/// Set up the table with the root inode pointing at source. Returns 0 on
+/// success, or STATUS_CHECK_ERRNO.
+int inode_table_init(InodeTable& self, const char* source);
+
+/// Free every inode, including any the kernel never forgot.
+void inode_table_free(InodeTable& self);
+
+/// Look up an inode by number. Returns nullptr if it isn't known.
+FangInode* inode_get(InodeTable& self, fuse_ino_t ino);
+
+/// Find or create the inode for a child of parent described by info, and
+/// take one lookup reference on it. Returns nullptr with errno set on error.
+FangInode* inode_ref_child(InodeTable& self, FangInode& parent,
+                           const char* plain_name, const char* cipher_name,
+                           const struct stat& info);
+
+/// Build the full ciphertext path of inode's backing file under source.
+void inode_backing_path(const FangInode& inode, const char* source, Buffer& outbuf);
+
+/// Drop nlookup references, freeing the inode if nothing else holds it.
+void inode_forget(InodeTable& self, fuse_ino_t ino, uint64_t nlookup);
+
+/// Forget the backing identity of an inode whose file is being removed, so
+/// that a new file reusing the backing inode number gets a fresh inode.
+void inode_unlink_backing(InodeTable& self, dev_t dev, ino_t ino);
@@ -0,0 +1,218 @@
+#include "ioring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include "log.h"
+#include "error.h"
+
+/// How many operations a per-thread ring keeps in flight at once.
+#define IO_RING_THREAD_ENTRIES 64
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_ring_init(IoRing& self, unsigned entries) {
+	memset(&self, 0, sizeof(self));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	self.fd = sys_io_uring_setup(entries, &params);
+	if(self.fd < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+	self.entries = params.sq_entries;
+
+	self.sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	self.cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		self.sq_map_len = self.cq_map_len = std::max(self.sq_map_len, self.cq_map_len);
+	}
+
+	self.sq_map = mmap(nullptr, self.sq_map_len, PROT_READ|PROT_WRITE,
+	                   MAP_SHARED|MAP_POPULATE, self.fd, IORING_OFF_SQ_RING);
+	if(self.sq_map == MAP_FAILED) {
+		self.sq_map = nullptr;
+		goto fail;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		self.cq_map = self.sq_map;
+	} else {
+		self.cq_map = mmap(nullptr, self.cq_map_len, PROT_READ|PROT_WRITE,
+		                   MAP_SHARED|MAP_POPULATE, self.fd, IORING_OFF_CQ_RING);
+		if(self.cq_map == MAP_FAILED) {
+			self.cq_map = nullptr;
+			goto fail;
+		}
+	}
+
+	self.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	self.sqes = mmap(nullptr, self.sqes_len, PROT_READ|PROT_WRITE,
+	                 MAP_SHARED|MAP_POPULATE, self.fd, IORING_OFF_SQES);
+	if(self.sqes == MAP_FAILED) {
+		self.sqes = nullptr;
+		goto fail;
+	}
+
+	{
+		uint8_t* sq = reinterpret_cast<uint8_t*>(self.sq_map);
+		uint8_t* cq = reinterpret_cast<uint8_t*>(self.cq_map);
+		self.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		self.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		self.sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		self.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		self.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		self.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		self.cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		self.cqes = cq + params.cq_off.cqes;
+		self.sqe_tail = *self.sq_tail;
+	}
+
+	return 0;
+
+fail:
+	const int new_errno = errno;
+	io_ring_free(self);
+	errno = new_errno;
+	return STATUS_CHECK_ERRNO;
+}
+
+void io_ring_free(IoRing& self) {
+	if(self.sqes != nullptr) { munmap(self.sqes, self.sqes_len); }
+	if(self.cq_map != nullptr && self.cq_map != self.sq_map) {
+		munmap(self.cq_map, self.cq_map_len);
+	}
+	if(self.sq_map != nullptr) { munmap(self.sq_map, self.sq_map_len); }
+	if(self.fd >= 0) { close(self.fd); }
+	memset(&self, 0, sizeof(self));
+	self.fd = -1;
+}
+
+bool io_ring_prep(IoRing& self, bool write, int fd, void* buf, size_t len,
+                  off_t offset, uint64_t tag) {
+	const unsigned head = __atomic_load_n(self.sq_head, __ATOMIC_ACQUIRE);
+	const unsigned tail = self.sqe_tail;
+	if(tail - head >= self.entries) {
+		return false;
+	}
+
+	const unsigned index = tail & *self.sq_mask;
+	struct io_uring_sqe* sqe = reinterpret_cast<struct io_uring_sqe*>(self.sqes) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(buf);
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	self.sq_array[index] = index;
+
+	self.sqe_tail += 1;
+	self.n_queued += 1;
+	return true;
+}
+
+int io_ring_submit(IoRing& self, bool wait) {
+	// Publish the new entries before the kernel can see the tail move.
+	__atomic_store_n(self.sq_tail, self.sqe_tail, __ATOMIC_RELEASE);
+
+	while(1) {
+		const int n = sys_io_uring_enter(self.fd, self.n_queued, wait? 1 : 0,
+		                                 wait? IORING_ENTER_GETEVENTS : 0);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -errno;
+		}
+
+		self.n_queued -= std::min<unsigned>(n, self.n_queued);
+		if(self.n_queued == 0 || wait) { return 0; }
+	}
+}
+
+bool io_ring_reap(IoRing& self, uint64_t* tag, int32_t* res) {
+	const unsigned head = *self.cq_head;
+	if(head == __atomic_load_n(self.cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	const struct io_uring_cqe* cqe =
+		reinterpret_cast<const struct io_uring_cqe*>(self.cqes) + (head & *self.cq_mask);
+	*tag = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(self.cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#else
+
+int io_ring_init(IoRing& self, unsigned entries) {
+	memset(&self, 0, sizeof(self));
+	self.fd = -1;
+	errno = ENOSYS;
+	return STATUS_CHECK_ERRNO;
+}
+
+void io_ring_free(IoRing& self) {}
+
+bool io_ring_prep(IoRing& self, bool write, int fd, void* buf, size_t len,
+                  off_t offset, uint64_t tag) {
+	return false;
+}
+
+int io_ring_submit(IoRing& self, bool wait) {
+	return -ENOSYS;
+}
+
+bool io_ring_reap(IoRing& self, uint64_t* tag, int32_t* res) {
+	return false;
+}
+
+#endif
+
+/// Owns a thread's ring, so that it is torn down with the thread.
+struct ThreadRing {
+	ThreadRing(): state(0) {}
+	~ThreadRing() {
+		if(state > 0) { io_ring_free(ring); }
+	}
+
+	/// 0 until first use, then 1 if the ring is usable or -1 if not.
+	int state;
+	IoRing ring;
+};
+
+IoRing* io_ring_thread(void) {
+	static thread_local ThreadRing thread_ring;
+
+	if(thread_ring.state == 0) {
+		if(io_ring_init(thread_ring.ring, IO_RING_THREAD_ENTRIES) == 0) {
+			thread_ring.state = 1;
+		} else {
+			static std::atomic_flag warned = ATOMIC_FLAG_INIT;
+			if(!warned.test_and_set()) {
+				log_warn("io_uring unavailable, using pread/pwrite: %s",
+				         strerror(errno));
+			}
+			thread_ring.state = -1;
+		}
+	}
+
+	return (thread_ring.state > 0)? &thread_ring.ring : nullptr;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/// A minimal io_uring instance, driven through the raw system calls so that
+/// no liburing is needed. Not thread-safe: each thread uses its own ring, via
+/// io_ring_thread().
+struct IoRing {
+	int fd;
+	unsigned entries;
+
+	/// Our copy of the submission queue tail, which runs ahead of the
+	/// shared one by n_queued prepared entries not yet handed to the kernel.
+	unsigned sqe_tail;
+	unsigned n_queued;
+
+	void* sq_map;
+	size_t sq_map_len;
+	void* cq_map;
+	size_t cq_map_len;
+	void* sqes;
+	size_t sqes_len;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	void* cqes;
+};
+
+/// Set up a ring with room for entries in-flight operations. Returns 0 on
+/// success, or STATUS_CHECK_ERRNO (ENOSYS if built without io_uring).
+int io_ring_init(IoRing& self, unsigned entries);
+void io_ring_free(IoRing& self);
+
+/// Queue a pread (write false) or pwrite (write true). Returns false if the
+/// submission queue is full; submit and reap first.
+bool io_ring_prep(IoRing& self, bool write, int fd, void* buf, size_t len,
+                  off_t offset, uint64_t tag);
+
+/// Hand every queued operation to the kernel, and wait until at least one
+/// completion is available if wait is set. Returns 0 or -errno.
+int io_ring_submit(IoRing& self, bool wait);
+
+/// Pop one completion, if any is ready. res is the operation's return value
+/// or -errno, as the kernel reports it.
+bool io_ring_reap(IoRing& self, uint64_t* tag, int32_t* res);
+
+/// The calling thread's ring, created on first use and freed when the
+/// thread exits. Returns nullptr if io_uring can't be used here, in which
+/// case callers fall back to plain pread/pwrite.
+IoRing* io_ring_thread(void);
@@ -0,0 +1,442 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sodium.h>
+#include "fangfs.h"
+#include "util.h"
+#include "log.h"
+#include "error.h"
+
+#define JOURNAL_MAGIC 0x4a474e46
+#define JOURNAL_CHECKSUM_LEN 16
+
+enum JournalRecordType {
+	JOURNAL_WRITE = 1,
+	JOURNAL_TRUNCATE = 2
+};
+
+/// Every record is this header, then the path, then the data, then a keyed
+/// checksum over all of it. Fields are little-endian.
+struct JournalHeader {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t arg;
+	uint32_t path_len;
+	uint32_t data_len;
+};
+
+#define JOURNAL_HEADER_LEN (sizeof(uint32_t)*4 + sizeof(uint64_t))
+
+/// Records are authenticated with a key derived from the master key, so
+/// that nobody without it can plant a record for us to replay.
+static void journal_key(FangFS& fs, uint8_t key[crypto_generichash_KEYBYTES]) {
+	static const char context[] = "FangFS intent log";
+	crypto_generichash(key, crypto_generichash_KEYBYTES,
+	                   reinterpret_cast<const uint8_t*>(context), sizeof(context),
+	                   fs.master_key, sizeof(fs.master_key));
+}
+
+static void journal_checksum(const uint8_t key[crypto_generichash_KEYBYTES],
+                             const uint8_t* record, size_t len,
+                             uint8_t out[JOURNAL_CHECKSUM_LEN]) {
+	crypto_generichash(out, JOURNAL_CHECKSUM_LEN, record, len,
+	                   key, crypto_generichash_KEYBYTES);
+}
+
+static void header_serialize(const JournalHeader& header, uint8_t* outbuf) {
+	uint32_t u32 = u32_to_le(header.magic);
+	memcpy(outbuf, &u32, sizeof(u32));
+	u32 = u32_to_le(header.type);
+	memcpy(outbuf + 4, &u32, sizeof(u32));
+	const uint64_t u64 = u64_to_le(header.arg);
+	memcpy(outbuf + 8, &u64, sizeof(u64));
+	u32 = u32_to_le(header.path_len);
+	memcpy(outbuf + 16, &u32, sizeof(u32));
+	u32 = u32_to_le(header.data_len);
+	memcpy(outbuf + 20, &u32, sizeof(u32));
+}
+
+static void header_parse(JournalHeader& header, const uint8_t* inbuf) {
+	header.magic = u32_from_le(u32_from_bytes(inbuf));
+	header.type = u32_from_le(u32_from_bytes(inbuf + 4));
+	uint64_t u64;
+	memcpy(&u64, inbuf + 8, sizeof(u64));
+	header.arg = u64_from_le(u64);
+	header.path_len = u32_from_le(u32_from_bytes(inbuf + 16));
+	header.data_len = u32_from_le(u32_from_bytes(inbuf + 20));
+}
+
+static int pread_full(int fd, uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pread(fd, buf + total, len - total, offset + total);
+		if(n == 0) {
+			return 1;
+		} else if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pwrite(fd, buf + total, len - total, offset + total);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+/// Flush everything written to the filesystem holding the source.
+static int sync_source(int source_fd) {
+#ifdef HAVE_SYNCFS
+	return syncfs(source_fd);
+#else
+	sync();
+	return 0;
+#endif
+}
+
+/// Apply every intact record in the log, stopping at the first torn or
+/// forged one. Records are applied in order, so the last copy of a block wins.
+static int journal_replay(FangFS& fs, int fd, int source_fd) {
+	uint8_t key[crypto_generichash_KEYBYTES];
+	journal_key(fs, key);
+
+	Buffer record;
+	uint8_t checksum[JOURNAL_CHECKSUM_LEN];
+	off_t offset = 0;
+	size_t n_applied = 0;
+
+	// Records for the same file tend to come in runs.
+	Buffer cur_path;
+	int cur_fd = -1;
+
+	while(1) {
+		buf_grow(record, JOURNAL_HEADER_LEN);
+		if(pread_full(fd, record.buf, JOURNAL_HEADER_LEN, offset) != 0) { break; }
+
+		JournalHeader header;
+		header_parse(header, record.buf);
+		if(header.magic != JOURNAL_MAGIC || header.path_len == 0 ||
+		   header.data_len > fs.metafile.block_size) {
+			break;
+		}
+
+		const size_t body_len = JOURNAL_HEADER_LEN + header.path_len + header.data_len;
+		buf_grow(record, body_len + JOURNAL_CHECKSUM_LEN);
+		if(pread_full(fd, record.buf, body_len + JOURNAL_CHECKSUM_LEN, offset) != 0) { break; }
+
+		journal_checksum(key, record.buf, body_len, checksum);
+		if(sodium_memcmp(checksum, record.buf + body_len, sizeof(checksum)) != 0) {
+			break;
+		}
+
+		offset += body_len + JOURNAL_CHECKSUM_LEN;
+
+		Buffer path_buf;
+		buf_grow(path_buf, header.path_len + 1);
+		memcpy(path_buf.buf, record.buf + JOURNAL_HEADER_LEN, header.path_len);
+		path_buf.buf[header.path_len] = '\0';
+		const char* path = reinterpret_cast<char*>(path_buf.buf);
+		const uint8_t* data = record.buf + JOURNAL_HEADER_LEN + header.path_len;
+
+		if(cur_fd < 0 || strcmp(reinterpret_cast<char*>(cur_path.buf), path) != 0) {
+			if(cur_fd >= 0) { close(cur_fd); }
+			buf_load_string(cur_path, path);
+
+			// A file that has since been removed, or packed, has nothing left
+			// to repair.
+			cur_fd = openat(source_fd, path, O_RDWR|O_NOFOLLOW);
+			if(cur_fd < 0) { continue; }
+		}
+
+		int status = 0;
+		if(header.type == JOURNAL_WRITE) {
+			status = pwrite_full(cur_fd, data, header.data_len,
+			                     header.arg * fs.metafile.block_size);
+		} else if(header.type == JOURNAL_TRUNCATE) {
+			status = ftruncate(cur_fd, header.arg);
+		}
+
+		if(status < 0) {
+			log_error("Could not replay intent log record for %s: %s",
+			          path, strerror(errno));
+		} else {
+			n_applied += 1;
+		}
+	}
+
+	if(cur_fd >= 0) { close(cur_fd); }
+	sodium_memzero(key, sizeof(key));
+
+	if(n_applied > 0) {
+		log_info("Replayed %lu intent log records",
+		         static_cast<unsigned long>(n_applied));
+	}
+
+	return 0;
+}
+
+int journal_recover(FangFS& fs) {
+	Buffer path;
+	path_join(fs.source, JOURNAL_NAME, path);
+
+	const int fd = open(reinterpret_cast<char*>(path.buf), O_RDWR);
+	if(fd < 0) {
+		if(errno == ENOENT) { return 0; }
+		return STATUS_CHECK_ERRNO;
+	}
+
+	const int source_fd = open(fs.source, O_RDONLY|O_DIRECTORY);
+	if(source_fd < 0) {
+		const int new_errno = errno;
+		close(fd);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	int status = journal_replay(fs, fd, source_fd);
+
+	// The replayed blocks must be on disk before their log records go away.
+	if(status == 0 && (sync_source(source_fd) < 0 ||
+	                   ftruncate(fd, 0) < 0 ||
+	                   fsync(fd) < 0)) {
+		status = STATUS_CHECK_ERRNO;
+	}
+
+	const int new_errno = errno;
+	close(source_fd);
+	close(fd);
+	errno = new_errno;
+	return status;
+}
+
+int journal_open(Journal& self, FangFS& fs) {
+	self.fs = &fs;
+	self.lsn_base = 0;
+	self.size = 0;
+	self.synced_lsn = 0;
+	self.sync_in_progress = false;
+	self.checkpointing = false;
+	self.inflight = 0;
+
+	Buffer path;
+	path_join(fs.source, JOURNAL_NAME, path);
+
+	self.fd = open(reinterpret_cast<char*>(path.buf), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	if(self.fd < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	self.source_fd = open(fs.source, O_RDONLY|O_DIRECTORY);
+	if(self.source_fd < 0) {
+		const int new_errno = errno;
+		close(self.fd);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	// journal_recover() has already emptied it, but be sure.
+	if(ftruncate(self.fd, 0) < 0) {
+		const int new_errno = errno;
+		close(self.source_fd);
+		close(self.fd);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	return 0;
+}
+
+/// Make every in-place write durable and empty the log. The caller must hold
+/// the lock, and must not have a record of its own in flight.
+static int journal_checkpoint(Journal& self, std::unique_lock<std::mutex>& guard) {
+	self.checkpointing = true;
+	while(self.inflight > 0) {
+		self.cond.wait(guard);
+	}
+
+	int status = 0;
+	if(sync_source(self.source_fd) < 0 || ftruncate(self.fd, 0) < 0) {
+		status = -errno;
+	} else {
+		self.lsn_base += self.size;
+		self.size = 0;
+		self.synced_lsn = self.lsn_base;
+	}
+
+	self.checkpointing = false;
+	self.cond.notify_all();
+	return status;
+}
+
+void journal_close(Journal& self) {
+	{
+		std::unique_lock<std::mutex> guard(self.lock);
+		while(self.sync_in_progress) {
+			self.cond.wait(guard);
+		}
+		const int status = journal_checkpoint(self, guard);
+		if(status < 0) {
+			log_error("Could not checkpoint the intent log: %s", strerror(-status));
+		}
+	}
+
+	close(self.source_fd);
+	close(self.fd);
+	buf_free(self.record);
+}
+
+/// Wait out any checkpoint under way, and checkpoint the log if it has grown
+/// too long, before appending to it. The caller must hold the lock, and must
+/// not have a record of its own in flight.
+static int journal_prepare_append(Journal& self, std::unique_lock<std::mutex>& guard) {
+	while(self.checkpointing) {
+		self.cond.wait(guard);
+	}
+
+	if(self.size >= JOURNAL_CHECKPOINT_SIZE) {
+		return journal_checkpoint(self, guard);
+	}
+	return 0;
+}
+
+/// Append one record at the end of the log. The caller must hold the lock.
+static int journal_append_locked(Journal& self, uint32_t type, const char* path,
+                                 uint64_t arg, const uint8_t* data, size_t data_len) {
+	const size_t path_len = strlen(path);
+
+	JournalHeader header;
+	header.magic = JOURNAL_MAGIC;
+	header.type = type;
+	header.arg = arg;
+	header.path_len = path_len;
+	header.data_len = data_len;
+
+	const size_t body_len = JOURNAL_HEADER_LEN + path_len + data_len;
+	buf_grow(self.record, body_len + JOURNAL_CHECKSUM_LEN);
+	header_serialize(header, self.record.buf);
+	memcpy(self.record.buf + JOURNAL_HEADER_LEN, path, path_len);
+	if(data_len > 0) {
+		memcpy(self.record.buf + JOURNAL_HEADER_LEN + path_len, data, data_len);
+	}
+
+	uint8_t key[crypto_generichash_KEYBYTES];
+	journal_key(*self.fs, key);
+	journal_checksum(key, self.record.buf, body_len, self.record.buf + body_len);
+	sodium_memzero(key, sizeof(key));
+
+	// Appends are serialized so that the log never has a hole in it, which
+	// would cut replay short.
+	const size_t record_len = body_len + JOURNAL_CHECKSUM_LEN;
+	if(pwrite_full(self.fd, self.record.buf, record_len, self.size) < 0) {
+		return -errno;
+	}
+
+	self.size += record_len;
+	return 0;
+}
+
+/// Append one record, returning the LSN just past it.
+static int journal_append(Journal& self, uint32_t type, const char* path,
+                          uint64_t arg, const uint8_t* data, size_t data_len,
+                          uint64_t* lsn) {
+	std::unique_lock<std::mutex> guard(self.lock);
+	int status = journal_prepare_append(self, guard);
+	if(status == 0) {
+		status = journal_append_locked(self, type, path, arg, data, data_len);
+	}
+	if(status < 0) {
+		return status;
+	}
+
+	self.inflight += 1;
+	*lsn = self.lsn_base + self.size;
+	return 0;
+}
+
+int journal_log_block(Journal& self, const char* path, uint64_t block_n,
+                      const uint8_t* block, size_t len, uint64_t* lsn) {
+	return journal_append(self, JOURNAL_WRITE, path, block_n, block, len, lsn);
+}
+
+int journal_log_truncate(Journal& self, const char* path, off_t physical_size,
+                         uint64_t* lsn) {
+	return journal_append(self, JOURNAL_TRUNCATE, path, physical_size, nullptr, 0, lsn);
+}
+
+int journal_log_blocks(Journal& self, const char* path, uint64_t first_block_n,
+                       const uint8_t* blocks, size_t block_len, size_t count,
+                       uint64_t* lsn) {
+	// A checkpoint waits for every record in flight, so it can only happen
+	// before the first of these; after that, this thread holds records of
+	// its own.
+	std::unique_lock<std::mutex> guard(self.lock);
+	int status = journal_prepare_append(self, guard);
+	for(size_t i = 0; status == 0 && i < count; i += 1) {
+		status = journal_append_locked(self, JOURNAL_WRITE, path, first_block_n + i,
+		                               blocks + i * block_len, block_len);
+	}
+	if(status < 0) {
+		return status;
+	}
+
+	self.inflight += 1;
+	*lsn = self.lsn_base + self.size;
+	return 0;
+}
+
+void journal_write_done(Journal& self) {
+	std::lock_guard<std::mutex> guard(self.lock);
+	self.inflight -= 1;
+	if(self.inflight == 0 && self.checkpointing) {
+		self.cond.notify_all();
+	}
+}
+
+int journal_sync(Journal& self, uint64_t lsn) {
+	std::unique_lock<std::mutex> guard(self.lock);
+
+	while(self.synced_lsn < lsn) {
+		if(self.sync_in_progress || self.checkpointing) {
+			// Somebody else is already syncing; they, or whoever follows
+			// them, will cover us too.
+			self.cond.wait(guard);
+			continue;
+		}
+
+		// Become the leader for everything appended so far.
+		self.sync_in_progress = true;
+		const uint64_t target = self.lsn_base + self.size;
+		guard.unlock();
+
+		const int status = fdatasync(self.fd);
+		const int new_errno = errno;
+
+		guard.lock();
+		self.sync_in_progress = false;
+		if(status == 0 && target > self.synced_lsn) {
+			self.synced_lsn = target;
+		}
+		self.cond.notify_all();
+
+		if(status < 0) {
+			return -new_errno;
+		}
+	}
+
+	return 0;
+}
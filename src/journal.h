@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <condition_variable>
+#include <mutex>
+#include "Buffer.h"
+
+#define JOURNAL_NAME "__FANGFS_JOURNAL"
+
+/// Once the log grows past this, the next append checkpoints it.
+#define JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+struct FangFS;
+
+/// A per-mount intent log. Every block is appended here before it is
+/// overwritten in place, so that fsync only has to make the log durable and a
+/// block torn by a crash can be rewritten from its logged copy at mount.
+///
+/// fsync callers are group-committed: while one thread is in fdatasync(), the
+/// others queue up behind it, and the next sync covers all of them at once.
+struct Journal {
+	FangFS* fs;
+	int fd;
+	int source_fd;
+
+	std::mutex lock;
+	std::condition_variable cond;
+
+	/// Log sequence numbers are byte positions in an endless log; lsn_base is
+	/// the position of the current file's first byte.
+	uint64_t lsn_base;
+	uint64_t size;
+	uint64_t synced_lsn;
+
+	bool sync_in_progress;
+	bool checkpointing;
+
+	/// Records appended whose in-place write hasn't finished yet. The log
+	/// can't be checkpointed until these land.
+	uint32_t inflight;
+
+	/// Scratch space for assembling records. Protected by lock.
+	Buffer record;
+};
+
+/// Replay any records left behind by a crash, then empty the log. Runs at
+/// every mount, whether or not journaling is enabled for it. Returns 0 on
+/// success or STATUS_CHECK_ERRNO.
+int journal_recover(FangFS& fs);
+
+/// Open (creating if needed) the intent log for fs. Returns 0 on success or
+/// STATUS_CHECK_ERRNO.
+int journal_open(Journal& self, FangFS& fs);
+
+/// Checkpoint and close the log.
+void journal_close(Journal& self);
+
+/// Log a ciphertext block about to be written in place at block_n of the
+/// backing file path (relative to the source). On success, *lsn is the
+/// position fsync must reach to cover it, and journal_write_done() must be
+/// called once the in-place write is finished.
+int journal_log_block(Journal& self, const char* path, uint64_t block_n,
+                      const uint8_t* block, size_t len, uint64_t* lsn);
+
+/// Log count consecutive ciphertext blocks of block_len bytes each, about to
+/// be written in place from first_block_n on, as journal_log_block() does.
+/// The records are appended together, and are one write as far as
+/// journal_write_done() is concerned: call it once, after all of them land.
+int journal_log_blocks(Journal& self, const char* path, uint64_t first_block_n,
+                       const uint8_t* blocks, size_t block_len, size_t count,
+                       uint64_t* lsn);
+
+/// Log that the backing file path is about to be truncated to
+/// physical_size bytes. Pairs with journal_write_done() like
+/// journal_log_block.
+int journal_log_truncate(Journal& self, const char* path, off_t physical_size,
+                         uint64_t* lsn);
+
+/// The in-place change for a logged record has been applied.
+void journal_write_done(Journal& self);
+
+/// Block until everything up to lsn is durable. Returns 0 or -errno.
+int journal_sync(Journal& self, uint64_t lsn);
@@ -0,0 +1,92 @@
+#include "keycache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "error.h"
+
+#ifdef HAVE_KEYCTL
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/keyctl.h>
+
+// Permission bits, as defined by keyutils.h rather than the kernel headers.
+#define KEY_POS_ALL 0x3f000000
+#define KEY_USR_VIEW 0x00010000
+#define KEY_USR_READ 0x00020000
+#define KEY_USR_SEARCH 0x00080000
+
+/// "fangfs:" followed by a hex hash of the field's salt. Salts are random, so
+/// this names exactly one key field on one filesystem.
+static void key_description(const Metafield& field, char* out, size_t out_len) {
+	uint8_t hash[16];
+	crypto_generichash(hash, sizeof(hash), field.salt, sizeof(field.salt), nullptr, 0);
+
+	const size_t prefix_len = snprintf(out, out_len, "fangfs:");
+	sodium_bin2hex(out + prefix_len, out_len - prefix_len, hash, sizeof(hash));
+}
+
+static long find_key(const Metafield& field) {
+	char description[64];
+	key_description(field, description, sizeof(description));
+	return syscall(__NR_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, "user",
+	               description, 0);
+}
+
+bool keycache_get(const Metafield& field, uint8_t child_key[crypto_secretbox_KEYBYTES]) {
+	const long id = find_key(field);
+	if(id < 0) {
+		return false;
+	}
+
+	const long n = syscall(__NR_keyctl, KEYCTL_READ, id, child_key, crypto_secretbox_KEYBYTES);
+	return n == crypto_secretbox_KEYBYTES;
+}
+
+int keycache_put(const Metafield& field, const uint8_t child_key[crypto_secretbox_KEYBYTES],
+                 unsigned timeout) {
+	char description[64];
+	key_description(field, description, sizeof(description));
+
+	const long id = syscall(__NR_add_key, "user", description, child_key,
+	                        crypto_secretbox_KEYBYTES, KEY_SPEC_USER_KEYRING);
+	if(id < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	// Only our own user may find and read it, and only until the timeout.
+	const unsigned long perm = KEY_POS_ALL | KEY_USR_VIEW | KEY_USR_READ | KEY_USR_SEARCH;
+	if(syscall(__NR_keyctl, KEYCTL_SETPERM, id, perm) < 0 ||
+	   syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, timeout) < 0) {
+		const int new_errno = errno;
+		syscall(__NR_keyctl, KEYCTL_INVALIDATE, id);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	return 0;
+}
+
+void keycache_drop(const Metafield& field) {
+	const long id = find_key(field);
+	if(id >= 0) {
+		syscall(__NR_keyctl, KEYCTL_INVALIDATE, id);
+	}
+}
+
+#else
+
+bool keycache_get(const Metafield& field, uint8_t child_key[crypto_secretbox_KEYBYTES]) {
+	return false;
+}
+
+int keycache_put(const Metafield& field, const uint8_t child_key[crypto_secretbox_KEYBYTES],
+                 unsigned timeout) {
+	errno = ENOSYS;
+	return STATUS_CHECK_ERRNO;
+}
+
+void keycache_drop(const Metafield& field) {}
+
+#endif
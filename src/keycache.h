@@ -0,0 +1,17 @@
+#pragma once
+
+#include <sodium.h>
+#include "metafile.h"
+
+/// Look up the child key for field in the user's kernel keyring, where
+/// keycache_put() may have left it. Returns true if one was found; it is up
+/// to the caller to check that it actually opens the field.
+bool keycache_get(const Metafield& field, uint8_t child_key[crypto_secretbox_KEYBYTES]);
+
+/// Cache the child key for field in the user's kernel keyring for timeout
+/// seconds. Returns 0 or STATUS_CHECK_ERRNO.
+int keycache_put(const Metafield& field, const uint8_t child_key[crypto_secretbox_KEYBYTES],
+                 unsigned timeout);
+
+/// Forget any cached child key for field.
+void keycache_drop(const Metafield& field);
@@ -0,0 +1,222 @@
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "error.h"
+
+/// Messages longer than this are cut short.
+#define LOG_MESSAGE_MAX 256
+
+/// How many messages a thread may have queued before it starts dropping
+/// them.
+#define LOG_RING_SLOTS 256
+
+/// How long the writer sleeps when there's nothing to write. Producers only
+/// look for a sleeping writer with a plain load, and take the locked
+/// exchange that wakes it only when it is asleep. With no fence between
+/// queuing a message and that load, a wakeup can be missed, so this bounds
+/// how late a message can be.
+#define LOG_IDLE_MS 100
+
+std::atomic<LogLevel> log_level(LOG_LEVEL_INFO);
+
+struct LogSlot {
+	uint16_t len;
+	char text[LOG_MESSAGE_MAX];
+};
+
+/// One thread's queued messages. The owning thread only advances head and
+/// the writer only advances tail, so neither needs a lock.
+struct LogRing {
+	LogSlot slots[LOG_RING_SLOTS];
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+
+	/// Set once the thread has exited; the writer frees the ring when it has
+	/// written out what's left.
+	std::atomic<bool> retired;
+	LogRing* next;
+};
+
+static std::mutex registry_lock;
+static LogRing* registry = nullptr;
+
+static std::atomic<bool> async(false);
+static std::atomic<bool> running(false);
+static std::atomic<bool> sleeping(false);
+static std::atomic<uint64_t> dropped(0);
+static std::thread* writer = nullptr;
+static int wake_pipe[2] = {-1, -1};
+
+struct LogRingHolder {
+	LogRingHolder(): ring(new LogRing()) {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		ring->next = registry;
+		registry = ring;
+	}
+
+	~LogRingHolder() {
+		ring->retired.store(true, std::memory_order_release);
+	}
+
+	LogRing* ring;
+};
+
+static LogRing& thread_ring() {
+	static thread_local LogRingHolder holder;
+	return *holder.ring;
+}
+
+void log_set_level(LogLevel level) {
+	log_level.store(level, std::memory_order_relaxed);
+}
+
+int log_parse_level(const char* name, LogLevel* level) {
+	static const char* const names[] = {"error", "warn", "info", "debug"};
+	for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i += 1) {
+		if(strcmp(name, names[i]) == 0) {
+			*level = static_cast<LogLevel>(i);
+			return 0;
+		}
+	}
+
+	return STATUS_ERROR;
+}
+
+static void wake_writer() {
+	if(sleeping.load(std::memory_order_acquire) && sleeping.exchange(false)) {
+		const char c = 0;
+		if(write(wake_pipe[1], &c, 1) < 0) {}
+	}
+}
+
+void log_write(LogLevel level, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+
+	if(!async.load(std::memory_order_acquire)) {
+		char text[LOG_MESSAGE_MAX];
+		vsnprintf(text, sizeof(text), format, args);
+		va_end(args);
+		fprintf(stderr, "%s\n", text);
+		return;
+	}
+
+	LogRing& ring = thread_ring();
+	const uint64_t head = ring.head.load(std::memory_order_relaxed);
+	if(head - ring.tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+		va_end(args);
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		wake_writer();
+		return;
+	}
+
+	LogSlot& slot = ring.slots[head % LOG_RING_SLOTS];
+	const int n = vsnprintf(slot.text, sizeof(slot.text), format, args);
+	va_end(args);
+	slot.len = (n < 0)? 0 : std::min<size_t>(n, sizeof(slot.text) - 1);
+
+	ring.head.store(head + 1, std::memory_order_release);
+	wake_writer();
+}
+
+/// Write out every queued message, and free the rings of threads that have
+/// exited. Returns the number of messages written.
+static size_t drain() {
+	size_t written = 0;
+	std::lock_guard<std::mutex> guard(registry_lock);
+	for(LogRing** cur = &registry; *cur != nullptr;) {
+		LogRing& ring = **cur;
+		const bool retired = ring.retired.load(std::memory_order_acquire);
+		const uint64_t head = ring.head.load(std::memory_order_acquire);
+		uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+		for(; tail < head; tail += 1) {
+			const LogSlot& slot = ring.slots[tail % LOG_RING_SLOTS];
+			fwrite(slot.text, 1, slot.len, stderr);
+			fputc('\n', stderr);
+			written += 1;
+		}
+		ring.tail.store(tail, std::memory_order_release);
+
+		if(retired) {
+			*cur = ring.next;
+			delete &ring;
+		} else {
+			cur = &ring.next;
+		}
+	}
+
+	// Say so when messages went missing, so the gap isn't mistaken for quiet.
+	static uint64_t reported_dropped = 0;
+	const uint64_t now_dropped = dropped.load(std::memory_order_relaxed);
+	if(now_dropped != reported_dropped) {
+		fprintf(stderr, "%llu log messages dropped\n",
+		        static_cast<unsigned long long>(now_dropped - reported_dropped));
+		reported_dropped = now_dropped;
+		written += 1;
+	}
+
+	if(written > 0) {
+		fflush(stderr);
+	}
+	return written;
+}
+
+static void writer_thread() {
+	while(running.load()) {
+		if(drain() > 0) { continue; }
+
+		sleeping.store(true);
+		if(drain() == 0) {
+			struct pollfd pfd;
+			pfd.fd = wake_pipe[0];
+			pfd.events = POLLIN;
+			poll(&pfd, 1, LOG_IDLE_MS);
+		}
+		sleeping.store(false);
+
+		char buf[64];
+		while(read(wake_pipe[0], buf, sizeof(buf)) > 0) {}
+	}
+}
+
+void log_start() {
+	if(writer != nullptr) { return; }
+	if(pipe2(wake_pipe, O_CLOEXEC|O_NONBLOCK) < 0) { return; }
+
+	running.store(true);
+	writer = new std::thread(writer_thread);
+	async.store(true);
+}
+
+void log_stop() {
+	if(writer == nullptr) { return; }
+
+	async.store(false);
+	running.store(false);
+	sleeping.store(true);
+	wake_writer();
+	writer->join();
+	delete writer;
+	writer = nullptr;
+
+	// Anything logged while the writer was shutting down.
+	drain();
+
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+uint64_t log_dropped() {
+	return dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+/// Message severities, most severe first.
+enum LogLevel {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG
+};
+
+/// The least severe level compiled in at all. Calls below it vanish along
+/// with their arguments; set it with -DFANGFS_LOG_LEVEL=debug in CMake.
+#ifndef FANGFS_LOG_MAX_LEVEL
+#define FANGFS_LOG_MAX_LEVEL LOG_LEVEL_INFO
+#endif
+
+/// The least severe level written at runtime. Read with a relaxed load on
+/// every call, so only set it with log_set_level().
+extern std::atomic<LogLevel> log_level;
+
+void log_set_level(LogLevel level);
+
+/// Parse "error", "warn", "info", or "debug". Returns 0 or STATUS_ERROR.
+int log_parse_level(const char* name, LogLevel* level);
+
+/// Format and queue a message. A newline is added. Use the log_*() macros
+/// instead, which check the level before evaluating any arguments.
+void log_write(LogLevel level, const char* format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define log_at(level, ...) do { \
+	if((level) <= FANGFS_LOG_MAX_LEVEL && (level) <= log_level.load(std::memory_order_relaxed)) { \
+		log_write((level), __VA_ARGS__); \
+	} \
+} while(0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/// Until log_start() is called, messages are written to stderr as they are
+/// logged. After it, each thread queues its messages in a ring of its own
+/// without taking any locks, and a background thread writes them out. Call
+/// it after any fork into the background.
+void log_start();
+
+/// Write out everything queued so far, and go back to writing messages as
+/// they are logged.
+void log_stop();
+
+/// The number of messages thrown away because their thread's ring was full.
+uint64_t log_dropped();
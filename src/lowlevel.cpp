@@ -0,0 +1,741 @@
+#include "lowlevel.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <algorithm>
+#include "file.h"
+#include "log.h"
+#include "memory.h"
+#include "stats.h"
+#include "util.h"
+#include "error.h"
+
+// Names never change underneath the kernel except through us, so entries can
+// be cached exactly as long as the high-level API does by default.
+#define ENTRY_TIMEOUT 1.0
+#define ATTR_TIMEOUT 1.0
+
+/// An open directory stream, kept across readdir calls so that offsets can be
+/// resumed without rescanning.
+struct FangDirHandle {
+	DIR* dir;
+	off_t offset;
+	struct dirent* entry;
+};
+
+/// The inode number of STATS_FILE_NAME in the root. The inode table counts
+/// up from FUSE_ROOT_ID, so it never hands this one out.
+#define STATS_INO (static_cast<fuse_ino_t>(-2))
+
+static inline bool is_stats_name(fuse_ino_t parent, const char* name) {
+	return parent == FUSE_ROOT_ID && strcmp(name, STATS_FILE_NAME) == 0;
+}
+
+static inline Buffer* get_stats_snapshot(struct fuse_file_info* fi) {
+	return reinterpret_cast<Buffer*>(static_cast<uintptr_t>(fi->fh));
+}
+
+static inline FangLowLevel& get_ll(fuse_req_t req) {
+	return *reinterpret_cast<FangLowLevel*>(fuse_req_userdata(req));
+}
+
+static inline FangFile* get_file(struct fuse_file_info* fi) {
+	return reinterpret_cast<FangFile*>(static_cast<uintptr_t>(fi->fh));
+}
+
+static inline FangDirHandle* get_dir(struct fuse_file_info* fi) {
+	return reinterpret_cast<FangDirHandle*>(static_cast<uintptr_t>(fi->fh));
+}
+
+/// Encrypt the name of a child of dir.
+static void child_name(FangLowLevel& ll, const FangInode& dir, const char* name,
+                       Buffer& outbuf) {
+	Buffer path;
+	buf_make_secure(path);
+	path_join(dir.path, name, path);
+	path_encrypt(*ll.fs, reinterpret_cast<char*>(path.buf), outbuf);
+}
+
+/// Stat an inode's backing file, translating the size into plaintext terms.
+static int inode_stat(FangLowLevel& ll, const FangInode& inode, struct stat* info) {
+	int status;
+	if(inode.fd >= 0) {
+		status = fstat(inode.fd, info);
+	} else {
+		status = fstatat(inode.parent->fd, inode.name, info, AT_SYMLINK_NOFOLLOW);
+	}
+
+	if(status < 0) {
+		return errno;
+	}
+
+	if(S_ISREG(info->st_mode)) {
+		// Only directories keep a descriptor open.
+		const off_t size = fang_file_size_at(*ll.fs, inode.parent->fd, inode.name,
+		                                     info->st_size);
+		if(size < 0) { return EIO; }
+		info->st_size = size;
+	}
+
+	info->st_ino = inode.ino;
+	return 0;
+}
+
+/// Resolve a child of dir whose ciphertext name is already known, taking a
+/// lookup reference on it. Returns 0 or an errno value.
+static int do_lookup(FangLowLevel& ll, FangInode& dir, const char* name,
+                     const char* cipher_name, struct fuse_entry_param* e) {
+	memset(e, 0, sizeof(*e));
+
+	struct stat info;
+	if(fstatat(dir.fd, cipher_name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+		return errno;
+	}
+
+	FangInode* inode = inode_ref_child(ll.inodes, dir, name, cipher_name, info);
+	if(inode == nullptr) {
+		return errno;
+	}
+
+	if(S_ISREG(info.st_mode)) {
+		const off_t size = fang_file_size_at(*ll.fs, dir.fd, cipher_name, info.st_size);
+		if(size < 0) {
+			inode_forget(ll.inodes, inode->ino, 1);
+			return EIO;
+		}
+		info.st_size = size;
+	}
+
+	info.st_ino = inode->ino;
+	e->ino = inode->ino;
+	e->attr = info;
+	e->attr_timeout = ATTR_TIMEOUT;
+	e->entry_timeout = ENTRY_TIMEOUT;
+	return 0;
+}
+
+/// Reply to a request that creates a new child with its entry.
+static void reply_new_entry(fuse_req_t req, FangLowLevel& ll, FangInode& dir,
+                            const char* name, const char* cipher_name) {
+	struct fuse_entry_param e;
+	const int error = do_lookup(ll, dir, name, cipher_name, &e);
+	if(error != 0) {
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	fuse_reply_entry(req, &e);
+}
+
+static void fangfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	StatScope timer(STAT_OP_LOOKUP);
+	if(is_stats_name(parent, name)) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		stats_file_stat(&e.attr);
+		e.ino = e.attr.st_ino = STATS_INO;
+		e.attr_timeout = ATTR_TIMEOUT;
+		e.entry_timeout = ENTRY_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	FangLowLevel& ll = get_ll(req);
+	FangInode* dir = inode_get(ll.inodes, parent);
+	if(dir == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	Buffer cipher_name;
+	child_name(ll, *dir, name, cipher_name);
+
+	struct fuse_entry_param e;
+	const int error = do_lookup(ll, *dir, name,
+	                            reinterpret_cast<char*>(cipher_name.buf), &e);
+	if(error != 0) {
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	fuse_reply_entry(req, &e);
+}
+
+static void fangfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	StatScope timer(STAT_OP_FORGET);
+	inode_forget(get_ll(req).inodes, ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void fangfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data* forgets) {
+	StatScope timer(STAT_OP_FORGET);
+	FangLowLevel& ll = get_ll(req);
+	for(size_t i = 0; i < count; i += 1) {
+		inode_forget(ll.inodes, forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void fangfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_GETATTR);
+	if(ino == STATS_INO) {
+		struct stat info;
+		stats_file_stat(&info);
+		info.st_ino = STATS_INO;
+		fuse_reply_attr(req, &info, ATTR_TIMEOUT);
+		return;
+	}
+
+	FangLowLevel& ll = get_ll(req);
+	FangInode* inode = inode_get(ll.inodes, ino);
+	if(inode == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	struct stat info;
+	const int error = inode_stat(ll, *inode, &info);
+	if(error != 0) {
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	fuse_reply_attr(req, &info, ATTR_TIMEOUT);
+}
+
+static void fangfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                              int to_set, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_SETATTR);
+	if(ino == STATS_INO) { fuse_reply_err(req, EACCES); return; }
+	FangLowLevel& ll = get_ll(req);
+	FangInode* inode = inode_get(ll.inodes, ino);
+	if(inode == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	// Directories are addressed through their own descriptor, everything else
+	// through the parent.
+	const int dirfd = (inode->fd >= 0)? inode->fd : inode->parent->fd;
+	const char* name = (inode->fd >= 0)? "." : inode->name;
+
+	if(to_set & FUSE_SET_ATTR_MODE) {
+		if(fchmodat(dirfd, name, attr->st_mode, 0) < 0) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+	}
+
+	if(to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID)) {
+		const uid_t uid = (to_set & FUSE_SET_ATTR_UID)? attr->st_uid : static_cast<uid_t>(-1);
+		const gid_t gid = (to_set & FUSE_SET_ATTR_GID)? attr->st_gid : static_cast<gid_t>(-1);
+		if(fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+	}
+
+	if(to_set & FUSE_SET_ATTR_SIZE) {
+		int status;
+		if(fi != nullptr && get_file(fi) != nullptr) {
+			status = fang_file_truncate(*get_file(fi), attr->st_size);
+		} else {
+			const int fd = openat(dirfd, name, O_RDWR);
+			if(fd < 0) {
+				fuse_reply_err(req, errno);
+				return;
+			}
+
+			Buffer real_path;
+			inode_backing_path(*inode, ll.fs->source, real_path);
+			FangFile* file = fang_file_open(*ll.fs, fd, reinterpret_cast<char*>(real_path.buf));
+			if(file == nullptr) {
+				const int new_errno = errno;
+				close(fd);
+				fuse_reply_err(req, new_errno);
+				return;
+			}
+
+			status = fang_file_truncate(*file, attr->st_size);
+			const int close_status = fang_file_close(file);
+			if(status == 0) { status = close_status; }
+		}
+
+		if(status < 0) {
+			fuse_reply_err(req, -status);
+			return;
+		}
+	}
+
+	if(to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME)) {
+		struct timespec times[2];
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1].tv_nsec = UTIME_OMIT;
+		if(to_set & FUSE_SET_ATTR_ATIME) { times[0] = attr->st_atim; }
+		if(to_set & FUSE_SET_ATTR_MTIME) { times[1] = attr->st_mtim; }
+		if(utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) < 0) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+	}
+
+	fangfs_ll_getattr(req, ino, fi);
+}
+
+static void fangfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+                            mode_t mode, dev_t rdev) {
+	StatScope timer(STAT_OP_MKNOD);
+	if(is_stats_name(parent, name)) { fuse_reply_err(req, EEXIST); return; }
+	FangLowLevel& ll = get_ll(req);
+	FangInode* dir = inode_get(ll.inodes, parent);
+	if(dir == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	Buffer cipher_name;
+	child_name(ll, *dir, name, cipher_name);
+	const char* cipher_name_str = reinterpret_cast<char*>(cipher_name.buf);
+
+	if(mknodat(dir->fd, cipher_name_str, mode, rdev) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	reply_new_entry(req, ll, *dir, name, cipher_name_str);
+}
+
+static void fangfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+                            mode_t mode) {
+	StatScope timer(STAT_OP_MKDIR);
+	if(is_stats_name(parent, name)) { fuse_reply_err(req, EEXIST); return; }
+	FangLowLevel& ll = get_ll(req);
+	FangInode* dir = inode_get(ll.inodes, parent);
+	if(dir == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	Buffer cipher_name;
+	child_name(ll, *dir, name, cipher_name);
+	const char* cipher_name_str = reinterpret_cast<char*>(cipher_name.buf);
+
+	if(mkdirat(dir->fd, cipher_name_str, mode) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	reply_new_entry(req, ll, *dir, name, cipher_name_str);
+}
+
+static void fangfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	StatScope timer(STAT_OP_UNLINK);
+	if(is_stats_name(parent, name)) { fuse_reply_err(req, EACCES); return; }
+	FangLowLevel& ll = get_ll(req);
+	FangInode* dir = inode_get(ll.inodes, parent);
+	if(dir == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	Buffer cipher_name;
+	child_name(ll, *dir, name, cipher_name);
+	const char* cipher_name_str = reinterpret_cast<char*>(cipher_name.buf);
+
+	struct stat info;
+	if(fstatat(dir->fd, cipher_name_str, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	if(unlinkat(dir->fd, cipher_name_str, 0) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	inode_unlink_backing(ll.inodes, info.st_dev, info.st_ino);
+	fuse_reply_err(req, 0);
+}
+
+/// Wrap a freshly opened backing descriptor for the child cipher_name of dir
+/// in a handle and store it in fi. Returns 0 or an errno value; the
+/// descriptor is closed on failure.
+static int attach_file(FangLowLevel& ll, const FangInode& dir, const char* cipher_name,
+                       int fd, bool created, struct fuse_file_info* fi) {
+	Buffer dir_path;
+	Buffer real_path;
+	inode_backing_path(dir, ll.fs->source, dir_path);
+	path_join(reinterpret_cast<char*>(dir_path.buf), cipher_name, real_path);
+
+	FangFile* file = fang_file_open(*ll.fs, fd, reinterpret_cast<char*>(real_path.buf));
+	if(file == nullptr) {
+		const int new_errno = errno;
+		close(fd);
+		return new_errno;
+	}
+
+	if(created || (fi->flags & O_TRUNC)) {
+		const int status = fang_file_note_created(*file);
+		if(status < 0) {
+			fang_file_close(file);
+			return -status;
+		}
+	}
+
+	fi->fh = reinterpret_cast<uintptr_t>(file);
+	return 0;
+}
+
+static void fangfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_OPEN);
+	if(ino == STATS_INO) {
+		if((fi->flags & O_ACCMODE) != O_RDONLY) { fuse_reply_err(req, EACCES); return; }
+
+		// Each open reads one consistent snapshot. Its size is only known
+		// once it's taken, so bypass the page cache.
+		Buffer* snapshot = new Buffer;
+		stats_format(*snapshot);
+		fi->fh = reinterpret_cast<uintptr_t>(snapshot);
+		fi->direct_io = 1;
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	FangLowLevel& ll = get_ll(req);
+	FangInode* inode = inode_get(ll.inodes, ino);
+	if(inode == nullptr) { fuse_reply_err(req, ENOENT); return; }
+	if(inode->fd >= 0) { fuse_reply_err(req, EISDIR); return; }
+
+	bool created = false;
+	const int fd = fang_file_open_backing(inode->parent->fd, inode->name,
+	                                      fang_file_backing_flags(*ll.fs, fi->flags) & ~O_CREAT,
+	                                      0, &created);
+	if(fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	const int error = attach_file(ll, *inode->parent, inode->name, fd, false, fi);
+	if(error != 0) {
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	fuse_reply_open(req, fi);
+}
+
+static void fangfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+                             mode_t mode, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_CREATE);
+	if(is_stats_name(parent, name)) { fuse_reply_err(req, EEXIST); return; }
+	FangLowLevel& ll = get_ll(req);
+	FangInode* dir = inode_get(ll.inodes, parent);
+	if(dir == nullptr) { fuse_reply_err(req, ENOENT); return; }
+
+	Buffer cipher_name;
+	child_name(ll, *dir, name, cipher_name);
+	const char* cipher_name_str = reinterpret_cast<char*>(cipher_name.buf);
+
+	bool created = false;
+	const int fd = fang_file_open_backing(dir->fd, cipher_name_str,
+	                                      fang_file_backing_flags(*ll.fs, fi->flags) | O_CREAT,
+	                                      mode, &created);
+	if(fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	int error = attach_file(ll, *dir, cipher_name_str, fd, created, fi);
+	if(error != 0) {
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	error = do_lookup(ll, *dir, name, cipher_name_str, &e);
+	if(error != 0) {
+		fang_file_close(get_file(fi));
+		fuse_reply_err(req, error);
+		return;
+	}
+
+	fuse_reply_create(req, &e, fi);
+}
+
+static void fangfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_READ);
+	if(ino == STATS_INO) {
+		const Buffer& snapshot = *get_stats_snapshot(fi);
+		const size_t n = (off >= static_cast<off_t>(snapshot.len))?
+		                 0 : std::min(size, snapshot.len - off);
+		fuse_reply_buf(req, reinterpret_cast<char*>(snapshot.buf) + off, n);
+		return;
+	}
+
+	FangFile* file = get_file(fi);
+	if(file == nullptr) { fuse_reply_err(req, EINVAL); return; }
+
+	// The plaintext of the file, on its way to the kernel.
+	Buffer buf;
+	buf_make_secure(buf);
+	buf_grow(buf, size);
+	const int n = fang_file_read(*file, off, size, buf.buf);
+	if(n < 0) {
+		fuse_reply_err(req, -n);
+		return;
+	}
+
+	fuse_reply_buf(req, reinterpret_cast<char*>(buf.buf), n);
+}
+
+static void fangfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf,
+                            size_t size, off_t off, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_WRITE);
+	if(ino == STATS_INO) { fuse_reply_err(req, EBADF); return; }
+	FangFile* file = get_file(fi);
+	if(file == nullptr) { fuse_reply_err(req, EINVAL); return; }
+
+	const int n = fang_file_write(*file, off, size, reinterpret_cast<const uint8_t*>(buf));
+	if(n < 0) {
+		fuse_reply_err(req, -n);
+		return;
+	}
+
+	fuse_reply_write(req, n);
+}
+
+static void fangfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv,
+                                off_t off, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_WRITE);
+	if(ino == STATS_INO) { fuse_reply_err(req, EBADF); return; }
+	FangFile* file = get_file(fi);
+	if(file == nullptr) { fuse_reply_err(req, EINVAL); return; }
+
+	const int n = fang_file_write_buf(*file, off, bufv);
+	if(n < 0) {
+		fuse_reply_err(req, -n);
+		return;
+	}
+
+	fuse_reply_write(req, n);
+}
+
+static void fangfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_RELEASE);
+	if(ino == STATS_INO) {
+		delete get_stats_snapshot(fi);
+		fi->fh = 0;
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	FangFile* file = get_file(fi);
+	if(file == nullptr) { fuse_reply_err(req, EINVAL); return; }
+
+	fi->fh = 0;
+	fuse_reply_err(req, -fang_file_close(file));
+}
+
+static void fangfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_FSYNC);
+	if(ino == STATS_INO) { fuse_reply_err(req, 0); return; }
+	FangFile* file = get_file(fi);
+	if(file == nullptr) { fuse_reply_err(req, EINVAL); return; }
+
+	fuse_reply_err(req, -fang_file_sync(*file, datasync));
+}
+
+static void fangfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_FLUSH);
+	if(ino == STATS_INO) { fuse_reply_err(req, 0); return; }
+	fuse_reply_err(req, -fangfs_flush(*get_ll(req).fs, fi));
+}
+
+static void fangfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_OPENDIR);
+	FangLowLevel& ll = get_ll(req);
+	FangInode* inode = inode_get(ll.inodes, ino);
+	if(inode == nullptr) { fuse_reply_err(req, ENOENT); return; }
+	if(inode->fd < 0) { fuse_reply_err(req, ENOTDIR); return; }
+
+	// The stream gets its own descriptor so that its position is private.
+	const int fd = openat(inode->fd, ".", O_RDONLY|O_DIRECTORY);
+	if(fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	DIR* dir = fdopendir(fd);
+	if(dir == nullptr) {
+		const int new_errno = errno;
+		close(fd);
+		fuse_reply_err(req, new_errno);
+		return;
+	}
+
+	FangDirHandle* handle = new FangDirHandle;
+	handle->dir = dir;
+	handle->offset = 0;
+	handle->entry = nullptr;
+	fi->fh = reinterpret_cast<uintptr_t>(handle);
+	fuse_reply_open(req, fi);
+}
+
+static void fangfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                              struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_READDIR);
+	FangLowLevel& ll = get_ll(req);
+	FangInode* inode = inode_get(ll.inodes, ino);
+	FangDirHandle* handle = get_dir(fi);
+	if(inode == nullptr || handle == nullptr) { fuse_reply_err(req, EBADF); return; }
+
+	if(off != handle->offset) {
+		seekdir(handle->dir, off);
+		handle->entry = nullptr;
+		handle->offset = off;
+	}
+
+	// Both hold plaintext names.
+	Buffer outbuf;
+	buf_make_secure(outbuf);
+	buf_grow(outbuf, size);
+	size_t pos = 0;
+
+	Buffer decrypted;
+	buf_make_secure(decrypted);
+	while(1) {
+		if(handle->entry == nullptr) {
+			errno = 0;
+			handle->entry = readdir(handle->dir);
+			if(handle->entry == nullptr) {
+				if(errno != 0 && pos == 0) {
+					fuse_reply_err(req, errno);
+					return;
+				}
+				break;
+			}
+		}
+
+		const char* cipher_name = handle->entry->d_name;
+		const off_t next_offset = telldir(handle->dir);
+		const char* name = cipher_name;
+
+		// Skip over "special" names
+		bool skip = (cipher_name[0] == '_');
+		if(!skip && strcmp(cipher_name, ".") != 0 && strcmp(cipher_name, "..") != 0) {
+			const int status = name_decrypt(*ll.fs, inode->path, cipher_name, decrypted, &name);
+			if(status == STATUS_TAMPERING) {
+				log_warn("Tampering detected on file %s", cipher_name);
+			}
+			skip = (status < 0);
+		}
+
+		if(!skip) {
+			struct stat info;
+			memset(&info, 0, sizeof(info));
+			info.st_ino = handle->entry->d_ino;
+			info.st_mode = handle->entry->d_type << 12;
+
+			const size_t entry_size = fuse_add_direntry(req,
+			                                            reinterpret_cast<char*>(outbuf.buf) + pos,
+			                                            size - pos, name, &info, next_offset);
+			if(entry_size > size - pos) {
+				// Doesn't fit; hand it out next time.
+				break;
+			}
+			pos += entry_size;
+		}
+
+		handle->entry = nullptr;
+		handle->offset = next_offset;
+	}
+
+	fuse_reply_buf(req, reinterpret_cast<char*>(outbuf.buf), pos);
+}
+
+static void fangfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_RELEASEDIR);
+	FangDirHandle* handle = get_dir(fi);
+	if(handle == nullptr) { fuse_reply_err(req, EBADF); return; }
+
+	closedir(handle->dir);
+	delete handle;
+	fi->fh = 0;
+	fuse_reply_err(req, 0);
+}
+
+static void fangfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	StatScope timer(STAT_OP_STATFS);
+	FangLowLevel& ll = get_ll(req);
+
+	struct statvfs info;
+	if(fstatvfs(ll.inodes.root->fd, &info) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fuse_reply_statfs(req, &info);
+}
+
+int fangfs_lowlevel_main(FangFS& fs, struct fuse_args* args) {
+	struct fuse_lowlevel_ops ops;
+	memset(&ops, 0, sizeof(ops));
+	ops.lookup = fangfs_ll_lookup;
+	ops.forget = fangfs_ll_forget;
+	ops.forget_multi = fangfs_ll_forget_multi;
+	ops.getattr = fangfs_ll_getattr;
+	ops.setattr = fangfs_ll_setattr;
+	ops.mknod = fangfs_ll_mknod;
+	ops.mkdir = fangfs_ll_mkdir;
+	ops.unlink = fangfs_ll_unlink;
+	ops.open = fangfs_ll_open;
+	ops.create = fangfs_ll_create;
+	ops.read = fangfs_ll_read;
+	ops.write = fangfs_ll_write;
+	ops.write_buf = fangfs_ll_write_buf;
+	ops.release = fangfs_ll_release;
+	ops.fsync = fangfs_ll_fsync;
+	ops.flush = fangfs_ll_flush;
+	ops.opendir = fangfs_ll_opendir;
+	ops.readdir = fangfs_ll_readdir;
+	ops.releasedir = fangfs_ll_releasedir;
+	ops.statfs = fangfs_ll_statfs;
+
+	FangLowLevel ll;
+	ll.fs = &fs;
+	if(inode_table_init(ll.inodes, fs.source) < 0) {
+		log_error("Cannot open %s: %s", fs.source, strerror(errno));
+		return 1;
+	}
+
+	char* mountpoint = nullptr;
+	int multithreaded = 0;
+	int foreground = 0;
+	int status = 1;
+
+	if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != -1) {
+		struct fuse_chan* chan = fuse_mount(mountpoint, args);
+		if(chan != nullptr) {
+			struct fuse_session* session = fuse_lowlevel_new(args, &ops, sizeof(ops), &ll);
+			if(session != nullptr) {
+				if(fuse_set_signal_handlers(session) != -1) {
+					fuse_session_add_chan(session, chan);
+					fuse_daemonize(foreground);
+					metafile_claim_lock(fs.metafile);
+					fangfs_relock(fs);
+					stats_dump_on_signal();
+					memory_watch();
+					log_start();
+
+					if(multithreaded) {
+						status = fuse_session_loop_mt(session);
+					} else {
+						status = fuse_session_loop(session);
+					}
+
+					fuse_remove_signal_handlers(session);
+					fuse_session_remove_chan(chan);
+				}
+				fuse_session_destroy(session);
+			}
+			fuse_unmount(mountpoint, chan);
+		}
+	}
+
+	free(mountpoint);
+	inode_table_free(ll.inodes);
+
+	return (status == 0)? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "fangfs.h"
+#include "inode.h"
+
+/// State shared by every request of the low-level FUSE frontend.
+struct FangLowLevel {
+	FangFS* fs;
+	InodeTable inodes;
+};
+
+/// Mount fs using the inode-based low-level FUSE API, and serve requests
+/// until unmounted. args is the FUSE command line, including the mount
+/// point. Returns the process exit status.
+int fangfs_lowlevel_main(FangFS& fs, struct fuse_args* args);
@@ -1,75 +1,236 @@
 #include "fangfs.h"
 
-#include <dirent.h>
+#include <algorithm>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include "options.h"
+#include "pack.h"
+#include "rotate.h"
+#include "trace.h"
+#include "log.h"
+#include "memory.h"
+#include "stats.h"
 #include "error.h"
 #include "compat/compat.h"
 
 static FangFS fangfs;
 
+/// The operation trace, if -o trace was given.
+static Trace trace_file;
+static Trace* trace = nullptr;
+
+static inline bool is_stats_file(const char* path) {
+	return strcmp(path, STATS_FILE_PATH) == 0;
+}
+
+static inline Buffer* get_stats_snapshot(struct fuse_file_info* fi) {
+	return reinterpret_cast<Buffer*>(static_cast<uintptr_t>(fi->fh));
+}
+
 static int fangfs_fuse_mknod(const char* path, mode_t m, dev_t d) {
-	return fangfs_mknod(fangfs, path, m, d);
+	StatScope timer(STAT_OP_MKNOD);
+	if(is_stats_file(path)) { return -EEXIST; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_MKNOD, path, 0, m, start, fangfs_mknod(fangfs, path, m, d));
 }
 
 static int fangfs_fuse_truncate(const char* path, off_t end) {
-	return fangfs_truncate(fangfs, path, end);
+	StatScope timer(STAT_OP_TRUNCATE);
+	if(is_stats_file(path)) { return -EACCES; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_TRUNCATE, path, end, 0, start,
+	                 fangfs_truncate(fangfs, path, end));
 }
 
 static int fangfs_fuse_ftruncate(const char* path, off_t end, struct fuse_file_info* fi) {
-	return fangfs_ftruncate(fangfs, path, end, fi);
+	StatScope timer(STAT_OP_TRUNCATE);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_FTRUNCATE, path, end, 0, start,
+	                 fangfs_ftruncate(fangfs, path, end, fi));
 }
 
 static int fangfs_fuse_unlink(const char* path) {
-	return fangfs_unlink(fangfs, path);
+	StatScope timer(STAT_OP_UNLINK);
+	if(is_stats_file(path)) { return -EACCES; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_UNLINK, path, 0, 0, start, fangfs_unlink(fangfs, path));
 }
 
 static int fangfs_fuse_open(const char* path, struct fuse_file_info* fi) {
-	return fangfs_open(fangfs, path, fi);
+	StatScope timer(STAT_OP_OPEN);
+	if(is_stats_file(path)) {
+		if((fi->flags & O_ACCMODE) != O_RDONLY) { return -EACCES; }
+
+		// Each open reads one consistent snapshot. Its size is only known
+		// once it's taken, so bypass the page cache.
+		Buffer* snapshot = new Buffer;
+		stats_format(*snapshot);
+		fi->fh = reinterpret_cast<uintptr_t>(snapshot);
+		fi->direct_io = 1;
+		return 0;
+	}
+
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_OPEN, path, 0, fi->flags, start,
+	                 fangfs_open(fangfs, path, fi));
+}
+
+static int fangfs_fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_CREATE);
+	if(is_stats_file(path)) { return -EEXIST; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_CREATE, path, 0, mode, start,
+	                 fangfs_create(fangfs, path, mode, fi));
 }
 
 static int fangfs_fuse_release(const char* path, struct fuse_file_info* fi) {
-	return fangfs_close(fangfs, fi);
+	StatScope timer(STAT_OP_RELEASE);
+	if(is_stats_file(path)) {
+		delete get_stats_snapshot(fi);
+		fi->fh = 0;
+		return 0;
+	}
+
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_RELEASE, path, 0, 0, start, fangfs_close(fangfs, fi));
 }
 
 static int fangfs_fuse_getattr(const char* path, struct stat* stbuf) {
-	return fangfs_getattr(fangfs, path, stbuf);
+	StatScope timer(STAT_OP_GETATTR);
+	if(is_stats_file(path)) {
+		stats_file_stat(stbuf);
+		return 0;
+	}
+
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_GETATTR, path, 0, 0, start,
+	                 fangfs_getattr(fangfs, path, stbuf));
 }
 
 static int fangfs_fuse_read(const char* path, char* buf, size_t size, \
                             off_t offset, struct fuse_file_info* fi) {
-	return fangfs_read(fangfs, buf, size, offset, fi);
+	StatScope timer(STAT_OP_READ);
+	if(is_stats_file(path)) {
+		const Buffer& snapshot = *get_stats_snapshot(fi);
+		if(offset >= static_cast<off_t>(snapshot.len)) { return 0; }
+		const size_t n = std::min(size, snapshot.len - offset);
+		memcpy(buf, snapshot.buf + offset, n);
+		return n;
+	}
+
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_READ, path, offset, size, start,
+	                 fangfs_read(fangfs, buf, size, offset, fi));
 }
 
 static int fangfs_fuse_write(const char* path, const char* buf, size_t size, \
                              off_t offset, struct fuse_file_info* fi) {
-	return fangfs_write(fangfs, buf, size, offset, fi);
+	StatScope timer(STAT_OP_WRITE);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_WRITE, path, offset, size, start,
+	                 fangfs_write(fangfs, buf, size, offset, fi));
+}
+
+static int fangfs_fuse_read_buf(const char* path, struct fuse_bufvec** bufp, \
+                                size_t size, off_t offset, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_READ);
+	if(is_stats_file(path)) {
+		const Buffer& snapshot = *get_stats_snapshot(fi);
+		const size_t n = (offset >= static_cast<off_t>(snapshot.len))?
+		                 0 : std::min(size, snapshot.len - offset);
+		struct fuse_bufvec* bufv = reinterpret_cast<struct fuse_bufvec*>(malloc(sizeof(*bufv)));
+		void* mem = malloc(n > 0 ? n : 1);
+		if(bufv == nullptr || mem == nullptr) {
+			free(bufv);
+			free(mem);
+			return -ENOMEM;
+		}
+		memcpy(mem, snapshot.buf + offset, n);
+		memset(bufv, 0, sizeof(*bufv));
+		bufv->count = 1;
+		bufv->buf[0].size = n;
+		bufv->buf[0].mem = mem;
+		bufv->buf[0].fd = -1;
+		*bufp = bufv;
+		return 0;
+	}
+
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_READ, path, offset, size, start,
+	                 fangfs_read_buf(fangfs, bufp, size, offset, fi));
+}
+
+static int fangfs_fuse_write_buf(const char* path, struct fuse_bufvec* buf, \
+                                 off_t offset, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_WRITE);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_WRITE, path, offset, fuse_buf_size(buf), start,
+	                 fangfs_write_buf(fangfs, buf, offset, fi));
+}
+
+static int fangfs_fuse_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_FSYNC);
+	if(is_stats_file(path)) { return 0; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_FSYNC, path, 0, datasync, start,
+	                 fangfs_fsync(fangfs, datasync, fi));
+}
+
+static int fangfs_fuse_flush(const char* path, struct fuse_file_info* fi) {
+	StatScope timer(STAT_OP_FLUSH);
+	if(is_stats_file(path)) { return 0; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_FLUSH, path, 0, 0, start, fangfs_flush(fangfs, fi));
 }
 
 static int fangfs_fuse_mkdir(const char* path, mode_t mode) {
-	return fangfs_mkdir(fangfs, path, mode);
+	StatScope timer(STAT_OP_MKDIR);
+	if(is_stats_file(path)) { return -EEXIST; }
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_MKDIR, path, 0, mode, start,
+	                 fangfs_mkdir(fangfs, path, mode));
 }
 
 static int fangfs_fuse_opendir(const char* path, struct fuse_file_info* fi) {
-	return fangfs_opendir(fangfs, path, fi);
+	StatScope timer(STAT_OP_OPENDIR);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_OPENDIR, path, 0, 0, start,
+	                 fangfs_opendir(fangfs, path, fi));
 }
 
 static int fangfs_fuse_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
                                off_t offset, struct fuse_file_info* fi) {
-	return fangfs_readdir(fangfs, path, buf, filler, offset, fi);
+	StatScope timer(STAT_OP_READDIR);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_READDIR, path, offset, 0, start,
+	                 fangfs_readdir(fangfs, path, buf, filler, offset, fi));
 }
 
 static int fangfs_fuse_releasedir(const char* path, struct fuse_file_info* fi) {
-	DIR* dir = fdopendir(fi->fh);
-	if(dir == nullptr) { return -errno; }
+	StatScope timer(STAT_OP_RELEASEDIR);
+	const uint64_t start = trace_begin(trace);
+	return trace_end(trace, TRACE_RELEASEDIR, path, 0, 0, start,
+	                 fangfs_releasedir(fangfs, path, fi));
+}
 
-	if(closedir(fdopendir(fi->fh)) < 0) {
-		return -errno;
-	}
+static void* fangfs_fuse_init(struct fuse_conn_info* conn) {
+	// fuse_main() may have forked us into the background since we took the
+	// metafile lock and locked memory, and any threads started before then
+	// are gone.
+	metafile_claim_lock(fangfs.metafile);
+	fangfs_relock(fangfs);
+	stats_dump_on_signal();
+	memory_watch();
+	log_start();
 
-	return 0;
+	// Likewise, the key rotation and packing engines can only start now.
+	if(fangfs.rotation != nullptr) { rotate_start(fangfs); }
+	if(fangfs.pack != nullptr) { pack_start(fangfs); }
+	return nullptr;
 }
 
 static struct fuse_operations fang_ops;
@@ -84,15 +245,21 @@ void handle_signal(int signum) {
 }
 
 int main(int argc, char** argv) {
+	fang_ops.init = fangfs_fuse_init;
 	fang_ops.mknod = fangfs_fuse_mknod;
 	fang_ops.truncate = fangfs_fuse_truncate;
 	fang_ops.ftruncate = fangfs_fuse_ftruncate;
 	fang_ops.unlink = fangfs_fuse_unlink;
     fang_ops.open = fangfs_fuse_open;
+    fang_ops.create = fangfs_fuse_create;
     fang_ops.release = fangfs_fuse_release;
     fang_ops.getattr = fangfs_fuse_getattr;
     fang_ops.read = fangfs_fuse_read;
     fang_ops.write = fangfs_fuse_write;
+    fang_ops.read_buf = fangfs_fuse_read_buf;
+    fang_ops.write_buf = fangfs_fuse_write_buf;
+    fang_ops.fsync = fangfs_fuse_fsync;
+    fang_ops.flush = fangfs_fuse_flush;
     fang_ops.mkdir = fangfs_fuse_mkdir;
     fang_ops.opendir = fangfs_fuse_opendir;
     fang_ops.readdir = fangfs_fuse_readdir;
@@ -106,20 +273,38 @@ int main(int argc, char** argv) {
 	argc--;
 	argv++;
 
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fangfs_parse_options(fangfs, &args) < 0) {
+		return 1;
+	}
+
 	try {
 		const int status = fangfs_fsinit(fangfs, source_dir);
 		if(status < 0) {
-			fprintf(stderr, "Initialization error: %d.\n", status);
 			if(status == STATUS_CHECK_ERRNO) {
-				fprintf(stderr, "%s\n", strerror(errno));
+				log_error("Initialization error: %d. %s", status, strerror(errno));
+			} else {
+				log_error("Initialization error: %d.", status);
 			}
 			return 1;
 		}
 	} catch (std::runtime_error& e) {
-		fprintf(stderr, "Initialization panic: %s\n", e.what());
+		log_error("Initialization panic: %s", e.what());
 		return 1;
 	}
 
+	if(fangfs.trace_path != nullptr) {
+		const uint32_t capacity = (fangfs.trace_records > 0)?
+		                          fangfs.trace_records : TRACE_DEFAULT_RECORDS;
+		if(trace_open(trace_file, fangfs.trace_path, capacity) < 0) {
+			log_error("Cannot create trace %s: %s", fangfs.trace_path,
+			          strerror(errno));
+			fangfs_fsclose(fangfs);
+			return 1;
+		}
+		trace = &trace_file;
+	}
+
 	// If we recieve a shutdown signal, we still want to clear any secret
 	// memory.
 	struct sigaction action;
@@ -130,12 +315,18 @@ int main(int argc, char** argv) {
 
 	int status = 0;
 	try {
-		status = fuse_main(argc, argv, &fang_ops, nullptr);
+		status = fuse_main(args.argc, args.argv, &fang_ops, nullptr);
 	} catch (std::runtime_error& e) {
-		fprintf(stderr, "Panic: %s\n", e.what());
+		log_error("Panic: %s", e.what());
 		status = 1;
 	}
 
+	log_stop();
 	fangfs_fsclose(fangfs);
+	if(trace != nullptr) {
+		trace = nullptr;
+		trace_close(trace_file);
+	}
+	fuse_opt_free_args(&args);
 	return status;
 }
@@ -0,0 +1,87 @@
+#include "fangfs.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include "log.h"
+#include "lowlevel.h"
+#include "options.h"
+#include "error.h"
+
+static FangFS fangfs;
+
+int main(int argc, char** argv) {
+	if(argc < 3) {
+		fprintf(stderr, "Usage: %s <source> <mountpoint> [options]\n", argv[0]);
+		return 1;
+	}
+
+	const char* source_dir = argv[1];
+	argc--;
+	argv++;
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fangfs_parse_options(fangfs, &args) < 0) {
+		return 1;
+	}
+
+	if(fangfs.trace_path != nullptr) {
+		log_error("-o trace is only supported by the high-level frontend");
+		return 1;
+	}
+
+	if(fangfs.rotate_key) {
+		log_error("-o rotate_key is only supported by the high-level frontend");
+		return 1;
+	}
+
+	if(fangfs.dir_index != 0) {
+		log_error("-o dir_index is only supported by the high-level frontend");
+		return 1;
+	}
+
+	try {
+		const int status = fangfs_fsinit(fangfs, source_dir);
+		if(status < 0) {
+			if(status == STATUS_CHECK_ERRNO) {
+				log_error("Initialization error: %d. %s", status, strerror(errno));
+			} else {
+				log_error("Initialization error: %d.", status);
+			}
+			return 1;
+		}
+	} catch (std::runtime_error& e) {
+		log_error("Initialization panic: %s", e.what());
+		return 1;
+	}
+
+	// Inodes cache backing names, which the rotation engine would change
+	// under them.
+	if(fangfs.rotation != nullptr) {
+		log_error("A key rotation is under way; mount with fangfs until it finishes");
+		fangfs_fsclose(fangfs);
+		return 1;
+	}
+
+	// Likewise, packing replaces backing files.
+	if(fangfs.pack != nullptr) {
+		log_error("This filesystem packs small files; mount it with fangfs");
+		fangfs_fsclose(fangfs);
+		return 1;
+	}
+
+	// FUSE installs its own SIGINT/SIGTERM handlers for the session, which
+	// end the loop and bring us back here to clear secret memory.
+	int status = 0;
+	try {
+		status = fangfs_lowlevel_main(fangfs, &args);
+	} catch (std::runtime_error& e) {
+		log_error("Panic: %s", e.what());
+		status = 1;
+	}
+
+	log_stop();
+	fangfs_fsclose(fangfs);
+	fuse_opt_free_args(&args);
+	return status;
+}
@@ -0,0 +1,319 @@
+// The memory accountant. Subsystems charge what they hold to it, each under
+// its own name; those with memory they can do without reserve it against the
+// budget first, and register a shrinker to give it back. A watcher thread
+// calls on the shrinkers when a reservation is refused, and when the kernel
+// reports memory pressure: through a PSI trigger on the cgroup the process
+// is in, or on the whole system, or failing both, by noticing the cgroup's
+// memory.events counters go up. Builds without mntent.h can't find the
+// cgroup, and only make room for refused reservations.
+#include "memory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MNTENT_H
+#include <mntent.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "log.h"
+#include "securepool.h"
+#include "stats.h"
+
+/// Once over budget, memory is given back until the total is this share of
+/// the budget below it, so that the next few reservations don't miss.
+#define MEMORY_LOW_WATER 8
+
+/// Under pressure, the shrinkers are asked for this share of the total.
+#define MEMORY_PRESSURE_SHARE 4
+
+/// Pressure is a stall of 150ms in any 2s: the shortest window that
+/// unprivileged processes may watch.
+#define MEMORY_PSI_TRIGGER "some 150000 2000000"
+
+/// How often memory.events is read when it is all there is to go on, in ms.
+#define MEMORY_EVENTS_INTERVAL 1000
+
+static const char* const memory_user_names[] = {
+	"secure_pool", "file_buffers", "resident_files", "dir_indexes"
+};
+static_assert(sizeof(memory_user_names) / sizeof(memory_user_names[0]) == MEM_N_USERS,
+              "missing memory user name");
+
+struct Shrinker {
+	Shrinker(): fn(nullptr), arg(nullptr) {}
+
+	MemoryShrinker fn;
+	void* arg;
+};
+
+static std::atomic<size_t> budget(0);
+static std::atomic<size_t> charged(0);
+static std::atomic<size_t> user_charged[MEM_N_USERS];
+
+/// Held while shrinkers are called, and to change them.
+static std::mutex shrink_lock;
+static Shrinker shrinkers[MEM_N_USERS];
+
+/// Refused reservations add up what they asked for here, and poke this pipe
+/// to wake the watcher.
+static std::atomic<size_t> wanted(0);
+static int wake_pipe[2] = {-1, -1};
+
+static size_t pool_bytes() {
+	SecurePoolUsage pool;
+	secure_pool_usage(pool);
+	return pool.pool_bytes;
+}
+
+void memory_set_budget(size_t bytes) {
+	budget.store(bytes, std::memory_order_relaxed);
+}
+
+bool memory_reserve(MemoryUser user, size_t len) {
+	const size_t limit = budget.load(std::memory_order_relaxed);
+	const size_t total = charged.fetch_add(len, std::memory_order_relaxed) + len;
+	if(limit == 0 || total + pool_bytes() <= limit) {
+		user_charged[user].fetch_add(len, std::memory_order_relaxed);
+		return true;
+	}
+
+	charged.fetch_sub(len, std::memory_order_relaxed);
+	stats_count(STAT_MEMORY_REFUSED, 1);
+	if(wake_pipe[1] >= 0) {
+		wanted.fetch_add(len, std::memory_order_relaxed);
+		const char c = 0;
+		if(write(wake_pipe[1], &c, 1) < 0) {}
+	}
+	return false;
+}
+
+void memory_charge(MemoryUser user, size_t len) {
+	charged.fetch_add(len, std::memory_order_relaxed);
+	user_charged[user].fetch_add(len, std::memory_order_relaxed);
+}
+
+void memory_release(MemoryUser user, size_t len) {
+	charged.fetch_sub(len, std::memory_order_relaxed);
+	user_charged[user].fetch_sub(len, std::memory_order_relaxed);
+}
+
+void memory_register_shrinker(MemoryUser user, MemoryShrinker shrinker, void* arg) {
+	std::lock_guard<std::mutex> guard(shrink_lock);
+	shrinkers[user].fn = shrinker;
+	shrinkers[user].arg = arg;
+}
+
+void memory_unregister_shrinker(MemoryUser user) {
+	std::lock_guard<std::mutex> guard(shrink_lock);
+	shrinkers[user] = Shrinker();
+}
+
+size_t memory_shrink(size_t goal) {
+	std::lock_guard<std::mutex> guard(shrink_lock);
+	size_t freed = 0;
+	for(size_t i = 0; i < MEM_N_USERS && freed < goal; i += 1) {
+		if(shrinkers[i].fn == nullptr) { continue; }
+		freed += shrinkers[i].fn(shrinkers[i].arg, goal - freed);
+	}
+
+	stats_count(STAT_MEMORY_RECLAIMED, freed);
+	return freed;
+}
+
+void memory_usage(MemoryUsage& usage) {
+	usage.budget = budget.load(std::memory_order_relaxed);
+	usage.total = 0;
+	for(size_t i = 0; i < MEM_N_USERS; i += 1) {
+		usage.users[i] = user_charged[i].load(std::memory_order_relaxed);
+	}
+	usage.users[MEM_SECURE_POOL] = pool_bytes();
+	for(size_t i = 0; i < MEM_N_USERS; i += 1) { usage.total += usage.users[i]; }
+}
+
+const char* memory_user_name(MemoryUser user) {
+	return memory_user_names[user];
+}
+
+#ifdef HAVE_MNTENT_H
+/// The directory of the cgroup v2 group the process is in, or "" if there
+/// is none.
+static std::string cgroup_dir() {
+	// Where cgroup v2 is mounted: /sys/fs/cgroup, or beside v1 controllers,
+	// usually /sys/fs/cgroup/unified.
+	std::string mount;
+	FILE* mounts = setmntent("/proc/self/mounts", "re");
+	if(mounts == nullptr) { return std::string(); }
+	while(struct mntent* entry = getmntent(mounts)) {
+		if(strcmp(entry->mnt_type, "cgroup2") == 0) {
+			mount = entry->mnt_dir;
+			break;
+		}
+	}
+	endmntent(mounts);
+	if(mount.empty()) { return std::string(); }
+
+	FILE* file = fopen("/proc/self/cgroup", "re");
+	if(file == nullptr) { return std::string(); }
+
+	std::string dir;
+	char line[4096];
+	while(fgets(line, sizeof(line), file) != nullptr) {
+		if(strncmp(line, "0::", 3) != 0) { continue; }
+		line[strcspn(line, "\n")] = '\0';
+		dir = mount + (line + 3);
+		break;
+	}
+
+	fclose(file);
+	return dir;
+}
+
+/// Open a PSI file and set a trigger on it, returning the descriptor to
+/// poll for POLLPRI, or -1.
+static int open_psi(const std::string& path) {
+	const int fd = open(path.c_str(), O_RDWR|O_NONBLOCK|O_CLOEXEC);
+	if(fd < 0) { return -1; }
+
+	if(write(fd, MEMORY_PSI_TRIGGER, sizeof(MEMORY_PSI_TRIGGER)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+/// The number of times a memory.events file says the cgroup hit its high or
+/// hard limit, or ran out of memory.
+static uint64_t read_events(int fd) {
+	char text[1024];
+	const ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+	if(n <= 0) { return 0; }
+	text[n] = '\0';
+
+	uint64_t events = 0;
+	for(const char* line = text; line != nullptr && *line != '\0'; ) {
+		char name[32];
+		unsigned long long count;
+		if(sscanf(line, "%31s %llu", name, &count) == 2 &&
+		   (strcmp(name, "high") == 0 || strcmp(name, "max") == 0 || strcmp(name, "oom") == 0)) {
+			events += count;
+		}
+		line = strchr(line, '\n');
+		if(line != nullptr) { line += 1; }
+	}
+	return events;
+}
+
+/// Give back enough memory for the reservations refused so far to fit in
+/// the budget, and under pressure, a share of everything.
+static void make_room(bool pressure) {
+	MemoryUsage usage;
+	memory_usage(usage);
+
+	size_t goal = 0;
+	const size_t demand = usage.total + wanted.exchange(0, std::memory_order_relaxed);
+	const size_t low_water = usage.budget - usage.budget / MEMORY_LOW_WATER;
+	if(usage.budget > 0 && demand > low_water) { goal = demand - low_water; }
+	if(pressure) {
+		stats_count(STAT_MEMORY_PRESSURE, 1);
+		goal = std::max(goal, usage.total / MEMORY_PRESSURE_SHARE);
+	}
+
+	if(goal == 0) { return; }
+	const size_t freed = memory_shrink(goal);
+	log_debug("Gave back %zu KiB of %zu KiB asked for", freed >> 10, goal >> 10);
+}
+
+static void watch_thread(int psi_fd, int events_fd) {
+	struct pollfd fds[2];
+	fds[0].fd = wake_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = psi_fd;
+	fds[1].events = POLLPRI;
+
+	uint64_t events = (events_fd >= 0)? read_events(events_fd) : 0;
+	while(1) {
+		const nfds_t n_fds = (psi_fd >= 0)? 2 : 1;
+		const int timeout = (psi_fd < 0 && events_fd >= 0)? MEMORY_EVENTS_INTERVAL : -1;
+		fds[0].revents = fds[1].revents = 0;
+		if(poll(fds, n_fds, timeout) < 0) {
+			if(errno == EINTR) { continue; }
+			return;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			char drain[64];
+			if(read(wake_pipe[0], drain, sizeof(drain)) < 0) {}
+		}
+
+		bool pressure = false;
+		if(psi_fd >= 0 && (fds[1].revents & POLLERR)) {
+			// The cgroup is gone; memory.events is too, so only refused
+			// reservations are left to go on.
+			close(psi_fd);
+			psi_fd = -1;
+		} else if(psi_fd >= 0 && (fds[1].revents & POLLPRI)) {
+			pressure = true;
+		} else if(psi_fd < 0 && events_fd >= 0) {
+			const uint64_t now = read_events(events_fd);
+			pressure = (now > events);
+			events = now;
+		}
+
+		make_room(pressure);
+	}
+}
+
+/// Open wake_pipe, both ends close-on-exec and non-blocking. Returns 0, or
+/// -1 with errno set.
+static int open_wake_pipe() {
+#ifdef HAVE_PIPE2
+	return pipe2(wake_pipe, O_CLOEXEC|O_NONBLOCK);
+#else
+	if(pipe(wake_pipe) < 0) { return -1; }
+	for(int i = 0; i < 2; i += 1) {
+		if(fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC) < 0 ||
+		   fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK) < 0) {
+			close(wake_pipe[0]);
+			close(wake_pipe[1]);
+			wake_pipe[0] = wake_pipe[1] = -1;
+			return -1;
+		}
+	}
+	return 0;
+#endif
+}
+
+void memory_watch() {
+	if(wake_pipe[0] >= 0 || open_wake_pipe() < 0) { return; }
+
+	int psi_fd = -1;
+	int events_fd = -1;
+#ifdef HAVE_MNTENT_H
+	const std::string dir = cgroup_dir();
+	psi_fd = dir.empty()? -1 : open_psi(dir + "/memory.pressure");
+	if(psi_fd >= 0) {
+		log_debug("Watching %s/memory.pressure", dir.c_str());
+	} else if((psi_fd = open_psi("/proc/pressure/memory")) >= 0) {
+		log_debug("Watching /proc/pressure/memory");
+	}
+
+	if(psi_fd < 0 && !dir.empty()) {
+		events_fd = open((dir + "/memory.events").c_str(), O_RDONLY|O_CLOEXEC);
+		if(events_fd >= 0) { log_debug("Watching %s/memory.events", dir.c_str()); }
+	}
+#endif
+	if(psi_fd < 0 && events_fd < 0) {
+		log_info("Cannot watch for memory pressure; only the memory budget is enforced");
+	}
+
+	std::thread(watch_thread, psi_fd, events_fd).detach();
+}
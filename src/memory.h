@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// The default memory budget of a mount, as a share of RAM.
+#define MEMORY_DEFAULT_SHARE 0.25
+
+/// The parts of the process whose memory is accounted for. Keep
+/// memory_user_names in step.
+enum MemoryUser {
+	/// The locked pool of secure buffers. Its size is fixed when it is set
+	/// up, and is read from the pool rather than charged.
+	MEM_SECURE_POOL,
+
+	/// The decrypted tail and scratch buffers of open files, where they
+	/// live outside of the secure pool.
+	MEM_FILE_BUFFERS,
+
+	/// The contents of packed files open for reading.
+	MEM_RESIDENT_FILES,
+
+	/// Directory indexes in use: their mapped chunks and the changes made
+	/// since they were last written out.
+	MEM_DIR_INDEXES,
+	MEM_N_USERS
+};
+
+struct MemoryUsage {
+	/// 0 if there is no budget.
+	size_t budget;
+	size_t total;
+	size_t users[MEM_N_USERS];
+};
+
+/// Give back memory that user can do without: at least goal bytes if it
+/// can, as counted by its charges. Returns how many bytes were given back.
+/// Called from the memory watcher, without any of the filesystem's locks.
+typedef size_t (*MemoryShrinker)(void* arg, size_t goal);
+
+/// Limit the memory charged by every user to bytes in all, or lift the
+/// limit with 0.
+void memory_set_budget(size_t bytes);
+
+/// Charge len bytes to user if the total stays within the budget, and
+/// return true. Otherwise, charge nothing, ask the memory watcher to make
+/// room, and return false; the caller then makes do without the memory.
+bool memory_reserve(MemoryUser user, size_t len);
+
+/// Charge len bytes that user can't do without, budget or not.
+void memory_charge(MemoryUser user, size_t len);
+void memory_release(MemoryUser user, size_t len);
+
+/// Move a charge of user from old_len bytes to new_len, budget or not.
+static inline void memory_adjust(MemoryUser user, size_t old_len, size_t new_len) {
+	if(new_len > old_len) {
+		memory_charge(user, new_len - old_len);
+	} else if(new_len < old_len) {
+		memory_release(user, old_len - new_len);
+	}
+}
+
+/// Have shrinker, called with arg, give back user's memory when the budget
+/// runs out or the system is short of memory. Each user has at most one.
+void memory_register_shrinker(MemoryUser user, MemoryShrinker shrinker, void* arg);
+
+/// Forget user's shrinker, waiting for it to return if it is running.
+void memory_unregister_shrinker(MemoryUser user);
+
+/// Ask each shrinker in turn to give back memory, until goal bytes have
+/// been. Returns how many bytes were.
+size_t memory_shrink(size_t goal);
+
+void memory_usage(MemoryUsage& usage);
+
+/// The name of user in statistics.
+const char* memory_user_name(MemoryUser user);
+
+/// Start a thread that makes room whenever a reservation is refused, and
+/// whenever the cgroup the process is in, or failing that the whole system,
+/// reports memory pressure. Call it after any fork into the background.
+void memory_watch();
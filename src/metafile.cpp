@@ -1,18 +1,32 @@
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include "util.h"
 #include "exlockfile.h"
 #include "metafile.h"
+#include "keycache.h"
+#include "codec.h"
+#include "log.h"
+#include "stats.h"
 #include "error.h"
 #include "compat/compat.h"
 
-// Don't use more than 128M of memory in our kdf when using automatic settings.
-#define MAX_MEM_LIMIT 1024 * 1024 * 1024
+// Don't use more than 1G of memory in our kdf when using automatic settings.
+#define MAX_MEM_LIMIT (1024 * 1024 * 1024)
+
+// Memory used for the first, cheap calibration run.
+#define KDF_PROBE_MEMLIMIT crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN
+
+// Calibration is done once a run lands within this factor of the target.
+#define KDF_TOLERANCE 1.25
+#define KDF_MAX_ROUNDS 4
 
 static int metafile_init_new(Metafile& self) {
 	// Figure out our block size
@@ -31,8 +45,12 @@ static int metafile_init_new(Metafile& self) {
 }
 
 static Metafield* metafile_append_key(Metafile& self) {
-	if(self.n_keys >= METAFILE_MAX_KEYS) {
-		return nullptr;
+	if(self.n_keys >= self.keys_capacity) {
+		const size_t capacity = (self.keys_capacity == 0)? 4 : self.keys_capacity * 2;
+		Metafield* keys = (Metafield*)realloc(self.keys, capacity * sizeof(Metafield));
+		if(keys == nullptr) { throw AllocationError(); }
+		self.keys = keys;
+		self.keys_capacity = capacity;
 	}
 
 	Metafield* field = &self.keys[self.n_keys];
@@ -42,7 +60,11 @@ static Metafield* metafile_append_key(Metafile& self) {
 	return field;
 }
 
-void metafield_parse(Metafield& self, const uint8_t inbuf[META_FIELD_LEN]) {
+size_t metafield_len(uint8_t version) {
+	return (version == 0)? META_FIELD_V0_LEN : META_FIELD_LEN;
+}
+
+void metafield_parse(Metafield& self, const uint8_t* inbuf, uint8_t version) {
 	uint8_t const* cur = inbuf;
 
 	self.opslimit = u32_from_le((uint32_t)(u32_from_bytes(cur)));
@@ -51,6 +73,18 @@ void metafield_parse(Metafield& self, const uint8_t inbuf[META_FIELD_LEN]) {
 	self.memlimit = u32_from_le((uint32_t)(u32_from_bytes(cur)));
 	cur += sizeof(uint32_t);
 
+	// Version 0 fields have neither a salt nor an ID.
+	if(version == 0) {
+		memset(self.salt, 0, sizeof(self.salt));
+		memset(self.key_id, 0, sizeof(self.key_id));
+	} else {
+		memcpy(self.salt, cur, sizeof(self.salt));
+		cur += sizeof(self.salt);
+
+		memcpy(self.key_id, cur, sizeof(self.key_id));
+		cur += sizeof(self.key_id);
+	}
+
 	memcpy(self.nonce, cur, sizeof(self.nonce));
 	cur += sizeof(self.nonce);
 
@@ -60,11 +94,19 @@ void metafield_parse(Metafield& self, const uint8_t inbuf[META_FIELD_LEN]) {
 void metafield_serialize(Metafield& self, uint8_t outbuf[META_FIELD_LEN]) {
 	uint8_t* cur = outbuf;
 
-	memcpy(cur, &self.opslimit, sizeof(self.opslimit));
-	cur += sizeof(self.opslimit);
+	const uint32_t opslimit = u32_to_le(self.opslimit);
+	memcpy(cur, &opslimit, sizeof(opslimit));
+	cur += sizeof(opslimit);
+
+	const uint32_t memlimit = u32_to_le(self.memlimit);
+	memcpy(cur, &memlimit, sizeof(memlimit));
+	cur += sizeof(memlimit);
 
-	memcpy(cur, &self.memlimit, sizeof(self.memlimit));
-	cur += sizeof(self.memlimit);
+	memcpy(cur, self.salt, sizeof(self.salt));
+	cur += sizeof(self.salt);
+
+	memcpy(cur, self.key_id, sizeof(self.key_id));
+	cur += sizeof(self.key_id);
 
 	memcpy(cur, self.nonce, sizeof(self.nonce));
 	cur += sizeof(self.nonce);
@@ -72,6 +114,13 @@ void metafield_serialize(Metafield& self, uint8_t outbuf[META_FIELD_LEN]) {
 	memcpy(cur, self.encrypted_key, sizeof(self.encrypted_key));
 }
 
+void metafield_key_id(const Metafield& self, const char* key_name,
+                      uint8_t outbuf[METAFIELD_ID_LEN]) {
+	crypto_generichash(outbuf, METAFIELD_ID_LEN,
+	                   reinterpret_cast<const uint8_t*>(key_name), strlen(key_name),
+	                   self.salt, sizeof(self.salt));
+}
+
 static int get_paths(Metafile& self, const char* sourcepath) {
 	// Create the path to the metafile
 	Buffer path_buf;
@@ -81,6 +130,13 @@ static int get_paths(Metafile& self, const char* sourcepath) {
 		return STATUS_ERROR;
 	}
 
+	// Create the path that new versions of the metafile are written to
+	path_join(sourcepath, METAFILE_TEMP, path_buf);
+	self.temppath = buf_copy_string(path_buf);
+	if(self.temppath == nullptr) {
+		return STATUS_ERROR;
+	}
+
 	// Create the path to the lockfile
 	path_join(sourcepath, METAFILE_LOCK, path_buf);
 
@@ -95,18 +151,33 @@ static int get_paths(Metafile& self, const char* sourcepath) {
 int metafile_init(Metafile& self, const char* sourcepath) {
 	self.version = FANGFS_META_VERSION;
 	memset(self.filename_nonce, 0, sizeof(self.filename_nonce));
+	self.compression = CODEC_NONE;
+	self.rotating = false;
 	self.n_keys = 0;
-	memset(self.keys, 0, sizeof(self.keys));
+	self.keys_capacity = 0;
+	self.keys = nullptr;
+	self.metafd = -1;
+	self.lockfd = -1;
+	self.metapath = nullptr;
+	self.temppath = nullptr;
+	self.lockpath = nullptr;
 
 	{
 		int status = get_paths(self, sourcepath);
 		if(status < 0) { return status; }
 	}
 
-	{
-		// Obtain our lock file so we can safely open up the metafile
-		int status = exlock_obtain(self.lockpath);
-		if(status != 0) { return status; }
+	// Obtain our lock file so we can safely open up the metafile
+	self.lockfd = exlock_obtain(self.lockpath, METAFILE_LOCK_TIMEOUT_MS);
+	if(self.lockfd < 0) {
+		const int new_errno = errno;
+		if(errno == ETIMEDOUT) {
+			const pid_t owner = exlock_owner(self.lockpath);
+			log_error("%s is locked by process %d; is it already mounted?",
+			          sourcepath, static_cast<int>(owner));
+		}
+		errno = new_errno;
+		return self.lockfd;
 	}
 
 	// Open the metafile
@@ -141,7 +212,7 @@ int metafile_init(Metafile& self, const char* sourcepath) {
 }
 
 int metafile_parse(Metafile& self) {
-	printf("Parsing\n");
+	log_debug("Parsing");
 
 	if(lseek(self.metafd, 0, SEEK_SET) < 0) {
 		return STATUS_CHECK_ERRNO;
@@ -166,40 +237,114 @@ int metafile_parse(Metafile& self) {
 		}
 	}
 
+	if(self.version > FANGFS_META_VERSION) {
+		errno = EPROTONOSUPPORT;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	// Version 2 added flags, and the previous key of a rotation, and version
+	// 3 the compression codec.
+	self.rotating = false;
+	self.compression = CODEC_NONE;
+	if(self.version >= 2) {
+		uint8_t flags = 0;
+		ssize_t n_read = read(self.metafd, &flags, sizeof(flags));
+		if(n_read != 1) {
+			return STATUS_CHECK_ERRNO;
+		}
+
+		if(self.version >= 3) {
+			n_read = read(self.metafd, &self.compression, sizeof(self.compression));
+			if(n_read != 1) {
+				return STATUS_CHECK_ERRNO;
+			}
+		}
+
+		if(flags & METAFILE_ROTATING) {
+			n_read = read(self.metafd, self.previous_nonce, sizeof(self.previous_nonce));
+			if(n_read < (ssize_t)sizeof(self.previous_nonce)) {
+				return STATUS_CHECK_ERRNO;
+			}
+
+			n_read = read(self.metafd, self.previous_key, sizeof(self.previous_key));
+			if(n_read < (ssize_t)sizeof(self.previous_key)) {
+				return STATUS_CHECK_ERRNO;
+			}
+			self.rotating = true;
+		}
+	}
+
 	// Read records until EOF
+	const size_t field_len = metafield_len(self.version);
 	while(1) {
 		uint8_t buf[META_FIELD_LEN];
-		ssize_t n_read = 0;
+		size_t n_read = 0;
 
 		// Read the current record until either EOF or it's finished.
-		while(n_read < (ssize_t)META_FIELD_LEN) {
-			ssize_t n = read(self.metafd, buf, (META_FIELD_LEN-n_read));
+		while(n_read < field_len) {
+			ssize_t n = read(self.metafd, buf + n_read, field_len - n_read);
 			if(n == 0) {
 				// EOF
 				return 0;
+			} else if(n < 0) {
+				if(errno == EINTR) { continue; }
+				return STATUS_CHECK_ERRNO;
 			}
 			n_read += n;
 		}
 
 		Metafield* field = metafile_append_key(self);
-		if(field == nullptr) {
-			return STATUS_METAFILE_TOO_MANY_KEYS;
-		}
-		metafield_parse(*field, buf);
+		metafield_parse(*field, buf, self.version);
 	}
 }
 
-int metafile_write(Metafile& self) {
-	// XXX We should back up the metafile BEFORE overwriting it.
-	// Just in case.
-	if(lseek(self.metafd, 0, SEEK_SET) < 0) {
-		return STATUS_CHECK_ERRNO;
+/// Flush the directory entry of path, so that a rename onto it is on disk.
+static int sync_parent(const char* path) {
+	size_t dir_len = path_get_basename(path) - path;
+	Buffer dir;
+	buf_grow(dir, dir_len + 2);
+	memcpy(dir.buf, path, dir_len);
+	if(dir_len == 0) { dir.buf[dir_len++] = '.'; }
+	dir.buf[dir_len] = '\0';
+
+	const int fd = open(reinterpret_cast<char*>(dir.buf), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(fd < 0) { return -1; }
+	const int status = fsync(fd);
+	const int new_errno = errno;
+	close(fd);
+	errno = new_errno;
+	return status;
+}
+
+/// Write len bytes of buf to fd, and flush them to disk.
+static int write_synced(int fd, const uint8_t* buf, size_t len) {
+	size_t n_written = 0;
+	while(n_written < len) {
+		const ssize_t n = write(fd, buf + n_written, len - n_written);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+
+		n_written += n;
 	}
 
+	return fsync(fd);
+}
+
+int metafile_write(Metafile& self) {
+	// Older metafiles are upgraded on write.
+	self.version = FANGFS_META_VERSION;
+	const uint8_t flags = self.rotating? METAFILE_ROTATING : 0;
 	size_t outbuf_len = sizeof(self.version) +
 	                    sizeof(self.block_size) +
 	                    sizeof(self.filename_nonce) +
+	                    sizeof(flags) +
+	                    sizeof(self.compression) +
 	                    (META_FIELD_LEN * self.n_keys);
+	if(self.rotating) {
+		outbuf_len += sizeof(self.previous_nonce) + sizeof(self.previous_key);
+	}
 	uint8_t* outbuf = (uint8_t*)malloc(outbuf_len);
 	uint8_t* cur = outbuf;
 
@@ -213,65 +358,405 @@ int metafile_write(Metafile& self) {
 	memcpy(cur, self.filename_nonce, sizeof(self.filename_nonce));
 	cur += sizeof(self.filename_nonce);
 
+	*cur = flags;
+	cur += sizeof(flags);
+
+	*cur = self.compression;
+	cur += sizeof(self.compression);
+
+	if(self.rotating) {
+		memcpy(cur, self.previous_nonce, sizeof(self.previous_nonce));
+		cur += sizeof(self.previous_nonce);
+
+		memcpy(cur, self.previous_key, sizeof(self.previous_key));
+		cur += sizeof(self.previous_key);
+	}
+
 	for(size_t i = 0; i < self.n_keys; i += 1) {
 		metafield_serialize(self.keys[i], cur);
 		cur += META_FIELD_LEN;
 	}
 
-	size_t n_written = 0;
-	while(n_written < outbuf_len) {
-		ssize_t n = write(self.metafd, outbuf, outbuf_len);
-		if(n < 0) {
-			// XXX Should we take this lying down, or keep trying?
-			int new_errno = errno;
-			free(outbuf);
-			errno = new_errno;
-			return STATUS_CHECK_ERRNO;
-		}
+	// The metafile is the only copy of the key fields, so it is never
+	// changed in place: a crash or a full disk part way through would leave
+	// nothing to unlock with. The new version is written out beside it, and
+	// renamed over it once it is on disk.
+	const int fd = open(self.temppath, O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if(fd < 0) {
+		free(outbuf);
+		return STATUS_CHECK_ERRNO;
+	}
 
-		n_written += n;
+	if(write_synced(fd, outbuf, outbuf_len) < 0 || rename(self.temppath, self.metapath) < 0) {
+		const int new_errno = errno;
+		close(fd);
+		unlink(self.temppath);
+		free(outbuf);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
 	}
 
 	free(outbuf);
 
+	// The new file is the metafile now, whether or not the rename is on disk
+	// yet.
+	if(self.metafd >= 0) { close(self.metafd); }
+	self.metafd = fd;
+	if(sync_parent(self.metapath) < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+
 	return 0;
 }
 
-int metafile_new_key_auto(Metafile& self,
-                          uint8_t master_key[crypto_secretbox_KEYBYTES],
-                          uint8_t child_key[crypto_secretbox_KEYBYTES]) {
-	// Use 10% of RAM up to 128MB for our memlimit
-	size_t mem_size = get_memory_size();
+size_t kdf_default_mem_ceiling() {
+	// Use 10% of RAM up to MAX_MEM_LIMIT
+	return static_cast<size_t>(fmin(get_memory_size() * 0.1, MAX_MEM_LIMIT));
+}
 
-	uint32_t opslimit = crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE;
-	uint32_t memlimit = (uint32_t)fmin(mem_size*0.1, MAX_MEM_LIMIT);
+/// Time one scrypt run with the given settings, in seconds. Returns a
+/// negative number on failure.
+static double kdf_time(uint32_t opslimit, uint32_t memlimit) {
+	uint8_t salt[METAFIELD_SALT_LEN];
+	uint8_t passphrase[16];
+	uint8_t key[crypto_secretbox_KEYBYTES];
+	randombytes_buf(salt, sizeof(salt));
+	randombytes_buf(passphrase, sizeof(passphrase));
+
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const int status = crypto_pwhash_scryptsalsa208sha256(
+		key, sizeof(key), reinterpret_cast<char*>(passphrase), sizeof(passphrase),
+		salt, opslimit, memlimit);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(status != 0) { return -1.0; }
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
 
-	return metafile_new_key(self, opslimit, memlimit, master_key, child_key);
+/// Choose settings that spend about ops operations of work, using as much
+/// memory as that much work can fill, but no more than mem_ceiling.
+static void kdf_pick(double ops, size_t mem_ceiling, KdfParams& out) {
+	// scrypt here runs with r = 8, N a power of two, and parallelism p. It
+	// needs 1024*N bytes, and libsodium charges 32*N*p operations, so the
+	// stored limits describe exactly what unlocking will cost. Prefer the
+	// largest N that fits, but a few passes over less memory can land much
+	// closer to the target than one or two passes over more.
+	const uint64_t min_n = crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN / 1024;
+	const double mem = fmax(crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN,
+	                        fmin(fmin(ops * 32, mem_ceiling), UINT32_MAX));
+	uint64_t n = min_n;
+	while(n * 2 * 1024 <= mem) { n *= 2; }
+
+	ops = fmax(ops, crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_MIN);
+	double best_error = INFINITY;
+	for(; n >= min_n; n /= 2) {
+		const double pass_ops = 32.0 * n;
+		const double passes = fmin(fmax(round(ops / pass_ops), 1), floor(UINT32_MAX / pass_ops));
+		const double error = fabs(passes * pass_ops - ops) / ops;
+		if(error < best_error) {
+			best_error = error;
+			out.memlimit = static_cast<uint32_t>(n * 1024);
+			out.opslimit = static_cast<uint32_t>(passes * pass_ops);
+		}
+
+		if(error <= 0.125) { break; }
+	}
+}
+
+int kdf_calibrate(double target_seconds, size_t mem_ceiling, KdfParams& out) {
+	// scrypt's running time is close to linear in opslimit, so measure the
+	// rate on a small run, extrapolate, and then correct against runs at the
+	// chosen settings, which may be slower once memory stops fitting in cache.
+	kdf_pick(KDF_PROBE_MEMLIMIT / 32, mem_ceiling, out);
+	out.seconds = kdf_time(out.opslimit, out.memlimit);
+	if(out.seconds < 0) { return STATUS_ERROR; }
+
+	for(int round = 0; round < KDF_MAX_ROUNDS; round += 1) {
+		const double rate = out.opslimit / fmax(out.seconds, 1e-6);
+		const KdfParams previous = out;
+		kdf_pick(rate * target_seconds, mem_ceiling, out);
+		if(out.opslimit == previous.opslimit && out.memlimit == previous.memlimit) {
+			break;
+		}
+
+		out.seconds = kdf_time(out.opslimit, out.memlimit);
+		if(out.seconds < 0) { return STATUS_ERROR; }
+
+		if(out.seconds <= target_seconds * KDF_TOLERANCE &&
+		   out.seconds >= target_seconds / KDF_TOLERANCE) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int metafile_new_key_auto(Metafile& self, double target_seconds, size_t mem_ceiling,
+                          const char* key_name, const char* passphrase,
+                          size_t passphrase_len,
+                          const uint8_t master_key[crypto_secretbox_KEYBYTES],
+                          KdfParams* chosen) {
+	KdfParams params;
+	const int status = kdf_calibrate(target_seconds, mem_ceiling, params);
+	if(status != 0) { return status; }
+	if(chosen != nullptr) { *chosen = params; }
+
+	return metafile_new_key(self, params.opslimit, params.memlimit, key_name, passphrase,
+	                        passphrase_len, master_key);
+}
+
+/// Stretch a passphrase into the child key for field.
+static int derive_child_key(const Metafield& field, const char* passphrase,
+                            size_t passphrase_len,
+                            uint8_t child_key[crypto_secretbox_KEYBYTES]) {
+	stats_count(STAT_KEYS_DERIVED, 1);
+	if(crypto_pwhash_scryptsalsa208sha256(child_key, crypto_secretbox_KEYBYTES,
+	                                      passphrase, passphrase_len, field.salt,
+	                                      field.opslimit, field.memlimit) != 0) {
+		return STATUS_ERROR;
+	}
+
+	return 0;
 }
 
 int metafile_new_key(Metafile& self, uint32_t opslimit, uint32_t memlimit,
-                     uint8_t master_key[crypto_secretbox_KEYBYTES],
-                     uint8_t child_key[crypto_secretbox_KEYBYTES]) {
-	Metafield* field = metafile_append_key(self);
-	if(field == nullptr) { return STATUS_ERROR; }
+                     const char* key_name, const char* passphrase, size_t passphrase_len,
+                     const uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	Metafield field;
+	memset(&field, 0, sizeof(field));
 
-	field->opslimit = opslimit;
-	field->memlimit = memlimit;
+	field.opslimit = opslimit;
+	field.memlimit = memlimit;
 
-	// Generate our nonce
-	randombytes_buf(field->nonce, sizeof(field->nonce));
+	// Generate our salt, ID, and nonce
+	randombytes_buf(field.salt, sizeof(field.salt));
+	metafield_key_id(field, key_name, field.key_id);
+	randombytes_buf(field.nonce, sizeof(field.nonce));
+
+	uint8_t child_key[crypto_secretbox_KEYBYTES];
+	if(derive_child_key(field, passphrase, passphrase_len, child_key) != 0) {
+		return STATUS_ERROR;
+	}
 
 	// Encrypt the master key
-	crypto_secretbox_easy(field->encrypted_key,
+	crypto_secretbox_easy(field.encrypted_key,
 	                      master_key, crypto_secretbox_KEYBYTES,
-	                      field->nonce, child_key);
+	                      field.nonce, child_key);
+	sodium_memzero(child_key, sizeof(child_key));
 
+	*metafile_append_key(self) = field;
 	return 0;
 }
 
+/// Recover the master key from field with its child key.
+static int metafield_open(const Metafield& field,
+                          const uint8_t child_key[crypto_secretbox_KEYBYTES],
+                          uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	const int result = crypto_secretbox_open_easy(master_key, field.encrypted_key,
+	                                              sizeof(field.encrypted_key),
+	                                              field.nonce, child_key);
+	return (result == 0)? 0 : STATUS_KEY_REJECTED;
+}
+
+/// Try to open field with the passphrase, caching the child key on success if
+/// cache_timeout is nonzero.
+static int metafield_unlock(const Metafield& field, const char* passphrase,
+                            size_t passphrase_len, unsigned cache_timeout,
+                            uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	uint8_t child_key[crypto_secretbox_KEYBYTES];
+	if(derive_child_key(field, passphrase, passphrase_len, child_key) != 0) {
+		return STATUS_ERROR;
+	}
+
+	const int status = metafield_open(field, child_key, master_key);
+	if(status == 0 && cache_timeout > 0 &&
+	   keycache_put(field, child_key, cache_timeout) != 0) {
+		log_warn("Could not cache key: %s", strerror(errno));
+	}
+
+	sodium_memzero(child_key, sizeof(child_key));
+	return status;
+}
+
+/// Order in which fields are tried when unlocking as key_name: those named
+/// key_name first, then anonymous ones, then the rest.
+static int metafield_unlock_pass(const Metafield& field, const char* key_name) {
+	uint8_t no_id[METAFIELD_ID_LEN];
+	memset(no_id, 0, sizeof(no_id));
+
+	uint8_t key_id[METAFIELD_ID_LEN];
+	metafield_key_id(field, key_name, key_id);
+	if(sodium_memcmp(key_id, field.key_id, sizeof(key_id)) == 0) { return 0; }
+	if(sodium_memcmp(no_id, field.key_id, sizeof(no_id)) == 0) { return 1; }
+	return 2;
+}
+
+/// How many passes of metafield_unlock_pass() unlocking as key_name takes.
+/// The rest are only tried when no field is named key_name; otherwise a
+/// mistyped passphrase would run the KDF once for every other user.
+static int metafile_unlock_passes(const Metafile& self, const char* key_name) {
+	for(size_t i = 0; i < self.n_keys; i += 1) {
+		if(metafield_unlock_pass(self.keys[i], key_name) == 0) { return 2; }
+	}
+	return 3;
+}
+
+int metafile_unlock(Metafile& self, const char* key_name,
+                    const char* passphrase, size_t passphrase_len, unsigned cache_timeout,
+                    uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	const int passes = metafile_unlock_passes(self, key_name);
+	for(int pass = 0; pass < passes; pass += 1) {
+		for(size_t i = 0; i < self.n_keys; i += 1) {
+			const Metafield& field = self.keys[i];
+			if(metafield_unlock_pass(field, key_name) != pass) {
+				continue;
+			}
+
+			const int status = metafield_unlock(field, passphrase, passphrase_len,
+			                                    cache_timeout, master_key);
+			if(status != STATUS_KEY_REJECTED) {
+				return status;
+			}
+		}
+	}
+
+	return STATUS_KEY_REJECTED;
+}
+
+int metafile_unlock_cached(Metafile& self, const char* key_name,
+                           uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	const int passes = metafile_unlock_passes(self, key_name);
+	for(int pass = 0; pass < passes; pass += 1) {
+		for(size_t i = 0; i < self.n_keys; i += 1) {
+			const Metafield& field = self.keys[i];
+			if(metafield_unlock_pass(field, key_name) != pass) {
+				continue;
+			}
+
+			uint8_t child_key[crypto_secretbox_KEYBYTES];
+			if(!keycache_get(field, child_key)) {
+				continue;
+			}
+
+			const int status = metafield_open(field, child_key, master_key);
+			sodium_memzero(child_key, sizeof(child_key));
+			if(status == 0) {
+				return 0;
+			}
+
+			// Whatever that was, it isn't this field's key anymore.
+			keycache_drop(field);
+		}
+	}
+
+	return STATUS_KEY_REJECTED;
+}
+
+/// Log each key field but the one at index kept, as it is about to be
+/// dropped. Only salted hashes of key names are stored, so fields are named
+/// by their position and key ID.
+static void log_dropped_fields(const Metafile& self, size_t kept) {
+	log_warn("Dropping %zu other key field%s; their users will need a new key",
+	         self.n_keys - 1, (self.n_keys == 2)? "" : "s");
+	for(size_t i = 0; i < self.n_keys; i += 1) {
+		if(i == kept) { continue; }
+
+		const Metafield& field = self.keys[i];
+		uint8_t unnamed[METAFIELD_ID_LEN] = {0};
+		char key_id[METAFIELD_ID_LEN * 2 + 1];
+		if(memcmp(field.key_id, unnamed, sizeof(unnamed)) == 0) {
+			strcpy(key_id, "none");
+		} else {
+			sodium_bin2hex(key_id, sizeof(key_id), field.key_id, sizeof(field.key_id));
+		}
+		log_warn("Dropping key field %zu (key ID %s)", i, key_id);
+	}
+}
+
+int metafile_rotate(Metafile& self, const char* key_name,
+                    const char* passphrase, size_t passphrase_len, unsigned cache_timeout,
+                    bool drop_others, const uint8_t next_key[crypto_secretbox_KEYBYTES],
+                    uint8_t master_key[crypto_secretbox_KEYBYTES]) {
+	if(self.n_keys > 1 && !drop_others) {
+		errno = EEXIST;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	const int passes = metafile_unlock_passes(self, key_name);
+	for(int pass = 0; pass < passes; pass += 1) {
+		for(size_t i = 0; i < self.n_keys; i += 1) {
+			Metafield& field = self.keys[i];
+			if(metafield_unlock_pass(field, key_name) != pass) {
+				continue;
+			}
+
+			uint8_t child_key[crypto_secretbox_KEYBYTES];
+			if(derive_child_key(field, passphrase, passphrase_len, child_key) != 0) {
+				return STATUS_ERROR;
+			}
+
+			if(metafield_open(field, child_key, master_key) != 0) {
+				sodium_memzero(child_key, sizeof(child_key));
+				continue;
+			}
+
+			if(cache_timeout > 0 && keycache_put(field, child_key, cache_timeout) != 0) {
+				log_warn("Could not cache key: %s", strerror(errno));
+			}
+
+			// The child key stays the same, so a cached copy keeps working.
+			randombytes_buf(field.nonce, sizeof(field.nonce));
+			crypto_secretbox_easy(field.encrypted_key,
+			                      next_key, crypto_secretbox_KEYBYTES,
+			                      field.nonce, child_key);
+			sodium_memzero(child_key, sizeof(child_key));
+
+			if(self.n_keys > 1) { log_dropped_fields(self, i); }
+			self.keys[0] = field;
+			self.n_keys = 1;
+
+			randombytes_buf(self.previous_nonce, sizeof(self.previous_nonce));
+			crypto_secretbox_easy(self.previous_key,
+			                      master_key, crypto_secretbox_KEYBYTES,
+			                      self.previous_nonce, next_key);
+			self.rotating = true;
+			return 0;
+		}
+	}
+
+	return STATUS_KEY_REJECTED;
+}
+
+int metafile_previous_key(const Metafile& self,
+                          const uint8_t master_key[crypto_secretbox_KEYBYTES],
+                          uint8_t previous_key[crypto_secretbox_KEYBYTES]) {
+	const int result = crypto_secretbox_open_easy(previous_key, self.previous_key,
+	                                              sizeof(self.previous_key),
+	                                              self.previous_nonce, master_key);
+	return (result == 0)? 0 : STATUS_TAMPERING;
+}
+
+void metafile_claim_lock(Metafile& self) {
+	if(self.lockfd >= 0) {
+		exlock_set_owner(self.lockfd);
+	}
+}
+
 void metafile_free(Metafile& self) {
-	close(self.metafd);
-	exlock_release(self.lockpath);
+	if(self.metafd >= 0) { close(self.metafd); }
+	if(self.lockfd >= 0) { exlock_release(self.lockpath, self.lockfd); }
+	self.metafd = -1;
+	self.lockfd = -1;
 	free(self.lockpath);
 	free(self.metapath);
+	free(self.temppath);
+	self.lockpath = nullptr;
+	self.metapath = nullptr;
+	self.temppath = nullptr;
+	free(self.keys);
+	self.keys = nullptr;
+	self.n_keys = 0;
+	self.keys_capacity = 0;
 }
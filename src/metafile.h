@@ -4,12 +4,29 @@
 #include <sodium.h>
 #include "util.h"
 
-static const uint8_t FANGFS_META_VERSION = 0;
+/// Version 1 added a KDF salt and key ID to every key field, version 2 a
+/// flags byte after the header, followed by the previous master key while a
+/// key rotation is under way, and version 3 a compression codec byte after
+/// the flags.
+static const uint8_t FANGFS_META_VERSION = 3;
+
+/// Metafile flag: a key rotation is under way, and the previous master key
+/// follows the flags.
+#define METAFILE_ROTATING 0x01
 
 #define METAFILE_LOCK "__FANGFS_META.lock"
+
+/// How long to wait for another mount of the same source to let go.
+#define METAFILE_LOCK_TIMEOUT_MS 5000
 #define METAFILE_NAME "__FANGFS_META"
-#define META_FIELD_LEN (sizeof(uint32_t)*2 + crypto_secretbox_NONCEBYTES + \
-                        crypto_secretbox_KEYBYTES + crypto_secretbox_MACBYTES)
+
+/// New versions of the metafile are written here, then renamed over it.
+#define METAFILE_TEMP "__FANGFS_META.new"
+#define METAFIELD_SALT_LEN crypto_pwhash_scryptsalsa208sha256_SALTBYTES
+#define METAFIELD_ID_LEN crypto_generichash_BYTES_MIN
+#define META_FIELD_V0_LEN (sizeof(uint32_t)*2 + crypto_secretbox_NONCEBYTES + \
+                           crypto_secretbox_KEYBYTES + crypto_secretbox_MACBYTES)
+#define META_FIELD_LEN (META_FIELD_V0_LEN + METAFIELD_SALT_LEN + METAFIELD_ID_LEN)
 
 struct Metafield {
 	/// scrypt CPU factor
@@ -18,6 +35,14 @@ struct Metafield {
 	/// scrypt memory factor
 	uint32_t memlimit;
 
+	/// The salt for deriving the child key from its passphrase
+	uint8_t salt[METAFIELD_SALT_LEN];
+
+	/// hash(key name) keyed with the salt. This lets unlocking pick the right
+	/// field before paying for the KDF, without linking key names across
+	/// filesystems. All zeros for fields without a name.
+	uint8_t key_id[METAFIELD_ID_LEN];
+
 	/// The random nonce
 	uint8_t nonce[crypto_secretbox_NONCEBYTES];
 
@@ -25,10 +50,11 @@ struct Metafield {
 	uint8_t encrypted_key[crypto_secretbox_KEYBYTES+crypto_secretbox_MACBYTES];
 };
 
-#define METAFILE_MAX_KEYS 8
 struct Metafile {
 	int metafd;
+	int lockfd;
 	char* metapath;
+	char* temppath;
 	char* lockpath;
 
 	uint8_t version;
@@ -36,22 +62,39 @@ struct Metafile {
 
 	uint8_t filename_nonce[crypto_secretbox_xsalsa20poly1305_NONCEBYTES];
 
+	/// The codec that blocks are compressed with, or CODEC_NONE. Fixed when
+	/// the filesystem is created, since it changes the block layout.
+	uint8_t compression;
+
+	/// Whether a key rotation is under way. If so, the previous master key is
+	/// kept sealed under the current one, so that entries the rotation hasn't
+	/// reached yet stay readable.
+	bool rotating;
+	uint8_t previous_nonce[crypto_secretbox_NONCEBYTES];
+	uint8_t previous_key[crypto_secretbox_KEYBYTES+crypto_secretbox_MACBYTES];
+
 	size_t n_keys;
-	Metafield keys[METAFILE_MAX_KEYS];
+	size_t keys_capacity;
+	Metafield* keys;
 };
 
 #if crypto_secretbox_xsalsa20poly1305_NONCEBYTES != 24
 #    error "Weird nonce length"
 #endif
 
-/// Parse in a single field containing key information.
-void metafield_parse(Metafield& self, const uint8_t inbuf[META_FIELD_LEN]);
+/// Parse in a single field containing key information, laid out as of the
+/// given metafile version.
+void metafield_parse(Metafield& self, const uint8_t* inbuf, uint8_t version);
+
+/// The length of a key information field as of the given metafile version.
+size_t metafield_len(uint8_t version);
 
 /// Dump this key information field into a buffer.
 void metafield_serialize(Metafield& self, uint8_t outbuf[META_FIELD_LEN]);
 
-/// Dump a key information field out into a buffer.
-void metafield_serialize(Metafield& self, uint8_t outbuf[META_FIELD_LEN]);
+/// Compute the key ID for key_name under the given field's salt.
+void metafield_key_id(const Metafield& self, const char* key_name,
+                      uint8_t outbuf[METAFIELD_ID_LEN]);
 
 /// Initialize an empty metafile. The provided metapath is copied internally.
 /// Returns 0 if the metafile is created, and 1 if it already existed.
@@ -60,17 +103,85 @@ int metafile_init(Metafile& self, const char* metapath);
 /// Parse in an existing metafile.
 int metafile_parse(Metafile& self);
 
-/// Dump the metafile out to disk.
+/// Dump the metafile out to disk. The new version replaces the old one
+/// atomically, and is flushed to disk along with its directory entry before
+/// this returns; either way, a crash leaves one or the other whole.
 int metafile_write(Metafile& self);
 
-/// Create a new key.
+/// Add a key field granting passphrase access to master_key, under the
+/// non-secret name key_name.
 int metafile_new_key(Metafile& self, uint32_t opslimit, uint32_t memlimit,
-                     uint8_t master_key[crypto_secretbox_KEYBYTES],
-                     uint8_t child_key[crypto_secretbox_KEYBYTES]);
+                     const char* key_name, const char* passphrase, size_t passphrase_len,
+                     const uint8_t master_key[crypto_secretbox_KEYBYTES]);
+
+/// scrypt settings for a key, as chosen by kdf_calibrate().
+struct KdfParams {
+	uint32_t opslimit;
+	uint32_t memlimit;
+
+	/// How long deriving a key with these settings took on this machine.
+	double seconds;
+};
 
-/// Wrapper to initialize a new key using automatic settings.
-int metafile_new_key_auto(Metafile& self,
-                          uint8_t master_key[crypto_secretbox_KEYBYTES],
-                          uint8_t child_key[crypto_secretbox_KEYBYTES]);
+/// The default target time for unlocking a key with automatic settings.
+#define KDF_DEFAULT_TARGET_SECONDS 1.0
+
+/// The default memory ceiling for automatic settings: 10% of RAM, up to 1G.
+size_t kdf_default_mem_ceiling();
+
+/// Benchmark scrypt on this machine, and choose settings under which deriving
+/// a key takes about target_seconds and uses at most mem_ceiling bytes. Where
+/// the target allows, memory grows with the work factor.
+int kdf_calibrate(double target_seconds, size_t mem_ceiling, KdfParams& out);
+
+/// Wrapper to initialize a new key using settings from kdf_calibrate(). If
+/// chosen is not nullptr, the settings used are stored there.
+int metafile_new_key_auto(Metafile& self, double target_seconds, size_t mem_ceiling,
+                          const char* key_name, const char* passphrase,
+                          size_t passphrase_len,
+                          const uint8_t master_key[crypto_secretbox_KEYBYTES],
+                          KdfParams* chosen);
+
+/// Recover the master key with a passphrase. Fields whose key ID matches
+/// key_name are tried first, then fields without an ID. The rest are only
+/// tried if no field matches key_name, so that the KDF normally only runs
+/// once, even for a wrong passphrase. If cache_timeout is nonzero, the
+/// child key that worked is kept in the kernel keyring for that many seconds.
+/// Returns 0, STATUS_KEY_REJECTED if no field accepts the passphrase, or
+/// STATUS_ERROR if the KDF fails.
+int metafile_unlock(Metafile& self, const char* key_name,
+                    const char* passphrase, size_t passphrase_len, unsigned cache_timeout,
+                    uint8_t master_key[crypto_secretbox_KEYBYTES]);
+
+/// Recover the master key from a child key cached by an earlier
+/// metafile_unlock(), without a passphrase or the KDF. Returns 0 or
+/// STATUS_KEY_REJECTED.
+int metafile_unlock_cached(Metafile& self, const char* key_name,
+                           uint8_t master_key[crypto_secretbox_KEYBYTES]);
+
+/// Unlock with a passphrase as metafile_unlock() does, then begin rotating
+/// the master key to next_key: the field that accepted the passphrase is
+/// resealed around next_key, every other field is dropped, since their
+/// passphrases are unknown, and the old master key is kept as the previous
+/// key. master_key receives the old master key. Only the in-memory metafile
+/// changes; metafile_write() commits it.
+///
+/// Other users lose their access, so unless drop_others is set, a metafile
+/// with more than one field is refused with STATUS_CHECK_ERRNO and EEXIST
+/// before the passphrase is tried.
+int metafile_rotate(Metafile& self, const char* key_name,
+                    const char* passphrase, size_t passphrase_len, unsigned cache_timeout,
+                    bool drop_others, const uint8_t next_key[crypto_secretbox_KEYBYTES],
+                    uint8_t master_key[crypto_secretbox_KEYBYTES]);
+
+/// Recover the previous master key of a rotation under way. Returns 0, or
+/// STATUS_TAMPERING if it wasn't sealed under master_key.
+int metafile_previous_key(const Metafile& self,
+                          const uint8_t master_key[crypto_secretbox_KEYBYTES],
+                          uint8_t previous_key[crypto_secretbox_KEYBYTES]);
+
+/// Record the calling process as the holder of the metafile lock. Call this
+/// after forking into the background.
+void metafile_claim_lock(Metafile& self);
 
 void metafile_free(Metafile& self);
@@ -0,0 +1,275 @@
+#include "options.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+#include "log.h"
+#include "pack.h"
+#include "error.h"
+
+enum {
+	KEY_SYNC,
+	KEY_IO,
+	KEY_BACKING_DIRECT,
+	KEY_KEY_NAME,
+	KEY_KEY_CACHE,
+	KEY_KDF_TIME,
+	KEY_KDF_MEM,
+	KEY_TRACE,
+	KEY_TRACE_RECORDS,
+	KEY_LOG_LEVEL,
+	KEY_ROTATE_KEY,
+	KEY_ROTATE_RATE,
+	KEY_ROTATE_DUTY,
+	KEY_COMPRESS,
+	KEY_PACK,
+	KEY_DIR_INDEX,
+	KEY_SECURE_POOL,
+	KEY_MEMORY_LIMIT
+};
+
+static const struct fuse_opt fang_opts[] = {
+	FUSE_OPT_KEY("sync=", KEY_SYNC),
+	FUSE_OPT_KEY("io=", KEY_IO),
+	FUSE_OPT_KEY("backing_direct", KEY_BACKING_DIRECT),
+	FUSE_OPT_KEY("key=", KEY_KEY_NAME),
+	FUSE_OPT_KEY("keycache=", KEY_KEY_CACHE),
+	FUSE_OPT_KEY("kdf_time=", KEY_KDF_TIME),
+	FUSE_OPT_KEY("kdf_mem=", KEY_KDF_MEM),
+	FUSE_OPT_KEY("trace=", KEY_TRACE),
+	FUSE_OPT_KEY("trace_records=", KEY_TRACE_RECORDS),
+	FUSE_OPT_KEY("log_level=", KEY_LOG_LEVEL),
+	FUSE_OPT_KEY("rotate_key", KEY_ROTATE_KEY),
+	FUSE_OPT_KEY("rotate_key=", KEY_ROTATE_KEY),
+	FUSE_OPT_KEY("rotate_rate=", KEY_ROTATE_RATE),
+	FUSE_OPT_KEY("rotate_duty=", KEY_ROTATE_DUTY),
+	FUSE_OPT_KEY("compress=", KEY_COMPRESS),
+	FUSE_OPT_KEY("pack=", KEY_PACK),
+	FUSE_OPT_KEY("dir_index=", KEY_DIR_INDEX),
+	FUSE_OPT_KEY("secure_pool=", KEY_SECURE_POOL),
+	FUSE_OPT_KEY("memory_limit=", KEY_MEMORY_LIMIT),
+	FUSE_OPT_END
+};
+
+/// Return the value part of a "name=value" option.
+static inline const char* option_value(const char* arg) {
+	const char* sep = strchr(arg, '=');
+	return (sep == nullptr)? "" : sep + 1;
+}
+
+static int process_option(void* data, const char* arg, int key,
+                          struct fuse_args* outargs) {
+	FangFS& fs = *reinterpret_cast<FangFS*>(data);
+
+	switch(key) {
+	case KEY_SYNC: {
+		const char* value = option_value(arg);
+		if(strcmp(value, "direct") == 0) {
+			fs.sync_mode = FANGFS_SYNC_DIRECT;
+		} else if(strcmp(value, "journal") == 0) {
+			fs.sync_mode = FANGFS_SYNC_JOURNAL;
+		} else {
+			log_error("Unknown sync mode: %s", value);
+			return -1;
+		}
+		return 0;
+	}
+	case KEY_IO: {
+		const char* value = option_value(arg);
+		if(strcmp(value, "posix") == 0) {
+			fs.io_engine = FANGFS_IO_POSIX;
+		} else if(strcmp(value, "uring") == 0) {
+			fs.io_engine = FANGFS_IO_URING;
+		} else if(strcmp(value, "mmap") == 0) {
+			fs.io_engine = FANGFS_IO_MMAP;
+		} else {
+			log_error("Unknown I/O engine: %s", value);
+			return -1;
+		}
+		return 0;
+	}
+	case KEY_BACKING_DIRECT:
+#ifdef O_DIRECT
+		fs.backing_direct = true;
+		return 0;
+#else
+		log_error("backing_direct is not supported on this platform");
+		return -1;
+#endif
+	case KEY_KEY_NAME:
+		// arg is freed once we return; the copy lives as long as the mount.
+		fs.key_name = strdup(option_value(arg));
+		if(fs.key_name == nullptr) { throw AllocationError(); }
+		return 0;
+	case KEY_KEY_CACHE: {
+		char* end = nullptr;
+		const unsigned long timeout = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || timeout > UINT_MAX) {
+			log_error("Invalid keycache timeout: %s", option_value(arg));
+			return -1;
+		}
+		fs.key_cache_timeout = timeout;
+		return 0;
+	}
+	case KEY_KDF_TIME: {
+		char* end = nullptr;
+		const double seconds = strtod(option_value(arg), &end);
+		if(*end != '\0' || !(seconds > 0)) {
+			log_error("Invalid KDF time: %s", option_value(arg));
+			return -1;
+		}
+		fs.kdf_target_seconds = seconds;
+		return 0;
+	}
+	case KEY_KDF_MEM: {
+		// In MiB
+		char* end = nullptr;
+		const unsigned long mebibytes = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || mebibytes == 0 || mebibytes > UINT32_MAX >> 20) {
+			log_error("Invalid KDF memory limit: %s", option_value(arg));
+			return -1;
+		}
+		fs.kdf_mem_ceiling = static_cast<size_t>(mebibytes) << 20;
+		return 0;
+	}
+	case KEY_TRACE:
+		fs.trace_path = strdup(option_value(arg));
+		if(fs.trace_path == nullptr) { throw AllocationError(); }
+		return 0;
+	case KEY_TRACE_RECORDS: {
+		char* end = nullptr;
+		const unsigned long records = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || records == 0 || records > UINT32_MAX) {
+			log_error("Invalid trace size: %s", option_value(arg));
+			return -1;
+		}
+		fs.trace_records = records;
+		return 0;
+	}
+	case KEY_LOG_LEVEL: {
+		LogLevel level;
+		if(log_parse_level(option_value(arg), &level) < 0) {
+			log_error("Unknown log level: %s", option_value(arg));
+			return -1;
+		}
+		if(level > FANGFS_LOG_MAX_LEVEL) {
+			log_warn("Built without %s logging", option_value(arg));
+		}
+		log_set_level(level);
+		return 0;
+	}
+	case KEY_ROTATE_KEY:
+		// Other users' key fields are only dropped when asked for by name.
+		if(strchr(arg, '=') != nullptr) {
+			if(strcmp(option_value(arg), "drop_others") != 0) {
+				log_error("Invalid key rotation mode: %s", option_value(arg));
+				return -1;
+			}
+			fs.rotate_drop_others = true;
+		}
+		fs.rotate_key = true;
+		return 0;
+	case KEY_ROTATE_RATE: {
+		// In MiB per second; 0 lifts the limit.
+		char* end = nullptr;
+		const unsigned long mebibytes = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || mebibytes > UINT32_MAX) {
+			log_error("Invalid rotation rate: %s", option_value(arg));
+			return -1;
+		}
+		fs.rotate_rate = static_cast<uint64_t>(mebibytes) << 20;
+		return 0;
+	}
+	case KEY_ROTATE_DUTY: {
+		// In percent of the time
+		char* end = nullptr;
+		const double percent = strtod(option_value(arg), &end);
+		if(*end != '\0' || !(percent > 0 && percent <= 100)) {
+			log_error("Invalid rotation duty cycle: %s", option_value(arg));
+			return -1;
+		}
+		fs.rotate_duty = percent / 100;
+		return 0;
+	}
+	case KEY_COMPRESS: {
+		const char* value = option_value(arg);
+		const Codec* codec = codec_by_name(value);
+		if(strcmp(value, codec_name(CODEC_NONE)) == 0) {
+			fs.compression = CODEC_NONE;
+		} else if(codec != nullptr) {
+			fs.compression = codec->id;
+		} else {
+			log_error("Unknown or unsupported compression codec: %s", value);
+			return -1;
+		}
+		return 0;
+	}
+	case KEY_PACK: {
+		// In bytes; 0 stops packing more files.
+		char* end = nullptr;
+		const unsigned long threshold = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || threshold > PACK_MAX_THRESHOLD) {
+			log_error("Invalid pack threshold: %s", option_value(arg));
+			return -1;
+		}
+		fs.pack_threshold = threshold;
+		return 0;
+	}
+	case KEY_DIR_INDEX: {
+		// In names; 0 keeps directories unindexed.
+		char* end = nullptr;
+		const unsigned long threshold = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || threshold > UINT32_MAX) {
+			log_error("Invalid directory index threshold: %s", option_value(arg));
+			return -1;
+		}
+		fs.dir_index = threshold;
+		return 0;
+	}
+	case KEY_SECURE_POOL: {
+		// In MiB; 0 leaves secure buffers on the heap.
+		char* end = nullptr;
+		const unsigned long mebibytes = strtoul(option_value(arg), &end, 10);
+		if(*end != '\0' || mebibytes > UINT32_MAX >> 20) {
+			log_error("Invalid secure buffer pool size: %s", option_value(arg));
+			return -1;
+		}
+		fs.secure_pool = static_cast<size_t>(mebibytes) << 20;
+		return 0;
+	}
+	case KEY_MEMORY_LIMIT: {
+		// In MiB, or in percent of RAM when it ends in '%'; 0 lifts the limit.
+		const char* value = option_value(arg);
+		char* end = nullptr;
+		if(value[0] != '\0' && value[strlen(value) - 1] == '%') {
+			const double percent = strtod(value, &end);
+			if(strcmp(end, "%") != 0 || !(percent > 0 && percent <= 100)) {
+				log_error("Invalid memory limit: %s", value);
+				return -1;
+			}
+			fs.memory_limit = 0;
+			fs.memory_share = percent / 100;
+			return 0;
+		}
+
+		const unsigned long mebibytes = strtoul(value, &end, 10);
+		if(*end != '\0' || mebibytes > UINT32_MAX) {
+			log_error("Invalid memory limit: %s", value);
+			return -1;
+		}
+		fs.memory_limit = static_cast<size_t>(mebibytes) << 20;
+		fs.memory_share = 0;
+		return 0;
+	}
+	}
+
+	// Not ours; pass it through to FUSE.
+	return 1;
+}
+
+int fangfs_parse_options(FangFS& fs, struct fuse_args* args) {
+	return fuse_opt_parse(args, &fs, fang_opts, process_option);
+}
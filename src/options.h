@@ -0,0 +1,8 @@
+#pragma once
+
+#include "fangfs.h"
+
+/// Strip the FangFS-specific "-o" options out of args, applying them to fs,
+/// and leave everything else for FUSE. Must run before fangfs_fsinit().
+/// Returns 0 on success, or -1 if an option was malformed.
+int fangfs_parse_options(FangFS& fs, struct fuse_args* args);
@@ -0,0 +1,1026 @@
+// Packing of small files. A file that was written and closed, and is at most
+// -o pack bytes long, is sealed into a record appended to a shared segment
+// file, and its backing file is replaced by a symlink naming the record,
+// which needs no data blocks of its own. Packed files are read whole out of
+// their record; opening one for writing turns it back into a standalone file
+// first. Records that nothing points at any more are counted as dead space,
+// and segments that are mostly dead are compacted into the current one.
+#include "pack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include "BufferEncryption.h"
+#include "log.h"
+#include "rotate.h"
+#include "stats.h"
+#include "util.h"
+#include "error.h"
+
+/// How often the engine packs the files closed since it last looked, in
+/// seconds.
+#define PACK_FLUSH_SECONDS 5
+
+/// Records are appended, and their entries swapped in, this much at a time,
+/// so that foreground operations aren't held off for long.
+#define PACK_BATCH_LEN (1024 * 1024)
+
+/// How many times to look up a packed entry again when compaction moves its
+/// record from under a read.
+#define PACK_READ_RETRIES 3
+
+/// Holds the store's name lock for writing while it lives.
+struct PackWriteLock {
+	explicit PackWriteLock(PackStore& store): names(store.names) {
+		pthread_rwlock_wrlock(&names);
+	}
+	~PackWriteLock() { pthread_rwlock_unlock(&names); }
+
+	pthread_rwlock_t& names;
+};
+
+/// A file read and sealed into a batch, waiting to be swapped in.
+struct PackCandidate {
+	std::string path;
+	struct stat info;
+	uint32_t size;
+
+	/// Where its record is in the batch, and how long it is.
+	uint64_t offset;
+	size_t len;
+};
+
+/// Records sealed for appending together.
+struct PackBatch {
+	std::vector<PackCandidate> candidates;
+	Buffer records;
+	Buffer contents;
+	Buffer plain;
+};
+
+PackReadLock::PackReadLock(FangFS& fs): store(fs.pack) {
+	if(store != nullptr) { pthread_rwlock_rdlock(&store->names); }
+}
+
+PackReadLock::~PackReadLock() {
+	if(store != nullptr) { pthread_rwlock_unlock(&store->names); }
+}
+
+const char* pack_relative_path(const FangFS& fs, const char* real_path) {
+	// Backing paths are built by joining onto the source.
+	const size_t source_len = strlen(fs.source);
+	if(strncmp(real_path, fs.source, source_len) == 0) { real_path += source_len; }
+	while(*real_path == '/') { real_path += 1; }
+	return real_path;
+}
+
+void pack_format_link(const PackLocator& locator, char out[PACK_LINK_MAX]) {
+	snprintf(out, PACK_LINK_MAX, PACK_LINK_PREFIX "%x:%llx:%x:%o", locator.segment,
+	         static_cast<unsigned long long>(locator.offset), locator.size,
+	         static_cast<unsigned>(locator.mode & 07777));
+}
+
+int pack_parse_link(const char* target, PackLocator& locator) {
+	const size_t prefix_len = strlen(PACK_LINK_PREFIX);
+	if(strncmp(target, PACK_LINK_PREFIX, prefix_len) != 0) { return -1; }
+
+	unsigned segment = 0;
+	unsigned long long offset = 0;
+	unsigned size = 0;
+	unsigned mode = 0;
+	int end = 0;
+	if(sscanf(target + prefix_len, "%x:%llx:%x:%o%n", &segment, &offset, &size, &mode,
+	          &end) != 4 || target[prefix_len + end] != '\0') {
+		return -1;
+	}
+	if(segment == 0 || size > PACK_MAX_THRESHOLD || mode > 07777) { return -1; }
+
+	locator.segment = segment;
+	locator.offset = offset;
+	locator.size = size;
+	locator.mode = mode;
+	return 0;
+}
+
+int pack_read_link(int dirfd, const char* name, PackLocator& locator) {
+	char target[PACK_LINK_MAX];
+	const ssize_t n = readlinkat(dirfd, name, target, sizeof(target) - 1);
+	if(n < 0) { return -1; }
+
+	target[n] = '\0';
+	if(pack_parse_link(target, locator) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+void pack_stat(const PackLocator& locator, struct stat* info) {
+	info->st_mode = S_IFREG | locator.mode;
+	info->st_size = locator.size;
+	info->st_blocks = (PACK_RECORD_OVERHEAD + locator.size + 511) / 512;
+}
+
+static void segment_name(uint32_t segment, char name[16]) {
+	snprintf(name, 16, "%08x", segment);
+}
+
+/// The segment number that name is the name of, or 0.
+static uint32_t parse_segment_name(const char* name) {
+	if(strlen(name) != 8 || strspn(name, "0123456789abcdef") != 8) { return 0; }
+	return strtoul(name, nullptr, 16);
+}
+
+int pack_open_segment(int source_fd, uint32_t segment) {
+	char name[16];
+	segment_name(segment, name);
+	Buffer path;
+	path_join(PACK_DIR_NAME, name, path);
+	return openat(source_fd, reinterpret_cast<char*>(path.buf), O_RDONLY|O_CLOEXEC);
+}
+
+/// Read len bytes at offset. Returns 0, 1 if the file ends first, or -1.
+static int pread_full(int fd, uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pread(fd, buf + total, len - total, offset + total);
+		if(n == 0) {
+			return 1;
+		} else if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pwrite(fd, buf + total, len - total, offset + total);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+/// Open a record whose length header has been checked: record holds
+/// record_len bytes. On success, plain holds the backing path length, the
+/// backing path, and the contents.
+static int open_record(const uint8_t* record, size_t record_len, const uint8_t* key,
+                       Buffer& plain) {
+	const uint8_t* nonce = record + PACK_RECORD_HEADER_LEN;
+	const uint8_t* sealed = nonce + BLOCK_HEADER_LEN;
+	const size_t sealed_len = record_len - PACK_RECORD_HEADER_LEN - BLOCK_HEADER_LEN;
+	const uint64_t start = stats_clock();
+	if(buf_decrypt(sealed, sealed_len, nonce, key, plain) != 0 || plain.len < 2) {
+		return STATUS_TAMPERING;
+	}
+	stats_time(STAT_DECRYPT, start);
+
+	const size_t path_len = plain.buf[0] | (plain.buf[1] << 8);
+	if(path_len > plain.len - 2) { return STATUS_TAMPERING; }
+	stats_count(STAT_BYTES_DECRYPTED, plain.len - 2 - path_len);
+	return 0;
+}
+
+ssize_t pack_read_record(const FangFS& fs, int segment_fd, const PackLocator& locator,
+                         const char* rel_path, const uint8_t* key, Buffer& out) {
+	const size_t path_len = strlen(rel_path);
+	const size_t record_len = pack_record_len(path_len, locator.size);
+	Buffer record;
+	buf_grow(record, record_len);
+	const int status = pread_full(segment_fd, record.buf, record_len, locator.offset);
+	if(status != 0) {
+		if(status > 0) { errno = ESTALE; }
+		return STATUS_CHECK_ERRNO;
+	}
+
+	// A record of another length can't be the one the entry means, and a
+	// record for another entry is one moved around outside the filesystem.
+	if(u32_from_le(u32_from_bytes(record.buf)) != record_len - PACK_RECORD_HEADER_LEN) {
+		return STATUS_TAMPERING;
+	}
+	Buffer plain;
+	if(open_record(record.buf, record_len, key, plain) < 0 ||
+	   plain.len != 2 + path_len + locator.size ||
+	   memcmp(plain.buf + 2, rel_path, path_len) != 0) {
+		sodium_memzero(plain.buf, plain.buf_len);
+		return STATUS_TAMPERING;
+	}
+
+	buf_grow(out, std::max<size_t>(locator.size, 1));
+	memcpy(out.buf, plain.buf + 2 + path_len, locator.size);
+	out.len = locator.size;
+	sodium_memzero(plain.buf, plain.buf_len);
+	return locator.size;
+}
+
+/// Seal len bytes of contents for the entry at rel_path under key, and add
+/// the record to the end of records. Returns the length of the record.
+static size_t seal_record(const uint8_t* key, const char* rel_path, const uint8_t* contents,
+                          size_t len, Buffer& plain, Buffer& records) {
+	const size_t path_len = strlen(rel_path);
+	const size_t plain_len = 2 + path_len + len;
+	buf_grow(plain, plain_len);
+	plain.buf[0] = path_len & 0xff;
+	plain.buf[1] = (path_len >> 8) & 0xff;
+	memcpy(plain.buf + 2, rel_path, path_len);
+	if(len > 0) { memcpy(plain.buf + 2 + path_len, contents, len); }
+
+	const size_t record_len = pack_record_len(path_len, len);
+	if(records.buf_len < records.len + record_len) {
+		buf_grow(records, std::max(records.len + record_len, records.buf_len * 2));
+	}
+
+	uint8_t* record = records.buf + records.len;
+	const uint32_t body_len = u32_to_le(record_len - PACK_RECORD_HEADER_LEN);
+	memcpy(record, &body_len, sizeof(body_len));
+	uint8_t* nonce = record + PACK_RECORD_HEADER_LEN;
+	randombytes_buf(nonce, BLOCK_HEADER_LEN);
+	const uint64_t start = stats_clock();
+	buf_encrypt(plain.buf, plain_len, nonce, key, nonce + BLOCK_HEADER_LEN);
+	stats_time(STAT_ENCRYPT, start);
+	stats_count(STAT_BYTES_ENCRYPTED, len);
+
+	sodium_memzero(plain.buf, plain_len);
+	records.len += record_len;
+	return record_len;
+}
+
+/// The descriptor of segment, opening it if need be. Call under store.lock.
+static int segment_fd(PackStore& store, uint32_t segment) {
+	auto it = store.segments.find(segment);
+	if(it != store.segments.end()) { return it->second; }
+
+	char name[16];
+	segment_name(segment, name);
+	const int fd = openat(store.dir_fd, name, O_RDWR|O_CLOEXEC);
+	if(fd >= 0) { store.segments[segment] = fd; }
+	return fd;
+}
+
+/// The descriptor of the active segment, creating it if need be. Call under
+/// store.lock.
+static int active_fd(PackStore& store) {
+	auto it = store.segments.find(store.active);
+	if(it != store.segments.end()) { return it->second; }
+
+	// Another mount may have got here first, if the source was copied
+	// around; never append to someone else's segment.
+	while(1) {
+		char name[16];
+		segment_name(store.active, name);
+		const int fd = openat(store.dir_fd, name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+		if(fd >= 0) {
+			store.segments[store.active] = fd;
+			store.active_len = 0;
+			return fd;
+		} else if(errno != EEXIST) {
+			return -1;
+		}
+		store.active += 1;
+	}
+}
+
+/// Append the records in batch to the active segment, moving on to a new
+/// segment if it is full, and make them durable. Returns 0 with where they
+/// start, or -1.
+static int append_records(PackStore& store, const Buffer& records, uint32_t& segment,
+                          uint64_t& offset) {
+	int fd;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		if(store.active_len > 0 && store.active_len + records.len > PACK_SEGMENT_LEN) {
+			store.active += 1;
+			store.active_len = 0;
+		}
+
+		fd = active_fd(store);
+		if(fd < 0) { return -1; }
+
+		// Compaction reads segments record by record, so nothing half
+		// written may be left where more records follow.
+		if(pwrite_full(fd, records.buf, records.len, store.active_len) < 0) {
+			const int new_errno = errno;
+			if(ftruncate(fd, store.active_len) < 0) { store.active_len = PACK_SEGMENT_LEN; }
+			errno = new_errno;
+			return -1;
+		}
+
+		segment = store.active;
+		offset = store.active_len;
+		store.active_len += records.len;
+	}
+
+	// The active segment is never compacted, so fd stays open.
+	if(fdatasync(fd) < 0) {
+		const int new_errno = errno;
+		std::lock_guard<std::mutex> guard(store.lock);
+		store.dead[segment] += records.len;
+		errno = new_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/// The hidden name next to path that entries are rebuilt under.
+static std::string temp_path(const std::string& path) {
+	return path.substr(0, path.rfind('/') + 1) + PACK_TEMP_NAME;
+}
+
+/// Replace the entry at path with a packed entry pointing at locator, with
+/// the times in info. Call under store.lock.
+static int link_entry(const std::string& path, const PackLocator& locator,
+                      const struct stat& info) {
+	char target[PACK_LINK_MAX];
+	pack_format_link(locator, target);
+
+	// A link left behind by a crash.
+	const std::string temp = temp_path(path);
+	unlink(temp.c_str());
+
+	if(symlink(target, temp.c_str()) < 0) { return -1; }
+
+	const struct timespec times[2] = {info.st_atim, info.st_mtim};
+	if(utimensat(AT_FDCWD, temp.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0 ||
+	   rename(temp.c_str(), path.c_str()) < 0) {
+		const int new_errno = errno;
+		unlink(temp.c_str());
+		errno = new_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/// Whether locator points at the same record as other.
+static inline bool same_record(const PackLocator& locator, const PackLocator& other) {
+	return locator.segment == other.segment && locator.offset == other.offset;
+}
+
+/// Count the record of the packed entry at real_path, as locator describes
+/// it, as dead. Call under store.lock.
+static void bury(FangFS& fs, const char* real_path, const PackLocator& locator) {
+	const size_t path_len = strlen(pack_relative_path(fs, real_path));
+	fs.pack->dead[locator.segment] += pack_record_len(path_len, locator.size);
+}
+
+/// Whether a key rotation is under way. Entries change names under the
+/// rotation engine, so packing and compaction wait for it to finish.
+static bool rotation_under_way(FangFS& fs) {
+	RotateReadLock names(fs);
+	return names.rotation != nullptr && !names.rotation->done;
+}
+
+static PackStore* store_new() {
+	PackStore* store = new PackStore;
+
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// A steady stream of foreground readers would otherwise hold the engine
+	// off forever.
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&store->names, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return store;
+}
+
+static void store_delete(PackStore* store) {
+	for(const auto& entry: store->segments) { close(entry.second); }
+	for(int fd: store->retired) { close(fd); }
+	if(store->dir_fd >= 0) { close(store->dir_fd); }
+	pthread_rwlock_destroy(&store->names);
+	delete store;
+}
+
+/// Pick up the dead space recorded by the last mount, for the segments that
+/// are still there. It is only a hint: a crash loses what the mount found,
+/// which leaves segments uncompacted, never the other way around.
+static void load_usage(PackStore& store) {
+	const int fd = openat(store.dir_fd, PACK_USAGE_NAME, O_RDONLY|O_CLOEXEC);
+	FILE* usage = (fd < 0)? nullptr : fdopen(fd, "r");
+	if(usage == nullptr) {
+		if(fd >= 0) { close(fd); }
+		return;
+	}
+
+	unsigned segment;
+	unsigned long long dead;
+	while(fscanf(usage, "%x %llu", &segment, &dead) == 2) {
+		char name[16];
+		segment_name(segment, name);
+		struct stat info;
+		if(segment != store.active && fstatat(store.dir_fd, name, &info, 0) == 0) {
+			store.dead[segment] = std::min<uint64_t>(dead, info.st_size);
+		}
+	}
+	fclose(usage);
+}
+
+/// Record the dead space for the next mount.
+static void save_usage(PackStore& store) {
+	const char* temp_name = PACK_USAGE_NAME ".new";
+	const int fd = openat(store.dir_fd, temp_name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	FILE* usage = (fd < 0)? nullptr : fdopen(fd, "w");
+	if(usage == nullptr) {
+		if(fd >= 0) { close(fd); }
+		log_warn("Cannot record the dead space in packed files: %s", strerror(errno));
+		return;
+	}
+
+	for(const auto& entry: store.dead) {
+		fprintf(usage, "%08x %llu\n", entry.first,
+		        static_cast<unsigned long long>(entry.second));
+	}
+	if(fclose(usage) != 0 || renameat(store.dir_fd, temp_name, store.dir_fd,
+	                                  PACK_USAGE_NAME) < 0) {
+		log_warn("Cannot record the dead space in packed files: %s", strerror(errno));
+	}
+}
+
+int pack_open(FangFS& fs) {
+	Buffer dir_path;
+	path_join(fs.source, PACK_DIR_NAME, dir_path);
+	const char* dir_path_str = reinterpret_cast<char*>(dir_path.buf);
+	if(fs.pack_threshold > 0 && mkdir(dir_path_str, 0700) < 0 && errno != EEXIST) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	// Without segments, and without -o pack, there is nothing to do.
+	const int dir_fd = open(dir_path_str, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(dir_fd < 0) {
+		return (errno == ENOENT)? 0 : STATUS_CHECK_ERRNO;
+	}
+
+	const int list_fd = dup(dir_fd);
+	DIR* dir = (list_fd < 0)? nullptr : fdopendir(list_fd);
+	if(dir == nullptr) {
+		const int new_errno = errno;
+		if(list_fd >= 0) { close(list_fd); }
+		close(dir_fd);
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	uint32_t last = 0;
+	struct dirent* entry;
+	while((entry = readdir(dir)) != nullptr) {
+		last = std::max(last, parse_segment_name(entry->d_name));
+	}
+	closedir(dir);
+
+	PackStore* store = store_new();
+	store->dir_fd = dir_fd;
+	store->active = last + 1;
+	load_usage(*store);
+	fs.pack = store;
+	return 0;
+}
+
+void pack_pin(FangFS& fs, const char* real_path) {
+	PackStore& store = *fs.pack;
+	std::lock_guard<std::mutex> guard(store.lock);
+	store.pins[real_path] += 1;
+
+	auto copying = store.copying.find(real_path);
+	if(copying != store.copying.end()) { copying->second = true; }
+}
+
+void pack_release(FangFS& fs, const FangFile& file) {
+	if(file.real_path == nullptr) { return; }
+
+	PackStore& store = *fs.pack;
+	std::lock_guard<std::mutex> guard(store.lock);
+	auto it = store.pins.find(file.real_path);
+	if(it != store.pins.end() && --it->second == 0) {
+		store.pins.erase(it);
+	}
+
+	// The engine checks the length again before it packs anything.
+	if(file.modified && fs.pack_threshold > 0 && file.state->size <= fs.pack_threshold) {
+		store.pending.insert(file.real_path);
+	}
+}
+
+/// Read the packed entry at real_path, under store.lock, and its record,
+/// outside of it. Returns 0 or -errno.
+static int load_record(FangFS& fs, const char* real_path, const uint8_t* key,
+                       PackLocator& locator, Buffer& out) {
+	PackStore& store = *fs.pack;
+	const char* rel_path = pack_relative_path(fs, real_path);
+	for(int attempt = 0;; attempt += 1) {
+		int fd;
+		{
+			std::lock_guard<std::mutex> guard(store.lock);
+			if(pack_read_link(AT_FDCWD, real_path, locator) < 0) { return -errno; }
+			fd = segment_fd(store, locator.segment);
+			if(fd < 0) { return -errno; }
+		}
+
+		const ssize_t status = pack_read_record(fs, fd, locator, rel_path, key, out);
+		if(status >= 0) {
+			return 0;
+		} else if(status == STATUS_TAMPERING) {
+			stats_count(STAT_TAMPERING, 1);
+			log_warn("Tampering detected on packed file %s", real_path);
+			return -EIO;
+		} else if(errno != ESTALE) {
+			return -errno;
+		} else if(attempt == PACK_READ_RETRIES) {
+			log_warn("The record of packed file %s is cut short", real_path);
+			return -EIO;
+		}
+	}
+}
+
+int pack_load(FangFS& fs, const char* real_path, const uint8_t* key, Buffer& out) {
+	PackLocator locator;
+	return load_record(fs, real_path, key, locator, out);
+}
+
+int pack_unpack(FangFS& fs, const char* real_path, const uint8_t* key, bool keep_contents) {
+	PackStore& store = *fs.pack;
+	std::lock_guard<std::mutex> guard(store.lock);
+
+	PackLocator locator;
+	struct stat info;
+	if(pack_read_link(AT_FDCWD, real_path, locator) < 0) {
+		// Already standalone, which some other open may have seen to.
+		return (errno == EINVAL)? 0 : -errno;
+	}
+	if(lstat(real_path, &info) < 0) { return -errno; }
+
+	// Segments are only retired under the lock, so the record stays put.
+	Buffer contents;
+	if(keep_contents) {
+		const int fd = segment_fd(store, locator.segment);
+		if(fd < 0) { return -errno; }
+
+		const ssize_t status = pack_read_record(fs, fd, locator,
+		                                        pack_relative_path(fs, real_path), key,
+		                                        contents);
+		if(status == STATUS_TAMPERING) {
+			stats_count(STAT_TAMPERING, 1);
+			log_warn("Tampering detected on packed file %s", real_path);
+			return -EIO;
+		} else if(status < 0) {
+			return (errno == ESTALE)? -EIO : -errno;
+		}
+	}
+
+	const std::string temp = temp_path(real_path);
+	unlink(temp.c_str());
+	const int fd = open(temp.c_str(), O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if(fd < 0) { return -errno; }
+
+	// Not journaled: the copy is synced whole before it goes anywhere.
+	FangFile* file = fang_file_open(fs, fd, nullptr);
+	if(file == nullptr) {
+		const int new_errno = errno;
+		close(fd);
+		unlink(temp.c_str());
+		return -new_errno;
+	}
+	file->key = key;
+
+	int status = 0;
+	if(keep_contents && contents.len > 0) {
+		status = fang_file_write(*file, 0, contents.len, contents.buf);
+		if(status >= 0) { status = 0; }
+	}
+	const struct timespec times[2] = {info.st_atim, info.st_mtim};
+	if(status == 0 && (fchmod(file->fd, locator.mode) < 0 || futimens(file->fd, times) < 0)) {
+		status = -errno;
+	}
+	if(status == 0) { status = fang_file_sync(*file, 0); }
+	const int close_status = fang_file_close(file);
+	if(status == 0) { status = close_status; }
+	if(status == 0 && rename(temp.c_str(), real_path) < 0) { status = -errno; }
+	sodium_memzero(contents.buf, contents.buf_len);
+	if(status < 0) {
+		unlink(temp.c_str());
+		return status;
+	}
+
+	bury(fs, real_path, locator);
+	stats_count(STAT_FILES_UNPACKED, 1);
+	return 0;
+}
+
+int pack_unlink(FangFS& fs, const char* real_path) {
+	if(fs.pack == nullptr) {
+		return (unlink(real_path) == 0)? 0 : -errno;
+	}
+
+	PackStore& store = *fs.pack;
+	std::lock_guard<std::mutex> guard(store.lock);
+	PackLocator locator;
+	const bool packed = pack_read_link(AT_FDCWD, real_path, locator) == 0;
+	if(unlink(real_path) < 0) { return -errno; }
+
+	if(packed) { bury(fs, real_path, locator); }
+	return 0;
+}
+
+/// Read the standalone file at path into the batch, if it is small enough,
+/// and closed.
+static void add_candidate(FangFS& fs, PackBatch& batch, const std::string& path) {
+	PackStore& store = *fs.pack;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		// Still open, so try again next time.
+		if(store.pins.count(path) > 0) {
+			store.pending.insert(path);
+			return;
+		}
+		store.copying[path] = false;
+	}
+
+	PackCandidate candidate;
+	candidate.path = path;
+	bool ok = false;
+	const int fd = open(path.c_str(), O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	FangFile* file = nullptr;
+	if(fd >= 0 && fstat(fd, &candidate.info) == 0 && S_ISREG(candidate.info.st_mode)) {
+		file = fang_file_open(fs, fd, nullptr);
+	}
+	if(file != nullptr && file->state->size <= static_cast<off_t>(fs.pack_threshold)) {
+		candidate.size = file->state->size;
+		buf_grow(batch.contents, std::max<size_t>(candidate.size, 1));
+		ok = fang_file_read(*file, 0, candidate.size, batch.contents.buf) ==
+		     static_cast<int>(candidate.size);
+	}
+	if(file != nullptr) {
+		fang_file_close(file);
+	} else if(fd >= 0) {
+		close(fd);
+	}
+
+	if(!ok) {
+		std::lock_guard<std::mutex> guard(store.lock);
+		store.copying.erase(path);
+		return;
+	}
+
+	candidate.offset = batch.records.len;
+	candidate.len = seal_record(fs.master_key, pack_relative_path(fs, path.c_str()),
+	                            batch.contents.buf, candidate.size, batch.plain,
+	                            batch.records);
+	sodium_memzero(batch.contents.buf, candidate.size);
+	batch.candidates.push_back(candidate);
+}
+
+/// Append the batch, and swap in a packed entry for every file in it that
+/// hasn't changed since it was read.
+static void commit_batch(FangFS& fs, PackBatch& batch, PackStats& stats) {
+	PackStore& store = *fs.pack;
+	if(batch.candidates.empty()) { return; }
+
+	uint32_t segment = 0;
+	uint64_t offset = 0;
+	const bool appended = append_records(store, batch.records, segment, offset) == 0;
+	if(!appended) {
+		log_warn("Cannot pack small files: %s", strerror(errno));
+	}
+
+	PackWriteLock names(store);
+	std::lock_guard<std::mutex> guard(store.lock);
+	for(const PackCandidate& candidate: batch.candidates) {
+		const std::string& path = candidate.path;
+		const bool disturbed = store.copying[path];
+		store.copying.erase(path);
+		if(!appended) { continue; }
+
+		// Anything that could have changed the file since it was read has
+		// to open it first, or replace it.
+		struct stat now;
+		const bool unchanged = !disturbed && store.pins.count(path) == 0 &&
+		                       lstat(path.c_str(), &now) == 0 &&
+		                       now.st_ino == candidate.info.st_ino &&
+		                       now.st_size == candidate.info.st_size &&
+		                       now.st_mtim.tv_sec == candidate.info.st_mtim.tv_sec &&
+		                       now.st_mtim.tv_nsec == candidate.info.st_mtim.tv_nsec;
+
+		PackLocator locator;
+		locator.segment = segment;
+		locator.offset = offset + candidate.offset;
+		locator.size = candidate.size;
+		locator.mode = candidate.info.st_mode & 07777;
+		if(unchanged && link_entry(path, locator, candidate.info) == 0) {
+			stats.files_packed += 1;
+			stats_count(STAT_FILES_PACKED, 1);
+		} else {
+			store.dead[segment] += candidate.len;
+		}
+	}
+
+	batch.candidates.clear();
+	batch.records.len = 0;
+}
+
+void pack_flush(FangFS& fs, PackStats& stats) {
+	PackStore& store = *fs.pack;
+	if(fs.pack_threshold == 0 || rotation_under_way(fs)) { return; }
+
+	std::set<std::string> pending;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		pending.swap(store.pending);
+	}
+
+	// Whatever is left when the engine stops stays standalone.
+	PackBatch batch;
+	for(const std::string& path: pending) {
+		if(store.stopping.load()) { break; }
+
+		add_candidate(fs, batch, path);
+		if(batch.records.len >= PACK_BATCH_LEN) { commit_batch(fs, batch, stats); }
+	}
+	commit_batch(fs, batch, stats);
+}
+
+/// Flush everything written to the filesystem holding the source.
+static int sync_source(int source_fd) {
+#ifdef HAVE_SYNCFS
+	return syncfs(source_fd);
+#else
+	sync();
+	return 0;
+#endif
+}
+
+/// A live record found in a segment being compacted.
+struct PackLive {
+	std::string path;
+	PackLocator locator;
+
+	/// Where its copy is in the batch, and how long it is.
+	uint64_t offset;
+	size_t len;
+};
+
+/// Copy the records that entries still point at out of segment, point the
+/// entries at the copies, and remove the segment.
+static void compact_segment(FangFS& fs, uint32_t segment, PackStats& stats) {
+	PackStore& store = *fs.pack;
+	int fd;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		fd = segment_fd(store, segment);
+	}
+	struct stat info;
+	if(fd < 0 || fstat(fd, &info) < 0) { return; }
+
+	std::vector<PackLive> live;
+	Buffer records;
+	Buffer record;
+	Buffer plain;
+	uint64_t offset = 0;
+	while(offset < static_cast<uint64_t>(info.st_size)) {
+		// A crash while appending leaves a record cut short, or zeros, at
+		// the end; nothing can point there.
+		uint8_t header[PACK_RECORD_HEADER_LEN];
+		if(pread_full(fd, header, sizeof(header), offset) != 0) { break; }
+		const size_t body_len = u32_from_le(u32_from_bytes(header));
+		const size_t record_len = PACK_RECORD_HEADER_LEN + body_len;
+		if(body_len == 0 || offset + record_len > static_cast<uint64_t>(info.st_size)) { break; }
+
+		// Anything else unreadable might hide records still in use, so leave
+		// the whole segment be.
+		buf_grow(record, record_len);
+		if(body_len < PACK_RECORD_OVERHEAD - PACK_RECORD_HEADER_LEN ||
+		   pread_full(fd, record.buf, record_len, offset) != 0 ||
+		   open_record(record.buf, record_len, fs.master_key, plain) < 0) {
+			log_warn("Not compacting packed file segment %08x: corrupt record at %llu",
+			         segment, static_cast<unsigned long long>(offset));
+			sodium_memzero(plain.buf, plain.buf_len);
+			return;
+		}
+
+		PackLive entry;
+		const size_t path_len = plain.buf[0] | (plain.buf[1] << 8);
+		Buffer path;
+		const std::string rel_path(reinterpret_cast<char*>(plain.buf) + 2, path_len);
+		path_join(fs.source, rel_path.c_str(), path);
+		entry.path = reinterpret_cast<char*>(path.buf);
+		sodium_memzero(plain.buf, plain.buf_len);
+
+		PackLocator locator;
+		bool in_use;
+		{
+			std::lock_guard<std::mutex> guard(store.lock);
+			in_use = pack_read_link(AT_FDCWD, entry.path.c_str(), locator) == 0 &&
+			         locator.segment == segment && locator.offset == offset;
+		}
+		if(in_use) {
+			// Records don't say where they are, so they move as they are.
+			entry.locator = locator;
+			entry.offset = records.len;
+			entry.len = record_len;
+			if(records.buf_len < records.len + record_len) {
+				buf_grow(records, std::max(records.len + record_len, records.buf_len * 2));
+			}
+			memcpy(records.buf + records.len, record.buf, record_len);
+			records.len += record_len;
+			live.push_back(entry);
+		}
+		offset += record_len;
+	}
+
+	uint32_t new_segment = 0;
+	uint64_t new_offset = 0;
+	if(!live.empty() && append_records(store, records, new_segment, new_offset) < 0) {
+		log_warn("Cannot compact packed file segment %08x: %s", segment, strerror(errno));
+		return;
+	}
+
+	uint64_t live_len = 0;
+	bool stranded = false;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		for(const PackLive& entry: live) {
+			PackLocator locator;
+			struct stat now;
+			if(lstat(entry.path.c_str(), &now) < 0 ||
+			   pack_read_link(AT_FDCWD, entry.path.c_str(), locator) < 0 ||
+			   !same_record(locator, entry.locator)) {
+				// Removed or unpacked meanwhile.
+				store.dead[new_segment] += entry.len;
+				continue;
+			}
+
+			locator.segment = new_segment;
+			locator.offset = new_offset + entry.offset;
+			if(link_entry(entry.path, locator, now) < 0) {
+				log_warn("Cannot compact packed file segment %08x: %s", segment,
+				         strerror(errno));
+				store.dead[new_segment] += entry.len;
+				stranded = true;
+				continue;
+			}
+			live_len += entry.len;
+		}
+	}
+	if(stranded) { return; }
+
+	// The new entries must be on disk before the old records can go.
+	if(sync_source(store.dir_fd) < 0) {
+		log_warn("Cannot compact packed file segment %08x: %s", segment, strerror(errno));
+		return;
+	}
+
+	// Reads that looked the segment up before it went see it cut short, and
+	// look their entry up again.
+	std::lock_guard<std::mutex> guard(store.lock);
+	char name[16];
+	segment_name(segment, name);
+	if(ftruncate(fd, 0) < 0 || unlinkat(store.dir_fd, name, 0) < 0) {
+		log_warn("Cannot remove packed file segment %08x: %s", segment, strerror(errno));
+		return;
+	}
+	store.segments.erase(segment);
+	store.retired.push_back(fd);
+	store.dead.erase(segment);
+
+	const uint64_t reclaimed = info.st_size - std::min<uint64_t>(live_len, info.st_size);
+	stats.segments_compacted += 1;
+	stats.bytes_compacted += reclaimed;
+	stats_count(STAT_BYTES_COMPACTED, reclaimed);
+}
+
+void pack_compact(FangFS& fs, PackStats& stats) {
+	PackStore& store = *fs.pack;
+	if(rotation_under_way(fs)) { return; }
+
+	std::vector<uint32_t> segments;
+	{
+		std::lock_guard<std::mutex> guard(store.lock);
+		for(const auto& entry: store.dead) {
+			if(entry.first == store.active) { continue; }
+
+			char name[16];
+			segment_name(entry.first, name);
+			struct stat info;
+			if(fstatat(store.dir_fd, name, &info, 0) == 0 &&
+			   entry.second * 2 >= static_cast<uint64_t>(info.st_size)) {
+				segments.push_back(entry.first);
+			}
+		}
+	}
+
+	for(uint32_t segment: segments) {
+		if(store.stopping.load()) { break; }
+		compact_segment(fs, segment, stats);
+	}
+}
+
+int pack_rotate_copy(FangFS& fs, const char* old_path, const char* new_path,
+                     const uint8_t* old_key, PackLocator& old_locator,
+                     PackLocator& new_locator) {
+	Buffer contents;
+	const int status = load_record(fs, old_path, old_key, old_locator, contents);
+	if(status < 0) {
+		errno = -status;
+		return -1;
+	}
+
+	Buffer plain;
+	Buffer records;
+	seal_record(fs.master_key, pack_relative_path(fs, new_path), contents.buf, contents.len,
+	            plain, records);
+	sodium_memzero(contents.buf, contents.buf_len);
+	if(append_records(*fs.pack, records, new_locator.segment, new_locator.offset) < 0) {
+		return -1;
+	}
+
+	new_locator.size = old_locator.size;
+	new_locator.mode = old_locator.mode;
+	return 0;
+}
+
+bool pack_rotate_swap(FangFS& fs, const char* old_path, const PackLocator& old_locator,
+                      const char* new_path, const PackLocator& new_locator) {
+	PackStore& store = *fs.pack;
+	std::lock_guard<std::mutex> guard(store.lock);
+
+	PackLocator locator;
+	struct stat info;
+	if(lstat(old_path, &info) < 0 || pack_read_link(AT_FDCWD, old_path, locator) < 0 ||
+	   !same_record(locator, old_locator) || link_entry(new_path, new_locator, info) < 0) {
+		bury(fs, new_path, new_locator);
+		return false;
+	}
+
+	unlink(old_path);
+	bury(fs, old_path, old_locator);
+	return true;
+}
+
+/// Sleep for up to seconds, waking early if the engine is told to stop.
+/// Returns false if it has been.
+static bool rest(PackStore& store, double seconds) {
+	std::unique_lock<std::mutex> guard(store.lock);
+	store.wake.wait_for(guard, std::chrono::duration<double>(seconds), [&store]() {
+		return store.stopping.load();
+	});
+	return !store.stopping.load();
+}
+
+static void engine_main(FangFS& fs) {
+	PackStore& store = *fs.pack;
+	while(rest(store, PACK_FLUSH_SECONDS)) {
+		PackStats stats;
+		memset(&stats, 0, sizeof(stats));
+		pack_flush(fs, stats);
+		pack_compact(fs, stats);
+
+		if(stats.files_packed > 0 || stats.segments_compacted > 0) {
+			log_debug("Packed %llu files, compacted %llu segments, %.1f MiB reclaimed",
+			          static_cast<unsigned long long>(stats.files_packed),
+			          static_cast<unsigned long long>(stats.segments_compacted),
+			          stats.bytes_compacted / (1024.0 * 1024.0));
+		}
+	}
+}
+
+void pack_start(FangFS& fs) {
+	PackStore& store = *fs.pack;
+	if(store.engine.joinable()) { return; }
+
+	store.stopping.store(false);
+	store.engine = std::thread(engine_main, std::ref(fs));
+}
+
+void pack_free(FangFS& fs) {
+	PackStore* store = fs.pack;
+	if(store == nullptr) { return; }
+
+	if(store->engine.joinable()) {
+		{
+			std::lock_guard<std::mutex> guard(store->lock);
+			store->stopping.store(true);
+		}
+		store->wake.notify_all();
+		store->engine.join();
+	}
+
+	save_usage(*store);
+	fs.pack = nullptr;
+	store_delete(store);
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fangfs.h"
+#include "file.h"
+
+/// The directory in the root of the source that holds the segments. Each
+/// segment is named after its number, as eight hex digits.
+#define PACK_DIR_NAME "__FANGFS_PACK"
+
+/// Dead space per segment, recorded when the mount ends.
+#define PACK_USAGE_NAME "usage"
+
+/// Hidden name that an entry is rebuilt under, next to the original, before
+/// it replaces it.
+#define PACK_TEMP_NAME "__FANGFS_PACK_TEMP"
+
+/// A packed file's backing entry is a symlink to a target starting with this,
+/// followed by the segment, offset, and plaintext length of its record in
+/// hex, and its permissions in octal, separated by colons.
+#define PACK_LINK_PREFIX "fangfs-pack:"
+
+/// Room for the longest target, short enough to be kept in the inode.
+#define PACK_LINK_MAX 64
+
+/// Segments take no more records once they are this long.
+#define PACK_SEGMENT_LEN (64 * 1024 * 1024)
+
+/// The largest file that -o pack can be asked to pack.
+#define PACK_MAX_THRESHOLD (64 * 1024)
+
+/// A record is the length of the rest of it as a little-endian uint32, a
+/// nonce, and, sealed, the length of its backing path as a little-endian
+/// uint16, the backing path relative to the source, and the file's contents.
+/// The path ties the record to the entry pointing at it.
+#define PACK_RECORD_HEADER_LEN 4
+#define PACK_RECORD_OVERHEAD (PACK_RECORD_HEADER_LEN + BLOCK_OVERHEAD + 2)
+
+/// Where a packed file's record is, as its entry's target says.
+struct PackLocator {
+	uint32_t segment;
+	uint64_t offset;
+
+	/// The plaintext length, and permissions, of the file.
+	uint32_t size;
+	mode_t mode;
+};
+
+/// The segments of a mounted filesystem, and the engine that packs small
+/// files into them and compacts them.
+///
+/// Packed entries only ever change under lock, and the engine replaces a
+/// standalone file only while holding names for writing, which every
+/// foreground operation that opens or removes an entry holds for reading.
+struct PackStore {
+	PackStore(): dir_fd(-1), active(0), active_len(0), stopping(false) {}
+
+	int dir_fd;
+
+	/// Foreground operations hold this for reading from resolving a path
+	/// until they are done with it, and the engine for writing while it
+	/// swaps a file for its packed entry.
+	pthread_rwlock_t names;
+
+	/// Serializes changes to packed entries, and guards everything below.
+	std::mutex lock;
+
+	/// Open segment descriptors. Compacted segments are emptied and
+	/// unlinked, but their descriptors are only closed with the store, so
+	/// that a read racing with compaction gets a short read rather than
+	/// someone else's descriptor.
+	std::map<uint32_t, int> segments;
+	std::vector<int> retired;
+
+	/// The segment new records go into, created on first use, and its
+	/// length so far.
+	uint32_t active;
+	uint64_t active_len;
+
+	/// Bytes of records that no entry points at any more, per segment.
+	std::map<uint32_t, uint64_t> dead;
+
+	/// Backing paths of open files, with their open counts, and of files
+	/// written and closed since the engine last looked.
+	std::map<std::string, unsigned> pins;
+	std::set<std::string> pending;
+
+	/// Backing paths of the files that the engine is packing, and whether
+	/// each has been opened since it was read, which makes the copy stale.
+	std::map<std::string, bool> copying;
+
+	std::thread engine;
+	std::condition_variable wake;
+	std::atomic<bool> stopping;
+
+private:
+	PackStore(const PackStore&);
+	PackStore& operator=(const PackStore&);
+};
+
+/// Holds the store's name lock for reading, if the filesystem has one, for
+/// as long as it lives.
+struct PackReadLock {
+	explicit PackReadLock(FangFS& fs);
+	~PackReadLock();
+
+	PackStore* store;
+
+private:
+	PackReadLock(const PackReadLock&);
+	PackReadLock& operator=(const PackReadLock&);
+};
+
+/// What one run of the engine did.
+struct PackStats {
+	uint64_t files_packed;
+	uint64_t segments_compacted;
+	uint64_t bytes_compacted;
+};
+
+/// The length of the record holding size bytes of a file whose backing path
+/// is path_len bytes long.
+static inline size_t pack_record_len(size_t path_len, size_t size) {
+	return PACK_RECORD_OVERHEAD + path_len + size;
+}
+
+/// real_path, a backing path under the source, relative to the source.
+const char* pack_relative_path(const FangFS& fs, const char* real_path);
+
+/// Format the target of a packed entry into out.
+void pack_format_link(const PackLocator& locator, char out[PACK_LINK_MAX]);
+
+/// Parse the target of a packed entry. Returns 0, or -1 if it isn't one.
+int pack_parse_link(const char* target, PackLocator& locator);
+
+/// Read the target of the packed entry name, relative to dirfd. Returns 0,
+/// or -1 with errno set, to EINVAL if it isn't a packed entry.
+int pack_read_link(int dirfd, const char* name, PackLocator& locator);
+
+/// Describe a packed file: info holds the lstat() of its entry, and is
+/// turned into the attributes of the file.
+void pack_stat(const PackLocator& locator, struct stat* info);
+
+/// Open a segment of the filesystem in source_fd for reading.
+int pack_open_segment(int source_fd, uint32_t segment);
+
+/// Read the record that locator points at out of segment_fd, check that it
+/// belongs to the entry at rel_path, its backing path relative to the source,
+/// and decrypt the contents under key into out. Returns the length of the
+/// contents, STATUS_TAMPERING, or STATUS_CHECK_ERRNO; a record cut short, as
+/// compaction leaves it, fails with ESTALE.
+ssize_t pack_read_record(const FangFS& fs, int segment_fd, const PackLocator& locator,
+                         const char* rel_path, const uint8_t* key, Buffer& out);
+
+/// Set up fs.pack if the source has segments, or -o pack asks for them. Each
+/// mount appends to a segment of its own. Returns 0 or STATUS_CHECK_ERRNO.
+int pack_open(FangFS& fs);
+
+/// Start the engine. It packs files at most fs.pack_threshold bytes long
+/// that were written and closed, every few seconds, and compacts segments
+/// that are mostly dead space.
+void pack_start(FangFS& fs);
+
+/// Stop the engine, if running, record the dead space, and close the store.
+void pack_free(FangFS& fs);
+
+/// Read the contents of the packed file at real_path, under key, into out.
+/// Returns 0 or -errno: -EINVAL if it isn't packed.
+int pack_load(FangFS& fs, const char* real_path, const uint8_t* key, Buffer& out);
+
+/// Replace the packed file at real_path with a standalone one under key, so
+/// that it can be written, copying its contents only if keep_contents is
+/// set. Succeeds if it already was standalone. Returns 0 or -errno.
+int pack_unpack(FangFS& fs, const char* real_path, const uint8_t* key, bool keep_contents);
+
+/// Remove the entry at real_path, packed or not. Returns 0 or -errno.
+int pack_unlink(FangFS& fs, const char* real_path);
+
+/// Record that the file at real_path is open. Call under a PackReadLock.
+void pack_pin(FangFS& fs, const char* real_path);
+
+/// Record that file has been closed, and queue it to be packed if it was
+/// written and is small enough.
+void pack_release(FangFS& fs, const FangFile& file);
+
+/// Pack every file queued by pack_release() that is still small and closed.
+/// The engine calls this every few seconds.
+void pack_flush(FangFS& fs, PackStats& stats);
+
+/// Move the live records out of every segment that is at least half dead
+/// space, then remove it. The engine calls this after pack_flush().
+void pack_compact(FangFS& fs, PackStats& stats);
+
+/// Copy the record of the packed entry at old_path, under old_key, into a
+/// new record under the master key for new_path, its name under the master
+/// key, for the key rotation engine. Returns 0 with the old and new
+/// locators, or -1.
+int pack_rotate_copy(FangFS& fs, const char* old_path, const char* new_path,
+                     const uint8_t* old_key, PackLocator& old_locator,
+                     PackLocator& new_locator);
+
+/// Point new_path at new_locator in place of old_path, if old_path still
+/// points at old_locator. Returns whether it was. The key rotation engine
+/// calls this with foreground operations held off.
+bool pack_rotate_swap(FangFS& fs, const char* old_path, const PackLocator& old_locator,
+                      const char* new_path, const PackLocator& new_locator);
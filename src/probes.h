@@ -0,0 +1,20 @@
+#pragma once
+
+/// USDT probes in the "fangfs" provider, for bpftrace or perf to attach to a
+/// running mount; see tools/probes for examples. An unattached probe is a
+/// single nop. Operations have an _entry and a _return probe on the same
+/// thread, so latencies are the difference between the two, measured by the
+/// tracer rather than paid for here. Without sys/sdt.h, probes compile away.
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define FANGFS_PROBE1(name, a) DTRACE_PROBE1(fangfs, name, a)
+#define FANGFS_PROBE2(name, a, b) DTRACE_PROBE2(fangfs, name, a, b)
+#define FANGFS_PROBE3(name, a, b, c) DTRACE_PROBE3(fangfs, name, a, b, c)
+#define FANGFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(fangfs, name, a, b, c, d)
+#else
+#define FANGFS_PROBE1(name, a) do {} while(0)
+#define FANGFS_PROBE2(name, a, b) do {} while(0)
+#define FANGFS_PROBE3(name, a, b, c) do {} while(0)
+#define FANGFS_PROBE4(name, a, b, c, d) do {} while(0)
+#endif
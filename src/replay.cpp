@@ -0,0 +1,405 @@
+// Replay an operation trace recorded with -o trace directly against the core,
+// without FUSE, and report per-operation latency for both the original run
+// and the replay.
+#include "fangfs.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "log.h"
+#include "options.h"
+#include "trace.h"
+#include "error.h"
+
+/// Everything a trace refers to by one path hash.
+struct Entity {
+	std::string path;
+	bool is_dir;
+
+	/// How far into the file the trace reads, so that a file the trace
+	/// didn't create can be made big enough beforehand.
+	uint64_t extent;
+
+	/// Handles open on this path, newest last.
+	std::vector<struct fuse_file_info> files;
+	std::vector<struct fuse_file_info> dirs;
+};
+
+static FangFS fangfs;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+	const uint64_t now = now_ns();
+	if(deadline <= now) { return; }
+
+	struct timespec ts;
+	ts.tv_sec = (deadline - now) / 1000000000ULL;
+	ts.tv_nsec = (deadline - now) % 1000000000ULL;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+static bool is_dir_op(uint8_t op) {
+	return op == TRACE_MKDIR || op == TRACE_OPENDIR || op == TRACE_READDIR ||
+	       op == TRACE_RELEASEDIR;
+}
+
+static bool is_create_op(uint8_t op) {
+	return op == TRACE_MKNOD || op == TRACE_CREATE || op == TRACE_MKDIR;
+}
+
+/// Plaintext paths are not in the trace, so make one up for each hash, at the
+/// same depth as the original so that resolving it costs the same.
+static std::string synthesize_path(const TraceRecord& record) {
+	if(record.depth == 0) { return "/"; }
+
+	std::string path;
+	for(uint16_t i = 1; i < record.depth; i += 1) {
+		path += "/r" + std::to_string(i);
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx", static_cast<unsigned long long>(record.path_hash));
+	return path + name;
+}
+
+/// Create whatever the trace expects to exist without creating it itself.
+static int prepare(std::unordered_map<uint64_t, Entity>& entities,
+                   const std::vector<TraceRecord>& records) {
+	std::unordered_map<uint64_t, bool> created_by_trace;
+	uint16_t max_depth = 0;
+	for(const TraceRecord& record: records) {
+		Entity& entity = entities[record.path_hash];
+		if(entity.path.empty()) {
+			entity.path = synthesize_path(record);
+			entity.is_dir = false;
+			entity.extent = 0;
+			created_by_trace[record.path_hash] = is_create_op(record.op);
+		}
+
+		entity.is_dir = entity.is_dir || is_dir_op(record.op) || record.depth == 0;
+		if(record.op == TRACE_READ) {
+			entity.extent = std::max(entity.extent, record.offset + record.size);
+		}
+		max_depth = std::max(max_depth, record.depth);
+	}
+
+	std::string parent;
+	for(uint16_t i = 1; i < max_depth; i += 1) {
+		parent += "/r" + std::to_string(i);
+		const int status = fangfs_mkdir(fangfs, parent.c_str(), 0700);
+		if(status < 0 && status != -EEXIST) { return status; }
+	}
+
+	std::vector<uint8_t> zeros(1 << 20, 0);
+	for(auto& pair: entities) {
+		Entity& entity = pair.second;
+		if(created_by_trace[pair.first] || entity.path == "/") { continue; }
+
+		if(entity.is_dir) {
+			const int status = fangfs_mkdir(fangfs, entity.path.c_str(), 0700);
+			if(status < 0 && status != -EEXIST) { return status; }
+			continue;
+		}
+
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDWR|O_CREAT;
+		int status = fangfs_create(fangfs, entity.path.c_str(), 0600, &fi);
+		for(uint64_t offset = 0; status >= 0 && offset < entity.extent; offset += zeros.size()) {
+			const size_t len = std::min<uint64_t>(zeros.size(), entity.extent - offset);
+			status = fangfs_write(fangfs, reinterpret_cast<char*>(zeros.data()), len,
+			                      offset, &fi);
+		}
+		if(status >= 0) { status = fangfs_close(fangfs, &fi); }
+		if(status < 0) { return status; }
+	}
+
+	return 0;
+}
+
+static int fill_nothing(void* buf, const char* name, const struct stat* st, off_t off) {
+	return 0;
+}
+
+/// The newest handle open on entity, opening one if the trace began after
+/// the original open.
+static struct fuse_file_info* get_handle(Entity& entity) {
+	if(entity.files.empty()) {
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDWR;
+		if(fangfs_open(fangfs, entity.path.c_str(), &fi) < 0) { return nullptr; }
+		entity.files.push_back(fi);
+	}
+
+	return &entity.files.back();
+}
+
+static struct fuse_file_info* get_dir_handle(Entity& entity) {
+	if(entity.dirs.empty()) {
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+		if(fangfs_opendir(fangfs, entity.path.c_str(), &fi) != 0) { return nullptr; }
+		entity.dirs.push_back(fi);
+	}
+
+	return &entity.dirs.back();
+}
+
+/// Run one traced operation, returning its result.
+static int64_t replay_one(Entity& entity, const TraceRecord& record, std::vector<char>& buf) {
+	const char* path = entity.path.c_str();
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+
+	switch(record.op) {
+	case TRACE_MKNOD:
+		return fangfs_mknod(fangfs, path, record.size, 0);
+	case TRACE_TRUNCATE:
+		return fangfs_truncate(fangfs, path, record.offset);
+	case TRACE_FTRUNCATE: {
+		struct fuse_file_info* handle = get_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		return fangfs_ftruncate(fangfs, path, record.offset, handle);
+	}
+	case TRACE_UNLINK:
+		return fangfs_unlink(fangfs, path);
+	case TRACE_OPEN: {
+		fi.flags = record.size;
+		const int status = fangfs_open(fangfs, path, &fi);
+		if(status >= 0) { entity.files.push_back(fi); }
+		return status;
+	}
+	case TRACE_CREATE: {
+		fi.flags = O_RDWR|O_CREAT;
+		const int status = fangfs_create(fangfs, path, record.size, &fi);
+		if(status >= 0) { entity.files.push_back(fi); }
+		return status;
+	}
+	case TRACE_RELEASE: {
+		if(entity.files.empty()) { return 0; }
+		fi = entity.files.back();
+		entity.files.pop_back();
+		return fangfs_close(fangfs, &fi);
+	}
+	case TRACE_GETATTR: {
+		struct stat info;
+		return fangfs_getattr(fangfs, path, &info);
+	}
+	case TRACE_READ: {
+		struct fuse_file_info* handle = get_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		if(buf.size() < record.size) { buf.resize(record.size, 'r'); }
+		return fangfs_read(fangfs, buf.data(), record.size, record.offset, handle);
+	}
+	case TRACE_WRITE: {
+		struct fuse_file_info* handle = get_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		if(buf.size() < record.size) { buf.resize(record.size, 'r'); }
+		return fangfs_write(fangfs, buf.data(), record.size, record.offset, handle);
+	}
+	case TRACE_FSYNC: {
+		struct fuse_file_info* handle = get_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		return fangfs_fsync(fangfs, record.size, handle);
+	}
+	case TRACE_FLUSH: {
+		struct fuse_file_info* handle = get_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		return fangfs_flush(fangfs, handle);
+	}
+	case TRACE_MKDIR:
+		return fangfs_mkdir(fangfs, path, record.size);
+	case TRACE_OPENDIR: {
+		const int status = fangfs_opendir(fangfs, path, &fi);
+		if(status == 0) { entity.dirs.push_back(fi); }
+		return status;
+	}
+	case TRACE_READDIR: {
+		struct fuse_file_info* handle = get_dir_handle(entity);
+		if(handle == nullptr) { return -EBADF; }
+		return fangfs_readdir(fangfs, path, nullptr, fill_nothing, record.offset, handle);
+	}
+	case TRACE_RELEASEDIR: {
+		if(entity.dirs.empty()) { return 0; }
+		fi = entity.dirs.back();
+		entity.dirs.pop_back();
+		return fangfs_releasedir(fangfs, path, &fi);
+	}
+	}
+
+	return 0;
+}
+
+/// Print count, errors, and latency percentiles in microseconds for each
+/// operation type.
+static void report(const char* source, std::vector<std::vector<uint64_t>>& latencies,
+                   const std::vector<uint64_t>& errors) {
+	for(size_t op = 0; op < latencies.size(); op += 1) {
+		std::vector<uint64_t>& ns = latencies[op];
+		if(ns.empty()) { continue; }
+
+		std::sort(ns.begin(), ns.end());
+		double total = 0;
+		for(uint64_t x: ns) { total += x; }
+		const auto pct = [&](double q) {
+			return ns[std::min(ns.size() - 1, static_cast<size_t>(q * ns.size()))] / 1000.0;
+		};
+
+		printf("%s\t%s\t%zu\t%llu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", source,
+		       trace_op_name(op), ns.size(), static_cast<unsigned long long>(errors[op]),
+		       total / ns.size() / 1000.0, pct(0.5), pct(0.9), pct(0.99), pct(0.999),
+		       ns.back() / 1000.0);
+	}
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-m] <trace> <source> [-o options]\n"
+	                "  -m  Replay at maximum speed instead of the original pace\n"
+	                "The passphrase for source is read from stdin. If source is empty,\n"
+	                "a new filesystem is created there.\n", name);
+}
+
+int main(int argc, char** argv) {
+	bool max_speed = false;
+	int c;
+	while((c = getopt(argc, argv, "+mh")) != -1) {
+		switch(c) {
+		case 'm':
+			max_speed = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(argc - optind < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char* trace_path = argv[optind];
+	const char* source_dir = argv[optind + 1];
+
+	// Whatever is left are "-o" options, as for a mount. Unlocking is not
+	// what's being measured, so don't spend long on a new key by default.
+	fangfs.kdf_target_seconds = 0.05;
+	argv[optind + 1] = argv[0];
+	struct fuse_args args = FUSE_ARGS_INIT(argc - optind - 1, argv + optind + 1);
+	if(fangfs_parse_options(fangfs, &args) < 0) {
+		return 1;
+	}
+	if(args.argc > 1) {
+		log_error("Unknown argument: %s", args.argv[1]);
+		return 1;
+	}
+	fuse_opt_free_args(&args);
+
+	TraceReader reader;
+	int status = trace_reader_open(reader, trace_path);
+	if(status < 0) {
+		log_error("Cannot read trace %s: %s", trace_path,
+		          (status == STATUS_CHECK_ERRNO)? strerror(errno) : "not a trace file");
+		return 1;
+	}
+
+	std::vector<TraceRecord> records;
+	records.reserve(reader.count);
+	for(uint64_t i = reader.first; i < reader.first + reader.count; i += 1) {
+		const TraceRecord& record = trace_reader_get(reader, i);
+		if(record.op != TRACE_NONE && record.op < TRACE_N_OPS) {
+			records.push_back(record);
+		}
+	}
+	trace_reader_close(reader);
+
+	// The ring holds records in the order operations finished.
+	std::stable_sort(records.begin(), records.end(),
+	                 [](const TraceRecord& a, const TraceRecord& b) {
+		return a.start_ns < b.start_ns;
+	});
+
+	std::vector<std::vector<uint64_t>> traced(TRACE_N_OPS);
+	std::vector<std::vector<uint64_t>> replayed(TRACE_N_OPS);
+	std::vector<uint64_t> traced_errors(TRACE_N_OPS, 0);
+	std::vector<uint64_t> replayed_errors(TRACE_N_OPS, 0);
+	uint64_t mismatches = 0;
+	uint64_t elapsed = 0;
+
+	try {
+		status = fangfs_fsinit(fangfs, source_dir);
+		if(status < 0) {
+			if(status == STATUS_CHECK_ERRNO) {
+				log_error("Initialization error: %d. %s", status, strerror(errno));
+			} else {
+				log_error("Initialization error: %d.", status);
+			}
+			return 1;
+		}
+
+		std::unordered_map<uint64_t, Entity> entities;
+		status = prepare(entities, records);
+		if(status < 0) {
+			log_error("Cannot set up files for the trace: %s", strerror(-status));
+			fangfs_fsclose(fangfs);
+			return 1;
+		}
+
+		std::vector<char> buf;
+		const uint64_t replay_start = now_ns();
+		const uint64_t trace_start = records.empty()? 0 : records[0].start_ns;
+		for(const TraceRecord& record: records) {
+			if(!max_speed) {
+				sleep_until(replay_start + (record.start_ns - trace_start));
+			}
+
+			Entity& entity = entities[record.path_hash];
+			const uint64_t start = now_ns();
+			const int64_t result = replay_one(entity, record, buf);
+			replayed[record.op].push_back(now_ns() - start);
+			traced[record.op].push_back(record.end_ns - record.start_ns);
+
+			if(record.result < 0) { traced_errors[record.op] += 1; }
+			if(result < 0) { replayed_errors[record.op] += 1; }
+			if((record.result < 0) != (result < 0)) { mismatches += 1; }
+		}
+		elapsed = now_ns() - replay_start;
+
+		for(auto& pair: entities) {
+			for(struct fuse_file_info& fi: pair.second.files) { fangfs_close(fangfs, &fi); }
+			for(struct fuse_file_info& fi: pair.second.dirs) {
+				fangfs_releasedir(fangfs, pair.second.path.c_str(), &fi);
+			}
+		}
+	} catch (std::runtime_error& e) {
+		log_error("Panic: %s", e.what());
+		fangfs_fsclose(fangfs);
+		return 1;
+	}
+
+	fangfs_fsclose(fangfs);
+
+	printf("source\top\tcount\terrors\tmean_us\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n");
+	report("trace", traced, traced_errors);
+	report("replay", replayed, replayed_errors);
+
+	fprintf(stderr, "Replayed %zu operations in %.3fs; %llu succeeded in one run and failed "
+	                "in the other\n", records.size(), elapsed / 1e9,
+	        static_cast<unsigned long long>(mismatches));
+	return 0;
+}
@@ -0,0 +1,579 @@
+// Rotation to a new master key while mounted. A background engine walks the
+// tree, renaming directories under the new key, and copying each file into a
+// hidden temporary file under the new key before swapping it in. Until it is
+// done, entries under either key are readable, and the name of an entry says
+// which key it, and its blocks, are under.
+#include "rotate.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "BufferEncryption.h"
+#include "file.h"
+#include "log.h"
+#include "pack.h"
+#include "stats.h"
+#include "util.h"
+#include "error.h"
+
+/// How much ciphertext the engine re-encrypts between checks of its limits.
+#define ROTATE_CHUNK_LEN (1 << 20)
+
+/// How long to wait before another pass when the last one had to leave
+/// entries behind, in seconds.
+#define ROTATE_RETRY_SECONDS 10
+
+/// Holds the rotation's name lock for writing while it lives.
+struct RotateWriteLock {
+	explicit RotateWriteLock(Rotation& rotation): names(rotation.names) {
+		pthread_rwlock_wrlock(&names);
+	}
+	~RotateWriteLock() { pthread_rwlock_unlock(&names); }
+
+	pthread_rwlock_t& names;
+};
+
+/// State for one pass of the engine.
+struct RotatePass {
+	RotatePass(FangFS& fang, RotateStats& totals):
+		fs(fang), rotation(*fang.rotation), stats(totals) {}
+
+	FangFS& fs;
+	Rotation& rotation;
+	RotateStats& stats;
+
+	/// Ciphertext read from the old file, and written to the new one.
+	Buffer ciphertext;
+	Buffer rotated;
+	Buffer plaintext;
+	Buffer packed;
+};
+
+RotateReadLock::RotateReadLock(FangFS& fs): rotation(fs.rotation) {
+	if(rotation == nullptr) { return; }
+
+	StatScope timer(STAT_ROTATE_WAIT);
+	pthread_rwlock_rdlock(&rotation->names);
+}
+
+RotateReadLock::~RotateReadLock() {
+	if(rotation != nullptr) {
+		pthread_rwlock_unlock(&rotation->names);
+	}
+}
+
+static Rotation* rotation_new() {
+	Rotation* rotation = new Rotation;
+	if(sodium_mlock(rotation->old_key, sizeof(rotation->old_key)) != 0) {
+		delete rotation;
+		return nullptr;
+	}
+
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// A steady stream of foreground readers would otherwise hold the engine
+	// off forever.
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&rotation->names, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return rotation;
+}
+
+static void rotation_delete(Rotation* rotation) {
+	pthread_rwlock_destroy(&rotation->names);
+	sodium_munlock(rotation->old_key, sizeof(rotation->old_key));
+	delete rotation;
+}
+
+int rotate_begin(FangFS& fs, const uint8_t next_key[crypto_secretbox_KEYBYTES]) {
+	Rotation* rotation = rotation_new();
+	if(rotation == nullptr) { return STATUS_ERROR; }
+
+	// Nothing may be written under the new key before the metafile that
+	// holds it is safely on disk, which metafile_write() sees to.
+	const int status = metafile_write(fs.metafile);
+	if(status < 0) {
+		const int new_errno = errno;
+		rotation_delete(rotation);
+		errno = new_errno;
+		return status;
+	}
+
+	memcpy(rotation->old_key, fs.master_key, sizeof(rotation->old_key));
+	memcpy(fs.master_key, next_key, sizeof(fs.master_key));
+	fs.rotation = rotation;
+	log_info("Rotating to a new master key");
+	return 0;
+}
+
+int rotate_resume(FangFS& fs) {
+	Rotation* rotation = rotation_new();
+	if(rotation == nullptr) { return STATUS_ERROR; }
+
+	if(metafile_previous_key(fs.metafile, fs.master_key, rotation->old_key) != 0) {
+		log_error("The previous master key of the key rotation is corrupt");
+		rotation_delete(rotation);
+		return STATUS_TAMPERING;
+	}
+
+	fs.rotation = rotation;
+	log_info("Resuming an interrupted key rotation");
+	return 0;
+}
+
+void rotate_pin(FangFS& fs, const char* real_path) {
+	Rotation& rotation = *fs.rotation;
+	std::lock_guard<std::mutex> guard(rotation.pins_lock);
+	rotation.pins[real_path] += 1;
+	if(rotation.copying == real_path) { rotation.disturbed = true; }
+}
+
+void rotate_unpin(FangFS& fs, const char* real_path) {
+	Rotation& rotation = *fs.rotation;
+	std::lock_guard<std::mutex> guard(rotation.pins_lock);
+	auto it = rotation.pins.find(real_path);
+	if(it != rotation.pins.end() && --it->second == 0) {
+		rotation.pins.erase(it);
+	}
+}
+
+/// Whether real_path, or anything below it, is open.
+static bool is_pinned(Rotation& rotation, const std::string& real_path) {
+	std::lock_guard<std::mutex> guard(rotation.pins_lock);
+	if(rotation.pins.count(real_path) > 0) { return true; }
+
+	const std::string prefix = real_path + "/";
+	auto it = rotation.pins.lower_bound(prefix);
+	return it != rotation.pins.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+}
+
+/// Sleep for up to seconds, waking early if the engine is told to stop.
+/// Returns false if it has been.
+static bool rest(Rotation& rotation, double seconds) {
+	std::unique_lock<std::mutex> guard(rotation.engine_lock);
+	rotation.wake.wait_for(guard, std::chrono::duration<double>(seconds), [&rotation]() {
+		return rotation.stopping.load();
+	});
+	return !rotation.stopping.load();
+}
+
+/// Sleep off what the rate and duty limits owe for len bytes re-encrypted in
+/// busy_ns of work. Returns false if the engine has been told to stop.
+static bool throttle(RotatePass& pass, uint64_t len, uint64_t busy_ns) {
+	const double busy = busy_ns / 1e9;
+	double wait = 0;
+	if(pass.fs.rotate_rate > 0) {
+		wait = static_cast<double>(len) / pass.fs.rotate_rate - busy;
+	}
+	if(pass.fs.rotate_duty > 0 && pass.fs.rotate_duty < 1) {
+		wait = std::max(wait, busy * (1 - pass.fs.rotate_duty) / pass.fs.rotate_duty);
+	}
+
+	if(wait <= 0) { return !pass.rotation.stopping.load(); }
+	return rest(pass.rotation, wait);
+}
+
+/// Read up to len bytes at offset, short only at the end of the file.
+static ssize_t read_full(int fd, uint8_t* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while(total < len) {
+		const ssize_t n = pread(fd, buf + total, len - total, offset + total);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		if(n == 0) { break; }
+		total += n;
+	}
+	return total;
+}
+
+/// Re-encrypt len bytes of consecutive slots, the last perhaps short, from
+/// pass.ciphertext into pass.rotated. Returns the length of the rotated
+/// slots, or -1 if a block fails authentication.
+static ssize_t rotate_blocks(RotatePass& pass, size_t len) {
+	const size_t block_size = pass.fs.metafile.block_size;
+	size_t rotated_len = 0;
+	for(size_t offset = 0; offset < len; offset += block_size) {
+		const size_t n = std::min(block_size, len - offset);
+		const ssize_t plain_n = fang_block_open(pass.fs, pass.rotation.old_key,
+		                                        pass.ciphertext.buf + offset, n,
+		                                        pass.plaintext.buf, pass.packed);
+		if(plain_n < 0) {
+			stats_count(STAT_TAMPERING, 1);
+			return -1;
+		}
+
+		rotated_len = offset + fang_block_seal(pass.fs, pass.fs.master_key,
+		                                       pass.plaintext.buf, plain_n,
+		                                       pass.rotated.buf + offset, pass.packed);
+		pass.stats.bytes += plain_n;
+		stats_count(STAT_BYTES_ROTATED, plain_n);
+	}
+	return rotated_len;
+}
+
+/// Copy the file at old_path into temp_path under the new key, with its
+/// permissions and times. info describes old_path as opened in fd.
+static bool copy_file(RotatePass& pass, const char* plain_path, int fd,
+                      const struct stat& info, const std::string& temp_path) {
+	const size_t block_size = pass.fs.metafile.block_size;
+	const size_t chunk_len = std::max<size_t>(ROTATE_CHUNK_LEN / block_size, 1) * block_size;
+	buf_grow(pass.ciphertext, chunk_len);
+	buf_grow(pass.rotated, chunk_len);
+	buf_grow(pass.plaintext, block_size);
+
+	const int out = open(temp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+	if(out < 0) {
+		log_warn("Cannot rotate %s: %s", plain_path, strerror(errno));
+		return false;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	bool ok = true;
+	off_t offset = 0;
+	while(ok && offset < info.st_size) {
+		const uint64_t start = stats_clock();
+		const ssize_t n = read_full(fd, pass.ciphertext.buf, chunk_len, offset);
+		if(n <= 0) {
+			// Shrunk under us; the swap will notice.
+			ok = false;
+			break;
+		}
+
+		const ssize_t rotated_n = rotate_blocks(pass, n);
+		if(rotated_n < 0) {
+			log_warn("Cannot rotate %s: tampering detected", plain_path);
+			ok = false;
+		} else if(fang_block_write_slots(pass.fs, out, pass.rotated.buf, rotated_n,
+		                                 offset) < 0) {
+			log_warn("Cannot rotate %s: %s", plain_path, strerror(errno));
+			ok = false;
+		}
+
+		// Let the page cache drop what has been rotated.
+		posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+		offset += n;
+		if(ok && !throttle(pass, n, stats_clock() - start)) {
+			ok = false;
+		}
+	}
+
+	// The copy must be whole on disk before it can replace the original.
+	const struct timespec times[2] = {info.st_atim, info.st_mtim};
+	if(ok && (fchmod(out, info.st_mode & 07777) < 0 || futimens(out, times) < 0 ||
+	          fsync(out) < 0)) {
+		log_warn("Cannot rotate %s: %s", plain_path, strerror(errno));
+		ok = false;
+	}
+
+	close(out);
+	return ok;
+}
+
+/// Move the file at old_path to new_path under the new key. Returns false if
+/// it has to be left for a later pass.
+static bool rotate_file(RotatePass& pass, const char* plain_path, const std::string& real_dir,
+                        const std::string& old_path, const std::string& new_path) {
+	Rotation& rotation = pass.rotation;
+
+	// A crash just after an earlier swap leaves the old copy behind.
+	struct stat info;
+	if(lstat(new_path.c_str(), &info) == 0) {
+		RotateWriteLock names(rotation);
+		return !is_pinned(rotation, old_path) && pack_unlink(pass.fs, old_path.c_str()) == 0;
+	}
+
+	const int fd = open(old_path.c_str(), O_RDONLY|O_NOFOLLOW);
+	if(fd < 0) {
+		// Deleted since the directory was listed.
+		return errno == ENOENT;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(rotation.pins_lock);
+		rotation.copying = old_path;
+		rotation.disturbed = false;
+	}
+
+	const std::string temp_path = real_dir + "/" ROTATE_TEMP_NAME;
+	bool swapped = false;
+	if(fstat(fd, &info) == 0 && !is_pinned(rotation, old_path)) {
+		if(fang_file_size_fd(pass.fs, fd, info.st_size) < 0) {
+			log_warn("Cannot rotate %s: impossible length", plain_path);
+		} else if(copy_file(pass, plain_path, fd, info, temp_path)) {
+			RotateWriteLock names(rotation);
+
+			// Anything that could have changed the file since it was
+			// copied has to open it first, or replace it.
+			struct stat now;
+			bool unchanged = lstat(old_path.c_str(), &now) == 0 &&
+			                 now.st_ino == info.st_ino && now.st_size == info.st_size &&
+			                 now.st_mtim.tv_sec == info.st_mtim.tv_sec &&
+			                 now.st_mtim.tv_nsec == info.st_mtim.tv_nsec;
+			{
+				std::lock_guard<std::mutex> guard(rotation.pins_lock);
+				unchanged = unchanged && !rotation.disturbed &&
+				            rotation.pins.count(old_path) == 0;
+				rotation.copying.clear();
+			}
+
+			if(unchanged && rename(temp_path.c_str(), new_path.c_str()) == 0) {
+				unlink(old_path.c_str());
+				swapped = true;
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(rotation.pins_lock);
+		rotation.copying.clear();
+	}
+	if(!swapped) { unlink(temp_path.c_str()); }
+	close(fd);
+	return swapped;
+}
+
+/// Move the packed file at old_path to new_path under the new key, by
+/// copying its record. Returns false if it has to be left for a later pass.
+static bool rotate_packed(RotatePass& pass, const char* plain_path,
+                          const std::string& old_path, const std::string& new_path) {
+	Rotation& rotation = pass.rotation;
+
+	// A crash just after an earlier swap leaves the old entry behind.
+	struct stat info;
+	if(lstat(new_path.c_str(), &info) == 0) {
+		RotateWriteLock names(rotation);
+		return pack_unlink(pass.fs, old_path.c_str()) == 0;
+	}
+
+	PackLocator old_locator;
+	PackLocator new_locator;
+	if(pack_rotate_copy(pass.fs, old_path.c_str(), new_path.c_str(), rotation.old_key,
+	                    old_locator, new_locator) < 0) {
+		// Removed since the directory was listed, or unpacked to be written,
+		// which leaves a file for the next pass.
+		if(errno == ENOENT) { return true; }
+		if(errno != EINVAL) { log_warn("Cannot rotate %s: %s", plain_path, strerror(errno)); }
+		return false;
+	}
+
+	// Readers hold the whole file, so only a swap to a standalone file,
+	// which the swap checks for, could lose anything.
+	RotateWriteLock names(rotation);
+	if(!pack_rotate_swap(pass.fs, old_path.c_str(), old_locator, new_path.c_str(),
+	                     new_locator)) {
+		return false;
+	}
+
+	pass.stats.bytes += old_locator.size;
+	stats_count(STAT_BYTES_ROTATED, old_locator.size);
+	return true;
+}
+
+/// Rename an entry other than a file to new_path under the new key, unless
+/// something under it is open. Returns whether it was.
+static bool rotate_name(RotatePass& pass, const std::string& old_path,
+                        const std::string& new_path) {
+	RotateWriteLock names(pass.rotation);
+	if(is_pinned(pass.rotation, old_path)) { return false; }
+
+	return rename(old_path.c_str(), new_path.c_str()) == 0;
+}
+
+/// Rotate everything in the plaintext directory plain_dir, backed by
+/// real_dir.
+static void rotate_dir(RotatePass& pass, const std::string& plain_dir,
+                       const std::string& real_dir) {
+	pass.stats.dirs += 1;
+
+	// A copy left behind by an interrupted pass.
+	unlink((real_dir + "/" ROTATE_TEMP_NAME).c_str());
+
+	DIR* dir = opendir(real_dir.c_str());
+	if(dir == nullptr) {
+		log_warn("Cannot rotate %s: %s", plain_dir.c_str(), strerror(errno));
+		pass.stats.remaining += 1;
+		return;
+	}
+
+	// Renaming entries while reading the directory could skip or repeat
+	// them, so take the whole listing first.
+	std::vector<std::string> names;
+	while(1) {
+		errno = 0;
+		struct dirent* entry = readdir(dir);
+		if(entry == nullptr) {
+			if(errno != 0) { pass.stats.remaining += 1; }
+			break;
+		}
+
+		// Special names, as readdir skips them.
+		const char* name = entry->d_name;
+		if(name[0] == '_' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		names.push_back(name);
+	}
+	closedir(dir);
+
+	Buffer decrypted;
+	Buffer plain_path;
+	Buffer current_name;
+	for(const std::string& name: names) {
+		if(pass.rotation.stopping.load()) {
+			pass.stats.remaining += 1;
+			return;
+		}
+
+		const char* plain_name = nullptr;
+		const uint8_t* key = nullptr;
+		if(name_decrypt(pass.fs, plain_dir.c_str(), name.c_str(), decrypted,
+		                &plain_name, &key) < 0) {
+			// Under neither key, or misplaced: nothing can read it anyway.
+			log_warn("Not rotating %s/%s, which doesn't belong there",
+			         plain_dir.c_str(), name.c_str());
+			continue;
+		}
+		path_join(plain_dir.c_str(), plain_name, plain_path);
+		const char* plain_path_str = reinterpret_cast<char*>(plain_path.buf);
+
+		const std::string old_path = real_dir + "/" + name;
+		struct stat info;
+		if(lstat(old_path.c_str(), &info) < 0) {
+			continue;
+		}
+
+		if(key == pass.fs.master_key) {
+			if(S_ISDIR(info.st_mode)) { rotate_dir(pass, plain_path_str, old_path); }
+			continue;
+		}
+
+		path_encrypt(pass.fs, plain_path_str, current_name);
+		const std::string new_path = real_dir + "/" +
+		                             reinterpret_cast<char*>(current_name.buf);
+		PackLocator locator;
+		const bool packed = S_ISLNK(info.st_mode) && pass.fs.pack != nullptr &&
+		                    pack_read_link(AT_FDCWD, old_path.c_str(), locator) == 0;
+		if(S_ISREG(info.st_mode) || packed) {
+			const bool moved = packed?
+			                   rotate_packed(pass, plain_path_str, old_path, new_path) :
+			                   rotate_file(pass, plain_path_str, real_dir, old_path, new_path);
+			if(moved) {
+				pass.stats.files += 1;
+			} else {
+				pass.stats.remaining += 1;
+			}
+		} else if(rotate_name(pass, old_path, new_path)) {
+			if(S_ISDIR(info.st_mode)) { rotate_dir(pass, plain_path_str, new_path); }
+		} else {
+			// Something below is open. Whatever else is in there can still
+			// move to the new key.
+			pass.stats.remaining += 1;
+			if(S_ISDIR(info.st_mode)) { rotate_dir(pass, plain_path_str, old_path); }
+		}
+	}
+}
+
+void rotate_pass(FangFS& fs, RotateStats& stats) {
+	memset(&stats, 0, sizeof(stats));
+	RotatePass pass(fs, stats);
+	rotate_dir(pass, "/", fs.source);
+}
+
+/// Flush everything written to the filesystem holding the source.
+static int sync_source(const char* source) {
+	const int fd = open(source, O_RDONLY|O_DIRECTORY);
+	if(fd < 0) { return -1; }
+#ifdef HAVE_SYNCFS
+	const int status = syncfs(fd);
+#else
+	sync();
+	const int status = 0;
+#endif
+	close(fd);
+	return status;
+}
+
+int rotate_finish(FangFS& fs) {
+	Rotation& rotation = *fs.rotation;
+
+	// Every swap has to be on disk before the old key can go.
+	if(sync_source(fs.source) < 0) {
+		return STATUS_CHECK_ERRNO;
+	}
+
+	RotateWriteLock names(rotation);
+	fs.metafile.rotating = false;
+	const int status = metafile_write(fs.metafile);
+	if(status < 0) {
+		fs.metafile.rotating = true;
+		return status;
+	}
+
+	rotation.done = true;
+	sodium_memzero(rotation.old_key, sizeof(rotation.old_key));
+	return 0;
+}
+
+static void engine_main(FangFS& fs) {
+	Rotation& rotation = *fs.rotation;
+	while(!rotation.stopping.load()) {
+		RotateStats stats;
+		rotate_pass(fs, stats);
+		if(rotation.stopping.load()) { break; }
+
+		log_info("Key rotation pass: %llu dirs, %llu files, %.1f MiB re-encrypted, "
+		         "%llu entries left",
+		         static_cast<unsigned long long>(stats.dirs),
+		         static_cast<unsigned long long>(stats.files),
+		         stats.bytes / (1024.0 * 1024.0),
+		         static_cast<unsigned long long>(stats.remaining));
+		if(stats.remaining == 0) {
+			if(rotate_finish(fs) == 0) {
+				log_info("Key rotation complete");
+			} else {
+				log_error("Cannot record the end of the key rotation: %s", strerror(errno));
+			}
+			return;
+		}
+
+		// Open files have to be closed before they can move.
+		rest(rotation, ROTATE_RETRY_SECONDS);
+	}
+}
+
+void rotate_start(FangFS& fs) {
+	Rotation& rotation = *fs.rotation;
+	if(rotation.done || rotation.engine.joinable()) { return; }
+
+	rotation.stopping.store(false);
+	rotation.engine = std::thread(engine_main, std::ref(fs));
+}
+
+void rotate_free(FangFS& fs) {
+	Rotation* rotation = fs.rotation;
+	if(rotation == nullptr) { return; }
+
+	if(rotation->engine.joinable()) {
+		{
+			std::lock_guard<std::mutex> guard(rotation->engine_lock);
+			rotation->stopping.store(true);
+		}
+		rotation->wake.notify_all();
+		rotation->engine.join();
+	}
+
+	fs.rotation = nullptr;
+	rotation_delete(rotation);
+}
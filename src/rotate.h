@@ -0,0 +1,108 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sodium.h>
+#include "fangfs.h"
+
+/// Hidden name that a file is re-encrypted into, next to the original,
+/// before it replaces it.
+#define ROTATE_TEMP_NAME "__FANGFS_ROTATE"
+
+/// Totals from one pass of the re-encryption engine over the tree.
+struct RotateStats {
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t bytes;
+
+	/// Entries still under the previous key at the end of the pass: open
+	/// files, files that changed while they were copied, and anything that
+	/// failed.
+	uint64_t remaining;
+};
+
+/// A master key rotation under way. Entries are under the previous key until
+/// the engine reaches them; a name that authenticates under the current key
+/// marks its entry, contents and all, as rotated.
+struct Rotation {
+	Rotation(): done(false), disturbed(false), stopping(false) {}
+
+	uint8_t old_key[crypto_secretbox_KEYBYTES];
+
+	/// Foreground operations hold this for reading from resolving a path
+	/// until they are done with it, and the engine for writing while it
+	/// swaps an entry to its new name.
+	pthread_rwlock_t names;
+
+	/// Set, under names, once every entry is under the current key.
+	bool done;
+
+	/// Backing paths of open files, with their open counts. The engine
+	/// leaves these, and the directories above them, alone.
+	std::mutex pins_lock;
+	std::map<std::string, unsigned> pins;
+
+	/// The file that the engine is copying, and whether it has been opened
+	/// since the copy began, which makes the copy stale. Under pins_lock.
+	std::string copying;
+	bool disturbed;
+
+	std::thread engine;
+	std::mutex engine_lock;
+	std::condition_variable wake;
+	std::atomic<bool> stopping;
+
+private:
+	Rotation(const Rotation&);
+	Rotation& operator=(const Rotation&);
+};
+
+/// Holds the rotation's name lock for reading, if a rotation is under way,
+/// for as long as it lives. Time spent waiting for the engine is recorded
+/// as STAT_ROTATE_WAIT.
+struct RotateReadLock {
+	explicit RotateReadLock(FangFS& fs);
+	~RotateReadLock();
+
+	Rotation* rotation;
+
+private:
+	RotateReadLock(const RotateReadLock&);
+	RotateReadLock& operator=(const RotateReadLock&);
+};
+
+/// Commit a rotation set up in memory by metafile_rotate(), with master_key
+/// still holding the old key: write the metafile out, then switch to
+/// next_key with the old key kept in a new fs.rotation.
+int rotate_begin(FangFS& fs, const uint8_t next_key[crypto_secretbox_KEYBYTES]);
+
+/// Pick up the rotation that the metafile of the unlocked fs records.
+/// Returns STATUS_TAMPERING if the previous key can't be recovered.
+int rotate_resume(FangFS& fs);
+
+/// Start the background engine on fs.rotation. It re-encrypts at most
+/// fs.rotate_rate bytes per second, works at most fs.rotate_duty of the
+/// time, and ends the rotation once a pass finds nothing left to do.
+void rotate_start(FangFS& fs);
+
+/// Make one pass over the whole tree, moving every entry that it can to the
+/// current key. The engine calls this until stats.remaining is 0.
+void rotate_pass(FangFS& fs, RotateStats& stats);
+
+/// Forget the previous key once nothing is under it any more, and record
+/// that in the metafile.
+int rotate_finish(FangFS& fs);
+
+/// Stop the engine, if running, and forget the previous key.
+void rotate_free(FangFS& fs);
+
+/// Record that the backing file real_path is open, or no longer is. Call
+/// rotate_pin() under a RotateReadLock.
+void rotate_pin(FangFS& fs, const char* real_path);
+void rotate_unpin(FangFS& fs, const char* real_path);
@@ -0,0 +1,247 @@
+// The secure buffer pool. One mapping, locked when the pool is set up, is cut
+// into slabs as slot sizes need them, and each slab into slots of its size.
+// Free slots are chained through their first bytes. Every thread keeps a few
+// free slots of each size to itself, so that most allocations and frees take
+// no lock, and trades them with the pool's shared free lists a batch at a
+// time.
+#include "securepool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <sodium.h>
+#include "log.h"
+#include "error.h"
+
+/// Slot sizes, from SECURE_POOL_MIN_SLOT doubling up to SECURE_POOL_MAX_SLOT.
+#define SECURE_POOL_CLASSES 9
+
+/// Slots moved between a thread and the pool at once, and the most a thread
+/// keeps of one size.
+#define SECURE_CACHE_BATCH 16
+#define SECURE_CACHE_MAX (SECURE_CACHE_BATCH * 2)
+
+static_assert((SECURE_POOL_MIN_SLOT << (SECURE_POOL_CLASSES - 1)) == SECURE_POOL_MAX_SLOT,
+              "slot classes don't reach the largest slot");
+
+struct SlotClass {
+	SlotClass(): free_head(nullptr) {}
+
+	/// Guards free_head.
+	std::mutex lock;
+	uint8_t* free_head;
+};
+
+struct SecurePool {
+	SecurePool(): map(nullptr), map_len(0), locked(0), slabs(0), slab_class(nullptr),
+	              slabs_used(0), slot_bytes(0), fallbacks(0), fallback_bytes(0) {}
+
+	uint8_t* map;
+	size_t map_len;
+	size_t locked;
+	size_t slabs;
+
+	/// The class of every slab carved so far.
+	uint8_t* slab_class;
+
+	/// Guards slabs_used and slab_class.
+	std::mutex slab_lock;
+	std::atomic<size_t> slabs_used;
+
+	SlotClass classes[SECURE_POOL_CLASSES];
+
+	std::atomic<size_t> slot_bytes;
+	std::atomic<uint64_t> fallbacks;
+	std::atomic<size_t> fallback_bytes;
+};
+
+static SecurePool pool;
+
+/// Set once map and the rest are in place; the pool is never torn down.
+static std::atomic<bool> pool_ready(false);
+static std::mutex init_lock;
+
+/// The free slots a thread holds on to, handed back when it exits.
+struct ThreadCache {
+	ThreadCache() {
+		memset(heads, 0, sizeof(heads));
+		memset(counts, 0, sizeof(counts));
+	}
+	~ThreadCache();
+
+	uint8_t* heads[SECURE_POOL_CLASSES];
+	size_t counts[SECURE_POOL_CLASSES];
+};
+
+static thread_local ThreadCache cache;
+
+static inline size_t class_size(size_t c) {
+	return static_cast<size_t>(SECURE_POOL_MIN_SLOT) << c;
+}
+
+static inline uint8_t* next_slot(const uint8_t* slot) {
+	uint8_t* next;
+	memcpy(&next, slot, sizeof(next));
+	return next;
+}
+
+static inline void set_next_slot(uint8_t* slot, uint8_t* next) {
+	memcpy(slot, &next, sizeof(next));
+}
+
+/// Hand n slots from the head of the thread's list of class c to the pool.
+static void give_back(size_t c, size_t n) {
+	uint8_t* first = cache.heads[c];
+	uint8_t* last = first;
+	for(size_t i = 1; i < n; i += 1) { last = next_slot(last); }
+	cache.heads[c] = next_slot(last);
+	cache.counts[c] -= n;
+
+	SlotClass& slots = pool.classes[c];
+	std::lock_guard<std::mutex> guard(slots.lock);
+	set_next_slot(last, slots.free_head);
+	slots.free_head = first;
+}
+
+ThreadCache::~ThreadCache() {
+	for(size_t c = 0; c < SECURE_POOL_CLASSES; c += 1) {
+		if(counts[c] > 0) { give_back(c, counts[c]); }
+	}
+}
+
+/// Carve a new slab into slots of class c, onto the pool's free list, which
+/// must be locked. Returns false if the pool is used up.
+static bool carve_slab(size_t c) {
+	uint8_t* slab;
+	{
+		std::lock_guard<std::mutex> guard(pool.slab_lock);
+		const size_t n = pool.slabs_used.load(std::memory_order_relaxed);
+		if(n >= pool.slabs) { return false; }
+		pool.slab_class[n] = c;
+		pool.slabs_used.store(n + 1, std::memory_order_relaxed);
+		slab = pool.map + n * SECURE_POOL_SLAB;
+	}
+
+	SlotClass& slots = pool.classes[c];
+	const size_t size = class_size(c);
+	for(size_t offset = SECURE_POOL_SLAB; offset > 0; offset -= size) {
+		uint8_t* slot = slab + offset - size;
+		set_next_slot(slot, slots.free_head);
+		slots.free_head = slot;
+	}
+	return true;
+}
+
+/// Take up to a batch of slots of class c from the pool for the thread.
+static void refill(size_t c) {
+	SlotClass& slots = pool.classes[c];
+	std::lock_guard<std::mutex> guard(slots.lock);
+	if(slots.free_head == nullptr && !carve_slab(c)) { return; }
+
+	while(slots.free_head != nullptr && cache.counts[c] < SECURE_CACHE_BATCH) {
+		uint8_t* slot = slots.free_head;
+		slots.free_head = next_slot(slot);
+		set_next_slot(slot, cache.heads[c]);
+		cache.heads[c] = slot;
+		cache.counts[c] += 1;
+	}
+}
+
+int secure_pool_init(size_t len) {
+	std::lock_guard<std::mutex> guard(init_lock);
+	if(pool_ready.load(std::memory_order_relaxed)) { return 0; }
+
+	const size_t slabs = len / SECURE_POOL_SLAB;
+	if(slabs == 0) { return 0; }
+
+	void* map = mmap(nullptr, slabs * SECURE_POOL_SLAB, PROT_READ|PROT_WRITE,
+	                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) { return -1; }
+	pool.map = reinterpret_cast<uint8_t*>(map);
+	pool.map_len = slabs * SECURE_POOL_SLAB;
+	pool.slabs = slabs;
+	pool.slab_class = new uint8_t[slabs];
+
+#ifdef MADV_DONTDUMP
+	madvise(pool.map, pool.map_len, MADV_DONTDUMP);
+#endif
+	if(mlock(pool.map, pool.map_len) == 0) {
+		pool.locked = pool.map_len;
+	} else {
+		log_warn("Cannot lock %zu KiB of buffers into memory, so plaintext may be swapped: %s",
+		         pool.map_len >> 10, strerror(errno));
+	}
+
+	pool_ready.store(true, std::memory_order_release);
+	return 0;
+}
+
+void secure_pool_relock() {
+	if(!pool_ready.load(std::memory_order_acquire) || pool.locked == 0) { return; }
+	if(mlock(pool.map, pool.map_len) < 0) {
+		log_warn("Cannot lock %zu KiB of buffers into memory, so plaintext may be swapped: %s",
+		         pool.map_len >> 10, strerror(errno));
+	}
+}
+
+uint8_t* secure_alloc(size_t len, size_t& slot_len) {
+	if(len <= SECURE_POOL_MAX_SLOT && pool_ready.load(std::memory_order_acquire)) {
+		size_t c = 0;
+		while(class_size(c) < len) { c += 1; }
+		if(cache.counts[c] == 0) { refill(c); }
+
+		uint8_t* slot = cache.heads[c];
+		if(slot != nullptr) {
+			cache.heads[c] = next_slot(slot);
+			cache.counts[c] -= 1;
+			set_next_slot(slot, nullptr);
+			slot_len = class_size(c);
+			pool.slot_bytes.fetch_add(slot_len, std::memory_order_relaxed);
+			return slot;
+		}
+	}
+
+	uint8_t* mem = reinterpret_cast<uint8_t*>(malloc(len));
+	if(mem == nullptr) { throw AllocationError(); }
+	pool.fallbacks.fetch_add(1, std::memory_order_relaxed);
+	pool.fallback_bytes.fetch_add(len, std::memory_order_relaxed);
+	slot_len = len;
+	return mem;
+}
+
+void secure_free(uint8_t* p, size_t slot_len) {
+	if(p == nullptr) { return; }
+	sodium_memzero(p, slot_len);
+
+	if(!secure_pool_owns(p)) {
+		pool.fallback_bytes.fetch_sub(slot_len, std::memory_order_relaxed);
+		free(p);
+		return;
+	}
+
+	const size_t c = pool.slab_class[(p - pool.map) / SECURE_POOL_SLAB];
+	set_next_slot(p, cache.heads[c]);
+	cache.heads[c] = p;
+	cache.counts[c] += 1;
+	pool.slot_bytes.fetch_sub(class_size(c), std::memory_order_relaxed);
+	if(cache.counts[c] > SECURE_CACHE_MAX) { give_back(c, SECURE_CACHE_BATCH); }
+}
+
+bool secure_pool_owns(const void* p) {
+	const uint8_t* at = reinterpret_cast<const uint8_t*>(p);
+	return pool_ready.load(std::memory_order_acquire) && at >= pool.map &&
+	       at < pool.map + pool.map_len;
+}
+
+void secure_pool_usage(SecurePoolUsage& usage) {
+	const bool ready = pool_ready.load(std::memory_order_acquire);
+	usage.pool_bytes = ready? pool.map_len : 0;
+	usage.locked_bytes = ready? pool.locked : 0;
+	usage.slab_bytes = pool.slabs_used.load(std::memory_order_relaxed) * SECURE_POOL_SLAB;
+	usage.slot_bytes = pool.slot_bytes.load(std::memory_order_relaxed);
+	usage.fallbacks = pool.fallbacks.load(std::memory_order_relaxed);
+	usage.fallback_bytes = pool.fallback_bytes.load(std::memory_order_relaxed);
+}
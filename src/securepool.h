@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Secure buffers (see buf_make_secure()) hold plaintext and key material.
+/// Their memory is carved out of a pool that is locked into RAM and left out
+/// of core dumps, and is zeroed whenever it is given back. Slots come in
+/// power-of-two sizes from SECURE_POOL_MIN_SLOT to SECURE_POOL_MAX_SLOT.
+/// Larger requests, and any the pool has no room left for, are served from
+/// the heap instead, and are still zeroed.
+#define SECURE_POOL_MIN_SLOT 256
+#define SECURE_POOL_MAX_SLOT (64 << 10)
+
+/// The pool is handed out to each slot size a slab at a time, and a slab
+/// stays with its size for good.
+#define SECURE_POOL_SLAB (64 << 10)
+
+struct SecurePoolUsage {
+	/// The size of the pool, and how much of it is locked into RAM.
+	size_t pool_bytes;
+	size_t locked_bytes;
+
+	/// Bytes of slabs carved out of the pool, and of slots handed out.
+	size_t slab_bytes;
+	size_t slot_bytes;
+
+	/// Allocations the heap served instead, and their bytes outstanding.
+	uint64_t fallbacks;
+	size_t fallback_bytes;
+};
+
+/// Set up the process's pool, len bytes long, unless it already has one.
+/// Returns 0, or -1 with errno set if the memory can't be mapped. Failing to
+/// lock it is only logged, since a pool that may be swapped is still zeroed.
+int secure_pool_init(size_t len);
+
+/// Lock the pool into memory again. Memory locks don't survive fork(), so a
+/// process that sets the pool up and then daemonizes calls this in the child.
+void secure_pool_relock();
+
+/// Allocate at least len bytes of secure memory, and set slot_len to how
+/// many there are. Throws AllocationError.
+uint8_t* secure_alloc(size_t len, size_t& slot_len);
+
+/// Zero the slot_len bytes at p, from secure_alloc(), and give them back.
+void secure_free(uint8_t* p, size_t slot_len);
+
+/// Whether p points into the pool.
+bool secure_pool_owns(const void* p);
+
+void secure_pool_usage(SecurePoolUsage& usage);
+
+/// An allocator that gives containers of plaintext secure memory.
+template <typename T>
+struct SecureAllocator {
+	typedef T value_type;
+
+	SecureAllocator() {}
+	template <typename U> SecureAllocator(const SecureAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		size_t slot_len;
+		return reinterpret_cast<T*>(secure_alloc(n * sizeof(T), slot_len));
+	}
+
+	/// The pool finds a slot's size from where it is, and the heap serves
+	/// exactly what was asked for, so n is all secure_free() needs.
+	void deallocate(T* p, size_t n) {
+		secure_free(reinterpret_cast<uint8_t*>(p), n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) { return false; }
@@ -0,0 +1,294 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "memory.h"
+
+// Histograms are log-linear: values below HIST_LINEAR get a bucket each, and
+// every power of two above that is split into HIST_SUB_BUCKETS, so a bucket
+// is never more than 12.5% wide. Past 2^HIST_MAX_EXPONENT ns (18 minutes)
+// everything lands in the last bucket.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB_BUCKETS)
+#define HIST_MIN_EXPONENT (HIST_SUB_BITS + 1)
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS (HIST_LINEAR + (HIST_MAX_EXPONENT - HIST_MIN_EXPONENT + 1) * HIST_SUB_BUCKETS)
+
+static const char* const stats_timer_names[] = {
+	"lookup", "forget", "getattr", "setattr", "mknod", "mkdir", "unlink",
+	"truncate", "open", "create", "read", "write", "fsync", "flush", "release",
+	"opendir", "readdir", "releasedir", "statfs",
+	"path_resolve", "encrypt", "decrypt", "compress", "decompress", "backing_read",
+	"backing_write", "readdir_decrypt", "rotate_wait"
+};
+static_assert(sizeof(stats_timer_names) / sizeof(stats_timer_names[0]) == STAT_N_TIMERS,
+              "missing timer name");
+
+static const char* const stats_counter_names[] = {
+	"bytes_encrypted", "bytes_decrypted", "backing_bytes_read",
+	"backing_bytes_written", "rmw_cycles", "tampering", "bytes_rotated",
+	"bytes_compressed", "bytes_packed", "bytes_incompressible", "files_packed",
+	"files_unpacked", "bytes_compacted", "dir_indexes_built", "memory_refused",
+	"memory_pressure", "bytes_reclaimed", "keys_derived"
+};
+static_assert(sizeof(stats_counter_names) / sizeof(stats_counter_names[0]) == STAT_N_COUNTERS,
+              "missing counter name");
+
+struct Histogram {
+	std::atomic<uint64_t> buckets[HIST_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+};
+
+/// One thread's statistics. Only the owning thread writes to them, so
+/// updates are plain relaxed loads and stores, with no locked instructions;
+/// readers may see a total that is a moment stale, but never a torn one.
+struct ThreadStats {
+	Histogram timers[STAT_N_TIMERS];
+	std::atomic<uint64_t> counters[STAT_N_COUNTERS];
+	ThreadStats* next;
+};
+
+/// Every live thread's statistics, plus the totals of threads that have
+/// exited.
+static std::mutex registry_lock;
+static ThreadStats* registry = nullptr;
+static ThreadStats retired;
+
+static inline void bump(std::atomic<uint64_t>& x, uint64_t n) {
+	x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void merge(std::atomic<uint64_t>& into, const std::atomic<uint64_t>& from) {
+	bump(into, from.load(std::memory_order_relaxed));
+}
+
+static void merge_stats(ThreadStats& into, const ThreadStats& from) {
+	for(size_t i = 0; i < STAT_N_TIMERS; i += 1) {
+		Histogram& dest = into.timers[i];
+		const Histogram& src = from.timers[i];
+		for(size_t j = 0; j < HIST_BUCKETS; j += 1) {
+			merge(dest.buckets[j], src.buckets[j]);
+		}
+		merge(dest.count, src.count);
+		merge(dest.sum, src.sum);
+
+		const uint64_t src_max = src.max.load(std::memory_order_relaxed);
+		if(src_max > dest.max.load(std::memory_order_relaxed)) {
+			dest.max.store(src_max, std::memory_order_relaxed);
+		}
+	}
+
+	for(size_t i = 0; i < STAT_N_COUNTERS; i += 1) {
+		merge(into.counters[i], from.counters[i]);
+	}
+}
+
+/// Registers the calling thread's statistics on first use, and folds them
+/// into the retired totals when the thread exits.
+struct ThreadStatsHolder {
+	ThreadStatsHolder(): stats(new ThreadStats()) {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		stats->next = registry;
+		registry = stats;
+	}
+
+	~ThreadStatsHolder() {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		merge_stats(retired, *stats);
+		for(ThreadStats** cur = &registry; *cur != nullptr; cur = &(*cur)->next) {
+			if(*cur == stats) {
+				*cur = stats->next;
+				break;
+			}
+		}
+		delete stats;
+	}
+
+	ThreadStats* stats;
+};
+
+static ThreadStats& thread_stats() {
+	static thread_local ThreadStatsHolder holder;
+	return *holder.stats;
+}
+
+static size_t bucket_index(uint64_t value) {
+	if(value < HIST_LINEAR) { return value; }
+
+	const int exponent = 63 - __builtin_clzll(value);
+	if(exponent > HIST_MAX_EXPONENT) { return HIST_BUCKETS - 1; }
+
+	const size_t sub = (value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+	return HIST_LINEAR + (exponent - HIST_MIN_EXPONENT) * HIST_SUB_BUCKETS + sub;
+}
+
+/// The largest value that lands in bucket i.
+static uint64_t bucket_upper_bound(size_t i) {
+	if(i < HIST_LINEAR) { return i; }
+
+	const size_t exponent = (i - HIST_LINEAR) / HIST_SUB_BUCKETS + HIST_MIN_EXPONENT;
+	const uint64_t sub = (i - HIST_LINEAR) % HIST_SUB_BUCKETS;
+	return ((HIST_SUB_BUCKETS + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+uint64_t stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_time(StatTimer which, uint64_t start) {
+	const uint64_t elapsed = stats_clock() - start;
+	Histogram& hist = thread_stats().timers[which];
+	bump(hist.buckets[bucket_index(elapsed)], 1);
+	bump(hist.count, 1);
+	bump(hist.sum, elapsed);
+	if(elapsed > hist.max.load(std::memory_order_relaxed)) {
+		hist.max.store(elapsed, std::memory_order_relaxed);
+	}
+}
+
+void stats_count(StatCounter which, uint64_t n) {
+	bump(thread_stats().counters[which], n);
+}
+
+static void append(Buffer& outbuf, const char* format, ...) {
+	while(1) {
+		va_list args;
+		va_start(args, format);
+		const size_t room = outbuf.buf_len - outbuf.len;
+		const int n = vsnprintf(reinterpret_cast<char*>(outbuf.buf) + outbuf.len, room,
+		                        format, args);
+		va_end(args);
+
+		if(n < 0) { return; }
+		if(static_cast<size_t>(n) < room) {
+			outbuf.len += n;
+			return;
+		}
+
+		buf_grow(outbuf, outbuf.len + n + 1);
+	}
+}
+
+/// The smallest bucket bound below which fraction q of the values fall, in
+/// microseconds.
+static double percentile(const Histogram& hist, uint64_t count, double q) {
+	const uint64_t rank = static_cast<uint64_t>(q * count);
+	uint64_t seen = 0;
+	for(size_t i = 0; i < HIST_BUCKETS; i += 1) {
+		seen += hist.buckets[i].load(std::memory_order_relaxed);
+		if(seen > rank) {
+			return bucket_upper_bound(i) / 1000.0;
+		}
+	}
+
+	return hist.max.load(std::memory_order_relaxed) / 1000.0;
+}
+
+void stats_format(Buffer& outbuf) {
+	ThreadStats* total = new ThreadStats();
+	{
+		std::lock_guard<std::mutex> guard(registry_lock);
+		merge_stats(*total, retired);
+		for(ThreadStats* cur = registry; cur != nullptr; cur = cur->next) {
+			merge_stats(*total, *cur);
+		}
+	}
+
+	buf_grow(outbuf, 4096);
+	outbuf.len = 0;
+	outbuf.buf[0] = '\0';
+
+	append(outbuf, "timer\tcount\tmean_us\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n");
+	for(size_t i = 0; i < STAT_N_TIMERS; i += 1) {
+		const Histogram& hist = total->timers[i];
+		const uint64_t count = hist.count.load(std::memory_order_relaxed);
+		if(count == 0) { continue; }
+
+		const double mean = hist.sum.load(std::memory_order_relaxed) / 1000.0 / count;
+		append(outbuf, "%s\t%llu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", stats_timer_names[i],
+		       static_cast<unsigned long long>(count), mean,
+		       percentile(hist, count, 0.5), percentile(hist, count, 0.9),
+		       percentile(hist, count, 0.99), percentile(hist, count, 0.999),
+		       hist.max.load(std::memory_order_relaxed) / 1000.0);
+	}
+
+	append(outbuf, "\ncounter\tvalue\n");
+	for(size_t i = 0; i < STAT_N_COUNTERS; i += 1) {
+		append(outbuf, "%s\t%llu\n", stats_counter_names[i],
+		       static_cast<unsigned long long>(total->counters[i].load()));
+	}
+
+	MemoryUsage memory;
+	memory_usage(memory);
+	append(outbuf, "\nmemory\tbytes\n");
+	for(size_t i = 0; i < MEM_N_USERS; i += 1) {
+		append(outbuf, "%s\t%zu\n", memory_user_name(static_cast<MemoryUser>(i)), memory.users[i]);
+	}
+	append(outbuf, "total\t%zu\nbudget\t%zu\n", memory.total, memory.budget);
+
+	delete total;
+}
+
+void stats_file_stat(struct stat* info) {
+	static const time_t started = time(nullptr);
+
+	memset(info, 0, sizeof(*info));
+	info->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	info->st_nlink = 1;
+	info->st_uid = getuid();
+	info->st_gid = getgid();
+	info->st_atime = info->st_mtime = info->st_ctime = started;
+}
+
+/// SIGUSR1 only pokes this pipe; the dump thread does the real work, since
+/// formatting allocates and takes locks.
+static int dump_pipe[2] = {-1, -1};
+
+static void handle_dump_signal(int signum) {
+	const int saved_errno = errno;
+	const char c = 0;
+	if(write(dump_pipe[1], &c, 1) < 0) {}
+	errno = saved_errno;
+}
+
+static void dump_thread() {
+	Buffer text;
+	char c;
+	while(1) {
+		const ssize_t n = read(dump_pipe[0], &c, 1);
+		if(n < 0 && errno == EINTR) { continue; }
+		if(n <= 0) { return; }
+
+		stats_format(text);
+		fwrite(text.buf, 1, text.len, stderr);
+		fflush(stderr);
+	}
+}
+
+void stats_dump_on_signal() {
+	if(pipe2(dump_pipe, O_CLOEXEC) < 0) {
+		return;
+	}
+
+	std::thread(dump_thread).detach();
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_dump_signal;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, nullptr);
+}
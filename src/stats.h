@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "Buffer.h"
+
+/// A virtual file in the mount root that reads back the current statistics.
+/// It is never listed, just as names starting with '_' in the source are
+/// skipped by readdir.
+#define STATS_FILE_NAME "__FANGFS_STATS"
+#define STATS_FILE_PATH "/" STATS_FILE_NAME
+
+/// Latencies tracked in histograms: every FUSE operation, then the stages
+/// inside them. Keep stats_timer_names in step.
+enum StatTimer {
+	STAT_OP_LOOKUP,
+	STAT_OP_FORGET,
+	STAT_OP_GETATTR,
+	STAT_OP_SETATTR,
+	STAT_OP_MKNOD,
+	STAT_OP_MKDIR,
+	STAT_OP_UNLINK,
+	STAT_OP_TRUNCATE,
+	STAT_OP_OPEN,
+	STAT_OP_CREATE,
+	STAT_OP_READ,
+	STAT_OP_WRITE,
+	STAT_OP_FSYNC,
+	STAT_OP_FLUSH,
+	STAT_OP_RELEASE,
+	STAT_OP_OPENDIR,
+	STAT_OP_READDIR,
+	STAT_OP_RELEASEDIR,
+	STAT_OP_STATFS,
+
+	STAT_PATH_RESOLVE,
+	STAT_ENCRYPT,
+	STAT_DECRYPT,
+	STAT_COMPRESS,
+	STAT_DECOMPRESS,
+	STAT_BACKING_READ,
+	STAT_BACKING_WRITE,
+	STAT_READDIR_DECRYPT,
+
+	/// Time foreground operations spent waiting for the key rotation engine.
+	STAT_ROTATE_WAIT,
+	STAT_N_TIMERS
+};
+
+/// Plain event counters. Keep stats_counter_names in step.
+enum StatCounter {
+	STAT_BYTES_ENCRYPTED,
+	STAT_BYTES_DECRYPTED,
+	STAT_BACKING_BYTES_READ,
+	STAT_BACKING_BYTES_WRITTEN,
+
+	/// Partial block writes that had to read the old block back in.
+	STAT_RMW_CYCLES,
+
+	/// Blocks and names that failed authentication.
+	STAT_TAMPERING,
+
+	/// Plaintext re-encrypted under a new master key by the rotation engine.
+	STAT_BYTES_ROTATED,
+
+	/// On compressed filesystems: plaintext stored in compressed blocks,
+	/// what it compressed to, and plaintext stored raw because it didn't
+	/// compress well enough.
+	STAT_BYTES_COMPRESSED,
+	STAT_BYTES_PACKED,
+	STAT_BYTES_INCOMPRESSIBLE,
+
+	/// Small files moved into segment files, and back out to be written,
+	/// and dead space in segment files given back by compaction.
+	STAT_FILES_PACKED,
+	STAT_FILES_UNPACKED,
+	STAT_BYTES_COMPACTED,
+
+	/// Directory indexes written out, whether first built or rebuilt.
+	STAT_DIR_INDEXES_BUILT,
+
+	/// Reservations refused for being over the memory budget, memory
+	/// pressure reported by the kernel, and bytes given back by shrinkers.
+	STAT_MEMORY_REFUSED,
+	STAT_MEMORY_PRESSURE,
+	STAT_MEMORY_RECLAIMED,
+
+	/// Passphrases stretched into child keys, each a full run of the KDF.
+	STAT_KEYS_DERIVED,
+	STAT_N_COUNTERS
+};
+
+/// Nanoseconds on the clock that timers are measured against.
+uint64_t stats_clock();
+
+/// Record the time since start, a value from stats_clock(), against which.
+void stats_time(StatTimer which, uint64_t start);
+
+void stats_count(StatCounter which, uint64_t n);
+
+/// Times the scope it lives in.
+struct StatScope {
+	explicit StatScope(StatTimer timer): which(timer), start(stats_clock()) {}
+	~StatScope() { stats_time(which, start); }
+
+	StatTimer which;
+	uint64_t start;
+
+private:
+	StatScope(const StatScope&);
+	StatScope& operator=(const StatScope&);
+};
+
+/// Add up every thread's statistics, and format them as text into outbuf:
+/// one tab-separated line per timer that has run, with latencies in
+/// microseconds, then one line per counter, then the bytes charged by each
+/// user of memory, their total, and the budget.
+void stats_format(Buffer& outbuf);
+
+/// Fill in attributes for STATS_FILE_NAME: a read-only file owned by the
+/// mounting user. Its size reads as 0, so it must be opened with direct_io.
+void stats_file_stat(struct stat* info);
+
+/// Dump the statistics to stderr whenever SIGUSR1 arrives. Starts a thread to
+/// do the formatting, so call it after any fork into the background.
+void stats_dump_on_signal();
@@ -0,0 +1,188 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sodium.h>
+#include "error.h"
+
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t current_thread(void) {
+	static thread_local uint32_t tid = 0;
+	if(tid == 0) {
+#ifdef SYS_gettid
+		tid = static_cast<uint32_t>(syscall(SYS_gettid));
+#else
+		// No kernel thread IDs to go by, so threads are numbered as they
+		// first record something.
+		static std::atomic<uint32_t> next_tid(1);
+		tid = next_tid.fetch_add(1, std::memory_order_relaxed);
+#endif
+	}
+	return tid;
+}
+
+int trace_open(Trace& self, const char* path, uint32_t capacity) {
+	self.fd = -1;
+	self.header = nullptr;
+	self.records = nullptr;
+
+	if(capacity == 0) {
+		errno = EINVAL;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	self.fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if(self.fd < 0) { return STATUS_CHECK_ERRNO; }
+
+	self.map_len = sizeof(TraceHeader) + static_cast<size_t>(capacity) * sizeof(TraceRecord);
+	void* map = MAP_FAILED;
+	if(ftruncate(self.fd, self.map_len) == 0) {
+		map = mmap(nullptr, self.map_len, PROT_READ|PROT_WRITE, MAP_SHARED, self.fd, 0);
+	}
+	if(map == MAP_FAILED) {
+		const int new_errno = errno;
+		close(self.fd);
+		self.fd = -1;
+		errno = new_errno;
+		return STATUS_CHECK_ERRNO;
+	}
+
+	self.header = static_cast<TraceHeader*>(map);
+	self.records = reinterpret_cast<TraceRecord*>(self.header + 1);
+	self.start_ns = clock_ns(CLOCK_MONOTONIC);
+	randombytes_buf(self.path_key, sizeof(self.path_key));
+
+	memcpy(self.header->magic, TRACE_MAGIC, sizeof(self.header->magic));
+	self.header->version = TRACE_VERSION;
+	self.header->capacity = capacity;
+	self.header->head.store(0);
+	self.header->start_realtime_ns = clock_ns(CLOCK_REALTIME);
+
+	return 0;
+}
+
+void trace_close(Trace& self) {
+	if(self.header != nullptr) {
+		munmap(self.header, self.map_len);
+		self.header = nullptr;
+		self.records = nullptr;
+	}
+
+	if(self.fd >= 0) {
+		close(self.fd);
+		self.fd = -1;
+	}
+
+	sodium_memzero(self.path_key, sizeof(self.path_key));
+}
+
+uint64_t trace_begin(const Trace* self) {
+	if(self == nullptr) { return 0; }
+	return clock_ns(CLOCK_MONOTONIC) - self->start_ns;
+}
+
+int trace_end(Trace* self, TraceOp op, const char* path, off_t offset, size_t size,
+              uint64_t start, int result) {
+	if(self == nullptr) { return result; }
+
+	TraceRecord record;
+	memset(&record, 0, sizeof(record));
+	record.op = op;
+	record.thread = current_thread();
+	record.offset = offset;
+	record.size = size;
+	record.start_ns = start;
+	record.end_ns = clock_ns(CLOCK_MONOTONIC) - self->start_ns;
+	record.result = result;
+
+	if(path != nullptr) {
+		const size_t path_len = strlen(path);
+		for(size_t i = 0; i < path_len; i += 1) {
+			if(path[i] == '/' && path[i+1] != '/' && path[i+1] != '\0') {
+				record.depth += 1;
+			}
+		}
+
+		uint8_t hash[crypto_generichash_BYTES_MIN];
+		crypto_generichash(hash, sizeof(hash), reinterpret_cast<const uint8_t*>(path),
+		                   path_len, self->path_key, sizeof(self->path_key));
+		memcpy(&record.path_hash, hash, sizeof(record.path_hash));
+	}
+
+	const uint64_t i = self->header->head.fetch_add(1);
+	self->records[i % self->header->capacity] = record;
+	return result;
+}
+
+const char* trace_op_name(uint8_t op) {
+	static const char* names[] = {
+		"none", "mknod", "truncate", "ftruncate", "unlink", "open", "create",
+		"release", "getattr", "read", "write", "fsync", "flush", "mkdir",
+		"opendir", "readdir", "releasedir"
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == TRACE_N_OPS, "missing op name");
+
+	return (op < TRACE_N_OPS)? names[op] : "unknown";
+}
+
+int trace_reader_open(TraceReader& self, const char* path) {
+	self.header = nullptr;
+	self.fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(self.fd < 0) { return STATUS_CHECK_ERRNO; }
+
+	struct stat info;
+	if(fstat(self.fd, &info) < 0) {
+		trace_reader_close(self);
+		return STATUS_CHECK_ERRNO;
+	}
+
+	if(static_cast<size_t>(info.st_size) < sizeof(TraceHeader)) {
+		trace_reader_close(self);
+		return STATUS_ERROR;
+	}
+
+	self.map_len = info.st_size;
+	void* map = mmap(nullptr, self.map_len, PROT_READ, MAP_SHARED, self.fd, 0);
+	if(map == MAP_FAILED) {
+		trace_reader_close(self);
+		return STATUS_CHECK_ERRNO;
+	}
+
+	self.header = static_cast<const TraceHeader*>(map);
+	self.records = reinterpret_cast<const TraceRecord*>(self.header + 1);
+	const TraceHeader& header = *self.header;
+	if(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.version != TRACE_VERSION || header.capacity == 0 ||
+	   self.map_len < sizeof(TraceHeader) + header.capacity * sizeof(TraceRecord)) {
+		trace_reader_close(self);
+		return STATUS_ERROR;
+	}
+
+	const uint64_t head = header.head.load();
+	self.first = (head > header.capacity)? head - header.capacity : 0;
+	self.count = head - self.first;
+	return 0;
+}
+
+void trace_reader_close(TraceReader& self) {
+	if(self.header != nullptr) {
+		munmap(const_cast<TraceHeader*>(self.header), self.map_len);
+		self.header = nullptr;
+	}
+
+	if(self.fd >= 0) {
+		close(self.fd);
+		self.fd = -1;
+	}
+}
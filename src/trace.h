@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <sys/types.h>
+
+#define TRACE_MAGIC "FANGTRCE"
+#define TRACE_VERSION 1
+
+/// The default number of records a trace file holds before wrapping.
+#define TRACE_DEFAULT_RECORDS (256 * 1024)
+
+/// The operations a trace records. Values are stored in trace files, so only
+/// ever add to the end.
+enum TraceOp {
+	TRACE_NONE = 0,
+	TRACE_MKNOD,
+	TRACE_TRUNCATE,
+	TRACE_FTRUNCATE,
+	TRACE_UNLINK,
+	TRACE_OPEN,
+	TRACE_CREATE,
+	TRACE_RELEASE,
+	TRACE_GETATTR,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_FSYNC,
+	TRACE_FLUSH,
+	TRACE_MKDIR,
+	TRACE_OPENDIR,
+	TRACE_READDIR,
+	TRACE_RELEASEDIR,
+	TRACE_N_OPS
+};
+
+/// One completed operation. Stored in host byte order.
+struct TraceRecord {
+	uint8_t op;
+	uint8_t padding;
+
+	/// The number of components in the plaintext path.
+	uint16_t depth;
+
+	/// The kernel thread ID of the FUSE worker that ran the operation.
+	uint32_t thread;
+
+	/// A hash of the plaintext path, keyed with a secret that is thrown away
+	/// with the trace, so that paths can be told apart but not recovered.
+	uint64_t path_hash;
+
+	/// The byte range of reads and writes. Truncates keep the new length in
+	/// offset, and readdir its position. Other operations keep their mode or
+	/// flags argument in size: the mode for mknod, create, and mkdir, the
+	/// open flags for open, and datasync for fsync.
+	int64_t offset;
+	uint64_t size;
+
+	/// Nanoseconds since the trace started.
+	uint64_t start_ns;
+	uint64_t end_ns;
+
+	/// The operation's return value: 0, a byte count, or -errno.
+	int64_t result;
+};
+
+/// The start of a trace file, which is followed by capacity records. Record
+/// number i (counting from 0) lives in slot i % capacity, so the file holds
+/// the last capacity records of the run.
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;
+
+	/// The number of records ever written.
+	std::atomic<uint64_t> head;
+
+	/// CLOCK_REALTIME at the start of the trace, in nanoseconds.
+	uint64_t start_realtime_ns;
+};
+
+/// A trace being recorded into a shared mapping of a ring file.
+struct Trace {
+	int fd;
+	TraceHeader* header;
+	TraceRecord* records;
+	size_t map_len;
+
+	/// CLOCK_MONOTONIC at the start of the trace, in nanoseconds.
+	uint64_t start_ns;
+
+	/// The key for path hashes. Never written out.
+	uint8_t path_key[32];
+};
+
+/// Create or replace the trace file at path, with room for capacity
+/// records. Returns 0 or STATUS_CHECK_ERRNO.
+int trace_open(Trace& self, const char* path, uint32_t capacity);
+
+void trace_close(Trace& self);
+
+/// The current trace clock, to pass as start to trace_end(). Returns 0 if
+/// self is nullptr, so that callers need not check whether tracing is on.
+uint64_t trace_begin(const Trace* self);
+
+/// Record an operation on path that started at start, and return result.
+int trace_end(Trace* self, TraceOp op, const char* path, off_t offset, size_t size,
+              uint64_t start, int result);
+
+/// The name of op, for reports.
+const char* trace_op_name(uint8_t op);
+
+/// A trace file mapped for reading.
+struct TraceReader {
+	int fd;
+	const TraceHeader* header;
+	const TraceRecord* records;
+	size_t map_len;
+
+	/// The records the file holds, as indices into the ring: first is the
+	/// oldest one that has not been overwritten.
+	uint64_t first;
+	uint64_t count;
+};
+
+/// Map the trace file at path. Returns 0, STATUS_CHECK_ERRNO, or STATUS_ERROR
+/// if the file is not a trace this version understands.
+int trace_reader_open(TraceReader& self, const char* path);
+
+/// The record with ring index first <= i < first + count.
+static inline const TraceRecord& trace_reader_get(const TraceReader& self, uint64_t i) {
+	return self.records[i % self.header->capacity];
+}
+
+void trace_reader_close(TraceReader& self);
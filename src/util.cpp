@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
+#include <unistd.h>
 #include "util.h"
 #include "error.h"
 
@@ -89,6 +91,51 @@ void path_building_for_each(const Buffer& buf, std::function<void(const Buffer&
 }
 
 #define BASE32_SYMBOLS "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"
+int read_passphrase(const char* prompt, Buffer& outbuf) {
+	const bool tty = isatty(STDIN_FILENO);
+	struct termios old_attrs;
+	if(tty) {
+		fprintf(stderr, "%s", prompt);
+		if(tcgetattr(STDIN_FILENO, &old_attrs) < 0) { return STATUS_CHECK_ERRNO; }
+
+		struct termios attrs = old_attrs;
+		attrs.c_lflag &= ~ECHO;
+		if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &attrs) < 0) { return STATUS_CHECK_ERRNO; }
+	}
+
+	// Read a byte at a time, so that no copy is left behind in stdio's
+	// buffers.
+	int status = 0;
+	size_t len = 0;
+	buf_grow(outbuf, 256);
+	while(1) {
+		char c;
+		const ssize_t n = read(STDIN_FILENO, &c, 1);
+		if(n < 0) {
+			if(errno == EINTR) { continue; }
+			status = STATUS_CHECK_ERRNO;
+			break;
+		}
+		if(n == 0 || c == '\n') { break; }
+
+		if(len + 1 >= outbuf.buf_len) { buf_grow(outbuf, 0); }
+		outbuf.buf[len] = c;
+		len += 1;
+	}
+
+	outbuf.buf[len] = '\0';
+	outbuf.len = len;
+
+	if(tty) {
+		const int new_errno = errno;
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_attrs);
+		fprintf(stderr, "\n");
+		errno = new_errno;
+	}
+
+	return status;
+}
+
 void base32_enc(const Buffer& input, Buffer& output) {
 	if(input.len == 0) {
 		buf_grow(output, 1);
@@ -18,6 +18,11 @@ static inline uint32_t u32_from_bytes(const uint8_t bytes[4]) {
 	return *(const uint32_t*)bytes;
 }
 
+/// Read a line-terminated passphrase from stdin into outbuf as a C-string,
+/// prompting on stderr and turning off echo if stdin is a terminal. Returns
+/// 0, or STATUS_CHECK_ERRNO. The caller should wipe outbuf when done.
+int read_passphrase(const char* prompt, Buffer& outbuf);
+
 void base32_enc(const Buffer& input, Buffer& output);
 int base32_dec(const char* input, Buffer& output);
 
@@ -44,3 +49,18 @@ static inline uint32_t u32_to_le(uint32_t x) {
 	return (x<<24) | (x<<8 & 0xff0000) | (x>>8 & 0xff00) | (x>>24);
 #endif
 }
+
+/// Convert a little-endian uint64_t into a native-endian uint64_t.
+static inline uint64_t u64_from_le(uint64_t x) {
+	return (uint64_t)u32_from_le((uint32_t)x) |
+	       ((uint64_t)u32_from_le((uint32_t)(x >> 32)) << 32);
+}
+
+/// Convert a native-endian uint64_t value into little-endian.
+static inline uint64_t u64_to_le(uint64_t x) {
+#ifdef FANGFS_LITTLE_ENDIAN
+	return x;
+#else
+	return ((uint64_t)u32_to_le((uint32_t)x) << 32) | u32_to_le((uint32_t)(x >> 32));
+#endif
+}
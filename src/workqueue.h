@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/// A queue between pipeline stages. Pushing blocks while capacity items are
+/// waiting, so a fast stage can't run arbitrarily far ahead of a slow one.
+/// Once closed, consumers drain what's left and then stop.
+template<typename T>
+struct WorkQueue {
+	explicit WorkQueue(size_t cap=0): capacity(cap), closed(false) {}
+
+	/// The most items waiting at once, or 0 for no limit.
+	size_t capacity;
+
+	bool closed;
+	std::deque<T> items;
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+
+private:
+	WorkQueue(const WorkQueue&);
+	WorkQueue& operator=(const WorkQueue&);
+};
+
+template<typename T>
+void workqueue_push(WorkQueue<T>& self, T item) {
+	std::unique_lock<std::mutex> guard(self.lock);
+	while(self.capacity > 0 && self.items.size() >= self.capacity) {
+		self.not_full.wait(guard);
+	}
+
+	self.items.push_back(std::move(item));
+	self.not_empty.notify_one();
+}
+
+/// Wait for an item. Returns false once the queue is closed and empty.
+template<typename T>
+bool workqueue_pop(WorkQueue<T>& self, T& item) {
+	std::unique_lock<std::mutex> guard(self.lock);
+	while(self.items.empty() && !self.closed) {
+		self.not_empty.wait(guard);
+	}
+	if(self.items.empty()) { return false; }
+
+	item = std::move(self.items.front());
+	self.items.pop_front();
+	self.not_full.notify_one();
+	return true;
+}
+
+template<typename T>
+void workqueue_close(WorkQueue<T>& self) {
+	std::lock_guard<std::mutex> guard(self.lock);
+	self.closed = true;
+	self.not_empty.notify_all();
+}
@@ -0,0 +1,192 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "test.h"
+#include "../src/check.h"
+#include "../src/file.h"
+#include "../src/util.h"
+
+struct Found {
+	CheckProblemKind kind;
+	std::string cipher_path;
+	bool plain_known;
+	uint64_t detail;
+};
+
+static std::string resolve(FangFS& fs, const char* path) {
+	Buffer real_path;
+	path_resolve(fs, path, real_path);
+	return reinterpret_cast<char*>(real_path.buf);
+}
+
+static void make_file(FangFS& fs, const char* path, size_t len) {
+	const std::string real_path = resolve(fs, path);
+	const int fd = open(real_path.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, real_path.c_str());
+	verify(file != nullptr);
+
+	std::vector<uint8_t> data(len, 'x');
+	verify(fang_file_write(*file, 0, len, data.data()) == static_cast<int>(len));
+	verify(fang_file_close(file) == 0);
+}
+
+/// The ciphertext path of path, relative to the source.
+static std::string cipher_path(FangFS& fs, const char* path) {
+	return resolve(fs, path).substr(strlen(fs.source) + 1);
+}
+
+static std::vector<Found> run(FangFS& fs, CheckOptions& options, CheckStats& stats) {
+	std::vector<Found> found;
+	options.on_problem = [&found](const CheckProblem& problem) {
+		Found f;
+		f.kind = problem.kind;
+		f.cipher_path = problem.cipher_path;
+		f.plain_known = (problem.plain_path != nullptr);
+		f.detail = problem.detail;
+		found.push_back(f);
+	};
+	verify(check_run(fs, options, stats) == 0);
+	return found;
+}
+
+static const Found* find(const std::vector<Found>& found, CheckProblemKind kind) {
+	for(const Found& f: found) {
+		if(f.kind == kind) { return &f; }
+	}
+	return nullptr;
+}
+
+static void corrupt(const std::string& real_path, off_t offset) {
+	const int fd = open(real_path.c_str(), O_RDWR);
+	verify(fd >= 0);
+	uint8_t c;
+	verify(pread(fd, &c, 1, offset) == 1);
+	c ^= 0x01;
+	verify(pwrite(fd, &c, 1, offset) == 1);
+	close(fd);
+}
+
+void test_clean(FangFS& fs) {
+	do_test();
+
+	CheckOptions options;
+	options.threads = 4;
+	CheckStats stats;
+	const std::vector<Found> found = run(fs, options, stats);
+	verify(found.empty());
+	verify(stats.problems == 0);
+	verify(stats.dirs == 3);
+	verify(stats.files == 4);
+
+	const size_t payload = fang_block_payload(fs);
+	verify(stats.blocks == (1000 + payload - 1) / payload + (100 + payload - 1) / payload + 1);
+}
+
+void test_problems(FangFS& fs) {
+	do_test();
+
+	// Flip a bit in the third block of the big file.
+	const std::string big = resolve(fs, "/a/big");
+	corrupt(big, 2 * 128 + BLOCK_OVERHEAD + 1);
+
+	// Cut a file short of a whole block.
+	verify(truncate(resolve(fs, "/a/b/small").c_str(), 128 + 3) == 0);
+
+	// Move an entry into a directory it wasn't encrypted for.
+	const std::string moved_to = resolve(fs, "/a/b") + "/" +
+	                             path_get_basename(resolve(fs, "/top").c_str());
+	verify(rename(resolve(fs, "/top").c_str(), moved_to.c_str()) == 0);
+
+	// And an entry with a name that was never encrypted at all.
+	const std::string garbage = resolve(fs, "/a") + "/AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA";
+	verify(close(open(garbage.c_str(), O_WRONLY|O_CREAT, 0600)) == 0);
+
+	CheckOptions options;
+	options.threads = 3;
+	CheckStats stats;
+	const std::vector<Found> found = run(fs, options, stats);
+	verify(found.size() == 4);
+	verify(stats.problems == 4);
+
+	const Found* block = find(found, CHECK_CORRUPT_BLOCK);
+	verify(block != nullptr && block->detail == 2 && block->plain_known);
+	verify(block->cipher_path == cipher_path(fs, "/a/big"));
+
+	const Found* length = find(found, CHECK_BAD_LENGTH);
+	verify(length != nullptr && length->cipher_path == cipher_path(fs, "/a/b/small"));
+
+	const Found* misplaced = find(found, CHECK_MISPLACED);
+	verify(misplaced != nullptr && !misplaced->plain_known);
+	verify(misplaced->cipher_path == moved_to.substr(strlen(fs.source) + 1));
+
+	verify(find(found, CHECK_CORRUPT_NAME) != nullptr);
+
+	unlink(garbage.c_str());
+	verify(rename(moved_to.c_str(), resolve(fs, "/top").c_str()) == 0);
+}
+
+void test_checkpoint(FangFS& fs) {
+	do_test();
+
+	const std::string checkpoint = std::string(fs.source) + "/../test-check-checkpoint";
+	const std::string big = cipher_path(fs, "/a/big");
+	const std::string small = cipher_path(fs, "/a/b/small");
+
+	// As if an earlier run was interrupted after checking these two.
+	FILE* f = fopen(checkpoint.c_str(), "w");
+	verify(f != nullptr);
+	fprintf(f, "fangfs-fsck checkpoint 1\nB\t2\t%s\nF\t0\t%s\nL\t0\t%s\nF\t0\t%s\nB\t7\t",
+	        big.c_str(), big.c_str(), small.c_str(), small.c_str());
+	fclose(f);
+
+	CheckOptions options;
+	options.threads = 2;
+	options.checkpoint_path = checkpoint.c_str();
+	CheckStats stats;
+	const std::vector<Found> found = run(fs, options, stats);
+
+	// The recorded problems are reported again without rereading the files.
+	verify(stats.files_skipped == 2);
+	verify(stats.files == 2);
+	verify(stats.blocks == 1);
+	verify(found.size() == 2);
+	const Found* block = find(found, CHECK_CORRUPT_BLOCK);
+	verify(block != nullptr && block->detail == 2 && block->plain_known);
+	verify(find(found, CHECK_BAD_LENGTH) != nullptr);
+
+	// Finished, so the checkpoint is gone.
+	verify(access(checkpoint.c_str(), F_OK) < 0);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-check-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+
+	FangFS fs;
+	test_init_fs(fs, dir);
+	verify(mkdir(resolve(fs, "/a").c_str(), 0700) == 0);
+	verify(mkdir(resolve(fs, "/a/b").c_str(), 0700) == 0);
+	make_file(fs, "/a/big", 1000);
+	make_file(fs, "/a/b/small", 100);
+	make_file(fs, "/a/b/empty", 0);
+	make_file(fs, "/top", 10);
+
+	// Special files are not part of the tree.
+	verify(close(open((std::string(dir) + "/__FANGFS_JOURNAL").c_str(), O_WRONLY|O_CREAT, 0600)) == 0);
+
+	test_clean(fs);
+	test_problems(fs);
+	test_checkpoint(fs);
+
+	const std::string cleanup = std::string("rm -rf ") + dir;
+	verify(system(cleanup.c_str()) == 0);
+	return 0;
+}
@@ -0,0 +1,326 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include "test.h"
+#include "../src/file.h"
+#include "../src/error.h"
+
+/// The codec under test.
+static const Codec* codec = nullptr;
+
+static void init_fs(FangFS& fs, uint32_t block_size) {
+	test_init_fs(fs, ".", block_size);
+	fs.metafile.compression = codec->id;
+}
+
+static FangFile* open_temp(FangFS& fs, char* path) {
+	int fd = mkstemp(path);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, path);
+	verify(file != nullptr);
+	return file;
+}
+
+/// Text that compresses about as well as a log does.
+static std::string log_lines(size_t len) {
+	std::string text;
+	char line[128];
+	for(unsigned i = 0; text.size() < len; i += 1) {
+		snprintf(line, sizeof(line),
+		         "2024-01-%02u 12:%02u:%02u INFO request id=%u status=%u bytes=%u\n",
+		         i % 28 + 1, i / 60 % 60, i % 60, i, (i % 7 == 0)? 500 : 200, i * 37 % 9000);
+		text += line;
+	}
+	text.resize(len);
+	return text;
+}
+
+static std::string random_bytes(size_t len) {
+	std::string data(len, '\0');
+	randombytes_buf(&data[0], len);
+	return data;
+}
+
+static const uint8_t* bytes(const std::string& data) {
+	return reinterpret_cast<const uint8_t*>(data.data());
+}
+
+static off_t backing_size(const FangFile& file) {
+	struct stat info;
+	verify(fstat(file.fd, &info) == 0);
+	return info.st_size;
+}
+
+void test_codec(void) {
+	do_test();
+
+	verify(codec_find(codec->id) == codec);
+	verify(codec_by_name(codec->name) == codec);
+	verify(strcmp(codec_name(codec->id), codec->name) == 0);
+	verify(codec_find(CODEC_NONE) == nullptr);
+	verify(codec_by_name("none") == nullptr);
+	verify(codec_name(200) == nullptr);
+
+	const std::string text = log_lines(4096);
+	uint8_t packed[4096];
+	const size_t packed_len = codec->compress(bytes(text), text.size(), packed, sizeof(packed));
+	verify(packed_len > 0 && packed_len < text.size() / 2);
+
+	uint8_t out[4096];
+	verify(codec->decompress(packed, packed_len, out, sizeof(out)) ==
+	       static_cast<ssize_t>(text.size()));
+	verify(memcmp(out, text.data(), text.size()) == 0);
+
+	// Neither side may overrun its buffer.
+	verify(codec->compress(bytes(text), text.size(), packed, 16) == 0);
+	verify(codec->decompress(packed, packed_len, out, 100) < 0);
+
+	memset(packed, 0xff, sizeof(packed));
+	verify(codec->decompress(packed, sizeof(packed), out, sizeof(out)) < 0);
+}
+
+void test_block(void) {
+	do_test();
+
+	FangFS fs;
+	init_fs(fs, 512);
+	const size_t payload = fang_block_payload(fs);
+	verify(payload == 512 - BLOCK_PACKED_OVERHEAD);
+
+	uint8_t block[512];
+	uint8_t out[512];
+	Buffer scratch;
+
+	// Text is stored compressed, and opens from a whole slot's worth of
+	// bytes.
+	const std::string text = log_lines(payload);
+	memset(block, 0xee, sizeof(block));
+	const size_t text_len = fang_block_seal(fs, fs.master_key, bytes(text), payload, block,
+	                                        scratch);
+	verify(text_len < payload - payload / COMPRESS_MIN_SAVING);
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       static_cast<ssize_t>(payload));
+	verify(memcmp(out, text.data(), payload) == 0);
+	verify(fang_block_open(fs, fs.master_key, block, text_len - 1, out, scratch) ==
+	       STATUS_ERROR);
+
+	// Random data is stored as it is, and fills the slot.
+	const std::string noise = random_bytes(payload);
+	verify(fang_block_seal(fs, fs.master_key, bytes(noise), payload, block, scratch) ==
+	       sizeof(block));
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       static_cast<ssize_t>(payload));
+	verify(memcmp(out, noise.data(), payload) == 0);
+
+	// So is an empty block.
+	verify(fang_block_seal(fs, fs.master_key, out, 0, block, scratch) ==
+	       BLOCK_PACKED_OVERHEAD);
+	verify(fang_block_open(fs, fs.master_key, block, BLOCK_PACKED_OVERHEAD, out, scratch) == 0);
+
+	// The unsealed lengths in the header have to agree with the sealed data.
+	fang_block_seal(fs, fs.master_key, bytes(text), 300, block, scratch);
+	block[4] ^= 1;
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       STATUS_TAMPERING);
+	block[4] ^= 1;
+	block[0] += 1;
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       STATUS_TAMPERING);
+	block[0] -= 1;
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) == 300);
+
+	block[BLOCK_SLOT_HEADER_LEN + BLOCK_HEADER_LEN + 3] ^= 1;
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       STATUS_TAMPERING);
+
+	// A header claiming more than a block holds is malformed.
+	const uint32_t huge = u32_to_le(4096);
+	memcpy(block, &huge, sizeof(huge));
+	verify(fang_block_open(fs, fs.master_key, block, sizeof(block), out, scratch) ==
+	       STATUS_ERROR);
+}
+
+void test_read_write(void) {
+	do_test();
+
+	FangFS fs;
+	init_fs(fs, 512);
+	const size_t payload = fang_block_payload(fs);
+	char path[] = "test-compress-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	// Compressible and incompressible blocks mixed together, written at
+	// unaligned offsets.
+	std::string data = log_lines(20 * payload + 100);
+	data.replace(5 * payload, 2 * payload, random_bytes(2 * payload));
+	verify(fang_file_write(*file, 0, 7 * payload + 3, bytes(data)) ==
+	       static_cast<int>(7 * payload + 3));
+	verify(fang_file_write(*file, 7 * payload + 3, data.size() - 7 * payload - 3,
+	                       bytes(data) + 7 * payload + 3) ==
+	       static_cast<int>(data.size() - 7 * payload - 3));
+	verify(file->state->size == static_cast<off_t>(data.size()));
+
+	// Blocks keep their slots, so the backing file is no longer than it
+	// would be without compression.
+	verify(backing_size(*file) <= 21 * 512);
+	verify(fang_file_size_fd(fs, file->fd, backing_size(*file)) ==
+	       static_cast<off_t>(data.size()));
+	verify(fang_file_size_at(fs, AT_FDCWD, path, backing_size(*file)) ==
+	       static_cast<off_t>(data.size()));
+
+	// Reading block N touches only block N.
+	std::string out(data.size() + payload, '\0');
+	uint8_t* out_buf = reinterpret_cast<uint8_t*>(&out[0]);
+	verify(fang_file_read(*file, 13 * payload + 5, 10, out_buf) == 10);
+	verify(memcmp(out_buf, data.data() + 13 * payload + 5, 10) == 0);
+
+	// Overwrite across the compressible and incompressible blocks.
+	const std::string patch = random_bytes(payload + 50);
+	data.replace(4 * payload + 20, patch.size(), patch);
+	verify(fang_file_write(*file, 4 * payload + 20, patch.size(), bytes(patch)) ==
+	       static_cast<int>(patch.size()));
+
+	// A fresh handle agrees.
+	verify(fang_file_close(file) == 0);
+	const int fd = open(path, O_RDWR);
+	verify(fd >= 0);
+	file = fang_file_open(fs, fd, path);
+	verify(file != nullptr);
+	verify(file->state->size == static_cast<off_t>(data.size()));
+	verify(fang_file_read(*file, 0, out.size(), out_buf) == static_cast<int>(data.size()));
+	verify(memcmp(out_buf, data.data(), data.size()) == 0);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_truncate(void) {
+	do_test();
+
+	FangFS fs;
+	init_fs(fs, 512);
+	const size_t payload = fang_block_payload(fs);
+	char path[] = "test-compress-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	const std::string data = log_lines(6 * payload);
+	verify(fang_file_write(*file, 0, data.size(), bytes(data)) ==
+	       static_cast<int>(data.size()));
+
+	// Into the middle of a block, onto a block boundary, and back out.
+	const off_t ends[] = {static_cast<off_t>(4 * payload + 17), static_cast<off_t>(3 * payload),
+	                      static_cast<off_t>(5 * payload + 1), 0};
+	std::string expected = data;
+	for(off_t end: ends) {
+		verify(fang_file_truncate(*file, end) == 0);
+		expected.resize(end, '\0');
+
+		file->state->size = -1;
+		file->state->tail_block_n = -1;
+		std::string out(6 * payload, '\0');
+		verify(fang_file_read(*file, 0, out.size(), reinterpret_cast<uint8_t*>(&out[0])) ==
+		       static_cast<int>(end));
+		verify(out.compare(0, end, expected) == 0);
+	}
+	verify(backing_size(*file) == 0);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_space(void) {
+	do_test();
+
+	FangFS fs;
+	init_fs(fs, COMPRESS_BLOCK_SIZE);
+	const size_t payload = fang_block_payload(fs);
+	char path[] = "test-compress-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	const size_t len = 32 * payload;
+	const std::string text = log_lines(len);
+	verify(fang_file_write(*file, 0, len, bytes(text)) == static_cast<int>(len));
+	verify(fsync(file->fd) == 0);
+
+	struct stat info;
+	verify(fstat(file->fd, &info) == 0);
+	const off_t text_space = info.st_blocks * 512;
+	verify(text_space < static_cast<off_t>(len / 3));
+
+	// Replacing it with noise takes the space back up, and replacing that
+	// with text gives it back again.
+	const std::string noise = random_bytes(len);
+	verify(fang_file_write(*file, 0, len, bytes(noise)) == static_cast<int>(len));
+	verify(fsync(file->fd) == 0);
+	verify(fstat(file->fd, &info) == 0);
+	verify(info.st_blocks * 512 >= static_cast<off_t>(len));
+
+	verify(fang_file_write(*file, 0, len, bytes(text)) == static_cast<int>(len));
+	verify(fsync(file->fd) == 0);
+	verify(fstat(file->fd, &info) == 0);
+	verify(info.st_blocks * 512 <= text_space + 32 * 4096);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_tampering(void) {
+	do_test();
+
+	FangFS fs;
+	init_fs(fs, 512);
+	const size_t payload = fang_block_payload(fs);
+	char path[] = "test-compress-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	const std::string data = log_lines(2 * payload + 10);
+	verify(fang_file_write(*file, 0, data.size(), bytes(data)) ==
+	       static_cast<int>(data.size()));
+
+	// Claim that the final block holds more than it does.
+	uint8_t header[BLOCK_SLOT_HEADER_LEN];
+	verify(pread(file->fd, header, sizeof(header), 2 * 512) == sizeof(header));
+	header[4] += 5;
+	verify(pwrite(file->fd, header, sizeof(header), 2 * 512) == sizeof(header));
+	file->state->size = -1;
+	file->state->tail_block_n = -1;
+
+	std::string out(data.size() + 5, '\0');
+	verify(fang_file_read(*file, 0, out.size(), reinterpret_cast<uint8_t*>(&out[0])) == -EIO);
+
+	// And one that the final block can't hold.
+	header[4] = 0xff;
+	header[5] = 0xff;
+	verify(pwrite(file->fd, header, sizeof(header), 2 * 512) == sizeof(header));
+	verify(fang_file_size_fd(fs, file->fd, backing_size(*file)) == -1);
+	verify(errno == EIO);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	const uint8_t ids[] = {CODEC_LZ4, CODEC_ZSTD};
+	for(uint8_t id: ids) {
+		codec = codec_find(id);
+		if(codec == nullptr) {
+			printf("Built without %s; skipping it\n", codec_name(id));
+			continue;
+		}
+
+		printf("Codec %s\n", codec->name);
+		test_codec();
+		test_block();
+		test_read_write();
+		test_truncate();
+		test_space();
+		test_tampering();
+	}
+
+	return 0;
+}
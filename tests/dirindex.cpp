@@ -0,0 +1,369 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#include "test.h"
+#include "../src/dirindex.h"
+#include "../src/util.h"
+
+#define TEST_THRESHOLD 16
+#define TEST_FILES 600
+
+static std::string source;
+
+/// The names that should be listed in /d.
+static std::set<std::string> names;
+
+struct Listing {
+	Listing(): limit(SIZE_MAX) {}
+
+	std::vector<std::string> names;
+	std::vector<off_t> offsets;
+	std::vector<mode_t> modes;
+
+	/// Report the buffer full after this many entries.
+	size_t limit;
+};
+
+static int fill(void* buf, const char* name, const struct stat* info, off_t offset) {
+	Listing& listing = *reinterpret_cast<Listing*>(buf);
+	if(listing.names.size() >= listing.limit) { return 1; }
+	listing.names.push_back(name);
+	listing.offsets.push_back(offset);
+	listing.modes.push_back((info == nullptr)? 0 : info->st_mode);
+	return 0;
+}
+
+static FangDir& open_dir(FangFS& fs, const char* path, struct fuse_file_info& fi) {
+	memset(&fi, 0, sizeof(fi));
+	verify(fangfs_opendir(fs, path, &fi) == 0);
+	return *reinterpret_cast<FangDir*>(static_cast<uintptr_t>(fi.fh));
+}
+
+static void close_dir(FangFS& fs, const char* path, struct fuse_file_info& fi) {
+	verify(fangfs_releasedir(fs, path, &fi) == 0);
+}
+
+/// List path through a new handle, and check it against expected.
+static void check_listing(FangFS& fs, const char* path,
+                          const std::set<std::string>& expected=names) {
+	struct fuse_file_info fi;
+	open_dir(fs, path, fi);
+	Listing listing;
+	verify(fangfs_readdir(fs, path, &listing, fill, 0, &fi) == 0);
+	close_dir(fs, path, fi);
+
+	std::set<std::string> listed;
+	for(const std::string& name: listing.names) {
+		if(name != "." && name != "..") { verify(listed.insert(name).second); }
+	}
+	verify(listed == expected);
+}
+
+static void create_file(FangFS& fs, const std::string& path) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	verify(fangfs_create(fs, path.c_str(), 0640, &fi) == 0);
+	verify(fangfs_close(fs, &fi) == 0);
+}
+
+static std::string index_path(FangFS& fs, const char* path) {
+	Buffer real_path;
+	path_resolve(fs, path, real_path);
+	return std::string(reinterpret_cast<char*>(real_path.buf)) + "/" DIRINDEX_NAME;
+}
+
+static off_t index_size(FangFS& fs, const char* path) {
+	struct stat info;
+	verify(stat(index_path(fs, path).c_str(), &info) == 0);
+	return info.st_size;
+}
+
+/// Unmount and mount again.
+static void remount(FangFS& fs) {
+	dirindex_free(fs);
+	verify(fs.dir_indexes == nullptr);
+	dirindex_init(fs);
+	verify(fs.dir_indexes != nullptr);
+}
+
+void test_build(FangFS& fs) {
+	do_test();
+
+	verify(fangfs_mkdir(fs, "/d", 0750) == 0);
+	for(int i = 0; i < TEST_FILES; i += 1) {
+		// Not in order, so that the source doesn't list them sorted by chance.
+		char name[16];
+		snprintf(name, sizeof(name), "f%04d", (i * 7919) % TEST_FILES);
+		create_file(fs, std::string("/d/") + name);
+		names.insert(name);
+	}
+
+	// The first listing scans the backing directory, and builds the index.
+	struct fuse_file_info fi;
+	FangDir& dir = open_dir(fs, "/d", fi);
+	verify(!dir.base);
+	verify(dir.building);
+	Listing listing;
+	verify(fangfs_readdir(fs, "/d", &listing, fill, 0, &fi) == 0);
+	verify(!dir.building);
+	close_dir(fs, "/d", fi);
+	verify(access(index_path(fs, "/d").c_str(), F_OK) == 0);
+
+	// The next is served from it, in order.
+	FangDir& indexed = open_dir(fs, "/d", fi);
+	verify(indexed.base);
+	listing = Listing();
+	verify(fangfs_readdir(fs, "/d", &listing, fill, 0, &fi) == 0);
+	close_dir(fs, "/d", fi);
+	verify(listing.names.size() == names.size() + 2);
+	verify(listing.names[0] == "." && listing.names[1] == "..");
+	verify(S_ISDIR(listing.modes[0]));
+	verify(std::equal(names.begin(), names.end(), listing.names.begin() + 2));
+	for(size_t i = 0; i < listing.offsets.size(); i += 1) {
+		verify(listing.offsets[i] == static_cast<off_t>(i + 1));
+		verify(S_ISDIR(listing.modes[i]) == (i < 2));
+	}
+
+	// A directory with too few names gets none.
+	check_listing(fs, "/", std::set<std::string>{"d"});
+	verify(access(index_path(fs, "/").c_str(), F_OK) < 0 && errno == ENOENT);
+}
+
+void test_offsets(FangFS& fs) {
+	do_test();
+
+	const std::vector<std::string> sorted(names.begin(), names.end());
+
+	// A listing that fills the buffer picks up where it left off.
+	struct fuse_file_info fi;
+	open_dir(fs, "/d", fi);
+	Listing listing;
+	off_t offset = 0;
+	while(1) {
+		Listing part;
+		part.limit = 100;
+		verify(fangfs_readdir(fs, "/d", &part, fill, offset, &fi) == 0);
+		if(part.names.empty()) { break; }
+		listing.names.insert(listing.names.end(), part.names.begin(), part.names.end());
+		offset = part.offsets.back();
+	}
+	verify(listing.names.size() == sorted.size() + 2);
+	verify(std::equal(sorted.begin(), sorted.end(), listing.names.begin() + 2));
+
+	// Seeking anywhere else starts from there, in whichever chunk.
+	const off_t starts[] = {1, 2, 257, 300, TEST_FILES + 1, TEST_FILES + 2, TEST_FILES + 50};
+	for(off_t start: starts) {
+		listing = Listing();
+		listing.limit = 3;
+		verify(fangfs_readdir(fs, "/d", &listing, fill, start, &fi) == 0);
+		for(size_t i = 0; i < listing.names.size(); i += 1) {
+			const off_t at = start + i;
+			verify(listing.offsets[i] == at + 1);
+			verify(listing.names[i] == ((at == 1)? std::string("..") : sorted[at - 2]));
+		}
+		verify(listing.names.size() == std::min<size_t>(3, std::max<off_t>(0, TEST_FILES + 2 - start)));
+	}
+	close_dir(fs, "/d", fi);
+}
+
+void test_changes(FangFS& fs) {
+	do_test();
+
+	// A handle opened before the changes keeps listing what it saw.
+	struct fuse_file_info before;
+	open_dir(fs, "/d", before);
+
+	verify(fangfs_unlink(fs, "/d/f0000") == 0);
+	verify(fangfs_unlink(fs, "/d/f0300") == 0);
+	names.erase("f0000");
+	names.erase("f0300");
+	create_file(fs, "/d/a-new");
+	create_file(fs, "/d/z-new");
+	create_file(fs, "/d/f0300");
+	names.insert("a-new");
+	names.insert("z-new");
+	names.insert("f0300");
+	verify(fangfs_mkdir(fs, "/d/sub", 0750) == 0);
+	names.insert("sub");
+	verify(fangfs_mknod(fs, "/d/node", S_IFREG|0640, 0) == 0);
+	names.insert("node");
+
+	// Failed changes leave it alone.
+	verify(fangfs_unlink(fs, "/d/missing") == -ENOENT);
+	verify(fangfs_mkdir(fs, "/d/sub", 0750) == -EEXIST);
+
+	Listing listing;
+	verify(fangfs_readdir(fs, "/d", &listing, fill, 0, &before) == 0);
+	close_dir(fs, "/d", before);
+	verify(listing.names.size() == TEST_FILES + 2);
+	verify(listing.names[2] == "f0000");
+
+	check_listing(fs, "/d");
+
+	struct fuse_file_info fi;
+	open_dir(fs, "/d", fi);
+	listing = Listing();
+	verify(fangfs_readdir(fs, "/d", &listing, fill, 0, &fi) == 0);
+	close_dir(fs, "/d", fi);
+	verify(std::equal(names.begin(), names.end(), listing.names.begin() + 2));
+	const size_t sub = std::find(listing.names.begin(), listing.names.end(), "sub") -
+	                   listing.names.begin();
+	verify(S_ISDIR(listing.modes[sub]));
+	verify(S_ISREG(listing.modes[sub + 1]));
+}
+
+void test_persist(FangFS& fs) {
+	do_test();
+
+	// A clean unmount leaves the index ready for the next mount.
+	remount(fs);
+	struct fuse_file_info fi;
+	FangDir& dir = open_dir(fs, "/d", fi);
+	verify(dir.base);
+	verify(!dir.building);
+	close_dir(fs, "/d", fi);
+	check_listing(fs, "/d");
+
+	// Enough changes get folded into a new index.
+	const off_t before = index_size(fs, "/d");
+	for(int i = 0; i < DIRINDEX_MIN_CHANGES + 10; i += 1) {
+		const std::string path = "/d/g" + std::to_string(i);
+		create_file(fs, path);
+		verify(fangfs_unlink(fs, path.c_str()) == 0);
+	}
+	verify(index_size(fs, "/d") > before);
+	check_listing(fs, "/d");
+	verify(index_size(fs, "/d") <= before);
+	check_listing(fs, "/d");
+}
+
+void test_stale(FangFS& fs) {
+	do_test();
+
+	// A change made behind the mount's back shows in the directory's mtime.
+	remount(fs);
+	dirindex_free(fs);
+	Buffer real_path;
+	path_resolve(fs, "/d", real_path);
+	const std::string hidden = std::string(reinterpret_cast<char*>(real_path.buf)) + "/_other";
+	verify(mknod(hidden.c_str(), S_IFREG|0600, 0) == 0);
+	dirindex_init(fs);
+
+	struct fuse_file_info fi;
+	FangDir& dir = open_dir(fs, "/d", fi);
+	verify(!dir.base);
+	verify(dir.building);
+	close_dir(fs, "/d", fi);
+
+	// So does a mount that never ended cleanly.
+	check_listing(fs, "/d");
+	delete fs.dir_indexes;
+	fs.dir_indexes = nullptr;
+	dirindex_init(fs);
+	FangDir& unclean = open_dir(fs, "/d", fi);
+	verify(!unclean.base);
+	close_dir(fs, "/d", fi);
+	check_listing(fs, "/d");
+}
+
+void test_tamper(FangFS& fs) {
+	do_test();
+
+	// Damage the last chunk, which is only opened when listed.
+	remount(fs);
+	const std::string path = index_path(fs, "/d");
+	const int fd = open(path.c_str(), O_RDWR);
+	verify(fd >= 0);
+	uint64_t offset;
+	verify(pread(fd, &offset, sizeof(offset), 40 + 8 * 2) == sizeof(offset));
+	uint8_t byte;
+	verify(pread(fd, &byte, 1, u64_from_le(offset) + 30) == 1);
+	byte ^= 1;
+	verify(pwrite(fd, &byte, 1, u64_from_le(offset) + 30) == 1);
+	close(fd);
+
+	struct fuse_file_info fi;
+	FangDir& dir = open_dir(fs, "/d", fi);
+	verify(dir.base);
+	Listing listing;
+	verify(fangfs_readdir(fs, "/d", &listing, fill, 2 + 2 * DIRINDEX_CHUNK_ENTRIES, &fi) == -EIO);
+	close_dir(fs, "/d", fi);
+	verify(access(path.c_str(), F_OK) < 0 && errno == ENOENT);
+
+	// It is rebuilt by the next listing.
+	check_listing(fs, "/d");
+	FangDir& rebuilt = open_dir(fs, "/d", fi);
+	verify(rebuilt.base);
+	close_dir(fs, "/d", fi);
+	check_listing(fs, "/d");
+}
+
+void test_shrink(FangFS& fs) {
+	do_test();
+
+	remount(fs);
+	check_listing(fs, "/d");
+	MemoryUsage usage;
+	memory_usage(usage);
+	verify(usage.users[MEM_DIR_INDEXES] > static_cast<size_t>(index_size(fs, "/d")));
+
+	// An index that a listing is using stays.
+	struct fuse_file_info fi;
+	FangDir& dir = open_dir(fs, "/d", fi);
+	verify(dir.base);
+	verify(memory_shrink(SIZE_MAX) == 0);
+	close_dir(fs, "/d", fi);
+
+	// Once let go of, it is built again by the next listing.
+	verify(memory_shrink(SIZE_MAX) == usage.users[MEM_DIR_INDEXES]);
+	memory_usage(usage);
+	verify(usage.users[MEM_DIR_INDEXES] == 0);
+	verify(fs.dir_indexes->dirs.empty());
+	FangDir& rebuilt = open_dir(fs, "/d", fi);
+	verify(rebuilt.building);
+	close_dir(fs, "/d", fi);
+
+	// No new index is started over budget, and listings go on without.
+	verify(fs.dir_indexes->dirs.empty());
+	memory_set_budget(1);
+	FangDir& unindexed = open_dir(fs, "/d", fi);
+	verify(!unindexed.building);
+	verify(!unindexed.base);
+	close_dir(fs, "/d", fi);
+	check_listing(fs, "/d");
+	memory_set_budget(0);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-dirindex-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+	source = dir;
+
+	FangFS fs;
+	test_init_fs(fs, source.c_str());
+	fs.dir_index = TEST_THRESHOLD;
+	dirindex_init(fs);
+	verify(fs.dir_indexes != nullptr);
+
+	test_build(fs);
+	test_offsets(fs);
+	test_changes(fs);
+	test_persist(fs);
+	test_stale(fs);
+	test_tamper(fs);
+	test_shrink(fs);
+
+	dirindex_free(fs);
+	verify(system((std::string("rm -rf ") + dir).c_str()) == 0);
+	return 0;
+}
@@ -1,28 +1,165 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "test.h"
 #include "../src/exlockfile.h"
 
 void test_simple(void) {
 	do_test();
 
-	int status = exlock_obtain("test-lock");
-	verify(status == 0);
+	int fd = exlock_obtain("test-lock", -1);
+	verify(fd >= 0);
+	verify(exlock_owner("test-lock") == getpid());
 
-	verify(!exlock_try_obtain("test-lock"));
+	verify(exlock_try_obtain("test-lock") < 0);
+	verify(errno == EWOULDBLOCK);
 
-	verify(exlock_release("test-lock") == 0);
+	verify(exlock_release("test-lock", fd) == 0);
+	verify(access("test-lock", F_OK) < 0);
 
-	verify(exlock_try_obtain("test-lock"));
-	verify(exlock_release("test-lock") == 0);
+	fd = exlock_try_obtain("test-lock");
+	verify(fd >= 0);
+	verify(exlock_release("test-lock", fd) == 0);
 }
 
 void test_illegal(const char* selfpath) {
 	do_test();
-	verify(!exlock_try_obtain(selfpath));
+	verify(exlock_try_obtain(selfpath) < 0);
+	verify(exlock_try_obtain(".") < 0);
+}
+
+void test_stale(void) {
+	do_test();
+
+	// A lock file left behind by a process that died holding it, or by an
+	// older version that locked with O_EXCL, must not keep anyone out.
+	pid_t child = fork();
+	verify(child >= 0);
+	if(child == 0) { _exit(0); }
+	verify(waitpid(child, nullptr, 0) == child);
+
+	FILE* f = fopen("test-lock", "w");
+	verify(f != nullptr);
+	fprintf(f, "%d\n", static_cast<int>(child));
+	fclose(f);
+	verify(exlock_owner("test-lock") == child);
+
+	const int fd = exlock_obtain("test-lock", 0);
+	verify(fd >= 0);
+	verify(exlock_owner("test-lock") == getpid());
+	verify(exlock_release("test-lock", fd) == 0);
+}
+
+void test_contention(void) {
+	do_test();
+
+	int ready[2];
+	verify(pipe(ready) == 0);
+
+	pid_t child = fork();
+	verify(child >= 0);
+	if(child == 0) {
+		const int fd = exlock_obtain("test-lock", -1);
+		if(write(ready[1], &fd, sizeof(fd)) != sizeof(fd)) { _exit(1); }
+		pause();
+		_exit(0);
+	}
+
+	int child_fd;
+	verify(read(ready[0], &child_fd, sizeof(child_fd)) == sizeof(child_fd));
+	verify(child_fd >= 0);
+	verify(exlock_owner("test-lock") == child);
+
+	verify(exlock_try_obtain("test-lock") < 0);
+	verify(errno == EWOULDBLOCK);
+
+	verify(exlock_obtain("test-lock", 50) < 0);
+	verify(errno == ETIMEDOUT);
+
+	// The kernel lets go of a dead holder's lock, even though its lock file
+	// is still lying around.
+	verify(kill(child, SIGKILL) == 0);
+	verify(waitpid(child, nullptr, 0) == child);
+	verify(access("test-lock", F_OK) == 0);
+
+	const int fd = exlock_obtain("test-lock", 1000);
+	verify(fd >= 0);
+	verify(exlock_release("test-lock", fd) == 0);
+
+	close(ready[0]);
+	close(ready[1]);
+}
+
+/// Increment the counter in test-counter by one, under the lock.
+static bool bump_counter(void) {
+	const int fd = exlock_obtain("test-lock", -1);
+	if(fd < 0) { return false; }
+
+	bool ok = false;
+	const int counter = open("test-counter", O_RDWR);
+	if(counter >= 0) {
+		char buf[16] = {0};
+		if(pread(counter, buf, sizeof(buf) - 1, 0) >= 0) {
+			const int len = snprintf(buf, sizeof(buf), "%d", atoi(buf) + 1);
+			ok = (pwrite(counter, buf, len, 0) == len);
+		}
+		close(counter);
+	}
+
+	return (exlock_release("test-lock", fd) == 0) && ok;
+}
+
+void test_mutual_exclusion(void) {
+	do_test();
+
+	const int N_CHILDREN = 8;
+	const int N_ROUNDS = 200;
+
+	FILE* f = fopen("test-counter", "w");
+	verify(f != nullptr);
+	fprintf(f, "0");
+	fclose(f);
+
+	pid_t children[N_CHILDREN];
+	for(int i = 0; i < N_CHILDREN; i += 1) {
+		children[i] = fork();
+		verify(children[i] >= 0);
+		if(children[i] == 0) {
+			for(int round = 0; round < N_ROUNDS; round += 1) {
+				if(!bump_counter()) { _exit(1); }
+			}
+			_exit(0);
+		}
+	}
+
+	for(int i = 0; i < N_CHILDREN; i += 1) {
+		int status;
+		verify(waitpid(children[i], &status, 0) == children[i]);
+		verify(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	f = fopen("test-counter", "r");
+	verify(f != nullptr);
+	int count = -1;
+	verify(fscanf(f, "%d", &count) == 1);
+	fclose(f);
+	verify(count == N_CHILDREN * N_ROUNDS);
+
+	unlink("test-counter");
 }
 
 int main(int argc, char** argv) {
+	unlink("test-lock");
+
 	test_simple();
 	test_illegal(argv[0]);
+	test_stale();
+	test_contention();
+	test_mutual_exclusion();
 
 	return 0;
 }
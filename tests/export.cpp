@@ -0,0 +1,232 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "test.h"
+#include "../src/exporter.h"
+#include "../src/file.h"
+#include "../src/importer.h"
+
+static std::string scratch;
+
+/// The tree every test exports: plaintext path to contents, with directories
+/// mapped to "/".
+static std::map<std::string, std::string> tree;
+
+static std::string contents(size_t len, char seed) {
+	std::string data(len, '\0');
+	for(size_t i = 0; i < len; i += 1) { data[i] = static_cast<char>(seed + i * 13); }
+	return data;
+}
+
+static std::string read_file(const std::string& path) {
+	FILE* f = fopen(path.c_str(), "rb");
+	verify(f != nullptr);
+	std::string data;
+	char buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) { data.append(buf, n); }
+	fclose(f);
+	return data;
+}
+
+/// Build the tree in plaintext, and import it into fs.
+static void populate(FangFS& fs) {
+	const size_t payload = fang_block_payload(fs);
+	const std::string long_dir(90, 'd');
+	tree["a"] = "/";
+	tree["a/b"] = "/";
+	tree["a/" + long_dir] = "/";
+	tree["empty"] = "";
+	tree["a/exact"] = contents(payload, 'e');
+	tree["a/b/small"] = contents(10, 's');
+	tree["big"] = contents(2500000, 'b');
+	tree["a/" + long_dir + "/" + std::string(60, 'n')] = contents(payload + 1, 'l');
+	tree["a/" + std::string(110, 'x')] = contents(3, 'x');
+
+	const std::string plain = scratch + "/plain";
+	verify(mkdir(plain.c_str(), 0700) == 0);
+	for(const auto& entry: tree) {
+		const std::string path = plain + "/" + entry.first;
+		if(entry.second == "/") {
+			verify(mkdir(path.c_str(), 0750) == 0);
+			continue;
+		}
+		FILE* f = fopen(path.c_str(), "wb");
+		verify(f != nullptr);
+		verify(fwrite(entry.second.data(), 1, entry.second.size(), f) == entry.second.size());
+		fclose(f);
+	}
+
+	ImportOptions options;
+	ImportStats stats;
+	verify(import_run(fs, plain.c_str(), "/", options, stats) == 0);
+	verify(stats.errors == 0);
+}
+
+static ExportStats run(FangFS& fs, const char* from, const char* to, int tar_fd,
+                       std::vector<std::string>* failed) {
+	ExportOptions options;
+	options.threads = 3;
+	options.tar_fd = tar_fd;
+	options.on_error = [failed](const char* path, int error) {
+		verify(error == EBADMSG);
+		if(failed != nullptr) { failed->push_back(path); }
+	};
+
+	ExportStats stats;
+	verify(export_run(fs, from, to, options, stats) == 0);
+	return stats;
+}
+
+/// Parse a tar stream into path -> contents, as tree is laid out.
+static std::map<std::string, std::string> parse_tar(const std::string& tar) {
+	std::map<std::string, std::string> entries;
+	std::string long_name;
+	size_t offset = 0;
+	while(1) {
+		verify(offset + 512 <= tar.size());
+		const char* header = tar.data() + offset;
+		offset += 512;
+		if(header[0] == '\0') { break; }
+
+		unsigned sum = 0;
+		for(size_t i = 0; i < 512; i += 1) {
+			sum += (i >= 148 && i < 156)? ' ' : static_cast<uint8_t>(header[i]);
+		}
+		verify(strtoul(header + 148, nullptr, 8) == sum);
+		verify(memcmp(header + 257, "ustar", 6) == 0);
+
+		const size_t size = strtoull(header + 124, nullptr, 8);
+		const std::string data = tar.substr(offset, size);
+		offset += (size + 511) / 512 * 512;
+
+		std::string name = std::string(header, strnlen(header, 100));
+		if(header[345] != '\0') {
+			name = std::string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+		}
+		if(!long_name.empty()) {
+			name = long_name;
+			long_name.clear();
+		}
+
+		if(header[156] == 'L') {
+			long_name = data.substr(0, data.size() - 1);
+		} else if(header[156] == '5') {
+			verify(name[name.size() - 1] == '/');
+			entries[name.substr(0, name.size() - 1)] = "/";
+		} else {
+			verify(header[156] == '0');
+			entries[name] = data;
+		}
+	}
+	return entries;
+}
+
+static std::string export_tar(FangFS& fs, const char* from, std::vector<std::string>* failed) {
+	const std::string path = scratch + "/out.tar";
+	const int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	verify(fd >= 0);
+	run(fs, from, nullptr, fd, failed);
+	close(fd);
+	const std::string tar = read_file(path);
+	unlink(path.c_str());
+	return tar;
+}
+
+void test_tree(FangFS& fs) {
+	do_test();
+
+	const std::string out = scratch + "/out";
+	const ExportStats stats = run(fs, "/", out.c_str(), -1, nullptr);
+	verify(stats.errors == 0);
+	verify(stats.dirs == 3);
+	verify(stats.files == 6);
+
+	for(const auto& entry: tree) {
+		const std::string path = out + "/" + entry.first;
+		struct stat info;
+		verify(stat(path.c_str(), &info) == 0);
+		if(entry.second == "/") {
+			verify(S_ISDIR(info.st_mode));
+			verify((info.st_mode & 0777) == 0750);
+		} else {
+			verify(read_file(path) == entry.second);
+		}
+	}
+
+	verify(system((std::string("rm -rf ") + out).c_str()) == 0);
+}
+
+void test_tar(FangFS& fs) {
+	do_test();
+
+	const std::string tar = export_tar(fs, "/", nullptr);
+	verify(tar.size() % 512 == 0);
+	verify(parse_tar(tar) == tree);
+
+	// Just one directory, with paths relative to it.
+	const std::map<std::string, std::string> sub = parse_tar(export_tar(fs, "/a/b", nullptr));
+	verify(sub.size() == 1);
+	verify(sub.at("small") == tree["a/b/small"]);
+}
+
+void test_corrupt(FangFS& fs) {
+	do_test();
+
+	// Flip a bit in the second block of the big file.
+	Buffer real_path;
+	path_resolve(fs, "/big", real_path);
+	const int fd = open(reinterpret_cast<char*>(real_path.buf), O_RDWR);
+	verify(fd >= 0);
+	uint8_t c;
+	verify(pread(fd, &c, 1, 128 + BLOCK_OVERHEAD) == 1);
+	c ^= 1;
+	verify(pwrite(fd, &c, 1, 128 + BLOCK_OVERHEAD) == 1);
+	close(fd);
+
+	// In a tree, the file is left out.
+	std::vector<std::string> failed;
+	const std::string out = scratch + "/out";
+	ExportStats stats = run(fs, "/", out.c_str(), -1, &failed);
+	verify(stats.errors == 1 && stats.files == 5);
+	verify(failed.size() == 1 && failed[0] == "/big");
+	verify(access((out + "/big").c_str(), F_OK) < 0);
+	verify(read_file(out + "/a/b/small") == tree["a/b/small"]);
+	verify(system((std::string("rm -rf ") + out).c_str()) == 0);
+
+	// In a tar stream, the bad block reads as zeros.
+	failed.clear();
+	const std::map<std::string, std::string> entries = parse_tar(export_tar(fs, "/", &failed));
+	verify(failed.size() == 1);
+	const size_t payload = fang_block_payload(fs);
+	std::string expected = tree["big"];
+	memset(&expected[payload], 0, payload);
+	verify(entries.at("big") == expected);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-export-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+	scratch = dir;
+	const std::string cipher = scratch + "/cipher";
+	verify(mkdir(cipher.c_str(), 0700) == 0);
+
+	FangFS fs;
+	test_init_fs(fs, cipher.c_str());
+	populate(fs);
+
+	test_tree(fs);
+	test_tar(fs);
+	test_corrupt(fs);
+
+	verify(system((std::string("rm -rf ") + dir).c_str()) == 0);
+	return 0;
+}
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/file.h"
+
+static FangFile* open_temp(FangFS& fs, char* path) {
+	int fd = mkstemp(path);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, path);
+	verify(file != nullptr);
+	return file;
+}
+
+void test_plaintext_size(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	const off_t payload = fang_block_payload(fs);
+
+	verify(fang_file_plaintext_size(fs, 0) == 0);
+	verify(fang_file_plaintext_size(fs, BLOCK_OVERHEAD) == 0);
+	verify(fang_file_plaintext_size(fs, BLOCK_OVERHEAD + 5) == 5);
+	verify(fang_file_plaintext_size(fs, 128) == payload);
+	verify(fang_file_plaintext_size(fs, 128 + BLOCK_OVERHEAD + 1) == payload + 1);
+	verify(fang_file_plaintext_size(fs, 128 + 3) == -1);
+}
+
+void test_read_write(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	char path[] = "test-file-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	uint8_t data[1000];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = i & 0xff; }
+
+	// Unaligned write spanning several blocks
+	verify(fang_file_write(*file, 10, 500, data) == 500);
+	verify(file->state->size == 510);
+
+	uint8_t out[1000];
+	memset(out, 0xaa, sizeof(out));
+	verify(fang_file_read(*file, 0, sizeof(out), out) == 510);
+	for(size_t i = 0; i < 10; i += 1) { verify(out[i] == 0); }
+	verify(memcmp(out + 10, data, 500) == 0);
+
+	// Overwrite the middle of a block
+	verify(fang_file_write(*file, 100, 3, data + 900) == 3);
+	verify(fang_file_read(*file, 99, 5, out) == 5);
+	verify(out[0] == data[89]);
+	verify(memcmp(out + 1, data + 900, 3) == 0);
+	verify(out[4] == data[93]);
+
+	// Leave a hole past the end
+	verify(fang_file_write(*file, 700, 10, data) == 10);
+	verify(fang_file_read(*file, 505, 205, out) == 205);
+	verify(memcmp(out, data + 495, 5) == 0);
+	for(size_t i = 5; i < 195; i += 1) { verify(out[i] == 0); }
+	verify(memcmp(out + 195, data, 10) == 0);
+
+	// The on-disk length matches the block layout
+	struct stat info;
+	verify(fstat(file->fd, &info) == 0);
+	verify(fang_file_plaintext_size(fs, info.st_size) == 710);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_truncate(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	char path[] = "test-file-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	uint8_t data[300];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = (i * 7) & 0xff; }
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+
+	verify(fang_file_truncate(*file, 150) == 0);
+	verify(file->state->size == 150);
+
+	uint8_t out[300];
+	verify(fang_file_read(*file, 0, sizeof(out), out) == 150);
+	verify(memcmp(out, data, 150) == 0);
+
+	verify(fang_file_truncate(*file, 200) == 0);
+	verify(fang_file_read(*file, 140, 100, out) == 60);
+	verify(memcmp(out, data + 140, 10) == 0);
+	for(size_t i = 10; i < 60; i += 1) { verify(out[i] == 0); }
+
+	verify(fang_file_truncate(*file, 0) == 0);
+	verify(fang_file_read(*file, 0, sizeof(out), out) == 0);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_tampering(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	char path[] = "test-file-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	uint8_t data[50];
+	memset(data, 'x', sizeof(data));
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+
+	// Flip a ciphertext bit behind the handle's back
+	uint8_t byte;
+	verify(pread(file->fd, &byte, 1, BLOCK_HEADER_LEN) == 1);
+	byte ^= 1;
+	verify(pwrite(file->fd, &byte, 1, BLOCK_HEADER_LEN) == 1);
+	file->state->tail_block_n = -1;
+
+	uint8_t out[50];
+	verify(fang_file_read(*file, 0, sizeof(out), out) == -EIO);
+
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_io_engines(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	fs.io_engine = FANGFS_IO_URING;
+	char path[] = "test-file-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	// Enough whole blocks to need more than one batch through the ring
+	const size_t payload = fang_block_payload(fs);
+	const size_t len = payload * 150 + 37;
+	uint8_t* data = new uint8_t[len];
+	uint8_t* out = new uint8_t[len + payload];
+	for(size_t i = 0; i < len; i += 1) { data[i] = (i * 13 + i / 256) & 0xff; }
+
+	verify(fang_file_write(*file, 0, len, data) == static_cast<int>(len));
+	memset(out, 0, len);
+	verify(fang_file_read(*file, 0, len + payload, out) == static_cast<int>(len));
+	verify(memcmp(out, data, len) == 0);
+
+	// Both engines read what the other wrote
+	fs.io_engine = FANGFS_IO_POSIX;
+	file->state->tail_block_n = -1;
+	memset(out, 0, len);
+	verify(fang_file_read(*file, 0, len, out) == static_cast<int>(len));
+	verify(memcmp(out, data, len) == 0);
+
+	verify(fang_file_write(*file, payload * 3, payload * 4, data) == static_cast<int>(payload * 4));
+	fs.io_engine = FANGFS_IO_URING;
+	verify(fang_file_read(*file, payload * 3, payload * 4, out) == static_cast<int>(payload * 4));
+	verify(memcmp(out, data, payload * 4) == 0);
+
+	// Tampering is still caught mid-batch
+	uint8_t byte;
+	verify(pread(file->fd, &byte, 1, 5 * fs.metafile.block_size + BLOCK_HEADER_LEN) == 1);
+	byte ^= 1;
+	verify(pwrite(file->fd, &byte, 1, 5 * fs.metafile.block_size + BLOCK_HEADER_LEN) == 1);
+	verify(fang_file_read(*file, 0, payload * 8, out) == -EIO);
+
+	delete[] data;
+	delete[] out;
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_direct(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".", DIRECT_IO_ALIGN);
+	fs.backing_direct = true;
+
+	char path[] = "test-file-XXXXXX";
+	close(mkstemp(path));
+	bool created;
+	const int fd = fang_file_open_backing(AT_FDCWD, path,
+	                                      fang_file_backing_flags(fs, O_RDWR|O_CREAT),
+	                                      0600, &created);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, path);
+	verify(file != nullptr);
+
+	// The short final block can't go out with O_DIRECT, so it has to fall back
+	const size_t payload = fang_block_payload(fs);
+	const size_t len = payload * 5 + 123;
+	uint8_t* data = new uint8_t[len];
+	uint8_t* out = new uint8_t[len];
+	for(size_t i = 0; i < len; i += 1) { data[i] = (i * 31) & 0xff; }
+
+	for(int engine = 0; engine < 2; engine += 1) {
+		fs.io_engine = engine? FANGFS_IO_URING : FANGFS_IO_POSIX;
+		verify(fang_file_truncate(*file, 0) == 0);
+		verify(fang_file_write(*file, 1, len - 1, data + 1) == static_cast<int>(len - 1));
+		verify(fang_file_write(*file, 0, 1, data) == 1);
+
+		file->state->tail_block_n = -1;
+		memset(out, 0, len);
+		verify(fang_file_read(*file, 0, len, out) == static_cast<int>(len));
+		verify(memcmp(out, data, len) == 0);
+	}
+
+	verify(fang_file_truncate(*file, payload + 7) == 0);
+	verify(fang_file_read(*file, payload, len, out) == 7);
+	verify(memcmp(out, data + payload, 7) == 0);
+
+	delete[] data;
+	delete[] out;
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+void test_mmap_engine(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	fs.io_engine = FANGFS_IO_MMAP;
+	char path[] = "test-file-XXXXXX";
+	FangFile* file = open_temp(fs, path);
+
+	const size_t payload = fang_block_payload(fs);
+	const size_t len = payload * 100 + 50;
+	uint8_t* data = new uint8_t[len];
+	uint8_t* out = new uint8_t[len];
+	for(size_t i = 0; i < len; i += 1) { data[i] = (i * 7 + 3) & 0xff; }
+
+	verify(fang_file_write(*file, 0, len, data) == static_cast<int>(len));
+	file->state->tail_block_n = -1;
+
+	// Sequential reads, which also exercise the readahead hints
+	for(size_t off = 0; off < len; off += 1000) {
+		const size_t n = std::min<size_t>(1000, len - off);
+		verify(fang_file_read(*file, off, n, out + off) == static_cast<int>(n));
+	}
+	verify(memcmp(out, data, len) == 0);
+	verify(file->map != nullptr);
+
+	// Writes through pwrite are visible through the mapping
+	verify(fang_file_write(*file, 10, 20, data + 500) == 20);
+	file->state->tail_block_n = -1;
+	verify(fang_file_read(*file, 0, 40, out) == 40);
+	verify(memcmp(out + 10, data + 500, 20) == 0);
+
+	// Shrinking the file behind the handle's back must not kill us
+	const int other = open(path, O_RDWR);
+	verify(other >= 0);
+	verify(ftruncate(other, 0) == 0);
+	close(other);
+	verify(fang_file_read(*file, payload * 50, payload * 10, out) == 0);
+
+	delete[] data;
+	delete[] out;
+	verify(fang_file_close(file) == 0);
+	unlink(path);
+}
+
+/// Open path through the filesystem, as FUSE would.
+static void open_path(FangFS& fs, const char* path, bool create, struct fuse_file_info& fi) {
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	verify((create? fangfs_create(fs, path, 0600, &fi) : fangfs_open(fs, path, &fi)) == 0);
+}
+
+void test_shared(void) {
+	do_test();
+
+	// Two handles and a truncation by path each change the file behind the
+	// others' backs, and none of them may lose what another wrote.
+	FangFS fs;
+	test_init_fs(fs, ".");
+	struct fuse_file_info a;
+	struct fuse_file_info b;
+	open_path(fs, "/shared", true, a);
+	open_path(fs, "/shared", false, b);
+
+	char data[1000];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = 'a' + i % 26; }
+	char expected[2000];
+	memset(expected, 0, sizeof(expected));
+
+	// Extend through one handle, then write past the end through the other,
+	// which last saw the file empty.
+	verify(fangfs_write(fs, data, 500, 0, &a) == 500);
+	memcpy(expected, data, 500);
+	verify(fangfs_write(fs, data + 500, 100, 900, &b) == 100);
+	memcpy(expected + 900, data + 500, 100);
+
+	// Extend the tail block through one handle, then write into it through
+	// the other, which has an older copy of it cached.
+	verify(fangfs_write(fs, data, 10, 1000, &a) == 10);
+	memcpy(expected + 1000, data, 10);
+	verify(fangfs_write(fs, data + 20, 5, 995, &b) == 5);
+	memcpy(expected + 995, data + 20, 5);
+
+	// Overwrite part of the tail in place through one handle, which leaves
+	// the backing file's length as it was, and its times too within a
+	// clock tick, then write into the same block through the other.
+	verify(fangfs_write(fs, data + 100, 8, 1001, &b) == 8);
+	memcpy(expected + 1001, data + 100, 8);
+	verify(fangfs_write(fs, data + 200, 1, 1004, &a) == 1);
+	memcpy(expected + 1004, data + 200, 1);
+
+	char out[2000];
+	verify(fangfs_read(fs, out, sizeof(out), 0, &a) == 1010);
+	verify(memcmp(out, expected, 1010) == 0);
+	verify(fangfs_read(fs, out, sizeof(out), 0, &b) == 1010);
+	verify(memcmp(out, expected, 1010) == 0);
+
+	// Both handles work from the same size and tail.
+	FangFile* file_a = reinterpret_cast<FangFile*>(a.fh);
+	FangFile* file_b = reinterpret_cast<FangFile*>(b.fh);
+	verify(file_a->state == file_b->state);
+	verify(file_a->state->refs == 2);
+
+	// Shrink by path, then write past the new end through a handle: the gap
+	// reads back as zeros, not as what was cut off.
+	verify(fangfs_truncate(fs, "/shared", 700) == 0);
+	verify(fangfs_write(fs, data, 50, 950, &a) == 50);
+	memset(expected + 700, 0, 250);
+	memcpy(expected + 950, data, 50);
+	verify(fangfs_read(fs, out, sizeof(out), 0, &b) == 1000);
+	verify(memcmp(out, expected, 1000) == 0);
+
+	verify(fangfs_close(fs, &a) == 0);
+	verify(fangfs_close(fs, &b) == 0);
+	verify(fangfs_unlink(fs, "/shared") == 0);
+}
+
+/// A buffer vector with room for count buffers, as libfuse allocates them.
+static struct fuse_bufvec* new_bufvec(size_t count) {
+	const size_t len = sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf);
+	struct fuse_bufvec* bufv = reinterpret_cast<struct fuse_bufvec*>(calloc(1, len));
+	verify(bufv != nullptr);
+	bufv->count = count;
+	for(size_t i = 0; i < count; i += 1) { bufv->buf[i].fd = -1; }
+	return bufv;
+}
+
+void test_bufs(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".");
+	struct fuse_file_info fi;
+	open_path(fs, "/bufs", true, fi);
+
+	char data[1000];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = 'A' + i % 53; }
+	char expected[2000];
+	memset(expected, 0, sizeof(expected));
+
+	// Scattered memory, starting partway into the first buffer, gathered
+	// onto an unaligned offset across several blocks.
+	struct fuse_bufvec* scattered = new_bufvec(3);
+	scattered->buf[0].size = 100;
+	scattered->buf[0].mem = data;
+	scattered->buf[1].size = 37;
+	scattered->buf[1].mem = data + 300;
+	scattered->buf[2].size = 250;
+	scattered->buf[2].mem = data + 500;
+	scattered->off = 10;
+	verify(fangfs_write_buf(fs, scattered, 53, &fi) == 377);
+	memcpy(expected + 53, data + 10, 90);
+	memcpy(expected + 143, data + 300, 37);
+	memcpy(expected + 180, data + 500, 250);
+	free(scattered);
+
+	// Data still in a file descriptor, as when FUSE splices a request.
+	char spliced_path[] = "test-file-XXXXXX";
+	const int fd = mkstemp(spliced_path);
+	verify(fd >= 0);
+	verify(write(fd, data, sizeof(data)) == sizeof(data));
+	struct fuse_bufvec* spliced = new_bufvec(2);
+	spliced->buf[0].size = 300;
+	spliced->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	spliced->buf[0].fd = fd;
+	spliced->buf[0].pos = 20;
+	spliced->buf[1].size = 7;
+	spliced->buf[1].mem = data + 900;
+	verify(fangfs_write_buf(fs, spliced, 1001, &fi) == 307);
+	memcpy(expected + 1001, data + 20, 300);
+	memcpy(expected + 1301, data + 900, 7);
+	free(spliced);
+	close(fd);
+	unlink(spliced_path);
+
+	// Read back through the zero-copy path, from an unaligned offset.
+	struct fuse_bufvec* reply = nullptr;
+	verify(fangfs_read_buf(fs, &reply, sizeof(expected), 7, &fi) == 0);
+	verify(reply->count == 1);
+	verify(reply->buf[0].size == 1308 - 7);
+	verify(memcmp(reply->buf[0].mem, expected + 7, 1308 - 7) == 0);
+	free(reply->buf[0].mem);
+	free(reply);
+
+	verify(fangfs_close(fs, &fi) == 0);
+	verify(fangfs_unlink(fs, "/bufs") == 0);
+}
+
+/// SIGBUSes that reached the handler installed before the mapped read
+/// engine's.
+static volatile sig_atomic_t foreign_sigbus = 0;
+
+static void count_sigbus(int sig, siginfo_t* info, void* context) {
+	foreign_sigbus += 1;
+}
+
+void test_foreign_sigbus(void) {
+	do_test();
+
+	// test_mmap_engine() has put the engine's handler in front of ours. A
+	// fault outside a mapped read still reaches ours, every time, and the
+	// engine's handler stays in place.
+	struct sigaction before;
+	verify(sigaction(SIGBUS, nullptr, &before) == 0);
+	verify(before.sa_sigaction != count_sigbus);
+	raise(SIGBUS);
+	raise(SIGBUS);
+	verify(foreign_sigbus == 2);
+
+	struct sigaction after;
+	verify(sigaction(SIGBUS, nullptr, &after) == 0);
+	verify(after.sa_sigaction == before.sa_sigaction);
+}
+
+int main(void) {
+	// Stands in for a handler the rest of the process had in place before
+	// the mapped read engine came along.
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = count_sigbus;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	verify(sigaction(SIGBUS, &action, nullptr) == 0);
+
+	test_plaintext_size();
+	test_read_write();
+	test_truncate();
+	test_shared();
+	test_bufs();
+	test_tampering();
+	test_io_engines();
+	test_direct();
+	test_mmap_engine();
+	test_foreign_sigbus();
+	return 0;
+}
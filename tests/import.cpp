@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "test.h"
+#include "../src/check.h"
+#include "../src/file.h"
+#include "../src/importer.h"
+
+static std::string plain_dir;
+
+static std::vector<uint8_t> pattern(size_t len, uint8_t seed) {
+	std::vector<uint8_t> data(len);
+	for(size_t i = 0; i < len; i += 1) { data[i] = (i * 7 + seed) & 0xff; }
+	return data;
+}
+
+static void make_plain(const char* path, size_t len, mode_t mode) {
+	const std::string full = plain_dir + path;
+	const int fd = open(full.c_str(), O_WRONLY|O_CREAT|O_EXCL, mode);
+	verify(fd >= 0);
+	const std::vector<uint8_t> data = pattern(len, len & 0xff);
+	verify(write(fd, data.data(), len) == static_cast<ssize_t>(len));
+	close(fd);
+}
+
+/// Read path back through the core, and compare it against what
+/// make_plain() wrote.
+static void verify_imported(FangFS& fs, const char* path, size_t len) {
+	Buffer real_path;
+	path_resolve(fs, path, real_path);
+	const char* real_path_str = reinterpret_cast<char*>(real_path.buf);
+	const int fd = open(real_path_str, O_RDWR);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, real_path_str);
+	verify(file != nullptr);
+	verify(file->state->size == static_cast<off_t>(len));
+
+	std::vector<uint8_t> out(len + 1);
+	verify(fang_file_read(*file, 0, out.size(), out.data()) == static_cast<int>(len));
+	out.resize(len);
+	verify(out == pattern(len, len & 0xff));
+	verify(fang_file_close(file) == 0);
+}
+
+static ImportStats run(FangFS& fs, const char* to, std::vector<std::string>* failed) {
+	ImportOptions options;
+	options.threads = 3;
+	options.on_error = [failed](const char* path, int error) {
+		if(failed != nullptr) { failed->push_back(path); }
+	};
+
+	ImportStats stats;
+	verify(import_run(fs, plain_dir.c_str(), to, options, stats) == 0);
+	return stats;
+}
+
+void test_import(FangFS& fs) {
+	do_test();
+
+	const size_t payload = fang_block_payload(fs);
+	const ImportStats stats = run(fs, "/", nullptr);
+	verify(stats.errors == 0);
+	verify(stats.dirs == 3);
+	verify(stats.files == 5);
+	verify(stats.skipped == 1);
+	verify(stats.bytes == 1 + payload + payload + 1 + 1500000);
+
+	verify_imported(fs, "/empty", 0);
+	verify_imported(fs, "/one", 1);
+	verify_imported(fs, "/sub/exact", payload);
+	verify_imported(fs, "/sub/deep/over", payload + 1);
+	verify_imported(fs, "/big", 1500000);
+
+	// Permissions and times come along.
+	Buffer real_path;
+	path_resolve(fs, "/one", real_path);
+	struct stat imported;
+	struct stat original;
+	verify(stat(reinterpret_cast<char*>(real_path.buf), &imported) == 0);
+	verify(stat((plain_dir + "/one").c_str(), &original) == 0);
+	verify((imported.st_mode & 07777) == 0640);
+	verify(imported.st_mtim.tv_sec == original.st_mtim.tv_sec);
+	verify(imported.st_mtim.tv_nsec == original.st_mtim.tv_nsec);
+
+	// And the result is exactly what the mount would have written.
+	CheckOptions check_options;
+	CheckStats check_stats;
+	verify(check_run(fs, check_options, check_stats) == 0);
+	verify(check_stats.problems == 0);
+	verify(check_stats.files == 5);
+}
+
+void test_existing(FangFS& fs) {
+	do_test();
+
+	// Directories merge, but files are never overwritten.
+	std::vector<std::string> failed;
+	const ImportStats stats = run(fs, "/", &failed);
+	verify(stats.errors == 5);
+	verify(stats.files == 0);
+	verify(failed.size() == 5);
+	verify_imported(fs, "/big", 1500000);
+}
+
+void test_subdir(FangFS& fs) {
+	do_test();
+
+	const ImportStats stats = run(fs, "/sub/deep", nullptr);
+	verify(stats.errors == 0);
+	verify(stats.files == 5);
+	verify_imported(fs, "/sub/deep/sub/deep/over", fang_block_payload(fs) + 1);
+	verify_imported(fs, "/sub/deep/big", 1500000);
+
+	// The destination must already exist.
+	ImportOptions options;
+	ImportStats missing;
+	verify(import_run(fs, plain_dir.c_str(), "/nowhere", options, missing) < 0);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-import-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+	plain_dir = std::string(dir) + "/plain";
+	const std::string cipher_dir = std::string(dir) + "/cipher";
+	verify(mkdir(plain_dir.c_str(), 0700) == 0);
+	verify(mkdir(cipher_dir.c_str(), 0700) == 0);
+
+	FangFS fs;
+	test_init_fs(fs, cipher_dir.c_str());
+	const size_t payload = fang_block_payload(fs);
+
+	verify(mkdir((plain_dir + "/sub").c_str(), 0750) == 0);
+	verify(mkdir((plain_dir + "/sub/deep").c_str(), 0700) == 0);
+	make_plain("/empty", 0, 0600);
+	make_plain("/one", 1, 0640);
+	make_plain("/sub/exact", payload, 0600);
+	make_plain("/sub/deep/over", payload + 1, 0600);
+	make_plain("/big", 1500000, 0600);
+	verify(symlink("one", (plain_dir + "/link").c_str()) == 0);
+
+	test_import(fs);
+	test_existing(fs);
+	test_subdir(fs);
+
+	const std::string cleanup = std::string("rm -rf ") + dir;
+	verify(system(cleanup.c_str()) == 0);
+	return 0;
+}
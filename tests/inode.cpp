@@ -0,0 +1,102 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/inode.h"
+
+static FangInode* ref(InodeTable& table, FangInode& parent, const char* name) {
+	struct stat info;
+	verify(fstatat(parent.fd, name, &info, 0) == 0);
+	return inode_ref_child(table, parent, name, name, info);
+}
+
+void test_lookup_counts(const char* root) {
+	do_test();
+
+	InodeTable table;
+	verify(inode_table_init(table, root) == 0);
+	verify(inode_get(table, FUSE_ROOT_ID) == table.root);
+
+	verify(mkdirat(table.root->fd, "dir", 0700) == 0);
+	int fd = openat(table.root->fd, "file", O_CREAT|O_WRONLY, 0600);
+	verify(fd >= 0);
+	close(fd);
+
+	FangInode* file = ref(table, *table.root, "file");
+	verify(file != nullptr);
+	verify(file->fd < 0);
+	verify(strcmp(file->path, "/file") == 0);
+
+	// Repeated lookups hand out the same number
+	const fuse_ino_t file_ino = file->ino;
+	verify(ref(table, *table.root, "file") == file);
+	verify(file->nlookup == 2);
+
+	inode_forget(table, file_ino, 1);
+	verify(inode_get(table, file_ino) == file);
+	inode_forget(table, file_ino, 1);
+	verify(inode_get(table, file_ino) == nullptr);
+
+	// A directory stays alive while it has children, even once forgotten
+	FangInode* dir = ref(table, *table.root, "dir");
+	verify(dir->fd >= 0);
+	fd = openat(dir->fd, "child", O_CREAT|O_WRONLY, 0600);
+	verify(fd >= 0);
+	close(fd);
+
+	FangInode* child = ref(table, *dir, "child");
+	verify(strcmp(child->path, "/dir/child") == 0);
+	const fuse_ino_t dir_ino = dir->ino;
+	const fuse_ino_t child_ino = child->ino;
+
+	inode_forget(table, dir_ino, 1);
+	verify(inode_get(table, dir_ino) == dir);
+	inode_forget(table, child_ino, 1);
+	verify(inode_get(table, child_ino) == nullptr);
+	verify(inode_get(table, dir_ino) == nullptr);
+
+	// The root is never released
+	inode_forget(table, FUSE_ROOT_ID, 100);
+	verify(inode_get(table, FUSE_ROOT_ID) == table.root);
+
+	unlinkat(table.root->fd, "dir/child", 0);
+	unlinkat(table.root->fd, "dir", AT_REMOVEDIR);
+	unlinkat(table.root->fd, "file", 0);
+	inode_table_free(table);
+}
+
+void test_unlink_backing(const char* root) {
+	do_test();
+
+	InodeTable table;
+	verify(inode_table_init(table, root) == 0);
+
+	int fd = openat(table.root->fd, "file", O_CREAT|O_WRONLY, 0600);
+	verify(fd >= 0);
+	close(fd);
+
+	FangInode* file = ref(table, *table.root, "file");
+	inode_unlink_backing(table, file->backing_dev, file->backing_ino);
+
+	// After the backing file is replaced, a lookup must not return the old
+	// inode even if the backing inode number is reused.
+	FangInode* replacement = ref(table, *table.root, "file");
+	verify(replacement != file);
+	verify(inode_get(table, file->ino) == file);
+
+	unlinkat(table.root->fd, "file", 0);
+	inode_table_free(table);
+}
+
+int main(void) {
+	char root[] = "test-inode-XXXXXX";
+	verify(mkdtemp(root) != nullptr);
+
+	test_lookup_counts(root);
+	test_unlink_backing(root);
+
+	rmdir(root);
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/file.h"
+#include "../src/journal.h"
+#include "../src/util.h"
+
+static void init_fs(FangFS& fs, char* source) {
+	verify(mkdtemp(source) != nullptr);
+	test_init_fs(fs, source);
+}
+
+static FangFile* open_file(FangFS& fs, const char* name, Buffer& path) {
+	path_join(fs.source, name, path);
+	const char* path_str = reinterpret_cast<char*>(path.buf);
+	int fd = open(path_str, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, path_str);
+	verify(file != nullptr);
+	verify(strcmp(file->journal_path, name) == 0);
+	verify(fang_file_note_created(*file) == 0);
+	return file;
+}
+
+/// Drop the log without checkpointing it, as a crash would.
+static void crash(Journal& journal) {
+	close(journal.fd);
+	close(journal.source_fd);
+}
+
+static void remove_fs(FangFS& fs, const char* name) {
+	Buffer path;
+	path_join(fs.source, name, path);
+	unlink(reinterpret_cast<char*>(path.buf));
+	path_join(fs.source, JOURNAL_NAME, path);
+	unlink(reinterpret_cast<char*>(path.buf));
+	rmdir(fs.source);
+}
+
+void test_torn_block(void) {
+	do_test();
+
+	char source[] = "journal-test-XXXXXX";
+	FangFS fs;
+	init_fs(fs, source);
+
+	Journal journal;
+	verify(journal_open(journal, fs) == 0);
+	fs.journal = &journal;
+
+	Buffer path;
+	FangFile* file = open_file(fs, "file", path);
+
+	uint8_t data[300];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = (i * 3) & 0xff; }
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+	verify(fang_file_sync(*file, 1) == 0);
+	verify(journal.synced_lsn >= file->journal_lsn);
+
+	// Tear the second block
+	uint8_t garbage[64];
+	memset(garbage, 0x5a, sizeof(garbage));
+	verify(pwrite(file->fd, garbage, sizeof(garbage), 128 + 10) == sizeof(garbage));
+	verify(fang_file_close(file) == 0);
+
+	crash(journal);
+	fs.journal = nullptr;
+	verify(journal_recover(fs) == 0);
+
+	const int fd = open(reinterpret_cast<char*>(path.buf), O_RDWR);
+	verify(fd >= 0);
+	file = fang_file_open(fs, fd, reinterpret_cast<char*>(path.buf));
+	verify(file != nullptr);
+
+	uint8_t out[300];
+	verify(fang_file_read(*file, 0, sizeof(out), out) == sizeof(data));
+	verify(memcmp(out, data, sizeof(data)) == 0);
+	verify(fang_file_close(file) == 0);
+
+	// Recovery empties the log
+	Buffer journal_path;
+	path_join(fs.source, JOURNAL_NAME, journal_path);
+	struct stat info;
+	verify(stat(reinterpret_cast<char*>(journal_path.buf), &info) == 0);
+	verify(info.st_size == 0);
+
+	remove_fs(fs, "file");
+}
+
+void test_replay_truncate(void) {
+	do_test();
+
+	char source[] = "journal-test-XXXXXX";
+	FangFS fs;
+	init_fs(fs, source);
+
+	Journal journal;
+	verify(journal_open(journal, fs) == 0);
+	fs.journal = &journal;
+
+	Buffer path;
+	FangFile* file = open_file(fs, "file", path);
+
+	uint8_t data[300];
+	memset(data, 'q', sizeof(data));
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+	verify(fang_file_truncate(*file, 100) == 0);
+	verify(fang_file_sync(*file, 1) == 0);
+
+	// Undo the shrink behind the log's back; replay must redo it.
+	verify(ftruncate(file->fd, 3 * 128) == 0);
+	verify(fang_file_close(file) == 0);
+
+	crash(journal);
+	fs.journal = nullptr;
+	verify(journal_recover(fs) == 0);
+
+	struct stat info;
+	verify(stat(reinterpret_cast<char*>(path.buf), &info) == 0);
+	verify(fang_file_plaintext_size(fs, info.st_size) == 100);
+
+	remove_fs(fs, "file");
+}
+
+void test_checkpoint(void) {
+	do_test();
+
+	char source[] = "journal-test-XXXXXX";
+	FangFS fs;
+	init_fs(fs, source);
+
+	Journal journal;
+	verify(journal_open(journal, fs) == 0);
+	fs.journal = &journal;
+
+	Buffer path;
+	FangFile* file = open_file(fs, "file", path);
+	uint8_t data[200];
+	memset(data, 'z', sizeof(data));
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+	verify(fang_file_close(file) == 0);
+
+	// A clean shutdown leaves nothing to replay.
+	journal_close(journal);
+	fs.journal = nullptr;
+
+	Buffer journal_path;
+	path_join(fs.source, JOURNAL_NAME, journal_path);
+	struct stat info;
+	verify(stat(reinterpret_cast<char*>(journal_path.buf), &info) == 0);
+	verify(info.st_size == 0);
+
+	remove_fs(fs, "file");
+}
+
+void test_checkpoint_batch(void) {
+	do_test();
+
+	char source[] = "journal-test-XXXXXX";
+	FangFS fs;
+	verify(mkdtemp(source) != nullptr);
+	test_init_fs(fs, source, 64 * 1024);
+	fs.io_engine = FANGFS_IO_URING;
+
+	Journal journal;
+	verify(journal_open(journal, fs) == 0);
+	fs.journal = &journal;
+
+	Buffer path;
+	FangFile* file = open_file(fs, "file", path);
+
+	// One batch of whole blocks that carries the log past the checkpoint
+	// size, then another that has to checkpoint it first. A batch that
+	// checkpoints while its own records are in flight never returns.
+	const size_t payload = fang_block_payload(fs);
+	const size_t len = (JOURNAL_CHECKPOINT_SIZE / payload + 2) * payload;
+	uint8_t* data = new uint8_t[len];
+	for(size_t i = 0; i < len; i += 1) { data[i] = (i * 7 + i / 4096) & 0xff; }
+
+	alarm(120);
+	verify(fang_file_write(*file, 0, len, data) == static_cast<int>(len));
+	verify(journal.size >= JOURNAL_CHECKPOINT_SIZE);
+	verify(fang_file_write(*file, len, payload * 3, data) == static_cast<int>(payload * 3));
+	alarm(0);
+	verify(journal.lsn_base >= JOURNAL_CHECKPOINT_SIZE);
+	verify(journal.size < JOURNAL_CHECKPOINT_SIZE);
+
+	uint8_t* out = new uint8_t[payload * 3];
+	verify(fang_file_read(*file, len, payload * 3, out) == static_cast<int>(payload * 3));
+	verify(memcmp(out, data, payload * 3) == 0);
+	verify(fang_file_read(*file, len - payload, payload, out) == static_cast<int>(payload));
+	verify(memcmp(out, data + len - payload, payload) == 0);
+
+	delete[] out;
+	delete[] data;
+	verify(fang_file_close(file) == 0);
+	journal_close(journal);
+	fs.journal = nullptr;
+	remove_fs(fs, "file");
+}
+
+int main(void) {
+	test_torn_block();
+	test_replay_truncate();
+	test_checkpoint();
+	test_checkpoint_batch();
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include "test.h"
+#include "../src/log.h"
+
+/// Read back everything logged to the capture file so far.
+static std::string captured(void) {
+	fflush(stderr);
+	FILE* f = fopen("test-log", "r");
+	verify(f != nullptr);
+
+	std::string text;
+	char buf[256];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		text.append(buf, n);
+	}
+	fclose(f);
+	return text;
+}
+
+static size_t count_of(const std::string& text, const std::string& needle) {
+	size_t count = 0;
+	for(size_t i = text.find(needle); i != std::string::npos; i = text.find(needle, i + 1)) {
+		count += 1;
+	}
+	return count;
+}
+
+void test_parse_level(void) {
+	do_test();
+
+	LogLevel level;
+	verify(log_parse_level("error", &level) == 0 && level == LOG_LEVEL_ERROR);
+	verify(log_parse_level("warn", &level) == 0 && level == LOG_LEVEL_WARN);
+	verify(log_parse_level("debug", &level) == 0 && level == LOG_LEVEL_DEBUG);
+	verify(log_parse_level("verbose", &level) < 0);
+}
+
+void test_sync(void) {
+	do_test();
+
+	log_set_level(LOG_LEVEL_INFO);
+	log_error("error %d", 1);
+	log_info("info %d", 2);
+	log_set_level(LOG_LEVEL_WARN);
+	log_info("info %d", 3);
+
+	// Arguments to filtered messages are never evaluated.
+	int evaluated = 0;
+	log_debug("debug %d", evaluated += 1);
+	verify(evaluated == 0);
+
+	const std::string text = captured();
+	verify(count_of(text, "error 1\n") == 1);
+	verify(count_of(text, "info 2\n") == 1);
+	verify(count_of(text, "info 3") == 0);
+	log_set_level(LOG_LEVEL_INFO);
+}
+
+void test_async(void) {
+	do_test();
+
+	log_start();
+
+	std::thread threads[4];
+	for(size_t i = 0; i < 4; i += 1) {
+		threads[i] = std::thread([i]() {
+			for(int j = 0; j < 10; j += 1) {
+				log_info("thread %zu message %d", i, j);
+			}
+		});
+	}
+	for(size_t i = 0; i < 4; i += 1) {
+		threads[i].join();
+	}
+	log_info("main message");
+
+	// Everything queued is written out by the time log_stop() returns,
+	// including what threads that have since exited logged.
+	log_stop();
+	verify(log_dropped() == 0);
+
+	const std::string text = captured();
+	verify(count_of(text, "thread ") == 40);
+	verify(count_of(text, "thread 3 message 9\n") == 1);
+	verify(count_of(text, "main message\n") == 1);
+
+	// Back to writing straight away.
+	log_info("after stop");
+	verify(count_of(captured(), "after stop\n") == 1);
+}
+
+void test_truncate(void) {
+	do_test();
+
+	const std::string long_name(1000, 'x');
+	log_info("long %s", long_name.c_str());
+	const std::string text = captured();
+	verify(count_of(text, "long xxx") == 1);
+	verify(text.find(long_name) == std::string::npos);
+}
+
+int main(void) {
+	if(freopen("test-log", "w", stderr) == nullptr) { return 1; }
+
+	test_parse_level();
+	test_sync();
+	test_async();
+	test_truncate();
+
+	unlink("test-log");
+	return 0;
+}
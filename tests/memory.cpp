@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "test.h"
+#include "../src/file.h"
+#include "../src/memory.h"
+#include "../src/stats.h"
+
+static size_t used(MemoryUser user) {
+	MemoryUsage usage;
+	memory_usage(usage);
+	return usage.users[user];
+}
+
+/// Stands in for a cache: holds some bytes, and gives back what it is asked.
+static size_t held = 0;
+
+static size_t shrink_held(void* arg, size_t goal) {
+	const size_t freed = std::min(goal, held);
+	held -= freed;
+	memory_release(MEM_RESIDENT_FILES, freed);
+	*reinterpret_cast<int*>(arg) += 1;
+	return freed;
+}
+
+void test_budget(void) {
+	do_test();
+
+	// Without a budget, anything goes.
+	verify(memory_reserve(MEM_RESIDENT_FILES, SIZE_MAX / 4));
+	memory_release(MEM_RESIDENT_FILES, SIZE_MAX / 4);
+
+	memory_set_budget(1 << 20);
+	verify(memory_reserve(MEM_RESIDENT_FILES, 600 << 10));
+	verify(!memory_reserve(MEM_DIR_INDEXES, 600 << 10));
+	verify(used(MEM_DIR_INDEXES) == 0);
+
+	// Charges go past it regardless.
+	memory_charge(MEM_FILE_BUFFERS, 600 << 10);
+	MemoryUsage usage;
+	memory_usage(usage);
+	verify(usage.budget == 1 << 20);
+	verify(usage.total == 1200 << 10);
+	verify(usage.users[MEM_RESIDENT_FILES] == 600 << 10);
+	verify(usage.users[MEM_FILE_BUFFERS] == 600 << 10);
+	verify(!memory_reserve(MEM_RESIDENT_FILES, 0));
+
+	memory_adjust(MEM_FILE_BUFFERS, 600 << 10, 100 << 10);
+	verify(used(MEM_FILE_BUFFERS) == 100 << 10);
+	memory_release(MEM_FILE_BUFFERS, 100 << 10);
+	memory_release(MEM_RESIDENT_FILES, 600 << 10);
+	verify(memory_reserve(MEM_DIR_INDEXES, 1 << 20));
+	memory_release(MEM_DIR_INDEXES, 1 << 20);
+	memory_set_budget(0);
+
+	// Refusals are counted.
+	Buffer text;
+	stats_format(text);
+	verify(strstr(reinterpret_cast<char*>(text.buf), "\nmemory_refused\t2\n") != nullptr);
+	verify(strstr(reinterpret_cast<char*>(text.buf), "\ndir_indexes\t0\n") != nullptr);
+}
+
+void test_shrinkers(void) {
+	do_test();
+
+	int calls = 0;
+	memory_register_shrinker(MEM_RESIDENT_FILES, shrink_held, &calls);
+	held = 300;
+	memory_charge(MEM_RESIDENT_FILES, held);
+
+	verify(memory_shrink(100) == 100);
+	verify(used(MEM_RESIDENT_FILES) == 200);
+	verify(memory_shrink(SIZE_MAX) == 200);
+	verify(used(MEM_RESIDENT_FILES) == 0);
+	verify(calls == 2);
+
+	memory_unregister_shrinker(MEM_RESIDENT_FILES);
+	verify(memory_shrink(SIZE_MAX) == 0);
+	verify(calls == 2);
+}
+
+void test_file_buffers(void) {
+	do_test();
+
+	FangFS fs;
+	test_init_fs(fs, ".", 4096);
+
+	char path[] = "test-memory-XXXXXX";
+	const int fd = mkstemp(path);
+	verify(fd >= 0);
+	FangFile* file = fang_file_open(fs, fd, path);
+	verify(file != nullptr);
+
+	uint8_t data[10000];
+	for(size_t i = 0; i < sizeof(data); i += 1) { data[i] = i * 7; }
+	verify(fang_file_write(*file, 0, sizeof(data), data) == sizeof(data));
+	const size_t charged = used(MEM_FILE_BUFFERS);
+	verify(charged > 0);
+	verify(charged == file->charged + file->state->charged);
+
+	// A handle in use keeps its buffers.
+	file->state->lock.lock();
+	verify(fang_file_shrink(nullptr, SIZE_MAX) == 0);
+	file->state->lock.unlock();
+
+	verify(fang_file_shrink(nullptr, SIZE_MAX) == charged);
+	verify(used(MEM_FILE_BUFFERS) == 0);
+	verify(file->state->tail_block_n == -1);
+
+	// They are set up again as needed.
+	uint8_t out[sizeof(data)];
+	verify(fang_file_read(*file, 0, sizeof(out), out) == sizeof(out));
+	verify(memcmp(out, data, sizeof(data)) == 0);
+	verify(used(MEM_FILE_BUFFERS) > 0);
+
+	verify(fang_file_close(file) == 0);
+	verify(used(MEM_FILE_BUFFERS) == 0);
+	unlink(path);
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	test_budget();
+	test_shrinkers();
+	test_file_buffers();
+	return 0;
+}
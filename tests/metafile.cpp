@@ -1,7 +1,29 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sodium.h>
 #include "test.h"
+#include "../src/codec.h"
+#include "../src/keycache.h"
 #include "../src/metafile.h"
+#include "../src/stats.h"
+#include "../src/error.h"
+
+#define TEST_OPSLIMIT crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_MIN
+#define TEST_MEMLIMIT crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN
+
+/// How many times the KDF has run, from the statistics.
+static unsigned long long keys_derived(void) {
+	Buffer text;
+	stats_format(text);
+	const char* line = strstr(reinterpret_cast<const char*>(text.buf), "\nkeys_derived\t");
+	unsigned long long count = 0;
+	verify(line != nullptr && sscanf(line, "\nkeys_derived\t%llu", &count) == 1);
+	return count;
+}
 
 void test_field(void) {
 	do_test();
@@ -15,6 +37,8 @@ void test_field(void) {
 
 	field.opslimit = 513;
 	field.memlimit = 513;
+	memset(field.salt, 2, sizeof(field.salt));
+	memset(field.key_id, 3, sizeof(field.key_id));
 	memcpy(field.nonce, nonce, sizeof(nonce));
 	memcpy(field.encrypted_key, encrypted_key, sizeof(encrypted_key));
 
@@ -26,6 +50,8 @@ void test_field(void) {
 	const uint8_t rightbuf[META_FIELD_LEN] = {
 	    0x01, 0x02, 0x00, 0x00,
 	    0x01, 0x02, 0x00, 0x00,
+	    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
 	    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
 
@@ -34,12 +60,268 @@ void test_field(void) {
 	// Test parse
 	{
 		Metafield field2;
-		metafield_parse(field2, buf);
+		metafield_parse(field2, buf, FANGFS_META_VERSION);
 		verify(memcmp(&field, &field2, sizeof(field)) == 0);
 	}
 }
 
+void test_field_v0(void) {
+	do_test();
+
+	// Version 0 fields lack the salt and ID
+	uint8_t buf[META_FIELD_V0_LEN];
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 7;
+	buf[4] = 9;
+	memset(buf + 8 + crypto_secretbox_NONCEBYTES, 1, buf + sizeof(buf) - (buf + 8 + crypto_secretbox_NONCEBYTES));
+	verify(metafield_len(0) == META_FIELD_V0_LEN);
+
+	Metafield field;
+	memset(&field, 0xff, sizeof(field));
+	metafield_parse(field, buf, 0);
+	verify(field.opslimit == 7);
+	verify(field.memlimit == 9);
+	for(size_t i = 0; i < sizeof(field.salt); i += 1) { verify(field.salt[i] == 0); }
+	for(size_t i = 0; i < sizeof(field.key_id); i += 1) { verify(field.key_id[i] == 0); }
+	for(size_t i = 0; i < sizeof(field.encrypted_key); i += 1) { verify(field.encrypted_key[i] == 1); }
+}
+
+void test_unlock(void) {
+	do_test();
+
+	char source[] = "metafile-test-XXXXXX";
+	verify(mkdtemp(source) != nullptr);
+
+	uint8_t master_key[crypto_secretbox_KEYBYTES];
+	randombytes_buf(master_key, sizeof(master_key));
+
+	// More keys than the old fixed limit of eight
+	{
+		Metafile metafile;
+		verify(metafile_init(metafile, source) == 0);
+		char name[16];
+		char passphrase[16];
+		for(int i = 0; i < 12; i += 1) {
+			snprintf(name, sizeof(name), "user%d", i);
+			snprintf(passphrase, sizeof(passphrase), "secret%d", i);
+			verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, name,
+			                        passphrase, strlen(passphrase), master_key) == 0);
+		}
+		verify(metafile_write(metafile) == 0);
+		metafile_free(metafile);
+	}
+
+	Metafile metafile;
+	verify(metafile_init(metafile, source) == 1);
+	verify(metafile.version == FANGFS_META_VERSION);
+	verify(metafile.n_keys == 12);
+
+	// Each field is tagged with its own name
+	uint8_t key_id[METAFIELD_ID_LEN];
+	metafield_key_id(metafile.keys[10], "user10", key_id);
+	verify(memcmp(key_id, metafile.keys[10].key_id, sizeof(key_id)) == 0);
+	metafield_key_id(metafile.keys[10], "user9", key_id);
+	verify(memcmp(key_id, metafile.keys[10].key_id, sizeof(key_id)) != 0);
+
+	uint8_t out[crypto_secretbox_KEYBYTES];
+	memset(out, 0, sizeof(out));
+	verify(metafile_unlock(metafile, "user10", "secret10", 8, 0, out) == 0);
+	verify(memcmp(out, master_key, sizeof(out)) == 0);
+
+	// A wrong name only costs time
+	memset(out, 0, sizeof(out));
+	verify(metafile_unlock(metafile, "nobody", "secret3", 7, 0, out) == 0);
+	verify(memcmp(out, master_key, sizeof(out)) == 0);
+
+	// A wrong passphrase only costs the one field named for it
+	const unsigned long long derived = keys_derived();
+	verify(metafile_unlock(metafile, "user3", "wrong", 5, 0, out) == STATUS_KEY_REJECTED);
+	verify(keys_derived() == derived + 1);
+
+	// Nothing was cached along the way
+	verify(metafile_unlock_cached(metafile, "user3", out) == STATUS_KEY_REJECTED);
+
+	// Remounting within the cache window skips the passphrase entirely
+	verify(metafile_unlock(metafile, "user4", "secret4", 7, 60, out) == 0);
+	uint8_t child_key[crypto_secretbox_KEYBYTES];
+	if(keycache_get(metafile.keys[4], child_key)) {
+		memset(out, 0, sizeof(out));
+		verify(metafile_unlock_cached(metafile, "user4", out) == 0);
+		verify(memcmp(out, master_key, sizeof(out)) == 0);
+
+		// A cached key that no longer fits is thrown away
+		metafile.keys[4].nonce[0] ^= 1;
+		verify(metafile_unlock_cached(metafile, "user4", out) == STATUS_KEY_REJECTED);
+		verify(!keycache_get(metafile.keys[4], child_key));
+	}
+
+	metafile_free(metafile);
+
+	Buffer path;
+	path_join(source, METAFILE_NAME, path);
+	unlink(reinterpret_cast<char*>(path.buf));
+	rmdir(source);
+}
+
+void test_rotate(void) {
+	do_test();
+
+	char source[] = "metafile-test-XXXXXX";
+	verify(mkdtemp(source) != nullptr);
+
+	uint8_t master_key[crypto_secretbox_KEYBYTES];
+	uint8_t next_key[crypto_secretbox_KEYBYTES];
+	randombytes_buf(master_key, sizeof(master_key));
+	randombytes_buf(next_key, sizeof(next_key));
+
+	{
+		Metafile metafile;
+		verify(metafile_init(metafile, source) == 0);
+		verify(!metafile.rotating);
+		verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "alice",
+		                        "secret1", 7, master_key) == 0);
+		verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "bob",
+		                        "secret2", 7, master_key) == 0);
+
+		uint8_t out[crypto_secretbox_KEYBYTES];
+		// Alice would lose her access, so that has to be asked for.
+		verify(metafile_rotate(metafile, "bob", "secret2", 7, 0, false, next_key, out) ==
+		       STATUS_CHECK_ERRNO && errno == EEXIST);
+		verify(!metafile.rotating && metafile.n_keys == 2);
+
+		verify(metafile_rotate(metafile, "bob", "wrong", 5, 0, true, next_key, out) ==
+		       STATUS_KEY_REJECTED);
+		verify(!metafile.rotating && metafile.n_keys == 2);
+
+		verify(metafile_rotate(metafile, "bob", "secret2", 7, 0, true, next_key, out) == 0);
+		verify(memcmp(out, master_key, sizeof(out)) == 0);
+		metafile.compression = CODEC_ZSTD;
+		verify(metafile_write(metafile) == 0);
+		metafile_free(metafile);
+	}
+
+	Metafile metafile;
+	verify(metafile_init(metafile, source) == 1);
+	verify(metafile.version == FANGFS_META_VERSION);
+	verify(metafile.rotating);
+	verify(metafile.compression == CODEC_ZSTD);
+
+	// Only the key that started the rotation is left, and it opens the new
+	// master key, which opens the old one.
+	verify(metafile.n_keys == 1);
+	uint8_t out[crypto_secretbox_KEYBYTES];
+	verify(metafile_unlock(metafile, "alice", "secret1", 7, 0, out) == STATUS_KEY_REJECTED);
+	verify(metafile_unlock(metafile, "bob", "secret2", 7, 0, out) == 0);
+	verify(memcmp(out, next_key, sizeof(out)) == 0);
+
+	uint8_t previous_key[crypto_secretbox_KEYBYTES];
+	verify(metafile_previous_key(metafile, out, previous_key) == 0);
+	verify(memcmp(previous_key, master_key, sizeof(previous_key)) == 0);
+	verify(metafile_previous_key(metafile, master_key, previous_key) == STATUS_TAMPERING);
+
+	// Finishing drops the previous key again.
+	metafile.rotating = false;
+	verify(metafile_write(metafile) == 0);
+	metafile_free(metafile);
+	verify(metafile_init(metafile, source) == 1);
+	verify(!metafile.rotating && metafile.n_keys == 1);
+	verify(metafile.compression == CODEC_ZSTD);
+	metafile_free(metafile);
+
+	Buffer path;
+	path_join(source, METAFILE_NAME, path);
+	unlink(reinterpret_cast<char*>(path.buf));
+	rmdir(source);
+}
+
+void test_write_atomic(void) {
+	do_test();
+
+	char source[] = "metafile-test-XXXXXX";
+	verify(mkdtemp(source) != nullptr);
+	Buffer path;
+	path_join(source, METAFILE_NAME, path);
+	const char* metapath = reinterpret_cast<char*>(path.buf);
+	Buffer temp;
+	path_join(source, METAFILE_TEMP, temp);
+	const char* temppath = reinterpret_cast<char*>(temp.buf);
+
+	uint8_t master_key[crypto_secretbox_KEYBYTES];
+	randombytes_buf(master_key, sizeof(master_key));
+
+	Metafile metafile;
+	verify(metafile_init(metafile, source) == 0);
+	verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "alice",
+	                        "secret1", 7, master_key) == 0);
+	verify(metafile_write(metafile) == 0);
+
+	// The metafile is replaced rather than rewritten, and the descriptor
+	// follows it.
+	struct stat before;
+	verify(stat(metapath, &before) == 0);
+	verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "bob",
+	                        "secret2", 7, master_key) == 0);
+	verify(metafile_write(metafile) == 0);
+	struct stat after;
+	struct stat open_info;
+	verify(stat(metapath, &after) == 0);
+	verify(fstat(metafile.metafd, &open_info) == 0);
+	verify(after.st_ino != before.st_ino);
+	verify(open_info.st_ino == after.st_ino);
+	verify(access(temppath, F_OK) != 0);
+
+	// A write that can't finish leaves the old metafile whole.
+	verify(mkdir(temppath, 0700) == 0);
+	verify(metafile_new_key(metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "carol",
+	                        "secret3", 7, master_key) == 0);
+	verify(metafile_write(metafile) < 0);
+	verify(stat(metapath, &before) == 0);
+	verify(before.st_ino == after.st_ino && before.st_size == after.st_size);
+	metafile_free(metafile);
+	rmdir(temppath);
+
+	verify(metafile_init(metafile, source) == 1);
+	verify(metafile.n_keys == 2);
+	uint8_t out[crypto_secretbox_KEYBYTES];
+	verify(metafile_unlock(metafile, "bob", "secret2", 7, 0, out) == 0);
+	verify(memcmp(out, master_key, sizeof(out)) == 0);
+	metafile_free(metafile);
+
+	unlink(metapath);
+	rmdir(source);
+}
+
+void test_calibrate(void) {
+	do_test();
+
+	const size_t ceiling = 32 * 1024 * 1024;
+
+	KdfParams fast;
+	verify(kdf_calibrate(0.05, ceiling, fast) == 0);
+	verify(fast.memlimit >= TEST_MEMLIMIT && fast.memlimit <= ceiling);
+	verify(fast.opslimit >= TEST_OPSLIMIT);
+	verify(fast.seconds > 0);
+
+	KdfParams slow;
+	verify(kdf_calibrate(0.4, ceiling, slow) == 0);
+	verify(slow.memlimit >= fast.memlimit && slow.memlimit <= ceiling);
+	verify(slow.opslimit > fast.opslimit);
+
+	// Timing is noisy, so only insist on the right ballpark.
+	verify(slow.seconds > 0.4 / 4 && slow.seconds < 0.4 * 4);
+
+	// Without a ceiling to stop it, memory grows along with the work.
+	KdfParams roomy;
+	verify(kdf_calibrate(0.4, 1024 * 1024 * 1024, roomy) == 0);
+	verify(roomy.memlimit >= slow.memlimit);
+}
+
 int main(void) {
 	test_field();
+	test_field_v0();
+	test_unlock();
+	test_rotate();
+	test_write_atomic();
+	test_calibrate();
 	return 0;
 }
@@ -0,0 +1,316 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include "test.h"
+#include "../src/check.h"
+#include "../src/exporter.h"
+#include "../src/file.h"
+#include "../src/pack.h"
+#include "../src/util.h"
+
+#define TEST_THRESHOLD 256
+
+static std::string scratch;
+static std::string source;
+
+/// Plaintext path to contents.
+static std::map<std::string, std::string> tree;
+
+static std::string contents(size_t len, char seed) {
+	std::string data(len, '\0');
+	for(size_t i = 0; i < len; i += 1) { data[i] = static_cast<char>(seed + i * 7); }
+	return data;
+}
+
+static void write_file(FangFS& fs, const std::string& path, const std::string& data) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR|O_TRUNC;
+	verify(fangfs_create(fs, path.c_str(), 0640, &fi) == 0);
+	if(!data.empty()) {
+		verify(fangfs_write(fs, data.data(), data.size(), 0, &fi) ==
+		       static_cast<int>(data.size()));
+	}
+	verify(fangfs_close(fs, &fi) == 0);
+	tree[path] = data;
+}
+
+static int read_file(FangFS& fs, const std::string& path, std::string& data) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	const int status = fangfs_open(fs, path.c_str(), &fi);
+	if(status < 0) { return status; }
+
+	data.clear();
+	char buf[100];
+	int n;
+	while((n = fangfs_read(fs, buf, sizeof(buf), data.size(), &fi)) > 0) {
+		data.append(buf, n);
+	}
+	verify(fangfs_close(fs, &fi) == 0);
+	return n;
+}
+
+static void check_tree(FangFS& fs) {
+	for(const auto& entry: tree) {
+		std::string data;
+		verify(read_file(fs, entry.first, data) == 0);
+		verify(data == entry.second);
+
+		struct stat info;
+		verify(fangfs_getattr(fs, entry.first.c_str(), &info) == 0);
+		verify(S_ISREG(info.st_mode));
+		verify((info.st_mode & 07777) == 0640);
+		verify(info.st_size == static_cast<off_t>(entry.second.size()));
+	}
+}
+
+static std::string resolve(FangFS& fs, const char* path) {
+	Buffer real_path;
+	path_resolve(fs, path, real_path);
+	return reinterpret_cast<char*>(real_path.buf);
+}
+
+static bool packed(FangFS& fs, const char* path) {
+	struct stat info;
+	verify(lstat(resolve(fs, path).c_str(), &info) == 0);
+	return S_ISLNK(info.st_mode);
+}
+
+static PackStats flush(FangFS& fs) {
+	PackStats stats;
+	memset(&stats, 0, sizeof(stats));
+	pack_flush(fs, stats);
+	return stats;
+}
+
+static size_t count_segments() {
+	size_t n = 0;
+	for(uint32_t segment = 1; segment < 16; segment += 1) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s/%s/%08x", source.c_str(), PACK_DIR_NAME, segment);
+		if(access(name, F_OK) == 0) { n += 1; }
+	}
+	return n;
+}
+
+/// Unmount and mount again, which starts a new segment.
+static void remount(FangFS& fs) {
+	pack_free(fs);
+	verify(fs.pack == nullptr);
+	verify(pack_open(fs) == 0);
+	verify(fs.pack != nullptr);
+}
+
+void test_pack(FangFS& fs) {
+	do_test();
+
+	verify(fangfs_mkdir(fs, "/a", 0750) == 0);
+	write_file(fs, "/small", contents(10, 's'));
+	write_file(fs, "/a/empty", "");
+	write_file(fs, "/a/edge", contents(TEST_THRESHOLD, 'e'));
+	write_file(fs, "/a/big", contents(TEST_THRESHOLD + 1, 'b'));
+
+	const PackStats stats = flush(fs);
+	verify(stats.files_packed == 3);
+	verify(packed(fs, "/small"));
+	verify(packed(fs, "/a/empty"));
+	verify(packed(fs, "/a/edge"));
+	verify(!packed(fs, "/a/big"));
+	verify(count_segments() == 1);
+	check_tree(fs);
+
+	// Nothing is left to do.
+	verify(flush(fs).files_packed == 0);
+}
+
+void test_open(FangFS& fs) {
+	do_test();
+
+	// Readers are served from the record, and the file stays packed.
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	verify(fangfs_open(fs, "/small", &fi) == 0);
+	char buf[4];
+	verify(fangfs_write(fs, "x", 1, 0, &fi) == -EBADF);
+	verify(fangfs_read(fs, buf, sizeof(buf), 8, &fi) == 2);
+	verify(memcmp(buf, tree["/small"].data() + 8, 2) == 0);
+	verify(fangfs_close(fs, &fi) == 0);
+	verify(packed(fs, "/small"));
+
+	// Writers get it back standalone first.
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	verify(fangfs_open(fs, "/small", &fi) == 0);
+	verify(!packed(fs, "/small"));
+	verify(fangfs_write(fs, "xyz", 3, 2, &fi) == 3);
+	tree["/small"].replace(2, 3, "xyz");
+
+	// It isn't packed while it is open...
+	verify(flush(fs).files_packed == 0);
+	verify(fangfs_close(fs, &fi) == 0);
+	check_tree(fs);
+
+	// ...but is once it has been closed.
+	verify(flush(fs).files_packed == 1);
+	verify(packed(fs, "/small"));
+	check_tree(fs);
+
+	// Truncating unpacks it too, and a file that grows too large stays put.
+	verify(fangfs_truncate(fs, "/a/edge", TEST_THRESHOLD + 10) == 0);
+	tree["/a/edge"].resize(TEST_THRESHOLD + 10, '\0');
+	verify(!packed(fs, "/a/edge"));
+	verify(fangfs_truncate(fs, "/a/empty", 3) == 0);
+	tree["/a/empty"].resize(3, '\0');
+	verify(!packed(fs, "/a/empty"));
+	check_tree(fs);
+
+	// Truncating counts as writing, so the small one goes back.
+	verify(flush(fs).files_packed == 1);
+	verify(packed(fs, "/a/empty"));
+	verify(!packed(fs, "/a/edge"));
+	check_tree(fs);
+}
+
+void test_unlink(FangFS& fs) {
+	do_test();
+
+	const std::string real_path = resolve(fs, "/a/empty");
+	verify(fangfs_unlink(fs, "/a/empty") == 0);
+	tree.erase("/a/empty");
+	verify(access(real_path.c_str(), F_OK) < 0 && errno == ENOENT);
+
+	std::string data;
+	verify(read_file(fs, "/a/empty", data) == -ENOENT);
+	check_tree(fs);
+}
+
+void test_compact(FangFS& fs) {
+	do_test();
+
+	// Fill a segment of its own with files, then overwrite most of them.
+	remount(fs);
+	for(int i = 0; i < 8; i += 1) {
+		write_file(fs, "/a/f" + std::to_string(i), contents(200, 'f' + i));
+	}
+	verify(flush(fs).files_packed == 8);
+	verify(count_segments() == 2);
+	remount(fs);
+
+	for(int i = 0; i < 6; i += 1) {
+		write_file(fs, "/a/f" + std::to_string(i), contents(100, 'g' + i));
+	}
+	verify(flush(fs).files_packed == 6);
+	verify(count_segments() == 3);
+	check_tree(fs);
+
+	// The dead space was recorded across the remount.
+	remount(fs);
+	PackStats stats;
+	memset(&stats, 0, sizeof(stats));
+	pack_compact(fs, stats);
+	// The first segment is mostly records left behind by test_open().
+	verify(stats.segments_compacted == 2);
+	verify(stats.bytes_compacted > 0);
+	verify(count_segments() == 2);
+	verify(packed(fs, "/small"));
+	verify(packed(fs, "/a/f6"));
+	verify(packed(fs, "/a/f7"));
+	check_tree(fs);
+
+	memset(&stats, 0, sizeof(stats));
+	pack_compact(fs, stats);
+	verify(stats.segments_compacted == 0);
+}
+
+void test_tamper(FangFS& fs) {
+	do_test();
+
+	// A record moved to another entry is caught.
+	const std::string from = resolve(fs, "/a/f6");
+	const std::string to = resolve(fs, "/a/f7");
+	char target[PACK_LINK_MAX];
+	const ssize_t n = readlink(from.c_str(), target, sizeof(target) - 1);
+	verify(n > 0);
+	target[n] = '\0';
+	verify(unlink(to.c_str()) == 0);
+	verify(symlink(target, to.c_str()) == 0);
+
+	std::string data;
+	verify(read_file(fs, "/a/f7", data) == -EIO);
+	verify(read_file(fs, "/a/f6", data) == 0);
+	verify(data == tree["/a/f6"]);
+
+	CheckOptions options;
+	options.threads = 2;
+	size_t corrupt = 0;
+	options.on_problem = [&corrupt](const CheckProblem& problem) {
+		verify(problem.kind == CHECK_CORRUPT_RECORD);
+		corrupt += 1;
+	};
+	CheckStats check_stats;
+	memset(&check_stats, 0, sizeof(check_stats));
+	verify(check_run(fs, options, check_stats) == 0);
+	verify(corrupt == 1);
+
+	verify(fangfs_unlink(fs, "/a/f7") == 0);
+	tree.erase("/a/f7");
+	check_tree(fs);
+}
+
+void test_export(FangFS& fs) {
+	do_test();
+
+	const std::string to = scratch + "/export";
+	ExportOptions options;
+	options.threads = 2;
+	ExportStats stats;
+	verify(export_run(fs, "/", to.c_str(), options, stats) == 0);
+	for(const auto& entry: tree) {
+		const std::string path = to + entry.first;
+		const int fd = open(path.c_str(), O_RDONLY);
+		verify(fd >= 0);
+		std::string data(entry.second.size() + 1, '\0');
+		verify(read(fd, &data[0], data.size()) == static_cast<ssize_t>(entry.second.size()));
+		data.resize(entry.second.size());
+		verify(data == entry.second);
+
+		struct stat info;
+		verify(fstat(fd, &info) == 0);
+		verify((info.st_mode & 07777) == 0640);
+		close(fd);
+	}
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-pack-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+	scratch = dir;
+	source = scratch + "/cipher";
+	verify(mkdir(source.c_str(), 0700) == 0);
+
+	FangFS fs;
+	test_init_fs(fs, source.c_str());
+	fs.pack_threshold = TEST_THRESHOLD;
+	verify(pack_open(fs) == 0);
+	verify(fs.pack != nullptr);
+
+	test_pack(fs);
+	test_open(fs);
+	test_unlink(fs);
+	test_compact(fs);
+	test_tamper(fs);
+	test_export(fs);
+
+	pack_free(fs);
+	verify(system((std::string("rm -rf ") + dir).c_str()) == 0);
+	return 0;
+}
@@ -0,0 +1,298 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#include <string>
+#include "test.h"
+#include "../src/file.h"
+#include "../src/rotate.h"
+#include "../src/error.h"
+
+#define TEST_OPSLIMIT crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_MIN
+#define TEST_MEMLIMIT crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_MIN
+
+static std::string scratch;
+static std::string source;
+
+/// Plaintext path to contents, with directories mapped to "/".
+static std::map<std::string, std::string> tree;
+
+/// The master key before the rotation.
+static uint8_t first_key[crypto_secretbox_KEYBYTES];
+
+static std::string contents(size_t len, char seed) {
+	std::string data(len, '\0');
+	for(size_t i = 0; i < len; i += 1) { data[i] = static_cast<char>(seed + i * 7); }
+	return data;
+}
+
+static void write_file(FangFS& fs, const std::string& path, const std::string& data) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR|O_TRUNC;
+	verify(fangfs_create(fs, path.c_str(), 0640, &fi) == 0);
+	if(!data.empty()) {
+		verify(fangfs_write(fs, data.data(), data.size(), 0, &fi) ==
+		       static_cast<int>(data.size()));
+	}
+	verify(fangfs_close(fs, &fi) == 0);
+}
+
+static std::string read_file(FangFS& fs, const std::string& path) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	verify(fangfs_open(fs, path.c_str(), &fi) == 0);
+
+	std::string data;
+	char buf[4096];
+	int n;
+	while((n = fangfs_read(fs, buf, sizeof(buf), data.size(), &fi)) > 0) {
+		data.append(buf, n);
+	}
+	verify(n == 0);
+	verify(fangfs_close(fs, &fi) == 0);
+	return data;
+}
+
+static int fill(void* buf, const char* name, const struct stat* info, off_t offset) {
+	std::multiset<std::string>& names = *reinterpret_cast<std::multiset<std::string>*>(buf);
+	if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0) { names.insert(name); }
+	return 0;
+}
+
+static std::multiset<std::string> list(FangFS& fs, const std::string& path) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	verify(fangfs_opendir(fs, path.c_str(), &fi) == 0);
+	std::multiset<std::string> names;
+	verify(fangfs_readdir(fs, path.c_str(), &names, fill, 0, &fi) == 0);
+	verify(fangfs_releasedir(fs, path.c_str(), &fi) == 0);
+	return names;
+}
+
+/// Check every file and directory listing against tree.
+static void check_tree(FangFS& fs) {
+	std::map<std::string, std::multiset<std::string> > dirs;
+	dirs["/"];
+	for(const auto& entry: tree) {
+		const size_t sep = entry.first.rfind('/');
+		dirs[(sep == 0)? "/" : entry.first.substr(0, sep)].insert(entry.first.substr(sep + 1));
+		if(entry.second == "/") {
+			dirs[entry.first];
+		} else {
+			verify(read_file(fs, entry.first) == entry.second);
+		}
+	}
+
+	for(const auto& dir: dirs) {
+		verify(list(fs, dir.first) == dir.second);
+	}
+}
+
+/// Count the backing entries of a directory, hidden ones aside.
+static size_t count_backing(FangFS& fs, const char* path) {
+	Buffer real_path;
+	path_resolve(fs, path, real_path);
+	DIR* dir = opendir(reinterpret_cast<char*>(real_path.buf));
+	verify(dir != nullptr);
+	size_t n = 0;
+	struct dirent* entry;
+	while((entry = readdir(dir)) != nullptr) {
+		if(entry->d_name[0] != '_' && entry->d_name[0] != '.') { n += 1; }
+	}
+	closedir(dir);
+	return n;
+}
+
+/// Create a filesystem with a real metafile, and populate it.
+static void setup(FangFS& fs) {
+	verify(metafile_init(fs.metafile, source.c_str()) == 0);
+	fs.metafile.block_size = 128;
+	fs.source = source.c_str();
+	fs.key_name = "test";
+	fs.rotate_rate = 0;
+	fs.rotate_duty = 1;
+	randombytes_buf(fs.master_key, sizeof(fs.master_key));
+	memcpy(first_key, fs.master_key, sizeof(first_key));
+	verify(metafile_new_key(fs.metafile, TEST_OPSLIMIT, TEST_MEMLIMIT, "test",
+	                        "secret", 6, fs.master_key) == 0);
+	verify(metafile_write(fs.metafile) == 0);
+
+	const size_t payload = fang_block_payload(fs);
+	tree["/a"] = "/";
+	tree["/a/b"] = "/";
+	tree["/small"] = contents(10, 's');
+	tree["/a/big"] = contents(300 * payload + 3, 'b');
+	tree["/a/exact"] = contents(payload, 'e');
+	tree["/a/b/empty"] = "";
+	tree["/a/b/c"] = contents(payload + 1, 'c');
+
+	for(const auto& entry: tree) {
+		if(entry.second == "/") {
+			verify(fangfs_mkdir(fs, entry.first.c_str(), 0750) == 0);
+		} else {
+			write_file(fs, entry.first, entry.second);
+		}
+	}
+}
+
+void test_begin(FangFS& fs) {
+	do_test();
+
+	uint8_t next_key[crypto_secretbox_KEYBYTES];
+	randombytes_buf(next_key, sizeof(next_key));
+	uint8_t out[crypto_secretbox_KEYBYTES];
+	verify(metafile_rotate(fs.metafile, "test", "secret", 6, 0, false, next_key, out) == 0);
+	verify(memcmp(out, first_key, sizeof(out)) == 0);
+	verify(rotate_begin(fs, next_key) == 0);
+	verify(fs.rotation != nullptr);
+	verify(memcmp(fs.master_key, next_key, sizeof(next_key)) == 0);
+
+	// Nothing has moved yet, and everything reads under the old key.
+	const uint8_t* key = nullptr;
+	Buffer real_path;
+	path_resolve(fs, "/a/b/c", real_path, &key);
+	verify(key == fs.rotation->old_key);
+	check_tree(fs);
+
+	// New entries go under the new key, even inside old directories.
+	tree["/a/b/new"] = contents(50, 'n');
+	write_file(fs, "/a/b/new", tree["/a/b/new"]);
+	path_resolve(fs, "/a/b/new", real_path, &key);
+	verify(key == fs.master_key);
+	check_tree(fs);
+}
+
+void test_resume(FangFS& fs) {
+	do_test();
+
+	// As if remounted: the metafile alone recovers both keys.
+	uint8_t master_key[crypto_secretbox_KEYBYTES];
+	memcpy(master_key, fs.master_key, sizeof(master_key));
+	rotate_free(fs);
+	metafile_free(fs.metafile);
+
+	verify(metafile_init(fs.metafile, source.c_str()) == 1);
+	verify(fs.metafile.rotating);
+	fs.metafile.block_size = 128;
+	verify(metafile_unlock(fs.metafile, "test", "secret", 6, 0, fs.master_key) == 0);
+	verify(memcmp(fs.master_key, master_key, sizeof(master_key)) == 0);
+	verify(rotate_resume(fs) == 0);
+	verify(memcmp(fs.rotation->old_key, first_key, sizeof(first_key)) == 0);
+	check_tree(fs);
+}
+
+void test_pass(FangFS& fs) {
+	do_test();
+
+	// An open file, and the directories above it, have to wait.
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	verify(fangfs_open(fs, "/a/b/c", &fi) == 0);
+
+	RotateStats stats;
+	rotate_pass(fs, stats);
+	verify(stats.remaining == 3);
+	verify(stats.files == 4);
+	check_tree(fs);
+
+	// Writes through the handle land in the old copy, which is still the
+	// only one.
+	verify(fangfs_write(fs, "xyz", 3, 1, &fi) == 3);
+	tree["/a/b/c"].replace(1, 3, "xyz");
+	verify(fangfs_close(fs, &fi) == 0);
+	check_tree(fs);
+
+	rotate_pass(fs, stats);
+	verify(stats.remaining == 0);
+	verify(stats.files == 1);
+	check_tree(fs);
+
+	Buffer real_path;
+	const uint8_t* key = nullptr;
+	for(const auto& entry: tree) {
+		path_resolve(fs, entry.first.c_str(), real_path, &key);
+		verify(key == fs.master_key);
+	}
+}
+
+void test_crash_window(FangFS& fs) {
+	do_test();
+
+	// Put back an old copy of a file next to its rotated one, as a crash
+	// between the swap and the unlink would leave it.
+	Buffer real_path;
+	path_resolve(fs, "/a/b/c", real_path);
+	const std::string rotated = reinterpret_cast<char*>(real_path.buf);
+	Buffer old_name;
+	path_encrypt(fs, "/a/b/c", old_name, fs.rotation->old_key);
+	const std::string stale = rotated.substr(0, rotated.rfind('/') + 1) +
+	                          reinterpret_cast<char*>(old_name.buf);
+	const std::string copy = scratch + "/copy";
+	verify(system(("cp '" + rotated + "' '" + copy + "'").c_str()) == 0);
+	verify(rename(copy.c_str(), stale.c_str()) == 0);
+
+	// It's listed once, and the rotated copy is the one read.
+	verify(count_backing(fs, "/a/b") == 4);
+	check_tree(fs);
+
+	RotateStats stats;
+	rotate_pass(fs, stats);
+	verify(stats.remaining == 0);
+	verify(count_backing(fs, "/a/b") == 3);
+	check_tree(fs);
+}
+
+void test_finish(FangFS& fs) {
+	do_test();
+
+	verify(rotate_finish(fs) == 0);
+	verify(!fs.metafile.rotating);
+	rotate_free(fs);
+	metafile_free(fs.metafile);
+
+	// With the rotation over, the new key alone reads everything.
+	uint8_t master_key[crypto_secretbox_KEYBYTES];
+	memcpy(master_key, fs.master_key, sizeof(master_key));
+	verify(metafile_init(fs.metafile, source.c_str()) == 1);
+	verify(!fs.metafile.rotating);
+	fs.metafile.block_size = 128;
+	verify(metafile_unlock(fs.metafile, "test", "secret", 6, 0, fs.master_key) == 0);
+	verify(memcmp(fs.master_key, master_key, sizeof(master_key)) == 0);
+	verify(fs.rotation == nullptr);
+	check_tree(fs);
+
+	// And the old one nothing.
+	memcpy(fs.master_key, first_key, sizeof(first_key));
+	verify(list(fs, "/").empty());
+	memcpy(fs.master_key, master_key, sizeof(master_key));
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	char dir[] = "test-rotate-XXXXXX";
+	verify(mkdtemp(dir) != nullptr);
+	scratch = dir;
+	source = scratch + "/cipher";
+	verify(mkdir(source.c_str(), 0700) == 0);
+
+	FangFS fs;
+	setup(fs);
+
+	test_begin(fs);
+	test_resume(fs);
+	test_pass(fs);
+	test_crash_window(fs);
+	test_finish(fs);
+
+	metafile_free(fs.metafile);
+	verify(system((std::string("rm -rf ") + dir).c_str()) == 0);
+	return 0;
+}
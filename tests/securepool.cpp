@@ -0,0 +1,168 @@
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "test.h"
+#include "../src/Buffer.h"
+#include "../src/securepool.h"
+
+#define TEST_POOL_SLABS 32
+
+static SecurePoolUsage usage() {
+	SecurePoolUsage now;
+	secure_pool_usage(now);
+	return now;
+}
+
+static bool zeroed(const uint8_t* p, size_t len) {
+	for(size_t i = 0; i < len; i += 1) {
+		if(p[i] != 0) { return false; }
+	}
+	return true;
+}
+
+void test_heap(void) {
+	do_test();
+
+	// Without a pool, secure buffers come from the heap.
+	Buffer buf;
+	buf_make_secure(buf);
+	buf_grow(buf, 100);
+	verify(buf.secure);
+	verify(usage().fallbacks == 1);
+	verify(usage().fallback_bytes == 100);
+	buf_free(buf);
+	verify(usage().fallback_bytes == 0);
+	verify(buf.secure);
+}
+
+void test_slots(void) {
+	do_test();
+
+	verify(secure_pool_init(SECURE_POOL_SLAB * TEST_POOL_SLABS) == 0);
+	verify(usage().pool_bytes == SECURE_POOL_SLAB * TEST_POOL_SLABS);
+
+	// Slots are the next power of two up, and are handed back zeroed.
+	size_t len;
+	uint8_t* slot = secure_alloc(100, len);
+	verify(len == SECURE_POOL_MIN_SLOT);
+	verify(secure_pool_owns(slot));
+	verify(usage().slot_bytes == SECURE_POOL_MIN_SLOT);
+	verify(zeroed(slot, len));
+	memset(slot, 'x', len);
+	secure_free(slot, len);
+	verify(usage().slot_bytes == 0);
+	verify(zeroed(slot + sizeof(void*), len - sizeof(void*)));
+
+	// The slot freed last is the first reused.
+	size_t again_len;
+	uint8_t* again = secure_alloc(SECURE_POOL_MIN_SLOT, again_len);
+	verify(again == slot);
+	verify(zeroed(again, again_len));
+	secure_free(again, again_len);
+
+	slot = secure_alloc(5000, len);
+	verify(len == 8192);
+	secure_free(slot, len);
+
+	// Too large for any slot.
+	const uint64_t fallbacks = usage().fallbacks;
+	slot = secure_alloc(SECURE_POOL_MAX_SLOT + 1, len);
+	verify(len == SECURE_POOL_MAX_SLOT + 1);
+	verify(!secure_pool_owns(slot));
+	verify(usage().fallbacks == fallbacks + 1);
+	secure_free(slot, len);
+
+	// Setting up again changes nothing.
+	verify(secure_pool_init(SECURE_POOL_SLAB) == 0);
+	verify(usage().pool_bytes == SECURE_POOL_SLAB * TEST_POOL_SLABS);
+}
+
+void test_buffer(void) {
+	do_test();
+
+	// Contents survive being moved into and growing within the pool.
+	Buffer buf;
+	buf_load_string(buf, "plaintext");
+	buf_make_secure(buf);
+	verify(secure_pool_owns(buf.buf));
+	verify(strcmp(reinterpret_cast<char*>(buf.buf), "plaintext") == 0);
+
+	uint8_t* old = buf.buf;
+	buf_grow(buf, 1000);
+	verify(buf.buf_len == 1024);
+	verify(secure_pool_owns(buf.buf));
+	verify(strcmp(reinterpret_cast<char*>(buf.buf), "plaintext") == 0);
+	verify(zeroed(old + sizeof(void*), SECURE_POOL_MIN_SLOT - sizeof(void*)));
+
+	// Copies into it stay secure.
+	Buffer other;
+	buf_load_string(other, "more plaintext");
+	buf_copy(other, buf);
+	verify(buf.buf_len == 1024);
+	verify(strcmp(reinterpret_cast<char*>(buf.buf), "more plaintext") == 0);
+
+	Buffer moved(std::move(buf));
+	verify(moved.secure);
+	verify(buf.buf == nullptr);
+	buf_free(moved);
+	verify(usage().slot_bytes == 0);
+}
+
+void test_exhaustion(void) {
+	do_test();
+
+	// Once every slab is carved, the heap takes over.
+	const uint64_t fallbacks = usage().fallbacks;
+	std::vector<std::pair<uint8_t*, size_t> > slots;
+	while(usage().fallbacks == fallbacks) {
+		size_t len;
+		uint8_t* slot = secure_alloc(SECURE_POOL_MAX_SLOT, len);
+		slots.push_back(std::make_pair(slot, len));
+	}
+	verify(usage().slab_bytes == SECURE_POOL_SLAB * TEST_POOL_SLABS);
+	verify(!secure_pool_owns(slots.back().first));
+	for(const auto& slot: slots) { secure_free(slot.first, slot.second); }
+	verify(usage().slot_bytes == 0);
+	verify(usage().fallback_bytes == 0);
+}
+
+void test_threads(void) {
+	do_test();
+
+	// Slots travel between threads and their caches without being handed out
+	// twice.
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 4; t += 1) {
+		threads.push_back(std::thread([t]() {
+			std::vector<std::pair<uint8_t*, size_t> > held;
+			for(int i = 0; i < 20000; i += 1) {
+				if(held.size() < 40 && (i * 7 + t) % 3 != 0) {
+					size_t len;
+					uint8_t* slot = secure_alloc(SECURE_POOL_MIN_SLOT << ((i + t) % 3), len);
+					verify(zeroed(slot, len));
+					memset(slot, 'a' + t, len);
+					held.push_back(std::make_pair(slot, len));
+				} else if(!held.empty()) {
+					const auto slot = held.back();
+					held.pop_back();
+					for(size_t j = 0; j < slot.second; j += 1) {
+						verify(slot.first[j] == 'a' + t);
+					}
+					secure_free(slot.first, slot.second);
+				}
+			}
+			for(const auto& slot: held) { secure_free(slot.first, slot.second); }
+		}));
+	}
+	for(std::thread& thread: threads) { thread.join(); }
+	verify(usage().slot_bytes == 0);
+}
+
+int main(void) {
+	test_heap();
+	test_slots();
+	test_buffer();
+	test_threads();
+	test_exhaustion();
+	return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include "test.h"
+#include "../src/stats.h"
+
+/// Find the line for name in a stats_format() dump, or nullptr.
+static const char* find_line(const Buffer& text, const char* name) {
+	const char* cur = reinterpret_cast<const char*>(text.buf);
+	const size_t name_len = strlen(name);
+	while(cur != nullptr && *cur != '\0') {
+		if(strncmp(cur, name, name_len) == 0 && cur[name_len] == '\t') {
+			return cur + name_len + 1;
+		}
+
+		cur = strchr(cur, '\n');
+		if(cur != nullptr) { cur += 1; }
+	}
+
+	return nullptr;
+}
+
+void test_timers(void) {
+	do_test();
+
+	// Pretend each call started 50µs ago.
+	for(int i = 0; i < 1000; i += 1) {
+		stats_time(STAT_ENCRYPT, stats_clock() - 50000);
+	}
+
+	Buffer text;
+	stats_format(text);
+	verify(strncmp(reinterpret_cast<char*>(text.buf), "timer\tcount\t", 12) == 0);
+
+	const char* line = find_line(text, "encrypt");
+	verify(line != nullptr);
+
+	unsigned long long count;
+	double mean, p50, p90, p99, p999, max;
+	verify(sscanf(line, "%llu\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf", &count, &mean,
+	              &p50, &p90, &p99, &p999, &max) == 7);
+	verify(count == 1000);
+	verify(mean >= 50.0);
+
+	// Buckets are at most 12.5% wide.
+	verify(p50 >= 50.0 && p50 <= 50.0 * 1.125 + 1.0);
+	verify(p50 <= p90 && p90 <= p99 && p99 <= p999);
+	verify(max >= 50.0);
+
+	// Timers that never ran are left out.
+	verify(find_line(text, "mkdir") == nullptr);
+}
+
+void test_scope(void) {
+	do_test();
+
+	{
+		StatScope timer(STAT_OP_MKNOD);
+		usleep(1000);
+	}
+
+	Buffer text;
+	stats_format(text);
+	const char* line = find_line(text, "mknod");
+	verify(line != nullptr);
+
+	unsigned long long count;
+	double mean;
+	verify(sscanf(line, "%llu\t%lf", &count, &mean) == 2);
+	verify(count == 1);
+	verify(mean >= 1000.0);
+}
+
+void test_counters(void) {
+	do_test();
+
+	stats_count(STAT_RMW_CYCLES, 3);
+	stats_count(STAT_RMW_CYCLES, 4);
+
+	Buffer text;
+	stats_format(text);
+
+	// Counters are always listed, even when zero.
+	const char* line = find_line(text, "rmw_cycles");
+	verify(line != nullptr && strncmp(line, "7\n", 2) == 0);
+	line = find_line(text, "bytes_decrypted");
+	verify(line != nullptr && strncmp(line, "0\n", 2) == 0);
+}
+
+void test_threads(void) {
+	do_test();
+
+	// Statistics from threads that have exited must not be lost.
+	std::thread threads[4];
+	for(size_t i = 0; i < 4; i += 1) {
+		threads[i] = std::thread([]() {
+			for(int j = 0; j < 100; j += 1) {
+				stats_count(STAT_TAMPERING, 1);
+				stats_time(STAT_DECRYPT, stats_clock());
+			}
+		});
+	}
+	for(size_t i = 0; i < 4; i += 1) {
+		threads[i].join();
+	}
+
+	stats_count(STAT_TAMPERING, 1);
+
+	Buffer text;
+	stats_format(text);
+	const char* line = find_line(text, "tampering");
+	verify(line != nullptr && strncmp(line, "401\n", 4) == 0);
+
+	line = find_line(text, "decrypt");
+	unsigned long long count;
+	verify(line != nullptr && sscanf(line, "%llu", &count) == 1);
+	verify(count == 400);
+}
+
+int main(void) {
+	test_timers();
+	test_scope();
+	test_counters();
+	test_threads();
+
+	return 0;
+}
@@ -2,6 +2,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sodium.h>
+#include "../src/fangfs.h"
 
 static inline void __fail(const char* file, const char* func, int line, const char* msg) {
 	fprintf(stderr, "Assertion failed at %s:%s:%d: %s\n", file, func, line, msg);
@@ -11,3 +14,14 @@ static inline void __fail(const char* file, const char* func, int line, const ch
 #define verify(cond) ((cond)? (void)0 : __fail(__FILE__, __FUNCTION__, __LINE__, #cond))
 
 #define do_test() (printf("Running %s...\n", __FUNCTION__))
+
+/// Set up fs for tests that don't need a metafile on disk: blocks of
+/// block_size bytes, a random master key and filename nonce, and source as
+/// the ciphertext directory.
+static inline void test_init_fs(FangFS& fs, const char* source, uint32_t block_size = 128) {
+	memset(&fs.metafile, 0, sizeof(fs.metafile));
+	fs.metafile.block_size = block_size;
+	randombytes_buf(fs.master_key, sizeof(fs.master_key));
+	randombytes_buf(fs.metafile.filename_nonce, sizeof(fs.metafile.filename_nonce));
+	fs.source = source;
+}
@@ -0,0 +1,91 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sodium.h>
+#include "test.h"
+#include "../src/trace.h"
+
+void test_passthrough(void) {
+	do_test();
+
+	// With tracing off, the shims must cost nothing but the call.
+	verify(trace_begin(nullptr) == 0);
+	verify(trace_end(nullptr, TRACE_READ, "/a", 0, 10, 0, -5) == -5);
+}
+
+void test_records(void) {
+	do_test();
+
+	Trace trace;
+	verify(trace_open(trace, "test-trace", 16) == 0);
+
+	const uint64_t start = trace_begin(&trace);
+	verify(trace_end(&trace, TRACE_WRITE, "/dir/file", 100, 4096, start, 4096) == 4096);
+	verify(trace_end(&trace, TRACE_READ, "/dir/file", 0, 10, trace_begin(&trace), -2) == -2);
+	verify(trace_end(&trace, TRACE_GETATTR, "/dir/other", 0, 0, trace_begin(&trace), 0) == 0);
+	verify(trace_end(&trace, TRACE_GETATTR, "/", 0, 0, trace_begin(&trace), 0) == 0);
+	trace_close(trace);
+
+	TraceReader reader;
+	verify(trace_reader_open(reader, "test-trace") == 0);
+	verify(reader.first == 0);
+	verify(reader.count == 4);
+
+	const TraceRecord& write = trace_reader_get(reader, 0);
+	verify(write.op == TRACE_WRITE);
+	verify(write.depth == 2);
+	verify(write.offset == 100 && write.size == 4096);
+	verify(write.result == 4096);
+	verify(write.end_ns >= write.start_ns);
+	verify(write.thread == static_cast<uint32_t>(syscall(SYS_gettid)));
+
+	const TraceRecord& read = trace_reader_get(reader, 1);
+	verify(read.op == TRACE_READ);
+	verify(read.result == -2);
+	verify(read.path_hash == write.path_hash);
+	verify(read.start_ns >= write.start_ns);
+
+	const TraceRecord& other = trace_reader_get(reader, 2);
+	verify(other.path_hash != write.path_hash);
+
+	const TraceRecord& root = trace_reader_get(reader, 3);
+	verify(root.depth == 0);
+
+	trace_reader_close(reader);
+	unlink("test-trace");
+}
+
+void test_wrap(void) {
+	do_test();
+
+	Trace trace;
+	verify(trace_open(trace, "test-trace", 4) == 0);
+	for(int i = 0; i < 10; i += 1) {
+		trace_end(&trace, TRACE_WRITE, "/file", i, 1, trace_begin(&trace), 1);
+	}
+	trace_close(trace);
+
+	// Only the newest records survive, oldest first.
+	TraceReader reader;
+	verify(trace_reader_open(reader, "test-trace") == 0);
+	verify(reader.first == 6);
+	verify(reader.count == 4);
+	for(uint64_t i = reader.first; i < reader.first + reader.count; i += 1) {
+		verify(trace_reader_get(reader, i).offset == static_cast<int64_t>(i));
+	}
+	trace_reader_close(reader);
+
+	// Anything else is refused.
+	verify(trace_reader_open(reader, "CMakeCache.txt") < 0);
+	unlink("test-trace");
+}
+
+int main(void) {
+	if(sodium_init() < 0) { return 1; }
+
+	test_passthrough();
+	test_records();
+	test_wrap();
+
+	return 0;
+}